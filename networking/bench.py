@@ -0,0 +1,324 @@
+#!/usr/bin/env python3
+"""Loopback benchmark for the S.H.A.M. client and server.
+
+Builds one optimized client/server pair per (window, payload) combination,
+then runs file transfers over a matrix of file sizes and loss rates plus a
+chat latency run per loss rate, and checks that a --workers server answers a
+second client while a first session is open. Loss and delay are applied by the impairment
+proxy so both directions see them and runs replay from --seed. Results are
+written to <out>/results.csv and <out>/results.json.
+"""
+
+import argparse
+import csv
+import hashlib
+import json
+import os
+import random
+import re
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SRC_DIR = os.path.dirname(os.path.abspath(__file__))
+
+FIELDS = [
+    "kind", "window", "payload", "file_bytes", "loss", "delay_ms", "rep", "ok",
+    "completion_s", "goodput_mbps", "segments", "retransmissions", "retransmit_ratio",
+    "client_cpu_ms_per_mb", "server_cpu_ms_per_mb",
+    "messages", "delivered", "latency_p50_ms", "latency_p90_ms", "latency_p99_ms", "latency_max_ms",
+]
+
+
+def parse_list(text, kind):
+    return [kind(x) for x in text.split(",") if x]
+
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def build_variant(args, window, payload):
+    build = os.path.join(args.out, "build", "w%d_p%d" % (window, payload))
+    # Keep the advertised receive window from capping the sender's window
+    receiver_buffer = min(65535, max(8192, 2 * window * payload))
+    cppflags = "-DWINDOW_SIZE=%d -DPAYLOAD_SIZE=%d -DRECEIVER_BUFFER_SIZE=%d -DMAX_BUFFER_PACKETS=%d" % (
+        window, payload, receiver_buffer, max(10, 2 * window))
+    subprocess.run(args.make.split() + ["-s", "-B", "BUILD=" + build, "CPPFLAGS=" + cppflags,
+                                        "CFLAGS=" + args.cflags, "all"], cwd=SRC_DIR, check=True)
+    return build
+
+
+def input_file(args, size):
+    path = os.path.join(args.out, "data", "input_%d.bin" % size)
+    if not os.path.exists(path):
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        rng = random.Random(size)
+        with open(path, "wb") as f:
+            f.write(bytes(rng.getrandbits(8) for _ in range(size)))
+    return path
+
+
+def md5(path):
+    h = hashlib.md5()
+    with open(path, "rb") as f:
+        for chunk in iter(lambda: f.read(1 << 16), b""):
+            h.update(chunk)
+    return h.hexdigest()
+
+
+def reap(proc, timeout):
+    """Waits for proc, killing it after timeout, and returns its CPU seconds."""
+    timer = threading.Timer(timeout, lambda: proc.kill())
+    timer.start()
+    _, status, usage = os.wait4(proc.pid, 0)
+    timer.cancel()
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    return usage.ru_utime + usage.ru_stime
+
+
+def start_path(args, build, workdir, server_port, loss, rep):
+    """Starts the proxy if the run needs impairment, returns (port, proxy)."""
+    if loss <= 0 and args.delay <= 0:
+        return server_port, None
+    proxy_port = free_port()
+    cmd = [os.path.join(build, "proxy"), str(proxy_port), "127.0.0.1", str(server_port),
+           "--loss=%g" % loss, "--delay=%g" % args.delay, "--seed=%d" % (args.seed + rep)]
+    proxy = subprocess.Popen(cmd, cwd=workdir, stdout=open(os.path.join(workdir, "proxy.out"), "w"),
+                             stderr=subprocess.STDOUT)
+    return proxy_port, proxy
+
+
+def stop_proxy(proxy):
+    if proxy:
+        proxy.send_signal(signal.SIGINT)
+        proxy.wait()
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    ordered = sorted(values)
+    rank = max(0, min(len(ordered) - 1, int(round(p / 100.0 * len(ordered) + 0.5)) - 1))
+    return ordered[rank]
+
+
+def run_file(args, build, window, payload, size, loss, rep):
+    workdir = tempfile.mkdtemp(prefix="run_", dir=os.path.join(args.out, "tmp"))
+    source = input_file(args, size)
+    server_port = free_port()
+    server = subprocess.Popen([os.path.join(build, "server"), str(server_port)], cwd=workdir,
+                              stdout=open(os.path.join(workdir, "server.out"), "w"), stderr=subprocess.STDOUT)
+    port, proxy = start_path(args, build, workdir, server_port, loss, rep)
+    time.sleep(0.2)
+
+    start = time.monotonic()
+    client = subprocess.Popen([os.path.join(build, "client"), "127.0.0.1", str(port), source, "out.dat"],
+                              cwd=workdir, stdout=open(os.path.join(workdir, "client.out"), "w"),
+                              stderr=subprocess.STDOUT)
+    client_cpu = reap(client, args.timeout)
+    completion = time.monotonic() - start
+    server_cpu = reap(server, 5)
+    stop_proxy(proxy)
+
+    with open(os.path.join(workdir, "client.out")) as f:
+        stats = re.search(r"Segments sent: (\d+), retransmissions: (\d+)", f.read())
+    received = os.path.join(workdir, "received_file.dat")
+    ok = client.returncode == 0 and os.path.exists(received) and md5(received) == md5(source)
+    segments = int(stats.group(1)) if stats else None
+    retransmissions = int(stats.group(2)) if stats else None
+    megabytes = size / 1e6
+
+    row = {
+        "kind": "file", "window": window, "payload": payload, "file_bytes": size, "loss": loss,
+        "delay_ms": args.delay, "rep": rep, "ok": ok,
+        "completion_s": round(completion, 4),
+        "goodput_mbps": round(size * 8 / completion / 1e6, 3) if ok else None,
+        "segments": segments, "retransmissions": retransmissions,
+        "retransmit_ratio": round(retransmissions / segments, 4) if segments else None,
+        "client_cpu_ms_per_mb": round(client_cpu * 1000 / megabytes, 3),
+        "server_cpu_ms_per_mb": round(server_cpu * 1000 / megabytes, 3),
+    }
+    if ok or not args.keep_failed:
+        shutil.rmtree(workdir)
+    else:
+        row["workdir"] = workdir
+    return row
+
+
+def run_chat(args, build, window, payload, loss, rep):
+    workdir = tempfile.mkdtemp(prefix="chat_", dir=os.path.join(args.out, "tmp"))
+    server_port = free_port()
+    server = subprocess.Popen([os.path.join(build, "server"), str(server_port), "--chat"], cwd=workdir,
+                              stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    received = {}
+
+    def read_server():
+        for line in server.stdout:
+            m = re.match(r"Client: msg (\d+) ", line)
+            if m:
+                received.setdefault(int(m.group(1)), time.monotonic())
+
+    reader = threading.Thread(target=read_server, daemon=True)
+    reader.start()
+    port, proxy = start_path(args, build, workdir, server_port, loss, rep)
+    time.sleep(0.2)
+
+    client = subprocess.Popen([os.path.join(build, "client"), "127.0.0.1", str(port), "--chat"], cwd=workdir,
+                              stdin=subprocess.PIPE, stdout=open(os.path.join(workdir, "client.out"), "w"),
+                              stderr=subprocess.STDOUT, text=True)
+    sent = {}
+    padding = "x" * 48
+    try:
+        for i in range(args.chat_messages):
+            client.stdin.write("msg %d %s\n" % (i, padding))
+            client.stdin.flush()
+            sent[i] = time.monotonic()
+            time.sleep(args.chat_interval / 1000.0)
+        client.stdin.write("/quit\n")
+        client.stdin.close()
+    except BrokenPipeError:
+        pass
+    reap(client, args.timeout)
+    reap(server, 5)
+    reader.join(1)
+    stop_proxy(proxy)
+
+    latencies = [(received[i] - sent[i]) * 1000 for i in sent if i in received]
+    row = {
+        "kind": "chat", "window": window, "payload": payload, "loss": loss, "delay_ms": args.delay,
+        # Undelivered messages show up in the delivered column, not as a failed run
+        "rep": rep, "ok": client.returncode == 0,
+        "messages": len(sent), "delivered": len(latencies),
+    }
+    for name, p in (("latency_p50_ms", 50), ("latency_p90_ms", 90), ("latency_p99_ms", 99), ("latency_max_ms", 100)):
+        value = percentile(latencies, p)
+        row[name] = round(value, 3) if value is not None else None
+    shutil.rmtree(workdir)
+    return row
+
+
+def run_workers(args, build, window, payload, rep):
+    """Opens one chat session on a two-worker server and holds it while a
+    second client connects, chats and quits. The second client must get its
+    handshake whichever worker its proposed connection ID names."""
+    workdir = tempfile.mkdtemp(prefix="workers_", dir=os.path.join(args.out, "tmp"))
+    server_port = free_port()
+    server = subprocess.Popen([os.path.join(build, "server"), str(server_port), "--chat", "--workers=2"], cwd=workdir,
+                              stdin=subprocess.DEVNULL, stdout=open(os.path.join(workdir, "server.out"), "w"),
+                              stderr=subprocess.STDOUT)
+    time.sleep(0.2)
+    client_cmd = [os.path.join(build, "client"), "127.0.0.1", str(server_port), "--chat"]
+    first = subprocess.Popen(client_cmd, cwd=workdir, stdin=subprocess.PIPE,
+                             stdout=open(os.path.join(workdir, "first.out"), "w"), stderr=subprocess.STDOUT, text=True)
+    time.sleep(0.5)
+    start = time.monotonic()
+    second = subprocess.Popen(client_cmd, cwd=workdir, stdin=subprocess.PIPE,
+                              stdout=open(os.path.join(workdir, "second.out"), "w"), stderr=subprocess.STDOUT, text=True)
+    try:
+        second.stdin.write("hello from the second client\n/quit\n")
+        second.stdin.close()
+    except BrokenPipeError:
+        pass
+    reap(second, args.timeout)
+    completion = time.monotonic() - start
+    try:
+        first.stdin.write("/quit\n")
+        first.stdin.close()
+    except BrokenPipeError:
+        pass
+    reap(first, args.timeout)
+    reap(server, 5)
+
+    with open(os.path.join(workdir, "second.out")) as f:
+        ok = second.returncode == 0 and "Handshake complete" in f.read()
+    row = {"kind": "workers", "window": window, "payload": payload, "rep": rep, "ok": ok,
+           "completion_s": round(completion, 4)}
+    if ok or not args.keep_failed:
+        shutil.rmtree(workdir)
+    else:
+        row["workdir"] = workdir
+    return row
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--make", default="make")
+    parser.add_argument("--cflags", default="-O3 -DNDEBUG")
+    parser.add_argument("--sizes", default="65536,1048576", help="file sizes in bytes")
+    parser.add_argument("--loss", default="0,0.01,0.05", help="per-direction loss rates")
+    parser.add_argument("--windows", default="4,8", help="client WINDOW_SIZE values")
+    parser.add_argument("--payloads", default="512,1024", help="PAYLOAD_SIZE values")
+    parser.add_argument("--delay", type=float, default=0.0, help="one-way delay in ms added by the proxy")
+    parser.add_argument("--reps", type=int, default=1)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--chat-messages", type=int, default=200)
+    parser.add_argument("--chat-interval", type=float, default=10.0, help="ms between chat messages")
+    parser.add_argument("--worker-runs", type=int, default=6,
+                        help="second-client checks against a --workers server per build, 0 to skip")
+    parser.add_argument("--timeout", type=float, default=120.0, help="seconds before a run is killed")
+    parser.add_argument("--out", default=os.path.join(SRC_DIR, "bench"))
+    parser.add_argument("--keep-failed", action="store_true", help="keep working directories of failed runs")
+    parser.add_argument("--quick", action="store_true", help="small matrix for a fast sanity check")
+    args = parser.parse_args()
+    if args.quick:
+        args.sizes, args.loss, args.windows, args.payloads = "65536", "0,0.02", "4", "1024"
+        args.chat_messages = 50
+        args.worker_runs = 2
+
+    args.out = os.path.abspath(args.out)
+    os.makedirs(os.path.join(args.out, "tmp"), exist_ok=True)
+    sizes = parse_list(args.sizes, int)
+    losses = parse_list(args.loss, float)
+    rows = []
+    failures = 0
+
+    for window in parse_list(args.windows, int):
+        for payload in parse_list(args.payloads, int):
+            build = build_variant(args, window, payload)
+            for rep in range(args.worker_runs):
+                row = run_workers(args, build, window, payload, rep)
+                rows.append(row)
+                failures += not row["ok"]
+                print("workers w=%-3d p=%-5d second client while one session is open %s %7.3fs" % (
+                    window, payload, "ok  " if row["ok"] else "FAIL", row["completion_s"]), flush=True)
+            for loss in losses:
+                for rep in range(args.reps):
+                    for size in sizes:
+                        row = run_file(args, build, window, payload, size, loss, rep)
+                        rows.append(row)
+                        failures += not row["ok"]
+                        print("file w=%-3d p=%-5d size=%-9d loss=%-5g %s %7.3fs %8s Mbit/s retx=%s" % (
+                            window, payload, size, loss, "ok  " if row["ok"] else "FAIL",
+                            row["completion_s"], row["goodput_mbps"], row["retransmit_ratio"]), flush=True)
+                    if args.chat_messages > 0:
+                        row = run_chat(args, build, window, payload, loss, rep)
+                        rows.append(row)
+                        failures += not row["ok"]
+                        print("chat w=%-3d p=%-5d loss=%-5g %s delivered=%d/%d p50=%sms p99=%sms" % (
+                            window, payload, loss, "ok  " if row["ok"] else "FAIL", row["delivered"],
+                            row["messages"], row["latency_p50_ms"], row["latency_p99_ms"]), flush=True)
+
+    try:
+        os.rmdir(os.path.join(args.out, "tmp"))
+    except OSError:
+        pass
+    with open(os.path.join(args.out, "results.csv"), "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=FIELDS, extrasaction="ignore")
+        writer.writeheader()
+        writer.writerows(rows)
+    with open(os.path.join(args.out, "results.json"), "w") as f:
+        json.dump({"cflags": args.cflags, "seed": args.seed, "runs": rows}, f, indent=2)
+    print("Wrote %d results to %s/results.{csv,json}" % (len(rows), args.out))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
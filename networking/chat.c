@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include "chat.h"
+#include "common.h"
+#include "net.h"
+#include "metrics.h"
+
+struct chat_input chat_in;
+
+void read_chat_input(void) {
+    if (chat_in.eof || chat_in.length == sizeof(chat_in.buffer)) return;
+    ssize_t n = read(STDIN_FILENO, chat_in.buffer + chat_in.length, sizeof(chat_in.buffer) - chat_in.length);
+    if (n > 0) {
+        chat_in.length += n;
+    } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+        chat_in.eof = 1;
+    }
+}
+
+// Where the next line ends: take bytes of text, consumed including the
+// terminator. Returns -1 if no line is ready yet.
+static int chat_line_extent(size_t *take, size_t *consumed) {
+    char *newline = memchr(chat_in.buffer, '\n', chat_in.length);
+    if (newline && (size_t)(newline - chat_in.buffer) <= CHAT_MESSAGE_MAX) {
+        *take = newline - chat_in.buffer;
+        *consumed = *take + 1;
+    } else if (chat_in.length >= CHAT_MESSAGE_MAX) {
+        *take = *consumed = CHAT_MESSAGE_MAX;
+    } else if (chat_in.eof && chat_in.length > 0) {
+        *take = *consumed = chat_in.length;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int next_chat_line(char *line) {
+    size_t take, consumed;
+    if (chat_line_extent(&take, &consumed) < 0) return -1;
+    memcpy(line, chat_in.buffer, take);
+    line[take] = '\0';
+    memmove(chat_in.buffer, chat_in.buffer + consumed, chat_in.length - consumed);
+    chat_in.length -= consumed;
+    return (int)take;
+}
+
+size_t chat_frame(char *out, const char *line, size_t length) {
+    uint16_t prefix = htons((uint16_t)length);
+    memcpy(out, &prefix, sizeof(prefix));
+    memcpy(out + sizeof(prefix), line, length);
+    return sizeof(prefix) + length;
+}
+
+static void session_log(struct chat_session *s, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void session_log(struct chat_session *s, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vlog_to(s->conn->cfg.log, format, args);
+    va_end(args);
+}
+
+static double elapsed_ms(const struct timeval *from, const struct timeval *to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_usec - from->tv_usec) / 1000.0;
+}
+
+void chat_session_init(struct chat_session *s, struct sham_conn *conn) {
+    memset(s, 0, sizeof(*s));
+    s->conn = conn;
+    s->peer_name = "Peer";
+    s->coalesce_delay_ms = -1;
+}
+
+static void print_line(struct chat_session *s, const char *text, size_t length) {
+    char line[PAYLOAD_SIZE + 1];
+    memcpy(line, text, length);
+    line[length] = '\0';
+    printf("%s: %s\n", s->peer_name, line);
+}
+
+// Prints every message the connection has ready. Once the peer's data has
+// ended, the side that did not start the close follows it.
+static void deliver_lines(struct chat_session *s) {
+    const char *payload;
+    ssize_t length;
+    while ((length = sham_recv_peek(s->conn, &payload)) > 0) {
+        size_t offset = 0;
+        while (offset + sizeof(uint16_t) <= (size_t)length) {
+            uint16_t prefix;
+            memcpy(&prefix, payload + offset, sizeof(prefix));
+            size_t message_length = ntohs(prefix);
+            offset += sizeof(prefix);
+            if (message_length > (size_t)length - offset) {
+                session_log(s, "TRUNCATED MSG LEN=%zu\n", message_length);
+                break;
+            }
+            print_line(s, payload + offset, message_length);
+            offset += message_length;
+        }
+        metrics_count_in(s->conn->metrics, M_BYTES_DELIVERED, length);
+        sham_recv_release(s->conn);
+    }
+    fflush(stdout);
+    if (length == 0 && !s->initiator && !s->closing) {
+        s->input_done = 1;
+        s->closing = 1;
+    }
+}
+
+// Callers check the window first, so only the packet pool can be short
+static void line_dropped(struct chat_session *s, size_t length) {
+    printf("Out of packet buffers, line dropped\n");
+    session_log(s, "DROP LINE LEN=%zu (%s)\n", length, strerror(errno));
+}
+
+// A line on its own, framed straight into the segment
+static void send_line(struct chat_session *s, const char *line, size_t length) {
+    size_t room;
+    char *payload = sham_send_buffer(s->conn, &room);
+    if (!payload || sham_send_commit(s->conn, chat_frame(payload, line, length)) < 0) line_dropped(s, length);
+}
+
+static void flush_batch(struct chat_session *s) {
+    if (s->batch_messages > 1) {
+        session_log(s, "COALESCED MSGS=%d LEN=%zu\n", s->batch_messages, s->batch_length);
+        s->messages_coalesced += s->batch_messages;
+    }
+    if (sham_send(s->conn, s->batch, s->batch_length) < 0) line_dropped(s, s->batch_length);
+    s->batch_length = 0;
+    s->batch_messages = 0;
+}
+
+// Appends one line to the batch, which must have room for it
+static void batch_line(struct chat_session *s, const char *line, size_t length) {
+    if (s->batch_length == 0) net_gettimeofday(&s->batch_since);
+    s->batch_length += chat_frame(s->batch + s->batch_length, line, length);
+    s->batch_messages++;
+}
+
+// Nagle's rule with a deadline: the batch goes out as soon as nothing is in
+// flight, and otherwise once it is full or its oldest line has waited
+// coalesce_delay_ms
+static int batch_due(const struct chat_session *s) {
+    if (s->batch_length == 0 || !sham_writable(s->conn)) return 0;
+    if (s->conn->window_count == 0 || s->input_done || s->closing) return 1;
+    struct timeval now;
+    net_gettimeofday(&now);
+    return elapsed_ms(&s->batch_since, &now) >= s->coalesce_delay_ms;
+}
+
+static void prompt(struct chat_session *s) {
+    if (s->prompt) {
+        printf("%s", s->prompt);
+        fflush(stdout);
+    }
+}
+
+// Packs ready lines into the batch until the next one would not fit
+static void coalesce_ready_lines(struct chat_session *s) {
+    char line[PAYLOAD_SIZE];
+    for (;;) {
+        if (batch_due(s)) flush_batch(s);
+        if (s->input_done || s->closing) return;
+
+        size_t take, consumed;
+        if (chat_line_extent(&take, &consumed) < 0) {
+            if (!chat_in.eof) return;
+            take = 0;
+        }
+        if (s->batch_length + sizeof(uint16_t) + take > PAYLOAD_SIZE) {
+            // Full: it leaves with the next window slot
+            if (!sham_writable(s->conn)) return;
+            if (s->batch_length > 0) {
+                flush_batch(s);
+                continue;
+            }
+        }
+
+        int length = next_chat_line(line);
+        if (length < 0 || strcmp(line, "/quit") == 0) {
+            s->input_done = 1;
+            continue;
+        }
+        if (length == 0) continue;
+        batch_line(s, line, length);
+        prompt(s);
+    }
+}
+
+// Sends every complete line that is ready while the window has room
+static void send_ready_lines(struct chat_session *s) {
+    char line[PAYLOAD_SIZE];
+    if (s->coalesce_delay_ms >= 0) {
+        coalesce_ready_lines(s);
+        return;
+    }
+    while (!s->input_done && !s->closing && sham_writable(s->conn)) {
+        int length = next_chat_line(line);
+        if (length < 0 && !chat_in.eof) return;
+        if (length < 0 || strcmp(line, "/quit") == 0) {
+            s->input_done = 1;
+            return;
+        }
+        if (length == 0) continue;
+        send_line(s, line, length);
+        prompt(s);
+    }
+}
+
+void chat_run(struct chat_session *s) {
+    struct sham_conn *c = s->conn;
+    while (!sham_done(c)) {
+        deliver_lines(s);
+        send_ready_lines(s);
+        if (s->input_done && s->initiator) s->closing = 1;
+        if (s->closing && s->batch_length == 0) sham_shutdown(c);
+
+        int wait_ms = sham_timeout_ms(c);
+        // The batch itself is sent by send_ready_lines; this only wakes the
+        // loop. With the window closed the next ACK does that instead.
+        if (s->batch_length > 0 && sham_writable(c)) {
+            struct timeval now;
+            net_gettimeofday(&now);
+            double remaining = s->coalesce_delay_ms - elapsed_ms(&s->batch_since, &now);
+            int batch_ms = remaining > 0 ? (int)remaining + 1 : 0;
+            if (wait_ms < 0 || batch_ms < wait_ms) wait_ms = batch_ms;
+        }
+
+        // Only take more input while it could be sent, so a closed window
+        // pushes back on stdin instead of growing the buffer
+        int want_input = !s->input_done && !s->closing && !chat_in.eof && chat_in.length < sizeof(chat_in.buffer) &&
+                         (sham_writable(c) || (s->coalesce_delay_ms >= 0 && s->batch_length < PAYLOAD_SIZE));
+        int sockfd = sham_fd(c);
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(sockfd, &read_fds);
+        if (want_input) FD_SET(STDIN_FILENO, &read_fds);
+        struct timeval tv = {1, 0};
+        if (wait_ms >= 0 && wait_ms < 1000) {
+            tv.tv_sec = 0;
+            tv.tv_usec = wait_ms * 1000;
+        }
+
+        int ready = net_select((sockfd > STDIN_FILENO ? sockfd : STDIN_FILENO) + 1, &read_fds, NULL, NULL, &tv);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("select error");
+            break;
+        }
+        if (ready > 0 && want_input && FD_ISSET(STDIN_FILENO, &read_fds)) read_chat_input();
+        if (sham_process(c) < 0) {
+            perror("recvfrom error");
+            break;
+        }
+    }
+    deliver_lines(s);
+    if (s->messages_coalesced > 0) printf("Lines sent in shared segments: %lu\n", s->messages_coalesced);
+}
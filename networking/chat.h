@@ -0,0 +1,78 @@
+#ifndef SHAM_CHAT_H
+#define SHAM_CHAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "headers.h"
+#include "sham.h"
+
+// Received data with nothing to send back is acknowledged after this long,
+// unless an outgoing line carries the ACK first. A second unacknowledged
+// segment is acknowledged at once.
+#ifndef CHAT_ACK_DELAY_MS
+#define CHAT_ACK_DELAY_MS 40
+#endif
+
+// With coalescing on, lines typed while earlier ones are unacknowledged are
+// packed into one segment. The batch goes out when nothing is in flight, when
+// the next line would not fit, or after this long at the latest.
+#ifndef CHAT_COALESCE_DELAY_MS
+#define CHAT_COALESCE_DELAY_MS 200
+#endif
+
+// Chat runs on a connection that agreed MSGS: every segment is a run of
+// messages, each behind a 16-bit length in network order. A line longer than
+// this is split.
+#define CHAT_MESSAGE_MAX (PAYLOAD_SIZE - sizeof(uint16_t))
+
+// Chat input is read from stdin with read() whenever select reports it ready,
+// so a half-typed line never holds up ACK processing or retransmissions
+struct chat_input {
+    char buffer[2 * PAYLOAD_SIZE];
+    size_t length;
+    int eof;
+};
+extern struct chat_input chat_in;
+
+// Appends whatever stdin has ready to chat_in
+void read_chat_input(void);
+
+// Takes the next complete line, without its terminator, into line (at least
+// CHAT_MESSAGE_MAX + 1 bytes). A line too long for one message is split, and
+// an unterminated last line is taken at EOF. Returns the length, or -1 if no
+// line is ready yet.
+int next_chat_line(char *line);
+
+// Writes one message (its length, then the text) to out, which needs
+// length + 2 bytes. Returns the bytes written.
+size_t chat_frame(char *out, const char *line, size_t length);
+
+// One full-duplex chat on an established connection. The connection does
+// the sending, ACKs and teardown; the session turns lines into messages and
+// back. The initiator closes on /quit or end of input, the other side once
+// the peer's data has ended.
+struct chat_session {
+    struct sham_conn *conn;
+    const char *peer_name;      // Prefixes delivered lines, e.g. "Client"
+    const char *prompt;         // Shown after each line sent, or NULL
+    int initiator;
+
+    // Coalescing: framed lines waiting for the next segment
+    int coalesce_delay_ms;      // Longest a line is held back; -1 when off
+    char batch[PAYLOAD_SIZE];
+    size_t batch_length;
+    int batch_messages;
+    struct timeval batch_since;
+
+    int input_done;             // /quit or end of input
+    int closing;                // Shut down once the batch is out
+    unsigned long messages_coalesced;  // Lines that shared a segment
+};
+
+void chat_session_init(struct chat_session *s, struct sham_conn *conn);
+
+// Runs the session until the connection is done
+void chat_run(struct chat_session *s);
+
+#endif
@@ -2,482 +2,950 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include "headers.h"
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
-#include <stdarg.h>
+#include "common.h"
+#include "net.h"
+#include "metrics.h"
+#include "qlog.h"
+#include "rtt.h"
+#include "compress.h"
+#include "fec.h"
+#include "digest.h"
+#include "chat.h"
+#include "fanout.h"
+#include "sham.h"
 
-#define PAYLOAD_SIZE 1024
-#define WINDOW_SIZE 4 // Max number of unacknowledged packets in flight
-
-// Global variables for packet loss simulation
-double packet_loss_rate = 0.0;
 int chat_mode = 0;
-FILE *log_file = NULL;
+int coalesce_delay_ms = -1; // --coalesce[=MS], chat mode only
+uint32_t connection_id = 0; // Proposed in the SYN, the server's SYN-ACK has the final say
 
-// RTO constants and variables
-#define ALPHA 0.25
-#define BETA 0.75
-double EstimatedRTT = 500.0; // Initial RTT estimate in ms
-double DevRTT = 0.0;
-double RTO = 1000.0; // Initial RTO in ms
-
-// Struct to hold a packet and its transmission info
-struct sent_packet {
-    struct sham_packet packet;
-    struct timeval sent_time;
-    int is_valid;
-    int seq_num;
-    size_t data_length;
-};
+// Compression is requested with --compress and only used if the server agrees
+int compression_requested = 0;
+int compression_level = COMP_DEFAULT_LEVEL;
+int compression_enabled = 0;
 
-// Flow control state
-struct flow_control {
-    int last_byte_sent;
-    int last_byte_acked;
-    int receiver_window;
-};
+// Forward error correction, requested with --fec[=K[,M]]. With no M the
+// parity count follows the measured loss rate.
+int fec_requested = 0;
+int fec_enabled = 0;
+int fec_k = FEC_DEFAULT_K;
+int fec_m = 0;
 
-// Function declarations
-void send_termination_sequence(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int next_seq_num);
-void send_data_chat(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len);
-void send_data_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char* filename);
-void print_usage(const char* program_name);
-int should_drop_packet(void);
-void log_message(const char *format, ...);
+// Multiplexed streams: the input file is stream 0 and every --stream=FILE adds
+// another, all sent round-robin over one connection
+int streams_requested = 0;
+int streams_enabled = 0;
+struct send_stream {
+    const char *path;
+    FILE *file;
+    uint64_t offset;
+    uint64_t size;
+    int finished;   // Frame with STREAM_FIN built
+} streams[MAX_STREAMS];
+int stream_count = 0;
+int next_stream = 0;
+
+// Batch mode: --batch sends every file under a directory, or every path
+// listed in a file, back to back over one connection
+int batch_requested = 0;
+int batch_enabled = 0;
+struct batch_file {
+    char *path;     // Where to read it
+    char *name;     // Relative path the server creates under its directory
+} *batch_files = NULL;
+int batch_count = 0;
+int batch_capacity = 0;
+struct batch_sender {
+    int next;                   // Next file to open
+    FILE *file;                 // Data being sent, NULL between files
+    uint64_t remaining;
+    struct md5_stream *md5;
+    char pending[sizeof(struct sham_file_header) + BATCH_NAME_MAX]; // Header and name, or digest
+    size_t pending_length;
+    size_t pending_sent;
+    int files_sent;
+    uint64_t bytes_sent;
+} batch;
+
+// Pipe mode: input_file "-" streams stdin, whose length is unknown. Reads
+// run up to PIPE_READAHEAD ahead of the window so the producer is not held
+// up by every ACK, and a sham_pipe_end follows the data.
+#ifndef PIPE_READAHEAD
+#define PIPE_READAHEAD (256 * 1024)
+#endif
+int pipe_mode = 0;
+int pipe_enabled = 0;
+struct pipe_reader {
+    char buffer[PIPE_READAHEAD];
+    size_t start;
+    size_t end;
+    int eof;
+    int error;      // Reading failed: no end marker, so the server sees a cut
+    uint64_t total;
+} readahead;
+
+// Download mode: with --get, input_file is a path under the server's --serve directory
+// and output_file is where it is saved. --range=OFFSET[,LENGTH] fetches part
+// of it into the same place in output_file, so several clients can fill one
+// file in parallel.
+int get_mode = 0;
+int get_enabled = 0;
+int get_ranged = 0;
+uint64_t get_offset = 0;
+uint64_t get_length = 0;    // 0 for the rest of the file
+int get_failed = 0;
+int send_failed = 0;        // The input could not be read to the end
+struct download_state {
+    char header[sizeof(struct sham_get_response)];
+    size_t have;
+    int status;
+    uint64_t size;          // Of the whole file on the server
+    uint64_t expected;
+    uint64_t received;
+    FILE *file;
+    const char *path;
+    int write_error;        // errno of the first failed write; later data is discarded
+} download;
 
-// Function to log messages with high-precision timestamps
-void log_message(const char *format, ...) {
-    if (!log_file) return; // Ensure logging is active only when log_file is open
+// Fanout mode: --fanout[=N] sends input_file once to many receivers running
+// server --fanout. A multicast server_ip is a group that N receivers (default
+// 1) join; otherwise server_ip and every --to=IP:PORT get each datagram in
+// one sendmmsg() call.
+int fanout_mode = 0;
+int fanout_expected = 0;
+const char *fanout_to[FANOUT_MAX_RECEIVERS];
+int fanout_to_count = 0;
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    time_t curtime = tv.tv_sec;
-    char time_buffer[30];
-    strftime(time_buffer, 30, "%Y-%m-%d %H:%M:%S", localtime(&curtime));
+// 0-RTT: with --0rtt the first file segment or chat line rides on the SYN
+int fast_open = 0;
+struct early_segment {
+    char payload[PAYLOAD_SIZE];
+    size_t length;
+    int accepted;   // Server confirmed it in the SYN-ACK
+    int quit;       // Chat user quit before the connection was up
+} early;
 
-    fprintf(log_file, "[%s.%06ld] [LOG] ", time_buffer, tv.tv_usec);
+// Per-server parameters remembered between runs in .sham_cache (or $SHAM_CACHE)
+#define CACHE_MAX_ENTRIES 64
+#define CACHE_MAX_AGE (7 * 24 * 3600)
+struct cached_params {
+    int valid;
+    double srtt;
+    double rttvar;
+    int window;
+    int flags;      // Options the server accepted last time
+};
+
+// RTT estimate, seeded from the cache and carried back into it
+double EstimatedRTT = 0.0;
+double DevRTT = 0.0;
 
-    va_list args;
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
+// Transmission counters, reported when the session ends
+unsigned long segments_sent = 0;
+unsigned long segments_retransmitted = 0;
 
-    fflush(log_file);
+// Function declarations
+void send_data_chat(struct sham_conn *conn);
+void send_data_file(struct sham_conn *conn, const char* filename);
+void send_data_pipe(struct sham_conn *conn);
+void recv_download(struct sham_conn *conn, const char *remote_path, const char *local_path);
+int send_data_fanout(int sockfd, const struct sockaddr_in *server_addr, const char *filename);
+void print_usage(const char* program_name);
+uint32_t generate_connection_id(void);
+int prepare_early_data(const char *filename);
+int load_cached_params(const char *server_ip, int server_port, struct cached_params *params);
+int open_streams(void);
+size_t read_stream_frame(char *payload);
+int collect_batch(const char *input, const char *target);
+size_t read_batch(char *payload, size_t room);
+void store_cached_params(const char *server_ip, int server_port, const struct cached_params *params);
+
+// Random non-zero ID, so clients started in the same second still differ
+uint32_t generate_connection_id(void) {
+    uint32_t id = net_random32();
+    while (id == 0) {
+        id = net_random32();
+    }
+    return id;
 }
 
-// Simulate packet loss
-int should_drop_packet() {
-    if (packet_loss_rate <= 0.0) return 0;
-    double random_val = (double)rand() / RAND_MAX;
-    return random_val < packet_loss_rate;
+const char *cache_path(void) {
+    const char *path = getenv("SHAM_CACHE");
+    return (path && *path) ? path : ".sham_cache";
 }
 
-void send_data_chat(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len) {
-    int next_seq_num = 1;
-    int base_seq_num = 1;
-    struct sent_packet window[WINDOW_SIZE];
-    int window_start = 0;
-    int window_count = 0;
+// Cache lines: <ip> <port> <srtt_ms> <rttvar_ms> <window> <flags> <unix_time>
+int load_cached_params(const char *server_ip, int server_port, struct cached_params *params) {
+    FILE *cache_file = fopen(cache_path(), "r");
+    if (!cache_file) return 0;
 
-    struct flow_control fc;
-    fc.last_byte_sent = 0;
-    fc.last_byte_acked = 0;
-    fc.receiver_window = 1024;
+    char ip[INET_ADDRSTRLEN];
+    int port, window, flags;
+    double srtt, rttvar;
+    long stamp;
+    params->valid = 0;
+    while (fscanf(cache_file, "%15s %d %lf %lf %d %d %ld", ip, &port, &srtt, &rttvar, &window, &flags, &stamp) == 7) {
+        if (port == server_port && strcmp(ip, server_ip) == 0 && time(NULL) - stamp < CACHE_MAX_AGE) {
+            params->valid = 1;
+            params->srtt = srtt;
+            params->rttvar = rttvar;
+            params->window = window;
+            params->flags = flags;
+        }
+    }
+    fclose(cache_file);
+    return params->valid;
+}
+
+// Rewrites the cache with this server's entry first, keeping the most recent others
+void store_cached_params(const char *server_ip, int server_port, const struct cached_params *params) {
+    char lines[CACHE_MAX_ENTRIES][128];
+    int count = 0;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    char rest[96];
 
-    for (int i = 0; i < WINDOW_SIZE; i++) {
-        window[i].is_valid = 0;
+    FILE *cache_file = fopen(cache_path(), "r");
+    if (cache_file) {
+        while (count < CACHE_MAX_ENTRIES - 1 && fscanf(cache_file, "%15s %d %95[^\n]", ip, &port, rest) == 3) {
+            if (port == server_port && strcmp(ip, server_ip) == 0) continue;
+            snprintf(lines[count++], sizeof(lines[0]), "%s %d %s", ip, port, rest);
+        }
+        fclose(cache_file);
     }
 
-    printf("Enter chat messages (type '/quit' to exit):\n");
-    if (packet_loss_rate > 0.0) {
-        printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path());
+    cache_file = fopen(tmp_path, "w");
+    if (!cache_file) {
+        perror("Failed to write connection cache");
+        return;
+    }
+    fprintf(cache_file, "%s %d %.3f %.3f %d %d %ld\n", server_ip, server_port, params->srtt, params->rttvar, params->window, params->flags, (long)time(NULL));
+    for (int i = 0; i < count; i++) {
+        fprintf(cache_file, "%s\n", lines[i]);
     }
+    fclose(cache_file);
+    if (rename(tmp_path, cache_path()) < 0) {
+        perror("Failed to update connection cache");
+    }
+}
 
-    while (1) {
-        // Step 1: Check for incoming ACKs and timeouts
-        fd_set read_fds;
-        struct timeval tv, current_time;
-
-        if (window_count > 0) {
-            gettimeofday(&current_time, NULL);
-            double elapsed = (current_time.tv_sec - window[window_start].sent_time.tv_sec) * 1000.0 +
-                             (current_time.tv_usec - window[window_start].sent_time.tv_usec) / 1000.0;
-
-            if (elapsed >= RTO) {
-                printf("TIMEOUT! Retransmitting SEQ=%u\n", window[window_start].seq_num);
-                log_message("TIMEOUT SEQ=%u\n", window[window_start].seq_num);
-                ssize_t bytes_to_send = sizeof(struct sham_header) + window[window_start].data_length;
-                if (!should_drop_packet()) {
-                    sendto(sockfd, &window[window_start].packet, bytes_to_send, 0, (const struct sockaddr *)server_addr, server_len);
-                    log_message("RETX DATA SEQ=%u LEN=%zu\n", window[window_start].seq_num, window[window_start].data_length);
-                } else {
-                    printf("DROPPED retransmission SEQ=%u (simulated loss)\n", window[window_start].seq_num);
-                    log_message("DROP DATA SEQ=%u\n", window[window_start].seq_num);
-                }
-                gettimeofday(&window[window_start].sent_time, NULL);
-                RTO *= 2;
-                if (RTO > 5000) RTO = 5000;
+// Reads what the SYN will carry: the first file segment, or the first chat
+// line framed as a message
+int prepare_early_data(const char *filename) {
+    if (chat_mode) {
+        printf("Enter chat messages (type '/quit' to exit):\n");
+        printf("You: ");
+        fflush(stdout);
+        // Nothing else to service before the handshake, so block for a line
+        char line[PAYLOAD_SIZE];
+        while (1) {
+            int len = next_chat_line(line);
+            if (len < 0 && !chat_in.eof) {
+                read_chat_input();
                 continue;
             }
-            tv.tv_sec = (long)(RTO - elapsed) / 1000;
-            tv.tv_usec = ((long)(RTO - elapsed) % 1000) * 1000;
-        } else {
-            tv.tv_sec = 1;
-            tv.tv_usec = 0;
+            if (len < 0 || strcmp(line, "/quit") == 0) {
+                early.quit = 1;
+                early.length = 0;
+                return 0;
+            }
+            if (len > 0) {
+                early.length = chat_frame(early.payload, line, len);
+                return 0;
+            }
         }
+    }
 
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
+    FILE *input_file = fopen(filename, "rb");
+    if (!input_file) {
+        perror("Failed to open input file");
+        return -1;
+    }
+    if (streams_requested) {
+        // The first frame of stream 0
+        struct sham_stream_header sh;
+        size_t n = fread(early.payload + sizeof(sh), 1, STREAM_DATA_SIZE, input_file);
+        int fin = n < STREAM_DATA_SIZE || fgetc(input_file) == EOF;
+        sh.stream_id = htons(0);
+        sh.flags = htons(fin ? STREAM_FIN : 0);
+        sh.offset = htonl(0);
+        memcpy(early.payload, &sh, sizeof(sh));
+        early.length = sizeof(sh) + n;
+    } else {
+        early.length = fread(early.payload, 1, PAYLOAD_SIZE, input_file);
+    }
+    fclose(input_file);
+    return 0;
+}
 
-        int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
+int open_streams(void) {
+    for (int i = 0; i < stream_count; i++) {
+        struct stat st;
+        streams[i].file = fopen(streams[i].path, "rb");
+        if (!streams[i].file || fstat(fileno(streams[i].file), &st) < 0) {
+            perror(streams[i].path);
+            while (i >= 0) {
+                if (streams[i].file) fclose(streams[i].file);
+                i--;
+            }
+            return -1;
+        }
+        streams[i].size = st.st_size;
+        printf("Stream %d: %s (%llu bytes)\n", i, streams[i].path, (unsigned long long)streams[i].size);
+    }
+    return 0;
+}
 
-        if (select_result > 0) {
-            struct sham_header ack_header;
-            recvfrom(sockfd, &ack_header, sizeof(ack_header), 0, NULL, NULL);
+// Builds the next frame round-robin across unfinished streams, so a short
+// stream is never queued behind a long one. Returns 0 once all are finished.
+size_t read_stream_frame(char *payload) {
+    for (int tried = 0; tried < stream_count; tried++) {
+        int id = next_stream;
+        struct send_stream *st = &streams[id];
+        next_stream = (next_stream + 1) % stream_count;
+        if (st->finished) continue;
 
-            if (ack_header.flags & ACK) {
-                uint32_t ack_num = ntohl(ack_header.ack_num);
-                fc.receiver_window = ntohs(ack_header.window_size);
+        struct sham_stream_header sh;
+        size_t n = fread(payload + sizeof(sh), 1, STREAM_DATA_SIZE, st->file);
+        int fin = n < STREAM_DATA_SIZE || st->offset + n >= st->size;
+        sh.stream_id = htons(id);
+        sh.flags = htons(fin ? STREAM_FIN : 0);
+        sh.offset = htonl((uint32_t)st->offset);
+        memcpy(payload, &sh, sizeof(sh));
+        st->offset += n;
+        st->finished = fin;
+        return sizeof(sh) + n;
+    }
+    return 0;
+}
 
-                printf("Received ACK=%u, Receiver Window=%d\n", ack_num, fc.receiver_window);
-                log_message("RCV ACK=%u\n", ack_num);
+int add_batch_file(const char *path, const char *name) {
+    if (strlen(name) > BATCH_NAME_MAX) {
+        printf("Warning: Name too long, skipping %s\n", path);
+        return 0;
+    }
+    if (batch_count == batch_capacity) {
+        int capacity = batch_capacity ? 2 * batch_capacity : 64;
+        struct batch_file *files = realloc(batch_files, capacity * sizeof(*files));
+        if (!files) {
+            perror("Failed to grow the batch file list");
+            return -1;
+        }
+        batch_files = files;
+        batch_capacity = capacity;
+    }
+    batch_files[batch_count].path = strdup(path);
+    batch_files[batch_count].name = strdup(name);
+    batch_count++;
+    return 0;
+}
 
-                // Update RTT/RTO only for non-retransmitted packets
-                if (window_count > 0 && window[window_start].is_valid) {
-                    gettimeofday(&current_time, NULL);
-                    double SampleRTT = (current_time.tv_sec - window[window_start].sent_time.tv_sec) * 1000.0 +
-                                       (current_time.tv_usec - window[window_start].sent_time.tv_usec) / 1000.0;
+// Adds the regular files under dir, named prefix/<path below dir>. Symbolic
+// links are not followed.
+int collect_batch_dir(const char *dir, const char *prefix) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+    struct dirent *entry;
+    int result = 0;
+    while (result == 0 && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[4096], name[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        snprintf(name, sizeof(name), "%s/%s", prefix, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) < 0) {
+            perror(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            result = collect_batch_dir(path, name);
+        } else if (S_ISREG(st.st_mode)) {
+            result = add_batch_file(path, name);
+        } else {
+            printf("Warning: Not a regular file, skipping %s\n", path);
+        }
+    }
+    closedir(d);
+    return result;
+}
 
-                    EstimatedRTT = (1 - ALPHA) * EstimatedRTT + ALPHA * SampleRTT;
-                    DevRTT = (1 - BETA) * DevRTT + BETA * fabs(SampleRTT - EstimatedRTT);
-                    RTO = EstimatedRTT + 4 * DevRTT;
+// input is a directory to walk or a file listing one path per line. Every
+// name is placed under target, which the server resolves in its own
+// directory.
+int collect_batch(const char *input, const char *target) {
+    struct stat st;
+    if (stat(input, &st) < 0) {
+        perror(input);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) return collect_batch_dir(input, target);
 
-                    if (RTO < 100) RTO = 100;
-                    if (RTO > 5000) RTO = 5000;
-                }
+    FILE *list = fopen(input, "r");
+    if (!list) {
+        perror(input);
+        return -1;
+    }
+    char line[4096];
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        const char *relative = line;
+        while (*relative == '/') relative++;
+        if (strncmp(relative, "./", 2) == 0) relative += 2;
+        char name[4096];
+        if (snprintf(name, sizeof(name), "%s/%s", target, relative) >= (int)sizeof(name)) {
+            printf("Warning: Name too long, skipping %s\n", line);
+            continue;
+        }
+        result = add_batch_file(line, name);
+    }
+    fclose(list);
+    return result;
+}
 
-                // Slide the window
-                while (window_count > 0 && (uint32_t)(window[window_start].seq_num + window[window_start].data_length) <= ack_num) {
-                    printf("Packet SEQ=%u acknowledged\n", window[window_start].seq_num);
-                    fc.last_byte_acked = window[window_start].seq_num + window[window_start].data_length - 1;
-                    window[window_start].is_valid = 0;
-                    window_start = (window_start + 1) % WINDOW_SIZE;
-                    window_count--;
-                }
+// Queues the next file's header and name. Returns 0 once no file is left.
+static int open_next_batch_file(void) {
+    while (batch.next < batch_count) {
+        struct batch_file *bf = &batch_files[batch.next++];
+        struct stat st;
+        FILE *file = fopen(bf->path, "rb");
+        if (!file || fstat(fileno(file), &st) < 0 || !S_ISREG(st.st_mode)) {
+            if (file) {
+                printf("Warning: Not a regular file, skipping %s\n", bf->path);
+                fclose(file);
+            } else {
+                perror(bf->path);
+            }
+            continue;
+        }
+        struct sham_file_header fh;
+        size_t name_length = strlen(bf->name);
+        fh.name_length = htons(name_length);
+        fh.flags = 0;
+        fh.mode = htonl(st.st_mode & 0777);
+        fh.size_high = htonl((uint32_t)((uint64_t)st.st_size >> 32));
+        fh.size_low = htonl((uint32_t)st.st_size);
+        memcpy(batch.pending, &fh, sizeof(fh));
+        memcpy(batch.pending + sizeof(fh), bf->name, name_length);
+        batch.pending_length = sizeof(fh) + name_length;
+        batch.pending_sent = 0;
+        batch.file = file;
+        batch.remaining = st.st_size;
+        batch.md5 = md5_stream_new();
+        printf("Batch file %d/%d: %s (%llu bytes)\n", batch.next, batch_count, bf->name, (unsigned long long)st.st_size);
+        log_message("BATCH FILE=%s LEN=%llu\n", bf->name, (unsigned long long)st.st_size);
+        return 1;
+    }
+    return 0;
+}
 
-                printf("Flow control update: Bytes in flight = %d, Receiver window = %d\n", fc.last_byte_sent - fc.last_byte_acked, fc.receiver_window);
-                log_message("FLOW WIN UPDATE=%u\n", fc.receiver_window);
+// Fills the segment from the record stream: the header and name, the data,
+// the digest, and straight on into the next file. Returns 0 at the end.
+size_t read_batch(char *payload, size_t room) {
+    size_t filled = 0;
+    while (filled < room) {
+        if (batch.pending_sent < batch.pending_length) {
+            size_t n = batch.pending_length - batch.pending_sent;
+            if (n > room - filled) n = room - filled;
+            memcpy(payload + filled, batch.pending + batch.pending_sent, n);
+            batch.pending_sent += n;
+            filled += n;
+        } else if (batch.file && batch.remaining > 0) {
+            size_t n = room - filled;
+            if (n > batch.remaining) n = batch.remaining;
+            size_t got = fread(payload + filled, 1, n, batch.file);
+            if (got < n) {
+                // The file shrank after its size was sent; the digest covers what went out
+                printf("Warning: %s is shorter than its size, padding with zeros\n", batch_files[batch.next - 1].path);
+                memset(payload + filled + got, 0, n - got);
             }
-        } else if (select_result < 0) {
-            perror("select error");
+            md5_stream_update(batch.md5, payload + filled, n);
+            batch.remaining -= n;
+            batch.bytes_sent += n;
+            filled += n;
+        } else if (batch.file) {
+            fclose(batch.file);
+            batch.file = NULL;
+            md5_stream_final(batch.md5, (unsigned char *)batch.pending);
+            batch.md5 = NULL;
+            batch.pending_length = MD5_DIGEST_SIZE;
+            batch.pending_sent = 0;
+            batch.files_sent++;
+        } else if (!open_next_batch_file()) {
             break;
         }
+    }
+    return filled;
+}
 
-        // Step 2: Read input and send new packets if the window has space
-        int bytes_in_flight = fc.last_byte_sent - fc.last_byte_acked;
-        while (window_count < WINDOW_SIZE && bytes_in_flight < fc.receiver_window) {
-            char payload[PAYLOAD_SIZE];
-            printf("You: ");
-            fflush(stdout);
+void send_data_chat(struct sham_conn *conn) {
+    if (!(conn->options & MSGS)) {
+        printf("Server is not in chat mode, closing\n");
+        sham_shutdown(conn);
+        while (!sham_done(conn) && sham_wait(conn) >= 0);
+        return;
+    }
+    struct chat_session session;
+    chat_session_init(&session, conn);
+    session.peer_name = "Server";
+    session.prompt = "You: ";
+    session.initiator = 1;
+    session.coalesce_delay_ms = coalesce_delay_ms;
 
-            if (fgets(payload, PAYLOAD_SIZE, stdin) == NULL) {
-                goto end_data_transfer;
-            }
-            if (strcmp(payload, "/quit\n") == 0) {
-                goto end_data_transfer;
-            }
+    // A line typed before the handshake is in flight already, or queued
+    // again by the library if the server declined it
+    if (early.quit) {
+        session.input_done = 1;
+    } else if (early.length == 0) {
+        printf("Enter chat messages (type '/quit' to exit):\n");
+        printf("You: ");
+        fflush(stdout);
+    }
+    if (packet_loss_rate > 0.0) {
+        printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
+    }
+    chat_run(&session);
 
-            size_t payload_len = strlen(payload);
-            if (payload_len > 0 && payload[payload_len - 1] == '\n') {
-                payload[payload_len - 1] = '\0';
-                payload_len--;
-            }
-            if (payload_len == 0) continue;
-
-            size_t packet_data_len = payload_len + 1;
-            int slot = (window_start + window_count) % WINDOW_SIZE;
-
-            memset(&window[slot], 0, sizeof(struct sent_packet));
-            window[slot].is_valid = 1;
-            window[slot].seq_num = next_seq_num;
-            window[slot].data_length = packet_data_len;
-
-            window[slot].packet.header.flags = 0;
-            window[slot].packet.header.seq_num = htonl(next_seq_num);
-            window[slot].packet.header.ack_num = htonl(0);
-            window[slot].packet.header.window_size = htons(1024);
-
-            memcpy(window[slot].packet.payload, payload, payload_len);
-            window[slot].packet.payload[payload_len] = '\0';
-
-            ssize_t bytes_to_send = sizeof(struct sham_header) + packet_data_len;
-            if (!should_drop_packet()) {
-                sendto(sockfd, &window[slot].packet, bytes_to_send, 0, (const struct sockaddr *)server_addr, server_len);
-                gettimeofday(&window[slot].sent_time, NULL);
-                printf("SND DATA SEQ=%u, Bytes in flight: %d, Receiver window: %d\n", next_seq_num, bytes_in_flight + (int)packet_data_len, fc.receiver_window);
-                log_message("SND DATA SEQ=%u LEN=%zu\n", next_seq_num, packet_data_len);
-            } else {
-                printf("DROPPED packet SEQ=%u (simulated loss)\n", next_seq_num);
-                log_message("DROP DATA SEQ=%u\n", next_seq_num);
-                gettimeofday(&window[slot].sent_time, NULL);
-            }
+    EstimatedRTT = conn->srtt;
+    DevRTT = conn->rttvar;
+    segments_sent += conn->segments_sent;
+    segments_retransmitted += conn->retransmissions;
+}
 
-            fc.last_byte_sent = next_seq_num + packet_data_len - 1;
-            next_seq_num += packet_data_len;
-            window_count++;
-            bytes_in_flight = fc.last_byte_sent - fc.last_byte_acked;
+void send_data_file(struct sham_conn *conn, const char* filename) {
+    FILE *input_file = NULL;
+    if (streams_enabled) {
+        if (open_streams() < 0) return;
+    } else if (batch_requested) {
+        if (!batch_enabled) {
+            printf("Server declined batch mode, closing without sending\n");
+            batch.next = batch_count;
         }
+    } else {
+        input_file = fopen(filename, "rb");
+        if (!input_file) {
+            perror("Failed to open input file");
+            return;
+        }
+    }
 
-        if (window_count == 0 && next_seq_num > 1) {
-            break; // All data sent and acknowledged
+    // The first segment went out on the SYN, or is queued again if the
+    // server declined it
+    if (early.length > 0) {
+        if (streams_enabled) {
+            struct sham_stream_header sh;
+            memcpy(&sh, early.payload, sizeof(sh));
+            streams[0].offset = early.length - sizeof(sh);
+            streams[0].finished = (ntohs(sh.flags) & STREAM_FIN) != 0;
+            fseek(streams[0].file, streams[0].offset, SEEK_SET);
+        } else {
+            fseek(input_file, early.length, SEEK_SET);
         }
     }
 
-end_data_transfer:
-    send_termination_sequence(sockfd, server_addr, server_len, next_seq_num);
-}
+    struct compressor *comp = NULL;
+    if (compression_enabled) {
+        comp = compressor_start(input_file, compression_level);
+        if (!comp) {
+            fclose(input_file);
+            return;
+        }
+    }
 
-void send_data_file(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, const char* filename) {
-    FILE *input_file = fopen(filename, "rb");
-    if (!input_file) {
-        perror("Failed to open input file");
-        return;
+    printf("Starting file transfer: %s\n", filename);
+    if (fec_enabled) {
+        printf("FEC: groups of %d segments, %s parity\n", conn->fec_group_k, fec_m ? "fixed" : "adaptive");
     }
-    
-    int next_seq_num = 1;
-    struct sent_packet window[WINDOW_SIZE];
-    int window_start = 0;
-    int window_count = 0;
+    if (comp) {
+        printf("Compression: zlib level %d, %d byte blocks\n", compression_level, COMP_BLOCK_SIZE);
+    }
+    if (packet_loss_rate > 0.0) {
+        printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
+    }
+
+    // Data is read straight into the segment that goes on the wire
     int file_finished = 0;
-    
-    struct flow_control fc;
-    fc.last_byte_sent = 0;
-    fc.last_byte_acked = 0;
-    fc.receiver_window = 1024;
-    
-    for (int i = 0; i < WINDOW_SIZE; i++) {
-        window[i].is_valid = 0;
+    while (!sham_done(conn)) {
+        while (!file_finished) {
+            size_t room;
+            char *payload = sham_send_buffer(conn, &room);
+            if (!payload) break;
+            size_t bytes_read = streams_enabled ? read_stream_frame(payload)
+                              : batch_requested ? read_batch(payload, room)
+                              : comp ? compressor_read(comp, payload, room)
+                                     : fread(payload, 1, room, input_file);
+            if (bytes_read == 0) {
+                file_finished = 1;
+                sham_shutdown(conn);
+                break;
+            }
+            sham_send_commit(conn, bytes_read);
+        }
+        if (sham_wait(conn) < 0) break;
+    }
+
+    if (comp) {
+        uint64_t raw_bytes, wire_bytes;
+        if (compressor_stop(comp, &raw_bytes, &wire_bytes) < 0) {
+            printf("Error: Input could not be read, the server was told to discard the transfer\n");
+            log_message("COMP INPUT ERROR\n");
+            send_failed = 1;
+        }
+        printf("Compressed %llu bytes to %llu bytes on the wire\n", (unsigned long long)raw_bytes, (unsigned long long)wire_bytes);
+        log_message("COMP RAW=%llu WIRE=%llu\n", (unsigned long long)raw_bytes, (unsigned long long)wire_bytes);
+    }
+    if (input_file) fclose(input_file);
+    for (int i = 0; i < stream_count && streams_enabled; i++) fclose(streams[i].file);
+    if (batch.file) {
+        fclose(batch.file);
+        md5_stream_final(batch.md5, (unsigned char *)batch.pending);
+    }
+    if (batch_enabled) {
+        printf("Batch: sent %d of %d files, %llu bytes of data\n", batch.files_sent, batch_count, (unsigned long long)batch.bytes_sent);
+        log_message("BATCH SENT FILES=%d BYTES=%llu\n", batch.files_sent, (unsigned long long)batch.bytes_sent);
+    }
+    if (conn->error) {
+        printf("Failed to close connection gracefully: %s.\n", strerror(conn->error));
+    } else {
+        printf("File transfer complete.\n");
+    }
+
+    EstimatedRTT = conn->srtt;
+    DevRTT = conn->rttvar;
+    segments_sent += conn->segments_sent;
+    segments_retransmitted += conn->retransmissions;
+}
+
+// Moves stdin to the connection, waiting on both so ACKs and timers are
+// served while the producer is slow
+void send_data_pipe(struct sham_conn *conn) {
+    int finished = 0;
+    printf("Starting pipe transfer from stdin\n");
+    if (!pipe_enabled) {
+        printf("Server declined pipe mode, closing without sending\n");
+        sham_shutdown(conn);
+        finished = 1;
     }
-    
-    printf("Starting file transfer: %s\n", filename);
     if (packet_loss_rate > 0.0) {
         printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
     }
-    
-    while (!file_finished || window_count > 0) {
-        fd_set read_fds;
-        struct timeval tv, current_time;
-        
-        if (window_count > 0) {
-            gettimeofday(&current_time, NULL);
-            double elapsed = (current_time.tv_sec - window[window_start].sent_time.tv_sec) * 1000.0 +
-                             (current_time.tv_usec - window[window_start].sent_time.tv_usec) / 1000.0;
-            
-            if (elapsed >= RTO) {
-                printf("TIMEOUT! Retransmitting SEQ=%u\n", window[window_start].seq_num);
-                log_message("TIMEOUT SEQ=%u\n", window[window_start].seq_num);
-                ssize_t bytes_to_send = sizeof(struct sham_header) + window[window_start].data_length;
-                if (!should_drop_packet()) {
-                    sendto(sockfd, &window[window_start].packet, bytes_to_send, 0, (const struct sockaddr *)server_addr, server_len);
-                    log_message("RETX DATA SEQ=%u LEN=%zu\n", window[window_start].seq_num, window[window_start].data_length);
-                } else {
-                    printf("DROPPED retransmission SEQ=%u (simulated loss)\n", window[window_start].seq_num);
-                    log_message("DROP DATA SEQ=%u\n", window[window_start].seq_num);
-                }
-                gettimeofday(&window[window_start].sent_time, NULL);
-                RTO *= 2;
-                if (RTO > 5000) RTO = 5000;
+
+    while (!sham_done(conn)) {
+        while (!finished) {
+            size_t available = readahead.end - readahead.start;
+            if (available == 0 && !readahead.eof) break;
+            size_t room;
+            char *payload = sham_send_buffer(conn, &room);
+            if (!payload) break;
+            if (available > 0) {
+                size_t n = available < room ? available : room;
+                memcpy(payload, readahead.buffer + readahead.start, n);
+                readahead.start += n;
+                sham_send_commit(conn, n);
                 continue;
             }
-            tv.tv_sec = (long)(RTO - elapsed) / 1000;
-            tv.tv_usec = ((long)(RTO - elapsed) % 1000) * 1000;
-        } else {
-            tv.tv_sec = 1;
-            tv.tv_usec = 0;
+            if (!readahead.error) {
+                struct sham_pipe_end marker;
+                memcpy(marker.magic, PIPE_END_MAGIC, sizeof(marker.magic));
+                marker.length_high = htonl((uint32_t)(readahead.total >> 32));
+                marker.length_low = htonl((uint32_t)readahead.total);
+                memcpy(payload, &marker, sizeof(marker));
+                sham_send_commit(conn, sizeof(marker));
+            }
+            sham_shutdown(conn);
+            finished = 1;
         }
-        
+        if (readahead.start == readahead.end) {
+            readahead.start = readahead.end = 0;
+        } else if (readahead.start > PIPE_READAHEAD / 2) {
+            memmove(readahead.buffer, readahead.buffer + readahead.start, readahead.end - readahead.start);
+            readahead.end -= readahead.start;
+            readahead.start = 0;
+        }
+
+        int want_input = !readahead.eof && readahead.end < PIPE_READAHEAD;
+        int sockfd = sham_fd(conn);
+        int timeout = sham_timeout_ms(conn);
+        struct timeval tv = {1, 0};
+        if (timeout >= 0) {
+            tv.tv_sec = timeout / 1000;
+            tv.tv_usec = (timeout % 1000) * 1000;
+        }
+        fd_set read_fds;
         FD_ZERO(&read_fds);
         FD_SET(sockfd, &read_fds);
-        
-        int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
-
-        if (select_result > 0) {
-            struct sham_header ack_header;
-            recvfrom(sockfd, &ack_header, sizeof(ack_header), 0, NULL, NULL);
-            
-            if (ack_header.flags & ACK) {
-                uint32_t ack_num = ntohl(ack_header.ack_num);
-                fc.receiver_window = ntohs(ack_header.window_size);
-                
-                printf("Received ACK=%u, Receiver Window=%d\n", ack_num, fc.receiver_window);
-                log_message("RCV ACK=%u\n", ack_num);
-                
-                if (window_count > 0 && window[window_start].is_valid) {
-                     gettimeofday(&current_time, NULL);
-                     double SampleRTT = (current_time.tv_sec - window[window_start].sent_time.tv_sec) * 1000.0 + 
-                                       (current_time.tv_usec - window[window_start].sent_time.tv_usec) / 1000.0;
-                     
-                     EstimatedRTT = (1 - ALPHA) * EstimatedRTT + ALPHA * SampleRTT;
-                     DevRTT = (1 - BETA) * DevRTT + BETA * fabs(SampleRTT - EstimatedRTT);
-                     RTO = EstimatedRTT + 4 * DevRTT;
-                     
-                     if (RTO < 100) RTO = 100;
-                     if (RTO > 5000) RTO = 5000;
-                }
-                
-                while (window_count > 0 && (uint32_t)(window[window_start].seq_num + window[window_start].data_length) <= ack_num) {
-                    printf("Packet SEQ=%u acknowledged\n", window[window_start].seq_num);
-                    fc.last_byte_acked = window[window_start].seq_num + window[window_start].data_length - 1;
-                    window[window_start].is_valid = 0;
-                    window_start = (window_start + 1) % WINDOW_SIZE;
-                    window_count--;
-                }
-                
-                printf("Flow control update: Bytes in flight = %d, Receiver window = %d\n", fc.last_byte_sent - fc.last_byte_acked, fc.receiver_window);
-                log_message("FLOW WIN UPDATE=%u\n", fc.receiver_window);
-            }
-        } else if (select_result < 0) {
+        if (want_input) FD_SET(STDIN_FILENO, &read_fds);
+        int ready = net_select((sockfd > STDIN_FILENO ? sockfd : STDIN_FILENO) + 1, &read_fds, NULL, NULL, &tv);
+        if (ready < 0 && errno != EINTR) {
             perror("select error");
             break;
         }
-
-        int bytes_in_flight = fc.last_byte_sent - fc.last_byte_acked;
-        while (window_count < WINDOW_SIZE && !file_finished && bytes_in_flight < fc.receiver_window) {
-            char payload[PAYLOAD_SIZE];
-            size_t bytes_read = fread(payload, 1, PAYLOAD_SIZE, input_file);
-            
-            if (bytes_read == 0) {
-                file_finished = 1;
-                break;
-            }
-            
-            size_t packet_data_len = bytes_read;
-            int slot = (window_start + window_count) % WINDOW_SIZE;
-            
-            memset(&window[slot], 0, sizeof(struct sent_packet));
-            window[slot].is_valid = 1;
-            window[slot].seq_num = next_seq_num;
-            window[slot].data_length = packet_data_len;
-            
-            window[slot].packet.header.flags = 0;
-            window[slot].packet.header.seq_num = htonl(next_seq_num);
-            window[slot].packet.header.ack_num = htonl(0);
-            window[slot].packet.header.window_size = htons(1024);
-            
-            memcpy(window[slot].packet.payload, payload, bytes_read);
-            
-            ssize_t bytes_to_send = sizeof(struct sham_header) + bytes_read;
-            if (!should_drop_packet()) {
-                sendto(sockfd, &window[slot].packet, bytes_to_send, 0, (const struct sockaddr *)server_addr, server_len);
-                gettimeofday(&window[slot].sent_time, NULL);
-                printf("SND DATA SEQ=%u, Size=%zu, Bytes in flight: %d, Receiver window: %d\n", next_seq_num, bytes_read, bytes_in_flight + (int)bytes_read, fc.receiver_window);
-                log_message("SND DATA SEQ=%u LEN=%zu\n", next_seq_num, bytes_read);
-            } else {
-                printf("DROPPED packet SEQ=%u (simulated loss)\n", next_seq_num);
-                log_message("DROP DATA SEQ=%u\n", next_seq_num);
-                gettimeofday(&window[slot].sent_time, NULL);
+        if (ready > 0 && want_input && FD_ISSET(STDIN_FILENO, &read_fds)) {
+            ssize_t n = read(STDIN_FILENO, readahead.buffer + readahead.end, PIPE_READAHEAD - readahead.end);
+            if (n > 0) {
+                readahead.end += n;
+                readahead.total += n;
+            } else if (n == 0) {
+                readahead.eof = 1;
+            } else if (errno != EINTR && errno != EAGAIN) {
+                perror("Failed to read stdin");
+                readahead.eof = readahead.error = 1;
             }
-            
-            fc.last_byte_sent = next_seq_num + bytes_read - 1;
-            next_seq_num += bytes_read;
-            window_count++;
-            bytes_in_flight = fc.last_byte_sent - fc.last_byte_acked;
         }
+        if (sham_process(conn) < 0) break;
     }
-    
-    fclose(input_file);
-    printf("File transfer complete.\n");
-    send_termination_sequence(sockfd, server_addr, server_len, next_seq_num);
+
+    if (conn->error) {
+        printf("Failed to close connection gracefully: %s.\n", strerror(conn->error));
+    } else if (pipe_enabled) {
+        printf("Pipe transfer complete: %llu bytes%s.\n", (unsigned long long)readahead.total,
+               readahead.error ? ", cut short by a read error" : "");
+    }
+    log_message("PIPE SENT=%llu%s\n", (unsigned long long)readahead.total, readahead.error ? " ERROR" : "");
+
+    EstimatedRTT = conn->srtt;
+    DevRTT = conn->rttvar;
+    segments_sent += conn->segments_sent;
+    segments_retransmitted += conn->retransmissions;
 }
 
-void send_termination_sequence(int sockfd, struct sockaddr_in *server_addr, socklen_t server_len, int next_seq_num) {
-    printf("Sending FIN to server...\n");
-    struct sham_header fin_header;
-    memset(&fin_header, 0, sizeof(fin_header));
-    
-    fin_header.flags = FIN;
-    fin_header.seq_num = htonl(next_seq_num); 
-    fin_header.ack_num = htonl(0);
-    fin_header.window_size = htons(1024);
-    
-    if (!should_drop_packet()) {
-        sendto(sockfd, &fin_header, sizeof(fin_header), 0, (const struct sockaddr *)server_addr, server_len);
-        log_message("SND FIN SEQ=%u\n", next_seq_num);
+// Opens the output once the response says data follows. A range is written
+// into an existing file in place, so parallel fetches of one file add up.
+static int open_download_output(void) {
+    if (get_ranged) {
+        // Never truncated, even when a parallel fetch creates it between
+        // our check and our open
+        int fd = open(download.path, O_RDWR | O_CREAT, 0644);
+        if (fd >= 0 && !(download.file = fdopen(fd, "r+b"))) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+        }
     } else {
-        printf("DROPPED FIN (simulated loss)\n");
-        log_message("DROP FIN\n");
+        download.file = fopen(download.path, "wb");
+    }
+    if (!download.file) {
+        perror(download.path);
+        return -1;
     }
+    if (get_ranged && fseeko(download.file, get_offset, SEEK_SET) < 0) {
+        perror("Failed to seek in the output file");
+        fclose(download.file);
+        download.file = NULL;
+        return -1;
+    }
+    return 0;
+}
 
-    struct sham_header header;
-    socklen_t temp_len = server_len;
-    
-    int retries = 0;
-    while (retries < 5) {
-        struct timeval tv = {1, 0};
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
-        
-        int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
-        if (select_result > 0) {
-            recvfrom(sockfd, &header, sizeof(header), 0, (struct sockaddr *)server_addr, &temp_len);
-            if (header.flags & FIN && header.flags & ACK) {
-                printf("Received FIN-ACK from server. Sending final ACK.\n");
-                log_message("RCV FIN-ACK SEQ=%u ACK=%u\n", ntohl(header.seq_num), ntohl(header.ack_num));
-                goto send_final_ack;
-            } else if (header.flags & FIN) {
-                printf("Received FIN from server. Sending final ACK.\n");
-                log_message("RCV FIN SEQ=%u\n", ntohl(header.seq_num));
-                goto send_final_ack;
-            } else if (header.flags & ACK) {
-                printf("Received ACK from server. Waiting for their FIN.\n");
-                log_message("RCV ACK FOR FIN\n");
-            }
-        } else {
-            printf("Timeout waiting for server response. Re-transmitting FIN...\n");
-            log_message("TIMEOUT waiting for server FIN/ACK\n");
-            if (!should_drop_packet()) {
-                sendto(sockfd, &fin_header, sizeof(fin_header), 0, (const struct sockaddr *)server_addr, server_len);
-                log_message("RETX FIN SEQ=%u\n", next_seq_num);
-            } else {
-                log_message("DROP RETX FIN SEQ=%u\n", next_seq_num);
-            }
-            retries++;
+static void deliver_download(const char *payload, size_t length) {
+    if (download.have < sizeof(download.header)) {
+        size_t n = sizeof(download.header) - download.have;
+        if (n > length) n = length;
+        memcpy(download.header + download.have, payload, n);
+        download.have += n;
+        payload += n;
+        length -= n;
+        if (download.have < sizeof(download.header)) return;
+
+        struct sham_get_response resp;
+        memcpy(&resp, download.header, sizeof(resp));
+        download.status = ntohs(resp.status);
+        download.size = ((uint64_t)ntohl(resp.size_high) << 32) | ntohl(resp.size_low);
+        download.expected = ((uint64_t)ntohl(resp.length_high) << 32) | ntohl(resp.length_low);
+        if (download.status != GET_OK) {
+            const char *reason = download.status == GET_NOT_FOUND ? "no such file"
+                               : download.status == GET_BAD_RANGE ? "offset past the end of the file"
+                                                                  : "invalid request";
+            printf("Error: Server refused the download: %s\n", reason);
+            log_message("GET REFUSED STATUS=%d\n", download.status);
+            return;
         }
+        printf("Downloading %llu bytes of %llu\n", (unsigned long long)download.expected, (unsigned long long)download.size);
+        if (open_download_output() < 0) download.status = -1;
     }
+    if (length == 0 || download.status != GET_OK || download.write_error) return;
+    if (length > download.expected - download.received) length = download.expected - download.received;
+    if (fwrite(payload, 1, length, download.file) != length) {
+        download.write_error = errno ? errno : EIO;
+        printf("Error: Failed to write %s: %s\n", download.path, strerror(download.write_error));
+        log_message("GET WRITE ERROR AFTER=%llu\n", (unsigned long long)download.received);
+        return;
+    }
+    download.received += length;
+}
 
-    printf("Failed to close connection gracefully after multiple retries.\n");
-    return;
-    
-send_final_ack:;
-    struct sham_header final_ack_header;
-    memset(&final_ack_header, 0, sizeof(final_ack_header));
-    
-    final_ack_header.flags = ACK;
-    final_ack_header.seq_num = htonl(ntohl(header.ack_num));
-    final_ack_header.ack_num = htonl(ntohl(header.seq_num) + 1);
-    final_ack_header.window_size = htons(1024);
-    
-    if (!should_drop_packet()) {
-        sendto(sockfd, &final_ack_header, sizeof(final_ack_header), 0, (const struct sockaddr *)server_addr, server_len);
-        printf("Connection closed.\n");
-        log_message("SND FINAL ACK\n");
+// Sends the request, closes our direction and saves what comes back
+void recv_download(struct sham_conn *conn, const char *remote_path, const char *local_path) {
+    download.path = local_path;
+    download.status = -1;
+    if (!get_enabled) {
+        printf("Server declined download mode\n");
+        get_failed = 1;
+        sham_shutdown(conn);
+        while (!sham_done(conn)) {
+            if (sham_wait(conn) < 0) break;
+        }
+        return;
+    }
+
+    struct sham_get_request req;
+    size_t path_length = strlen(remote_path);
+    req.path_length = htons(path_length);
+    req.flags = 0;
+    req.offset_high = htonl((uint32_t)(get_offset >> 32));
+    req.offset_low = htonl((uint32_t)get_offset);
+    req.length_high = htonl((uint32_t)(get_length >> 32));
+    req.length_low = htonl((uint32_t)get_length);
+    size_t room;
+    char *payload;
+    while (!(payload = sham_send_buffer(conn, &room))) {
+        if (sham_done(conn) || sham_wait(conn) < 0) return;
+    }
+    memcpy(payload, &req, sizeof(req));
+    memcpy(payload + sizeof(req), remote_path, path_length);
+    sham_send_commit(conn, sizeof(req) + path_length);
+    sham_shutdown(conn);
+    printf("Requested %s", remote_path);
+    if (get_ranged) printf(" from byte %llu", (unsigned long long)get_offset);
+    printf("\n");
+
+    // Segments are written straight out of the reassembly buffer
+    ssize_t length;
+    while (1) {
+        const char *data;
+        while ((length = sham_recv_peek(conn, &data)) > 0) {
+            deliver_download(data, length);
+            sham_recv_release(conn);
+        }
+        if (length == 0 || sham_done(conn) || sham_wait(conn) < 0) break;
+    }
+    while (!sham_done(conn)) {
+        if (sham_wait(conn) < 0) break;
+    }
+
+    if (download.file) {
+        // A delayed write error shows up only here
+        int failed = ferror(download.file);
+        if (fclose(download.file) != 0) failed = 1;
+        if (failed && !download.write_error) {
+            download.write_error = errno ? errno : EIO;
+            printf("Error: Failed to write %s: %s\n", local_path, strerror(download.write_error));
+        }
+        download.file = NULL;
+    }
+    if (download.status == GET_OK && download.received == download.expected && !download.write_error) {
+        printf("Download complete: %llu bytes saved to %s\n", (unsigned long long)download.received, local_path);
+        log_message("GET COMPLETE LEN=%llu\n", (unsigned long long)download.received);
+        if (!get_ranged) calculate_md5_hash(local_path);
     } else {
-        printf("DROPPED final ACK (simulated loss)\n");
-        log_message("DROP FINAL ACK\n");
+        if (download.write_error) {
+            log_message("GET WRITE FAILED LEN=%llu\n", (unsigned long long)download.received);
+        } else if (download.status == GET_OK) {
+            printf("Error: Download ended after %llu of %llu bytes\n", (unsigned long long)download.received,
+                   (unsigned long long)download.expected);
+            log_message("GET INCOMPLETE LEN=%llu\n", (unsigned long long)download.received);
+        } else if (download.have < sizeof(download.header)) {
+            printf("Error: No response from the server\n");
+        }
+        get_failed = 1;
     }
+
+    EstimatedRTT = conn->srtt;
+    DevRTT = conn->rttvar;
+    segments_sent += conn->segments_sent;
+    segments_retransmitted += conn->retransmissions;
+}
+
+// Fanout mode: one session to every receiver, without a handshake per peer
+int send_data_fanout(int sockfd, const struct sockaddr_in *server_addr, const char *filename) {
+    static struct fanout_sender sender;
+    if (fanout_sender_init(&sender, sockfd, filename, connection_id) < 0) return 1;
+    sender.multicast = IN_MULTICAST(ntohl(server_addr->sin_addr.s_addr));
+    sender.targets[sender.target_count++] = *server_addr;
+    if (sender.multicast) {
+        if (fanout_to_count > 0) printf("Note: --to is not used when sending to a multicast group\n");
+        if (fanout_multicast_interface(sockfd) < 0) {
+            fanout_sender_close(&sender);
+            return 1;
+        }
+    } else {
+        for (int i = 0; i < fanout_to_count; i++) {
+            char ip[INET_ADDRSTRLEN];
+            const char *colon = strrchr(fanout_to[i], ':');
+            struct sockaddr_in *target = &sender.targets[sender.target_count];
+            memset(target, 0, sizeof(*target));
+            target->sin_family = AF_INET;
+            if (!colon || colon - fanout_to[i] >= (int)sizeof(ip) || atoi(colon + 1) <= 0) {
+                printf("Warning: Invalid receiver %s, expected IP:PORT\n", fanout_to[i]);
+                continue;
+            }
+            memcpy(ip, fanout_to[i], colon - fanout_to[i]);
+            ip[colon - fanout_to[i]] = '\0';
+            target->sin_port = htons(atoi(colon + 1));
+            if (inet_pton(AF_INET, ip, &target->sin_addr) <= 0) {
+                printf("Warning: Invalid receiver %s, expected IP:PORT\n", fanout_to[i]);
+                continue;
+            }
+            sender.target_count++;
+        }
+    }
+    sender.expected = fanout_expected > 0 ? fanout_expected : (sender.multicast ? 1 : sender.target_count);
+    if (fec_requested) {
+        sender.fec_k = fec_k;
+        sender.fec_m = fec_m > 0 ? fec_m : -1;
+    }
+
+    metrics_open_connection(connection_id);
+    qlog_set_connection(connection_id);
+    int failed = fanout_send(&sender);
+    segments_sent = sender.data_sent;
+    segments_retransmitted = sender.retransmissions;
+    fanout_sender_close(&sender);
+    return failed;
 }
 
 void print_usage(const char* program_name) {
     printf("Usage:\n");
     printf("  File Transfer Mode: %s <server_ip> <server_port> <input_file> <output_file_name> [loss_rate]\n", program_name);
+    printf("  Batch Mode: %s <server_ip> <server_port> --batch <dir_or_list> <target_dir> [loss_rate]\n", program_name);
+    printf("  Pipe Mode: %s <server_ip> <server_port> - <output_file_name> [loss_rate] (reads stdin to its end)\n", program_name);
+    printf("  Download Mode: %s <server_ip> <server_port> --get <remote_path> <local_file> [loss_rate]\n", program_name);
+    printf("  Fanout Mode: %s <group_or_ip> <port> <input_file> <output_file_name> --fanout[=N] [--to=IP:PORT ...]\n", program_name);
     printf("  Chat Mode: %s <server_ip> <server_port> --chat [loss_rate]\n", program_name);
     printf("  loss_rate: Packet loss probability 0.0-1.0 (optional, default: 0.0)\n");
+    printf("Options:\n");
+    printf("  --compress[=level]: Compress file data in independent zlib blocks (level 1-9)\n");
+    printf("  --fec[=K[,M]]: Send M parity packets per K data segments (M adapts to loss if omitted)\n");
+    printf("  --0rtt: Carry the first segment or chat line on the SYN, using cached server parameters\n");
+    printf("  --coalesce[=MS]: Chat: pack lines typed while others are unacknowledged into one segment,\n");
+    printf("                   holding a line back at most MS ms (default %d)\n", CHAT_COALESCE_DELAY_MS);
+    printf("  --stream=FILE: Send FILE as another stream alongside input_file (repeatable); the server\n");
+    printf("                 writes stream N to <output_file_name>.N\n");
+    printf("  --get: Fetch remote_path from under the server's --serve=DIR instead of sending a file\n");
+    printf("  --range=OFFSET[,LENGTH]: With --get, fetch LENGTH bytes (default: the rest) from OFFSET and\n");
+    printf("                           write them at OFFSET in local_file without truncating it\n");
+    printf("  --batch: input_file is a directory, or a file listing paths one per line; every file is\n");
+    printf("           sent over one connection and created under <target_dir> in the server's --dir\n");
+    printf("  --fanout[=N]: Send input_file once to many receivers started with server --fanout: N that join\n");
+    printf("                a multicast group (default 1), or the unicast server and every --to\n");
+    printf("  --to=IP:PORT: Fanout: another unicast receiver (repeatable)\n");
+    printf("Environment:\n");
+    printf("  SHAM_CACHE: Connection parameter cache file (default .sham_cache, always used with --0rtt)\n");
+    printf("  SHAM_MCAST_IF: Address of the interface for multicast, e.g. 127.0.0.1 for a local test\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -486,6 +954,83 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    // Pull out option flags so the positional arguments keep their meaning
+    int positional = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--compress", 10) == 0) {
+            compression_requested = 1;
+            if (argv[i][10] == '=') {
+                compression_level = atoi(argv[i] + 11);
+                if (compression_level < 1 || compression_level > 9) {
+                    printf("Warning: Invalid compression level %s, using %d\n", argv[i] + 11, COMP_DEFAULT_LEVEL);
+                    compression_level = COMP_DEFAULT_LEVEL;
+                }
+            }
+        } else if (strncmp(argv[i], "--coalesce", 10) == 0) {
+            coalesce_delay_ms = CHAT_COALESCE_DELAY_MS;
+            if (argv[i][10] == '=') {
+                coalesce_delay_ms = atoi(argv[i] + 11);
+                if (coalesce_delay_ms < 0) {
+                    printf("Warning: Invalid coalescing delay %s, using %d ms\n", argv[i] + 11, CHAT_COALESCE_DELAY_MS);
+                    coalesce_delay_ms = CHAT_COALESCE_DELAY_MS;
+                }
+            }
+        } else if (strcmp(argv[i], "--0rtt") == 0) {
+            fast_open = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch_requested = 1;
+        } else if (strcmp(argv[i], "--get") == 0) {
+            get_mode = 1;
+        } else if (strncmp(argv[i], "--fanout", 8) == 0) {
+            fanout_mode = 1;
+            if (argv[i][8] == '=') {
+                fanout_expected = atoi(argv[i] + 9);
+                if (fanout_expected < 1 || fanout_expected > FANOUT_MAX_RECEIVERS) {
+                    printf("Warning: Invalid receiver count %s, using the default\n", argv[i] + 9);
+                    fanout_expected = 0;
+                }
+            }
+        } else if (strncmp(argv[i], "--to=", 5) == 0) {
+            if (fanout_to_count + 1 < FANOUT_MAX_RECEIVERS) {
+                fanout_to[fanout_to_count++] = argv[i] + 5;
+            } else {
+                printf("Warning: At most %d receivers, ignoring %s\n", FANOUT_MAX_RECEIVERS, argv[i] + 5);
+            }
+        } else if (strncmp(argv[i], "--range=", 8) == 0) {
+            char *comma;
+            get_ranged = 1;
+            get_offset = strtoull(argv[i] + 8, &comma, 10);
+            get_length = *comma == ',' ? strtoull(comma + 1, NULL, 10) : 0;
+        } else if (strncmp(argv[i], "--stream=", 9) == 0) {
+            streams_requested = 1;
+            if (stream_count + 1 < MAX_STREAMS) {
+                streams[++stream_count].path = argv[i] + 9;
+            } else {
+                printf("Warning: At most %d streams, ignoring %s\n", MAX_STREAMS, argv[i] + 9);
+            }
+        } else if (strncmp(argv[i], "--fec", 5) == 0) {
+            fec_requested = 1;
+            if (argv[i][5] == '=') {
+                char *spec = argv[i] + 6;
+                fec_k = atoi(spec);
+                char *comma = strchr(spec, ',');
+                fec_m = comma ? atoi(comma + 1) : 0;
+                if (fec_k < 1 || fec_k > FEC_MAX_K || fec_m < 0 || fec_m > FEC_MAX_M) {
+                    printf("Warning: Invalid FEC setting %s, using K=%d with adaptive parity\n", spec, FEC_DEFAULT_K);
+                    fec_k = FEC_DEFAULT_K;
+                    fec_m = 0;
+                }
+            }
+        } else {
+            argv[positional++] = argv[i];
+        }
+    }
+    argc = positional;
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
     char *server_ip = argv[1];
     int server_port = atoi(argv[2]);
     if (server_port <= 0) {
@@ -513,6 +1058,11 @@ int main(int argc, char *argv[]) {
         }
         input_file = argv[3];
         output_file = argv[4];
+        pipe_mode = !get_mode && strcmp(input_file, "-") == 0;
+        if (streams_requested) {
+            streams[0].path = input_file;
+            stream_count++;
+        }
         
         if (argc >= 6) {
             double loss_rate = atof(argv[5]);
@@ -533,14 +1083,13 @@ int main(int argc, char *argv[]) {
         printf("Logging enabled: writing to client_log.txt\n");
     }
     
-    srand(time(NULL));
+    srand(net_random32());
     
     int sockfd;
     struct sockaddr_in server_addr;
     socklen_t server_len = sizeof(server_addr);
-    struct sham_header header;
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    if ((sockfd = net_socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("socket creation failed");
         if (log_file) fclose(log_file);
         exit(EXIT_FAILURE);
@@ -555,8 +1104,10 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    metrics_init("client");
+    qlog_open("client");
     printf("Connecting to server %s:%d\n", server_ip, server_port);
-    printf("Mode: %s\n", chat_mode ? "Chat" : "File Transfer");
+    printf("Mode: %s\n", chat_mode ? "Chat" : fanout_mode ? "Fanout" : "File Transfer");
     if (!chat_mode) {
         printf("Input file: %s\n", input_file);
         printf("Output file: %s\n", output_file);
@@ -565,70 +1116,209 @@ int main(int argc, char *argv[]) {
         printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
     }
 
-    // Connection establishment
-    memset(&header, 0, sizeof(header));
-    header.flags = SYN;
-    header.seq_num = htonl(50);
-    header.ack_num = htonl(0);
-    header.window_size = htons(1024);
-    
-    if (!should_drop_packet()) {
-        sendto(sockfd, &header, sizeof(header), 0, (const struct sockaddr *)&server_addr, server_len);
-        printf("Sent SYN with seq_num: %u\n", ntohl(header.seq_num));
-        log_message("SND SYN SEQ=%u\n", ntohl(header.seq_num));
-    } else {
-        printf("DROPPED SYN (simulated loss)\n");
-        log_message("DROP SYN\n");
+    if (fanout_to_count > 0 && !fanout_mode) {
+        printf("Note: --to is only used with --fanout\n");
+    }
+    if (fanout_mode) {
+        int failed = 1;
+        if (chat_mode || get_mode || pipe_mode) {
+            printf("Error: --fanout sends a file, not chat, --get or stdin\n");
+        } else {
+            if (streams_requested || compression_requested || fast_open || batch_requested) {
+                printf("Note: --stream, --compress, --0rtt and --batch are not used with --fanout\n");
+            }
+            connection_id = generate_connection_id();
+            failed = send_data_fanout(sockfd, &server_addr, input_file);
+            printf("Segments sent: %lu, retransmissions: %lu\n", segments_sent, segments_retransmitted);
+            log_message("STATS SENT=%lu RETX=%lu\n", segments_sent, segments_retransmitted);
+        }
+        net_close(sockfd);
+        metrics_shutdown();
+        qlog_close();
+        if (log_file) fclose(log_file);
+        return failed;
     }
 
-    struct timeval handshake_timeout = {3, 0}; // 3-second timeout for handshake
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(sockfd, &read_fds);
-    
-    if (select(sockfd + 1, &read_fds, NULL, NULL, &handshake_timeout) <= 0) {
-        printf("Handshake failed: Timeout waiting for SYN-ACK.\n");
+    // Cached parameters seed the SYN timeout and RTO for a known server
+    struct cached_params cache;
+    memset(&cache, 0, sizeof(cache));
+    int use_cache = fast_open || getenv("SHAM_CACHE") != NULL;
+    if (use_cache && load_cached_params(server_ip, server_port, &cache)) {
+        EstimatedRTT = cache.srtt;
+        DevRTT = cache.rttvar;
+        double rto = rto_from_estimate(EstimatedRTT, DevRTT);
+        printf("Using cached parameters: RTT=%.1fms, RTO=%.1fms\n", EstimatedRTT, rto);
+        log_message("CACHE HIT RTT=%.1f RTO=%.1f\n", EstimatedRTT, rto);
+    }
+
+    if (streams_requested && chat_mode) {
+        streams_requested = 0;
+    }
+    if (batch_requested && chat_mode) {
+        batch_requested = 0;
+    }
+    if (get_mode) {
+        if (streams_requested || compression_requested || fast_open || batch_requested) {
+            printf("Note: --stream, --compress, --0rtt and --batch are not used with --get\n");
+            streams_requested = compression_requested = fast_open = batch_requested = 0;
+        }
+        if (strlen(input_file) > GET_PATH_MAX) {
+            printf("Error: Remote path longer than %zu bytes\n", (size_t)GET_PATH_MAX);
+            metrics_shutdown();
+            qlog_close();
+            if (log_file) fclose(log_file);
+            net_close(sockfd);
+            return 1;
+        }
+    } else if (get_ranged) {
+        printf("Note: --range is only used with --get\n");
+        get_ranged = 0;
+    }
+    if (pipe_mode) {
+        if (streams_requested || compression_requested || fast_open || batch_requested) {
+            printf("Note: --stream, --compress, --0rtt and --batch are not used when reading stdin\n");
+            streams_requested = compression_requested = fast_open = batch_requested = 0;
+        }
+    }
+    if (batch_requested) {
+        if (streams_requested || compression_requested || fast_open) {
+            printf("Note: --stream, --compress and --0rtt are not used with --batch\n");
+            streams_requested = compression_requested = fast_open = 0;
+        }
+        if (collect_batch(input_file, output_file) < 0 || batch_count == 0) {
+            printf("Error: No files to send from %s\n", input_file);
+            metrics_shutdown();
+            qlog_close();
+            if (log_file) fclose(log_file);
+            net_close(sockfd);
+            return 1;
+        }
+        printf("Batch: %d files\n", batch_count);
+    }
+    if (streams_requested && compression_requested) {
+        printf("Note: --compress is not used with --stream, each stream would need its own compressor\n");
+        compression_requested = 0;
+    }
+    if (fast_open && compression_requested && !chat_mode) {
+        printf("Note: --0rtt is not used with --compress, the first block is not ready before the handshake\n");
+        fast_open = 0;
+    }
+    if (fast_open && cache.valid && !(cache.flags & EARLY)) {
+        printf("Server declined early data last time, using a normal handshake\n");
+        fast_open = 0;
+    }
+    if (fast_open && prepare_early_data(input_file) < 0) {
+        metrics_shutdown();
+        qlog_close();
         if (log_file) fclose(log_file);
-        close(sockfd);
+        net_close(sockfd);
         return 1;
     }
-    
-    recvfrom(sockfd, &header, sizeof(header), 0, (struct sockaddr *)&server_addr, &server_len);
-    if ((header.flags & SYN) && (header.flags & ACK)) {
-        uint16_t initial_window = ntohs(header.window_size);
-        printf("Received SYN-ACK with seq_num: %u, ack_num: %u, window: %d\n", ntohl(header.seq_num), ntohl(header.ack_num), initial_window);
-        log_message("RCV SYN-ACK SEQ=%u ACK=%u\n", ntohl(header.seq_num), ntohl(header.ack_num));
-
-        struct sham_header final_ack_header;
-        memset(&final_ack_header, 0, sizeof(final_ack_header));
-        final_ack_header.flags = ACK;
-        final_ack_header.seq_num = htonl(ntohl(header.ack_num));
-        final_ack_header.ack_num = htonl(ntohl(header.seq_num) + 1);
-        final_ack_header.window_size = htons(1024);
-
-        if (!should_drop_packet()) {
-            sendto(sockfd, &final_ack_header, sizeof(final_ack_header), 0, (const struct sockaddr *)&server_addr, server_len);
-            printf("Sent final ACK. Handshake complete.\n");
-            log_message("SND ACK FOR SYN\n");
-        } else {
-            printf("DROPPED final handshake ACK (simulated loss)\n");
-            log_message("DROP ACK FOR SYN\n");
+
+    // Connection establishment
+    struct sham_config cfg;
+    sham_config_init(&cfg);
+    cfg.loss_rate = packet_loss_rate;
+    cfg.log = log_file;
+    cfg.trace = stdout;
+    cfg.peer_name = "server";
+    cfg.fec_k = fec_k;
+    cfg.fec_m = fec_m;
+    cfg.srtt = EstimatedRTT;
+    cfg.rttvar = DevRTT;
+    if (chat_mode) {
+        cfg.options |= MSGS;
+        cfg.ack_delay_ms = CHAT_ACK_DELAY_MS;
+    }
+    if (compression_requested && !chat_mode) cfg.options |= COMP;
+    if (fec_requested && !chat_mode) cfg.options |= FEC;
+    if (streams_requested) cfg.options |= STREAMS;
+    if (batch_requested) cfg.options |= BATCH;
+    if (pipe_mode) cfg.options |= PIPE;
+    if (get_mode) cfg.options |= GET;
+    cfg.options |= EXTSEQ;
+    const char *isn = getenv("SHAM_ISN"); // A fixed ISN, e.g. just below 2^32 to test wraparound
+    if (isn) cfg.isn = strtoll(isn, NULL, 10);
+
+    static struct sham_conn conn;
+    connection_id = generate_connection_id();
+    sham_connect(&conn, sockfd, &server_addr, server_len, connection_id, &cfg, early.payload, early.length);
+    while (!sham_established(&conn) && !sham_done(&conn)) {
+        if (sham_wait(&conn) < 0) break;
+    }
+
+    if (sham_established(&conn)) {
+        connection_id = conn.conn_id;
+        // The server may have renumbered the connection, so its slot is claimed now
+        conn.metrics = metrics_open_connection(connection_id);
+        qlog_set_connection(connection_id);
+
+        if (compression_requested && !chat_mode) {
+            compression_enabled = (conn.options & COMP) != 0;
+            printf("Compression %s by server\n", compression_enabled ? "accepted" : "declined");
+        }
+        if (fec_requested && !chat_mode) {
+            fec_enabled = (conn.options & FEC) != 0;
+            printf("FEC %s by server\n", fec_enabled ? "accepted" : "declined");
+        }
+        if (streams_requested) {
+            streams_enabled = (conn.options & STREAMS) != 0;
+            printf("Streams %s by server%s\n", streams_enabled ? "accepted" : "declined", streams_enabled ? "" : ", sending only the input file");
+        }
+        if (batch_requested) {
+            batch_enabled = (conn.options & BATCH) != 0;
         }
+        if (pipe_mode) {
+            pipe_enabled = (conn.options & PIPE) != 0;
+        }
+        if (get_mode) {
+            get_enabled = (conn.options & GET) != 0;
+        }
+        if (early.length > 0) {
+            early.accepted = conn.early_accepted;
+            printf("Early data %s by server\n", early.accepted ? "accepted" : "declined, resending after handshake");
+        }
+
+        cache.valid = 1;
+        cache.window = conn.peer_window;
+        cache.flags = (conn.options & (COMP | FEC)) | (early.length > 0 ? (early.accepted ? EARLY : 0) : (cache.flags & EARLY));
     } else {
-        printf("Handshake failed.\n");
+        printf("Handshake failed: no SYN-ACK after %d attempts.\n", HANDSHAKE_MAX_ATTEMPTS);
+        metrics_shutdown();
+        qlog_close();
         if (log_file) fclose(log_file);
-        close(sockfd);
+        net_close(sockfd);
         return 1;
     }
 
     printf("Handshake complete. Starting data transfer.\n");
     if (chat_mode) {
-        send_data_chat(sockfd, &server_addr, server_len);
+        send_data_chat(&conn);
+    } else if (get_mode) {
+        recv_download(&conn, input_file, output_file);
+    } else if (pipe_mode) {
+        send_data_pipe(&conn);
     } else {
-        send_data_file(sockfd, &server_addr, server_len, input_file);
+        send_data_file(&conn, input_file);
     }
+    sham_close(&conn);
+    for (int i = 0; i < batch_count; i++) {
+        free(batch_files[i].path);
+        free(batch_files[i].name);
+    }
+    free(batch_files);
+    printf("Segments sent: %lu, retransmissions: %lu\n", segments_sent, segments_retransmitted);
+    log_message("STATS SENT=%lu RETX=%lu\n", segments_sent, segments_retransmitted);
     
-    close(sockfd);
+    if (use_cache) {
+        cache.srtt = EstimatedRTT;
+        cache.rttvar = DevRTT;
+        store_cached_params(server_ip, server_port, &cache);
+    }
+
+    net_close(sockfd);
+    metrics_shutdown();
+    qlog_close();
     if (log_file) fclose(log_file);
-    return 0;
+    return get_failed || send_failed;
 }
\ No newline at end of file
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "common.h"
+#include "net.h"
+#include "metrics.h"
+#include "qlog.h"
+
+double packet_loss_rate = 0.0;
+FILE *log_file = NULL;
+
+// Writes one log line with a high-precision timestamp
+void vlog_to(FILE *file, const char *format, va_list args) {
+    if (!file) return; // Ensure logging is active only when a log file is open
+
+    struct timeval tv;
+    net_gettimeofday(&tv);
+    time_t curtime = tv.tv_sec;
+    struct tm local;
+    char time_buffer[30];
+    strftime(time_buffer, 30, "%Y-%m-%d %H:%M:%S", localtime_r(&curtime, &local));
+
+    fprintf(file, "[%s.%06ld] [LOG] ", time_buffer, tv.tv_usec);
+    vfprintf(file, format, args);
+    fflush(file);
+}
+
+void log_message(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vlog_to(log_file, format, args);
+    va_end(args);
+}
+
+static int record_drop(void) {
+    metrics_count(M_SIMULATED_DROPS, 1);
+    qlog_event("transport:packet_dropped", "\"trigger\":\"simulated_loss\"");
+    return 1;
+}
+
+// Simulate packet loss
+int should_drop_packet(void) {
+    if (packet_loss_rate <= 0.0) return 0;
+    double random_val = (double)rand() / RAND_MAX;
+    if (random_val >= packet_loss_rate) return 0;
+    return record_drop();
+}
+
+int should_drop(double loss_rate, unsigned int *seed, struct metrics_block *metrics) {
+    if (loss_rate <= 0.0) return 0;
+    double random_val = (double)rand_r(seed) / RAND_MAX;
+    if (random_val >= loss_rate) return 0;
+    metrics_count_in(metrics, M_SIMULATED_DROPS, 1);
+    return 1;
+}
+
+void sham_header_encode(struct sham_header *header, uint32_t seq_num, uint32_t ack_num, uint16_t flags, uint16_t window_size, uint32_t conn_id) {
+    header->seq_num = htonl(seq_num);
+    header->ack_num = htonl(ack_num);
+    header->flags = flags;
+    header->window_size = htons(window_size);
+    header->conn_id = htonl(conn_id);
+}
+
+void sham_header_decode(const struct sham_header *wire, struct sham_header *host) {
+    host->seq_num = ntohl(wire->seq_num);
+    host->ack_num = ntohl(wire->ack_num);
+    host->flags = wire->flags;
+    host->window_size = ntohs(wire->window_size);
+    host->conn_id = ntohl(wire->conn_id);
+}
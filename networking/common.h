@@ -0,0 +1,28 @@
+#ifndef SHAM_COMMON_H
+#define SHAM_COMMON_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include "headers.h"
+
+// Shared by client and server: simulated loss and the RUDP_LOG trace
+extern double packet_loss_rate;
+extern FILE *log_file;
+
+int should_drop_packet(void);
+void log_message(const char *format, ...);
+
+// The same for callers that keep their own log file, loss rate and PRNG
+// state instead of the globals above. should_drop counts a drop into
+// `metrics`; tracing it is up to the caller.
+struct metrics_block;
+void vlog_to(FILE *file, const char *format, va_list args);
+int should_drop(double loss_rate, unsigned int *seed, struct metrics_block *metrics);
+
+// Header conversion between host values and the wire layout. seq_num,
+// ack_num, window_size and conn_id are network order; flags travel as is.
+void sham_header_encode(struct sham_header *header, uint32_t seq_num, uint32_t ack_num, uint16_t flags, uint16_t window_size, uint32_t conn_id);
+void sham_header_decode(const struct sham_header *wire, struct sham_header *host);
+
+#endif
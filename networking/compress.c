@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "compress.h"
+
+// One framed block waiting to be transmitted
+struct comp_slot {
+    unsigned char *data;  // comp_block_header followed by the stored bytes
+    size_t length;
+    size_t offset;        // Bytes already handed to the sender
+};
+
+struct compressor {
+    FILE *input;
+    int level;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct comp_slot slots[COMP_QUEUE_DEPTH];
+    int head;
+    int count;
+    int finished;   // Producer reached end of input
+    int stopping;   // Consumer gave up, producer must exit
+    int read_error; // Input failed, the stream ends with an abort block
+    uint64_t raw_bytes;
+    uint64_t wire_bytes;
+};
+
+struct decompressor {
+    FILE *output;
+    struct comp_block_header header;
+    size_t header_filled;
+    unsigned char *stored;
+    size_t stored_len;
+    size_t stored_filled;
+    unsigned char *raw;
+    int is_raw;
+    int failed;
+};
+
+static void *compressor_thread(void *arg) {
+    struct compressor *comp = arg;
+    unsigned char *raw = malloc(COMP_BLOCK_SIZE);
+    if (!raw) {
+        perror("Failed to allocate compression buffer");
+        pthread_mutex_lock(&comp->lock);
+        comp->finished = 1;
+        pthread_cond_signal(&comp->not_empty);
+        pthread_mutex_unlock(&comp->lock);
+        return NULL;
+    }
+
+    while (1) {
+        size_t raw_len = fread(raw, 1, COMP_BLOCK_SIZE, comp->input);
+        int read_error = raw_len < COMP_BLOCK_SIZE && ferror(comp->input);
+        if (raw_len == 0 && !read_error) break;
+
+        pthread_mutex_lock(&comp->lock);
+        while (comp->count == COMP_QUEUE_DEPTH && !comp->stopping) {
+            pthread_cond_wait(&comp->not_full, &comp->lock);
+        }
+        if (comp->stopping) {
+            pthread_mutex_unlock(&comp->lock);
+            break;
+        }
+        struct comp_slot *slot = &comp->slots[(comp->head + comp->count) % COMP_QUEUE_DEPTH];
+        pthread_mutex_unlock(&comp->lock);
+
+        // The slot is ours until it is published, compress outside the lock
+        struct comp_block_header *header = (struct comp_block_header *)slot->data;
+        if (read_error) {
+            // Whatever this read returned is dropped with the rest of the file
+            perror("Failed to read input for compression");
+            header->raw_len = htonl(COMP_BLOCK_ABORT);
+            header->stored_len = 0;
+            slot->length = sizeof(*header);
+            slot->offset = 0;
+            pthread_mutex_lock(&comp->lock);
+            comp->count++;
+            comp->read_error = 1;
+            comp->wire_bytes += slot->length;
+            pthread_cond_signal(&comp->not_empty);
+            pthread_mutex_unlock(&comp->lock);
+            break;
+        }
+        uLongf stored_len = compressBound(COMP_BLOCK_SIZE);
+        int rc = compress2(slot->data + sizeof(*header), &stored_len, raw, raw_len, comp->level);
+        if (rc != Z_OK || stored_len >= raw_len) {
+            // Incompressible block, ship it as is
+            memcpy(slot->data + sizeof(*header), raw, raw_len);
+            stored_len = raw_len;
+            header->stored_len = htonl((uint32_t)stored_len | COMP_BLOCK_RAW);
+        } else {
+            header->stored_len = htonl((uint32_t)stored_len);
+        }
+        header->raw_len = htonl((uint32_t)raw_len);
+        slot->length = sizeof(*header) + stored_len;
+        slot->offset = 0;
+
+        pthread_mutex_lock(&comp->lock);
+        comp->count++;
+        comp->raw_bytes += raw_len;
+        comp->wire_bytes += slot->length;
+        pthread_cond_signal(&comp->not_empty);
+        pthread_mutex_unlock(&comp->lock);
+    }
+
+    free(raw);
+    pthread_mutex_lock(&comp->lock);
+    comp->finished = 1;
+    pthread_cond_signal(&comp->not_empty);
+    pthread_mutex_unlock(&comp->lock);
+    return NULL;
+}
+
+struct compressor *compressor_start(FILE *input, int level) {
+    struct compressor *comp = calloc(1, sizeof(*comp));
+    if (!comp) {
+        perror("Failed to allocate compressor");
+        return NULL;
+    }
+    comp->input = input;
+    comp->level = level;
+    for (int i = 0; i < COMP_QUEUE_DEPTH; i++) {
+        comp->slots[i].data = malloc(sizeof(struct comp_block_header) + compressBound(COMP_BLOCK_SIZE));
+        if (!comp->slots[i].data) {
+            perror("Failed to allocate compression queue");
+            for (int j = 0; j < i; j++) free(comp->slots[j].data);
+            free(comp);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&comp->lock, NULL);
+    pthread_cond_init(&comp->not_empty, NULL);
+    pthread_cond_init(&comp->not_full, NULL);
+
+    if (pthread_create(&comp->thread, NULL, compressor_thread, comp) != 0) {
+        perror("Failed to start compression thread");
+        for (int i = 0; i < COMP_QUEUE_DEPTH; i++) free(comp->slots[i].data);
+        free(comp);
+        return NULL;
+    }
+    return comp;
+}
+
+// Copies up to len bytes of the framed stream into buf. Blocks only when the
+// helper thread has fallen behind; returns 0 once the whole input is drained.
+size_t compressor_read(struct compressor *comp, char *buf, size_t len) {
+    size_t copied = 0;
+
+    pthread_mutex_lock(&comp->lock);
+    while (copied < len) {
+        while (comp->count == 0 && !comp->finished) {
+            pthread_cond_wait(&comp->not_empty, &comp->lock);
+        }
+        if (comp->count == 0) break;
+
+        struct comp_slot *slot = &comp->slots[comp->head];
+        size_t chunk = slot->length - slot->offset;
+        if (chunk > len - copied) chunk = len - copied;
+        memcpy(buf + copied, slot->data + slot->offset, chunk);
+        slot->offset += chunk;
+        copied += chunk;
+
+        if (slot->offset == slot->length) {
+            comp->head = (comp->head + 1) % COMP_QUEUE_DEPTH;
+            comp->count--;
+            pthread_cond_signal(&comp->not_full);
+        }
+    }
+    pthread_mutex_unlock(&comp->lock);
+    return copied;
+}
+
+int compressor_stop(struct compressor *comp, uint64_t *raw_bytes, uint64_t *wire_bytes) {
+    pthread_mutex_lock(&comp->lock);
+    comp->stopping = 1;
+    pthread_cond_signal(&comp->not_full);
+    pthread_mutex_unlock(&comp->lock);
+    pthread_join(comp->thread, NULL);
+
+    if (raw_bytes) *raw_bytes = comp->raw_bytes;
+    if (wire_bytes) *wire_bytes = comp->wire_bytes;
+    int failed = comp->read_error;
+
+    for (int i = 0; i < COMP_QUEUE_DEPTH; i++) free(comp->slots[i].data);
+    pthread_mutex_destroy(&comp->lock);
+    pthread_cond_destroy(&comp->not_empty);
+    pthread_cond_destroy(&comp->not_full);
+    free(comp);
+    return failed ? -1 : 0;
+}
+
+struct decompressor *decompressor_new(FILE *output) {
+    struct decompressor *decomp = calloc(1, sizeof(*decomp));
+    if (!decomp) {
+        perror("Failed to allocate decompressor");
+        return NULL;
+    }
+    decomp->output = output;
+    decomp->stored = malloc(compressBound(COMP_BLOCK_SIZE));
+    decomp->raw = malloc(COMP_BLOCK_SIZE);
+    if (!decomp->stored || !decomp->raw) {
+        perror("Failed to allocate decompression buffers");
+        free(decomp->stored);
+        free(decomp->raw);
+        free(decomp);
+        return NULL;
+    }
+    return decomp;
+}
+
+// Accepts in-order stream bytes and writes every completed block to the
+// output file. Returns -1 if the stream is corrupt or the sender aborted it.
+int decompressor_write(struct decompressor *decomp, const char *data, size_t len) {
+    if (decomp->failed) return -1;
+    while (len > 0) {
+        if (decomp->header_filled < sizeof(decomp->header)) {
+            size_t chunk = sizeof(decomp->header) - decomp->header_filled;
+            if (chunk > len) chunk = len;
+            memcpy((char *)&decomp->header + decomp->header_filled, data, chunk);
+            decomp->header_filled += chunk;
+            data += chunk;
+            len -= chunk;
+            if (decomp->header_filled < sizeof(decomp->header)) break;
+
+            uint32_t stored = ntohl(decomp->header.stored_len);
+            decomp->is_raw = (stored & COMP_BLOCK_RAW) != 0;
+            decomp->stored_len = stored & ~COMP_BLOCK_RAW;
+            decomp->stored_filled = 0;
+            if (ntohl(decomp->header.raw_len) == COMP_BLOCK_ABORT) {
+                fprintf(stderr, "Sender could not read its input, compressed stream aborted\n");
+                decomp->failed = 1;
+                return -1;
+            }
+            if (ntohl(decomp->header.raw_len) > COMP_BLOCK_SIZE ||
+                decomp->stored_len > compressBound(COMP_BLOCK_SIZE)) {
+                fprintf(stderr, "Corrupt compressed block header\n");
+                decomp->failed = 1;
+                return -1;
+            }
+            continue;
+        }
+
+        size_t chunk = decomp->stored_len - decomp->stored_filled;
+        if (chunk > len) chunk = len;
+        memcpy(decomp->stored + decomp->stored_filled, data, chunk);
+        decomp->stored_filled += chunk;
+        data += chunk;
+        len -= chunk;
+        if (decomp->stored_filled < decomp->stored_len) break;
+
+        uLongf raw_len = ntohl(decomp->header.raw_len);
+        if (decomp->is_raw) {
+            fwrite(decomp->stored, 1, decomp->stored_len, decomp->output);
+        } else {
+            uLongf out_len = raw_len;
+            if (uncompress(decomp->raw, &out_len, decomp->stored, decomp->stored_len) != Z_OK || out_len != raw_len) {
+                fprintf(stderr, "Failed to decompress block\n");
+                decomp->failed = 1;
+                return -1;
+            }
+            fwrite(decomp->raw, 1, out_len, decomp->output);
+        }
+        decomp->header_filled = 0;
+    }
+    return 0;
+}
+
+// Releases the decoder. Returns -1 if the stream failed or ended inside a block.
+int decompressor_finish(struct decompressor *decomp) {
+    int truncated = !decomp->failed && decomp->header_filled != 0;
+    if (truncated) {
+        fprintf(stderr, "Compressed stream ended mid-block\n");
+    }
+    int failed = truncated || decomp->failed;
+    free(decomp->stored);
+    free(decomp->raw);
+    free(decomp);
+    return failed ? -1 : 0;
+}
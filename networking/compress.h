@@ -0,0 +1,39 @@
+#ifndef SHAM_COMPRESS_H
+#define SHAM_COMPRESS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed file transfers carry a stream of independent blocks, each
+// preceded by this header (both fields in network byte order).
+struct comp_block_header {
+    uint32_t raw_len;     // Size of the block after decompression
+    uint32_t stored_len;  // Bytes that follow; COMP_BLOCK_RAW set if stored uncompressed
+};
+
+#define COMP_BLOCK_SIZE 65536      // Raw bytes per independent block
+#define COMP_QUEUE_DEPTH 4         // Blocks the helper thread may run ahead
+#define COMP_BLOCK_RAW 0x80000000u // Block did not shrink, payload is the raw data
+#define COMP_DEFAULT_LEVEL 1       // Favour speed, the link is the bottleneck
+#define COMP_BLOCK_ABORT 0xFFFFFFFFu // raw_len of the last block when the input could not be read
+
+struct compressor;
+struct decompressor;
+
+// Sender side: a helper thread reads the input and compresses it block by
+// block while the caller drains the framed stream with compressor_read().
+// A read error ends the stream with an abort block, so the receiver fails
+// the transfer instead of keeping a truncated file.
+struct compressor *compressor_start(FILE *input, int level);
+size_t compressor_read(struct compressor *comp, char *buf, size_t len);
+// Returns -1 if the input could not be read to the end
+int compressor_stop(struct compressor *comp, uint64_t *raw_bytes, uint64_t *wire_bytes);
+
+// Receiver side: feed in-order stream bytes, decoded data goes to output.
+// Once decompressor_write() fails nothing more is written.
+struct decompressor *decompressor_new(FILE *output);
+int decompressor_write(struct decompressor *decomp, const char *data, size_t len);
+int decompressor_finish(struct decompressor *decomp);
+
+#endif
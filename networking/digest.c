@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include <openssl/evp.h> // Use EVP API for modern cryptographic operations
+#include "digest.h"
+
+#define DIGEST_READ_SIZE 65536
+
+int md5_file_hex(const char *filename, char hex[MD5_HEX_LENGTH]) {
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    FILE *inFile = fopen(filename, "rb");
+    if (!inFile) {
+        perror("Failed to open file for MD5 calculation");
+        return -1;
+    }
+
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    if (!mdctx) {
+        perror("Failed to create EVP_MD_CTX");
+        fclose(inFile);
+        return -1;
+    }
+
+    if (EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) != 1) {
+        perror("Failed to initialize MD5 digest");
+        EVP_MD_CTX_free(mdctx);
+        fclose(inFile);
+        return -1;
+    }
+
+    static unsigned char data[DIGEST_READ_SIZE];
+    size_t bytes;
+    while ((bytes = fread(data, 1, sizeof(data), inFile)) != 0) {
+        if (EVP_DigestUpdate(mdctx, data, bytes) != 1) {
+            perror("Failed to update MD5 digest");
+            EVP_MD_CTX_free(mdctx);
+            fclose(inFile);
+            return -1;
+        }
+    }
+
+    if (EVP_DigestFinal_ex(mdctx, md_value, &md_len) != 1) {
+        perror("Failed to finalize MD5 digest");
+        EVP_MD_CTX_free(mdctx);
+        fclose(inFile);
+        return -1;
+    }
+
+    EVP_MD_CTX_free(mdctx);
+    fclose(inFile);
+
+    for (unsigned int i = 0; i < md_len && i < (MD5_HEX_LENGTH - 1) / 2; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", md_value[i]);
+    }
+    return 0;
+}
+
+void calculate_md5_hash(const char *filename) {
+    char hex[MD5_HEX_LENGTH];
+    if (md5_file_hex(filename, hex) == 0) {
+        printf("MD5: %s\n", hex);
+    }
+}
+
+struct md5_stream *md5_stream_new(void) {
+    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+    if (mdctx && EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) != 1) {
+        EVP_MD_CTX_free(mdctx);
+        mdctx = NULL;
+    }
+    return (struct md5_stream *)mdctx;
+}
+
+void md5_stream_update(struct md5_stream *md5, const void *data, size_t length) {
+    if (md5) EVP_DigestUpdate((EVP_MD_CTX *)md5, data, length);
+}
+
+void md5_stream_final(struct md5_stream *md5, unsigned char digest[MD5_DIGEST_SIZE]) {
+    unsigned char md_value[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    memset(digest, 0, MD5_DIGEST_SIZE);
+    if (!md5) return;
+    if (EVP_DigestFinal_ex((EVP_MD_CTX *)md5, md_value, &md_len) == 1 && md_len == MD5_DIGEST_SIZE) {
+        memcpy(digest, md_value, MD5_DIGEST_SIZE);
+    }
+    EVP_MD_CTX_free((EVP_MD_CTX *)md5);
+}
+
+void md5_to_hex(const unsigned char digest[MD5_DIGEST_SIZE], char hex[MD5_HEX_LENGTH]) {
+    for (int i = 0; i < MD5_DIGEST_SIZE; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
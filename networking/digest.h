@@ -0,0 +1,23 @@
+#ifndef SHAM_DIGEST_H
+#define SHAM_DIGEST_H
+
+#include <stddef.h>
+
+#define MD5_HEX_LENGTH 33 // 32 hex digits and the terminator
+
+// Hashes the whole file; returns 0 and fills hex, or -1 on error
+int md5_file_hex(const char *filename, char hex[MD5_HEX_LENGTH]);
+
+// Function to calculate and print the MD5 hash of a file
+void calculate_md5_hash(const char *filename);
+
+// Incremental MD5 for data that arrives or is sent piecewise. md5_stream_final
+// frees the context.
+#define MD5_DIGEST_SIZE 16
+struct md5_stream;
+struct md5_stream *md5_stream_new(void);
+void md5_stream_update(struct md5_stream *md5, const void *data, size_t length);
+void md5_stream_final(struct md5_stream *md5, unsigned char digest[MD5_DIGEST_SIZE]);
+void md5_to_hex(const unsigned char digest[MD5_DIGEST_SIZE], char hex[MD5_HEX_LENGTH]);
+
+#endif
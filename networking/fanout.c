@@ -0,0 +1,906 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "fanout.h"
+#include "common.h"
+#include "net.h"
+#include "metrics.h"
+#include "rtt.h"
+#include "digest.h"
+
+static uint64_t now_us(void) {
+    struct timeval tv;
+    net_gettimeofday(&tv);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void wait_readable(int sockfd, uint64_t timeout_us) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sockfd, &read_fds);
+    struct timeval tv = { (time_t)(timeout_us / 1000000), (suseconds_t)(timeout_us % 1000000) };
+    net_select(sockfd + 1, &read_fds, NULL, NULL, &tv);
+}
+
+static const char *address_name(const struct sockaddr_in *addr, char *out, size_t length) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+    snprintf(out, length, "%s:%d", ip, ntohs(addr->sin_port));
+    return out;
+}
+
+// Segment i holds bytes from i * PAYLOAD_SIZE; its sequence number follows
+// on from the ISN as in a unicast connection
+static uint32_t offset_seq(uint32_t isn, uint64_t offset) {
+    return isn + 1 + (uint32_t)offset;
+}
+
+// The byte offset seq stands for, taken as the one nearest base
+static int64_t widen_offset(uint32_t isn, uint64_t base, uint32_t seq) {
+    return (int64_t)base + (int32_t)(seq - offset_seq(isn, base));
+}
+
+static size_t segment_length(uint64_t size, uint64_t index) {
+    uint64_t left = size - index * PAYLOAD_SIZE;
+    return left < PAYLOAD_SIZE ? (size_t)left : PAYLOAD_SIZE;
+}
+
+static struct in_addr multicast_interface(void) {
+    struct in_addr iface;
+    iface.s_addr = htonl(INADDR_ANY);
+    const char *name = getenv("SHAM_MCAST_IF");
+    if (name && inet_pton(AF_INET, name, &iface) <= 0) {
+        printf("Warning: Invalid SHAM_MCAST_IF %s, letting the system choose\n", name);
+        iface.s_addr = htonl(INADDR_ANY);
+    }
+    return iface;
+}
+
+int fanout_join_group(int sockfd, struct in_addr group) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = group;
+    mreq.imr_interface = multicast_interface();
+    if (net_setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP failed");
+        return -1;
+    }
+    return 0;
+}
+
+int fanout_multicast_interface(int sockfd) {
+    struct in_addr iface = multicast_interface();
+    if (iface.s_addr != htonl(INADDR_ANY) &&
+        net_setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0) {
+        perror("IP_MULTICAST_IF failed");
+        return -1;
+    }
+    unsigned char loop = 1; // Receivers on this host hear the group too
+    net_setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    return 0;
+}
+
+// --- Sender ---
+
+int fanout_sender_init(struct fanout_sender *s, int sockfd, const char *path, uint32_t session_id) {
+    memset(s, 0, sizeof(*s));
+    s->sockfd = sockfd;
+    s->session_id = session_id;
+    s->isn = net_random32();
+    s->fec_k = FEC_DEFAULT_K;
+    if (file_map_open(&s->map, path) < 0) {
+        perror(path);
+        return -1;
+    }
+    s->size = s->map.size;
+    s->segments = (s->size + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE;
+    file_map_range(&s->map, 0, s->size);
+
+    struct md5_stream *md5 = md5_stream_new();
+    static char chunk[65536];
+    ssize_t n;
+    for (uint64_t pos = 0; (n = file_map_read(&s->map, pos, chunk, sizeof(chunk))) > 0; pos += n) {
+        md5_stream_update(md5, chunk, n);
+    }
+    md5_stream_final(md5, s->md5);
+    fec_init();
+    return 0;
+}
+
+void fanout_sender_close(struct fanout_sender *s) {
+    file_map_close(&s->map);
+}
+
+static struct fanout_datagram *queue_slot(struct fanout_sender *s);
+
+// Sends everything queued in one sendmmsg() call: each datagram once to the
+// group, or once to every unicast receiver still missing data. Announces go
+// to every target and the FIN to every receiver that joined.
+static void flush_queue(struct fanout_sender *s) {
+    static struct mmsghdr messages[FANOUT_BURST * FANOUT_MAX_RECEIVERS];
+    static struct iovec iov[FANOUT_BURST];
+    const struct sockaddr_in *dest[FANOUT_MAX_RECEIVERS];
+    int dest_count = 0;
+    if (s->multicast || !s->started) {
+        for (int i = 0; i < s->target_count; i++) dest[dest_count++] = &s->targets[i];
+    } else {
+        for (int i = 0; i < s->receiver_count; i++) {
+            struct fanout_receiver_info *r = &s->receivers[i];
+            if (s->finishing || (r->active && !r->complete)) dest[dest_count++] = &r->addr;
+        }
+    }
+
+    unsigned int count = 0;
+    for (int i = 0; i < s->queued; i++) {
+        struct fanout_datagram *d = &s->queue[i];
+        if (should_drop_packet()) {
+            struct sham_header h;
+            sham_header_decode((struct sham_header *)d->data, &h);
+            log_message("DROP SEQ=%u FLAGS=%u (simulated loss)\n", h.seq_num, h.flags);
+            continue;
+        }
+        iov[i].iov_base = d->data;
+        iov[i].iov_len = d->length;
+        for (int j = 0; j < dest_count; j++) {
+            struct msghdr *m = &messages[count++].msg_hdr;
+            memset(m, 0, sizeof(*m));
+            m->msg_name = (void *)dest[j];
+            m->msg_namelen = sizeof(struct sockaddr_in);
+            m->msg_iov = &iov[i];
+            m->msg_iovlen = 1;
+        }
+    }
+    s->queued = 0;
+
+    for (unsigned int done = 0; done < count;) {
+        int sent = net_sendmmsg(s->sockfd, messages + done, count - done, 0);
+        s->syscalls++;
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            perror("sendmmsg failed");
+            break;
+        }
+        done += sent;
+    }
+}
+
+static struct fanout_datagram *queue_slot(struct fanout_sender *s) {
+    if (s->queued == FANOUT_BURST) flush_queue(s);
+    return &s->queue[s->queued++];
+}
+
+static void queue_segment(struct fanout_sender *s, uint64_t index, uint64_t now) {
+    struct fanout_datagram *d = queue_slot(s);
+    struct sham_packet *packet = (struct sham_packet *)d->data;
+    size_t length = segment_length(s->size, index);
+    uint32_t seq = offset_seq(s->isn, index * PAYLOAD_SIZE);
+    sham_header_encode(&packet->header, seq, (uint32_t)now, MCAST, 0, s->session_id);
+    if (file_map_read(&s->map, index * PAYLOAD_SIZE, packet->payload, length) != (ssize_t)length) {
+        perror("Failed to read the file being sent");
+        memset(packet->payload, 0, length); // Receivers will report an MD5 mismatch
+    }
+    d->length = sizeof(struct sham_header) + length;
+    metrics_count(M_BYTES_SENT, length);
+}
+
+static int group_size(struct fanout_sender *s, uint64_t group) {
+    uint64_t left = s->segments - group * s->fec_k;
+    return left < (uint64_t)s->fec_k ? (int)left : s->fec_k;
+}
+
+// Parity rows first_row .. first_row + rows - 1 of one group, rebuilt from
+// the file so repairs can use rows the proactive pass never sent
+static void queue_parity(struct fanout_sender *s, uint64_t group, int first_row, int rows, uint64_t now) {
+    static struct fec_encoder encoder;
+    static char data[PAYLOAD_SIZE];
+    uint64_t first = group * s->fec_k;
+    int k = group_size(s, group);
+    fec_encoder_reset(&encoder, k, first_row + rows);
+    for (int i = 0; i < k; i++) {
+        size_t length = segment_length(s->size, first + i);
+        if (file_map_read(&s->map, (first + i) * PAYLOAD_SIZE, data, length) != (ssize_t)length) {
+            memset(data, 0, length);
+        }
+        fec_encoder_add(&encoder, offset_seq(s->isn, (first + i) * PAYLOAD_SIZE), data, length);
+    }
+    for (int row = first_row; row < first_row + rows; row++) {
+        struct fanout_datagram *d = queue_slot(s);
+        d->length = fec_encoder_build(&encoder, row, s->session_id, d->data);
+        struct sham_header *header = (struct sham_header *)d->data;
+        header->flags |= MCAST;
+        header->ack_num = htonl((uint32_t)now);
+        s->parity_sent++;
+    }
+    log_message("SND PARITY GROUP=%llu ROWS=%d-%d\n", (unsigned long long)group, first_row, first_row + rows - 1);
+}
+
+static void queue_announce(struct fanout_sender *s, uint64_t now) {
+    struct fanout_datagram *d = queue_slot(s);
+    struct sham_packet *packet = (struct sham_packet *)d->data;
+    struct sham_fanout_announce announce;
+    announce.size_high = htonl((uint32_t)(s->size >> 32));
+    announce.size_low = htonl((uint32_t)s->size);
+    memcpy(announce.md5, s->md5, sizeof(announce.md5));
+    sham_header_encode(&packet->header, s->isn, (uint32_t)now, SYN | MCAST, 0, s->session_id);
+    memcpy(packet->payload, &announce, sizeof(announce));
+    d->length = sizeof(struct sham_header) + sizeof(announce);
+    log_message("SND ANNOUNCE SESSION=%u SIZE=%llu\n", s->session_id, (unsigned long long)s->size);
+}
+
+static uint64_t repair_holdoff(struct fanout_sender *s);
+
+static struct fanout_receiver_info *find_receiver(struct fanout_sender *s, uint32_t id) {
+    for (int i = 0; i < s->receiver_count; i++) {
+        if (s->receivers[i].id == id) return &s->receivers[i];
+    }
+    return NULL;
+}
+
+static int clamp_window(int window) {
+    if (window < 1) return 1;
+    return window > FANOUT_MAX_WINDOW ? FANOUT_MAX_WINDOW : window;
+}
+
+static void record_rtt(struct fanout_receiver_info *r, uint32_t echo, uint32_t delay, uint64_t now) {
+    int32_t sample_us = (int32_t)((uint32_t)now - echo - delay);
+    if (sample_us <= 0) return;
+    double sample = sample_us / 1000.0;
+    if (r->srtt == 0) {
+        r->srtt = sample;
+        r->rttvar = sample / 2;
+    } else {
+        rtt_update(&r->srtt, &r->rttvar, sample);
+    }
+    metrics_record(H_RTT, sample_us);
+}
+
+static void handle_join(struct fanout_sender *s, const struct sham_header *h, const struct sockaddr_in *from, uint64_t now) {
+    char name[64];
+    struct fanout_receiver_info *r = find_receiver(s, h->seq_num);
+    if (r) {
+        r->last_heard_us = now;
+        return;
+    }
+    if (s->started || s->receiver_count == FANOUT_MAX_RECEIVERS) {
+        printf("Receiver %u at %s joined too late, ignoring it\n", h->seq_num, address_name(from, name, sizeof(name)));
+        log_message("LATE JOIN ID=%u\n", h->seq_num);
+        return;
+    }
+    r = &s->receivers[s->receiver_count++];
+    memset(r, 0, sizeof(*r));
+    r->id = h->seq_num;
+    r->addr = *from;
+    r->active = 1;
+    r->window = clamp_window(h->window_size);
+    r->last_heard_us = now;
+    record_rtt(r, h->ack_num, 0, now);
+    printf("Receiver %u joined from %s (%d/%d), window %d segments\n", r->id, address_name(from, name, sizeof(name)),
+           s->receiver_count, s->expected, r->window);
+    log_message("JOIN ID=%u WIN=%d\n", r->id, r->window);
+}
+
+// Remembers the most segments one receiver lacks in a parity group
+static void note_group(struct fanout_sender *s, uint64_t group, int missing) {
+    if (missing == 0) return;
+    struct fanout_group_state *g = &s->groups[group % FANOUT_MAX_WINDOW];
+    if (missing > g->worst) g->worst = missing;
+}
+
+static void handle_status(struct fanout_sender *s, const struct sham_header *h, const char *payload, size_t length, uint64_t now) {
+    struct fanout_receiver_info *r = find_receiver(s, h->seq_num);
+    if (!r || !r->active) return;
+    r->last_heard_us = now;
+    r->window = clamp_window(h->window_size);
+    s->reports++;
+    metrics_count(M_ACKS_RECEIVED, 1);
+
+    struct sham_fanout_status status;
+    if (length < sizeof(status)) return;
+    memcpy(&status, payload, sizeof(status));
+    record_rtt(r, ntohl(status.echo), ntohl(status.echo_delay), now);
+
+    uint64_t base = r->acked * PAYLOAD_SIZE < s->size ? r->acked * PAYLOAD_SIZE : s->size;
+    int64_t offset = widen_offset(s->isn, base, h->ack_num);
+    if (offset >= (int64_t)base && offset <= (int64_t)s->size) {
+        uint64_t acked = (uint64_t)offset == s->size ? s->segments : (uint64_t)offset / PAYLOAD_SIZE;
+        if (acked > s->next) acked = s->next;
+        if (acked > r->acked) {
+            metrics_count(M_BYTES_ACKED, (acked - r->acked) * PAYLOAD_SIZE);
+            r->acked = acked;
+        }
+    }
+    int64_t high = widen_offset(s->isn, base, ntohl(status.high_seq));
+    if (high >= (int64_t)base && high <= (int64_t)s->size) {
+        r->highest = (uint64_t)high == s->size ? s->segments : (uint64_t)high / PAYLOAD_SIZE;
+    }
+    if (r->highest < r->acked) r->highest = r->acked;
+    if (r->acked == s->segments && !r->complete) {
+        r->complete = 1;
+        printf("Receiver %u has the whole file\n", r->id);
+        log_message("COMPLETE ID=%u\n", r->id);
+    }
+
+    int nak_count = ntohs(status.nak_count);
+    if (nak_count > (int)((length - sizeof(status)) / sizeof(struct sham_fanout_nak))) {
+        nak_count = (length - sizeof(status)) / sizeof(struct sham_fanout_nak);
+    }
+    uint64_t group = 0;
+    int missing = 0;
+    for (int i = 0; i < nak_count; i++) {
+        struct sham_fanout_nak nak;
+        memcpy(&nak, payload + sizeof(status) + i * sizeof(nak), sizeof(nak));
+        int64_t start = widen_offset(s->isn, r->acked * PAYLOAD_SIZE, ntohl(nak.seq));
+        if (start < 0 || start % PAYLOAD_SIZE != 0) continue;
+        uint64_t first = (uint64_t)start / PAYLOAD_SIZE;
+        uint64_t end = first + ntohl(nak.count);
+        if (first < r->acked) first = r->acked;
+        if (end > s->next) end = s->next;
+        for (uint64_t index = first; index < end; index++) {
+            struct fanout_slot *slot = &s->slots[index % FANOUT_MAX_WINDOW];
+            if (!slot->requested && slot->repairs == 0) s->naked++;
+            slot->requested = 1;
+            r->naks++;
+            if (index / s->fec_k != group) {
+                note_group(s, group, missing);
+                group = index / s->fec_k;
+                missing = 0;
+            }
+            missing++;
+        }
+    }
+    note_group(s, group, missing);
+
+    // Nothing after the last segments it heard of: if they went out a
+    // repair interval ago, the tail was lost
+    uint64_t holdoff = repair_holdoff(s);
+    for (uint64_t index = r->highest; index < s->next; index++) {
+        struct fanout_slot *slot = &s->slots[index % FANOUT_MAX_WINDOW];
+        if (now - slot->sent_us < holdoff) continue;
+        if (!slot->requested && slot->repairs == 0) s->naked++;
+        slot->requested = 1;
+    }
+    if (nak_count > 0) log_message("RCV NAK ID=%u ACK=%u RANGES=%d\n", r->id, h->ack_num, nak_count);
+}
+
+static void receive_reports(struct fanout_sender *s, uint64_t now) {
+    static int warned;
+    union sham_datagram rx;
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t length;
+    while ((length = net_recvfrom(s->sockfd, &rx, sizeof(rx), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) > 0) {
+        from_len = sizeof(from);
+        if ((size_t)length < sizeof(struct sham_header)) continue;
+        struct sham_header h;
+        sham_header_decode(&rx.packet.header, &h);
+        if (!(h.flags & MCAST)) {
+            if (!warned && (h.flags & (SYN | ACK)) == (SYN | ACK)) {
+                char name[64];
+                printf("%s answered as a unicast server; start receivers with --fanout\n", address_name(&from, name, sizeof(name)));
+                warned = 1;
+            }
+            continue;
+        }
+        if (h.conn_id != s->session_id) continue;
+        if ((h.flags & (SYN | ACK)) == (SYN | ACK)) {
+            handle_join(s, &h, &from, now);
+        } else if (h.flags & ACK) {
+            handle_status(s, &h, rx.packet.payload, length - sizeof(struct sham_header), now);
+        }
+    }
+}
+
+// Lowest segment some active receiver still lacks
+static uint64_t window_base(struct fanout_sender *s) {
+    uint64_t base = s->next;
+    for (int i = 0; i < s->receiver_count; i++) {
+        struct fanout_receiver_info *r = &s->receivers[i];
+        if (r->active && r->acked < base) base = r->acked;
+    }
+    return base;
+}
+
+// One past the last segment the slowest receiver's window allows
+static uint64_t send_limit(struct fanout_sender *s) {
+    uint64_t limit = window_base(s) + FANOUT_MAX_WINDOW;
+    for (int i = 0; i < s->receiver_count; i++) {
+        struct fanout_receiver_info *r = &s->receivers[i];
+        if (r->active && !r->complete && r->acked + r->window < limit) limit = r->acked + r->window;
+    }
+    return limit < s->segments ? limit : s->segments;
+}
+
+// Pacing credit accrues at the smallest window per largest RTT, so a
+// window goes out spread over the round trip of the slowest receiver.
+// Returns the microseconds until the next segment may go.
+static uint64_t refill_tokens(struct fanout_sender *s, uint64_t now) {
+    double srtt = 0;
+    int window = FANOUT_MAX_WINDOW;
+    for (int i = 0; i < s->receiver_count; i++) {
+        struct fanout_receiver_info *r = &s->receivers[i];
+        if (!r->active || r->complete) continue;
+        if (r->srtt > srtt) srtt = r->srtt;
+        if (r->window < window) window = r->window;
+    }
+    uint64_t elapsed = now - s->tokens_us;
+    s->tokens_us = now;
+    if (srtt <= 0) {
+        s->tokens = FANOUT_BURST;
+        return 0;
+    }
+    double per_segment_us = srtt * 1000 / window;
+    s->tokens += elapsed / per_segment_us;
+    if (s->tokens > FANOUT_BURST) s->tokens = FANOUT_BURST;
+    return s->tokens >= 1 ? 0 : (uint64_t)((1 - s->tokens) * per_segment_us) + 1;
+}
+
+// Long enough for a repair to reach the slowest receiver and its next
+// report to come back, so one loss is not repaired twice
+static uint64_t repair_holdoff(struct fanout_sender *s) {
+    double rtt = 0;
+    for (int i = 0; i < s->receiver_count; i++) {
+        struct fanout_receiver_info *r = &s->receivers[i];
+        if (r->active && r->srtt + 4 * r->rttvar > rtt) rtt = r->srtt + 4 * r->rttvar;
+    }
+    return (uint64_t)(rtt * 1000) + FANOUT_NAK_INTERVAL_MS * 1000;
+}
+
+static int repair_due(struct fanout_slot *slot, uint64_t now, uint64_t holdoff) {
+    return slot->requested && now - slot->sent_us >= holdoff;
+}
+
+static void mark_repaired(struct fanout_slot *slot, uint64_t now) {
+    slot->requested = 0;
+    slot->sent_us = now;
+    slot->repairs++;
+}
+
+// Repairs the union of the gaps reported since the last pass. A group whose
+// worst receiver lacks r segments, where the union is larger, gets r fresh
+// parity rows; each receiver rebuilds its own losses from them.
+static void send_repairs(struct fanout_sender *s, uint64_t now) {
+    uint64_t holdoff = repair_holdoff(s);
+    uint64_t base = window_base(s);
+    for (uint64_t index = base; index < s->next; index++) {
+        struct fanout_slot *slot = &s->slots[index % FANOUT_MAX_WINDOW];
+        if (!repair_due(slot, now, holdoff)) continue;
+
+        uint64_t group = index / s->fec_k;
+        struct fanout_group_state *g = &s->groups[group % FANOUT_MAX_WINDOW];
+        uint64_t first = group * s->fec_k;
+        uint64_t end = first + group_size(s, group);
+        if (end > s->next) end = s->next;
+        int rows = g->worst;
+        if (!g->parity_repaired && rows > 0 && g->parity_sent + rows <= FEC_MAX_M && first + group_size(s, group) <= s->next) {
+            int wanted = 0;
+            for (uint64_t i = index; i < end; i++) {
+                if (repair_due(&s->slots[i % FANOUT_MAX_WINDOW], now, holdoff)) wanted++;
+            }
+            if (wanted > rows) {
+                queue_parity(s, group, g->parity_sent, rows, now);
+                g->parity_sent += rows;
+                g->parity_repaired = 1;
+                g->worst = 0;
+                s->parity_repairs += rows;
+                for (uint64_t i = index; i < end; i++) {
+                    struct fanout_slot *other = &s->slots[i % FANOUT_MAX_WINDOW];
+                    if (repair_due(other, now, holdoff)) mark_repaired(other, now);
+                }
+                index = end - 1;
+                continue;
+            }
+        }
+        queue_segment(s, index, now);
+        mark_repaired(slot, now);
+        g->worst = 0;
+        s->retransmissions++;
+        metrics_count(M_RETRANSMISSIONS, 1);
+        log_message("RETX SEQ=%u\n", offset_seq(s->isn, index * PAYLOAD_SIZE));
+    }
+}
+
+static void queue_new_segment(struct fanout_sender *s, uint64_t now) {
+    uint64_t index = s->next++;
+    uint64_t group = index / s->fec_k;
+    if (index % s->fec_k == 0) memset(&s->groups[group % FANOUT_MAX_WINDOW], 0, sizeof(struct fanout_group_state));
+    struct fanout_slot *slot = &s->slots[index % FANOUT_MAX_WINDOW];
+    memset(slot, 0, sizeof(*slot));
+    slot->sent_us = now;
+    queue_segment(s, index, now);
+    s->data_sent++;
+    metrics_count(M_SEGMENTS_SENT, 1);
+    log_message("SND DATA SEQ=%u\n", offset_seq(s->isn, index * PAYLOAD_SIZE));
+
+    // Proactive parity once the group is complete; adaptive counts follow
+    // the share of segments that some receiver has reported missing
+    if (s->fec_m != 0 && (index + 1 == s->segments || (index + 1) % s->fec_k == 0)) {
+        int m = s->fec_m;
+        if (m < 0) m = fec_choose_parity((double)s->naked / s->data_sent, s->fec_k);
+        queue_parity(s, group, 0, m, now);
+        s->groups[group % FANOUT_MAX_WINDOW].parity_sent = m;
+    }
+}
+
+static int active_incomplete(struct fanout_sender *s, uint64_t now) {
+    int count = 0;
+    for (int i = 0; i < s->receiver_count; i++) {
+        struct fanout_receiver_info *r = &s->receivers[i];
+        if (!r->active || r->complete) continue;
+        if (now - r->last_heard_us > FANOUT_RECEIVER_TIMEOUT_MS * 1000ULL) {
+            r->active = 0;
+            printf("Receiver %u stopped reporting at segment %llu, continuing without it\n", r->id, (unsigned long long)r->acked);
+            log_message("TIMEOUT ID=%u ACK=%llu\n", r->id, (unsigned long long)r->acked);
+            metrics_count(M_TIMEOUTS, 1);
+            continue;
+        }
+        count++;
+    }
+    return count;
+}
+
+int fanout_send(struct fanout_sender *s) {
+    char name[64];
+    printf("Announcing %llu bytes to %s%s, waiting for %d receiver%s\n", (unsigned long long)s->size,
+           address_name(&s->targets[0], name, sizeof(name)), s->multicast ? " (multicast)" : "",
+           s->expected, s->expected == 1 ? "" : "s");
+
+    uint64_t start = now_us();
+    uint64_t next_announce = start;
+    while (s->receiver_count < s->expected) {
+        uint64_t now = now_us();
+        if (now - start >= FANOUT_JOIN_TIMEOUT_MS * 1000ULL) break;
+        if (now >= next_announce) {
+            queue_announce(s, now);
+            flush_queue(s);
+            next_announce = now + FANOUT_ANNOUNCE_MS * 1000;
+        }
+        uint64_t deadline = start + FANOUT_JOIN_TIMEOUT_MS * 1000ULL;
+        if (next_announce < deadline) deadline = next_announce;
+        wait_readable(s->sockfd, deadline > now ? deadline - now : 0);
+        receive_reports(s, now_us());
+    }
+    if (s->receiver_count == 0) {
+        printf("No receivers joined.\n");
+        return 1;
+    }
+    if (s->receiver_count < s->expected) {
+        printf("Only %d of %d receivers joined, sending to them\n", s->receiver_count, s->expected);
+    }
+
+    s->started = 1;
+    uint64_t began = now_us();
+    s->tokens_us = began;
+    s->next_repair_us = began + FANOUT_NAK_INTERVAL_MS * 1000;
+    while (1) {
+        uint64_t now = now_us();
+        receive_reports(s, now);
+        if (active_incomplete(s, now) == 0) break;
+        if (now >= s->next_repair_us) {
+            send_repairs(s, now);
+            s->next_repair_us = now + FANOUT_NAK_INTERVAL_MS * 1000;
+        }
+        refill_tokens(s, now);
+        uint64_t limit = send_limit(s);
+        while (s->next < limit && s->tokens >= 1) {
+            queue_new_segment(s, now);
+            s->tokens -= 1;
+        }
+        flush_queue(s);
+
+        uint64_t wait = s->next_repair_us > now ? s->next_repair_us - now : 0;
+        if (s->next < limit) {
+            uint64_t credit = refill_tokens(s, now_us());
+            if (credit < wait) wait = credit;
+        }
+        wait_readable(s->sockfd, wait);
+    }
+
+    s->finishing = 1;
+    for (int i = 0; i < FANOUT_FIN_COUNT; i++) {
+        struct fanout_datagram *d = queue_slot(s);
+        sham_header_encode((struct sham_header *)d->data, offset_seq(s->isn, s->size), (uint32_t)now_us(), FIN | MCAST, 0, s->session_id);
+        d->length = sizeof(struct sham_header);
+    }
+    flush_queue(s);
+    log_message("SND FIN\n");
+
+    double elapsed = (now_us() - began) / 1e6;
+    int failed = s->receiver_count < s->expected;
+    printf("Fanout sent: %llu bytes in %.2f s, %lu segments, %lu retransmissions, %lu parity (%lu for repair), "
+           "%lu send calls, %lu reports\n", (unsigned long long)s->size, elapsed, s->data_sent, s->retransmissions,
+           s->parity_sent, s->parity_repairs, s->syscalls, s->reports);
+    for (int i = 0; i < s->receiver_count; i++) {
+        struct fanout_receiver_info *r = &s->receivers[i];
+        printf("  Receiver %u at %s: %s, %lu segments reported missing, RTT %.2f ms\n", r->id,
+               address_name(&r->addr, name, sizeof(name)), r->complete ? "complete" : "incomplete", r->naks, r->srtt);
+        if (!r->complete) failed = 1;
+    }
+    log_message("STATS SENT=%lu RETX=%lu PARITY=%lu REPAIR_PARITY=%lu CALLS=%lu\n", s->data_sent, s->retransmissions,
+                s->parity_sent, s->parity_repairs, s->syscalls);
+    return failed;
+}
+
+// --- Receiver ---
+
+void fanout_receiver_init(struct fanout_receiver *r, int sockfd, const char *output_path) {
+    memset(r, 0, sizeof(*r));
+    r->sockfd = sockfd;
+    r->id = net_random32();
+    r->output_path = output_path;
+    r->fd = -1;
+    fec_init();
+    fec_decoder_init(&r->decoder);
+}
+
+static int has_segment(struct fanout_receiver *r, uint64_t index) {
+    return (r->have[index / 8] >> (index % 8)) & 1;
+}
+
+static uint32_t ack_seq(struct fanout_receiver *r) {
+    uint64_t offset = r->acked * PAYLOAD_SIZE;
+    return offset_seq(r->isn, offset < r->size ? offset : r->size);
+}
+
+static void send_join(struct fanout_receiver *r, uint32_t echo) {
+    struct sham_header header;
+    sham_header_encode(&header, r->id, echo, SYN | ACK | MCAST, FANOUT_RECEIVE_WINDOW, r->session_id);
+    net_sendto(r->sockfd, &header, sizeof(header), 0, (const struct sockaddr *)&r->sender, sizeof(r->sender));
+    log_message("SND JOIN SESSION=%u ID=%u\n", r->session_id, r->id);
+}
+
+// One report with every gap between the ACK and the furthest segment heard
+static void send_status(struct fanout_receiver *r, uint64_t now) {
+    struct sham_packet packet;
+    struct sham_fanout_status status;
+    size_t naks = 0;
+    for (uint64_t index = r->acked; index < r->highest && naks < FANOUT_MAX_NAKS;) {
+        if (has_segment(r, index)) {
+            index++;
+            continue;
+        }
+        uint64_t end = index;
+        while (end < r->highest && !has_segment(r, end)) end++;
+        struct sham_fanout_nak nak;
+        nak.seq = htonl(offset_seq(r->isn, index * PAYLOAD_SIZE));
+        nak.count = htonl((uint32_t)(end - index));
+        memcpy(packet.payload + sizeof(status) + naks * sizeof(nak), &nak, sizeof(nak));
+        naks++;
+        index = end;
+    }
+    status.echo = htonl(r->echo);
+    status.echo_delay = htonl((uint32_t)(now - r->echo_us));
+    uint64_t high = r->highest * PAYLOAD_SIZE;
+    status.high_seq = htonl(offset_seq(r->isn, high < r->size ? high : r->size));
+    status.nak_count = htons((uint16_t)naks);
+    status.flags = 0;
+    memcpy(packet.payload, &status, sizeof(status));
+    sham_header_encode(&packet.header, r->id, ack_seq(r), ACK | MCAST, FANOUT_RECEIVE_WINDOW, r->session_id);
+    size_t length = sizeof(struct sham_header) + sizeof(status) + naks * sizeof(struct sham_fanout_nak);
+    net_sendto(r->sockfd, &packet, length, 0, (const struct sockaddr *)&r->sender, sizeof(r->sender));
+    r->last_status_us = now;
+    r->reported_ack = r->acked;
+    r->reports++;
+    metrics_count(M_ACKS_SENT, 1);
+    log_message("SND STATUS ACK=%u NAKS=%zu\n", ack_seq(r), naks);
+}
+
+static int handle_announce(struct fanout_receiver *r, const struct sham_header *h, const char *payload, size_t length,
+                           const struct sockaddr_in *from) {
+    if (r->joined) {
+        // Our join was lost if nothing has arrived since
+        if (h->conn_id == r->session_id && r->received == 0) send_join(r, h->ack_num);
+        return 0;
+    }
+    struct sham_fanout_announce announce;
+    if (length < sizeof(announce)) return 0;
+    memcpy(&announce, payload, sizeof(announce));
+    r->size = ((uint64_t)ntohl(announce.size_high) << 32) | ntohl(announce.size_low);
+    r->segments = (r->size + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE;
+    memcpy(r->md5, announce.md5, sizeof(r->md5));
+    r->session_id = h->conn_id;
+    r->isn = h->seq_num;
+    r->sender = *from;
+
+    r->fd = open(r->output_path, O_RDWR | O_CREAT | O_TRUNC, 0644); // Read back to rebuild from parity
+    if (r->fd < 0 || ftruncate(r->fd, r->size) < 0) {
+        perror(r->output_path);
+        return -1;
+    }
+    r->have = calloc(r->segments / 8 + 1, 1);
+    if (!r->have) {
+        perror("Failed to allocate the segment map");
+        return -1;
+    }
+    r->joined = 1;
+    char name[64];
+    printf("Joining session %u from %s: %llu bytes\n", r->session_id, address_name(from, name, sizeof(name)),
+           (unsigned long long)r->size);
+    send_join(r, h->ack_num);
+    return 0;
+}
+
+static void store_segment(struct fanout_receiver *r, uint64_t index, const char *data, size_t length) {
+    if (index >= r->segments || length != segment_length(r->size, index)) {
+        log_message("IGNORE SEGMENT %llu LEN=%zu\n", (unsigned long long)index, length);
+        return;
+    }
+    if (index >= r->acked + FANOUT_RECEIVE_WINDOW) {
+        log_message("DROP SEGMENT %llu (beyond window)\n", (unsigned long long)index);
+        metrics_count(M_BUFFER_DROPS, 1);
+        return;
+    }
+    if (has_segment(r, index)) {
+        r->duplicates++;
+        metrics_count(M_DUPLICATES, 1);
+        return;
+    }
+    uint64_t write_start = now_us();
+    if (pwrite(r->fd, data, length, index * PAYLOAD_SIZE) != (ssize_t)length) {
+        if (!r->write_error) perror("Failed to write received data");
+        r->write_error = 1;
+        return;
+    }
+    metrics_record(H_WRITE_LATENCY, now_us() - write_start);
+    r->have[index / 8] |= 1 << (index % 8);
+    r->received++;
+    metrics_count(M_BYTES_DELIVERED, length);
+    if (index < r->highest) {
+        r->repaired++;
+    } else {
+        if (index > r->highest) metrics_count(M_OUT_OF_ORDER, 1);
+        r->highest = index + 1;
+    }
+    while (r->acked < r->segments && has_segment(r, r->acked)) r->acked++;
+}
+
+static int64_t segment_index(struct fanout_receiver *r, uint32_t seq) {
+    int64_t offset = widen_offset(r->isn, r->acked * PAYLOAD_SIZE, seq);
+    if (offset < 0 || offset % PAYLOAD_SIZE != 0) return -1;
+    return offset / PAYLOAD_SIZE;
+}
+
+// Feeds the group's segments we hold back from the output file, then
+// rebuilds whatever the parity rows received so far allow
+static void handle_parity(struct fanout_receiver *r, const unsigned char *datagram, size_t length) {
+    static struct fec_segment rebuilt[FEC_MAX_GROUPS * FEC_MAX_M];
+    static char data[PAYLOAD_SIZE];
+    int slot = fec_decoder_add_parity(&r->decoder, datagram, length);
+    if (slot < 0) return;
+    struct fec_group *group = &r->decoder.groups[slot];
+    for (int i = 0; i < group->k; i++) {
+        int64_t index = segment_index(r, group->seqs[i]);
+        if (index < 0 || (uint64_t)index >= r->segments || !has_segment(r, index)) continue;
+        size_t n = segment_length(r->size, index);
+        if (pread(r->fd, data, n, index * PAYLOAD_SIZE) == (ssize_t)n) {
+            fec_decoder_store(&r->decoder, group->seqs[i], data, n);
+        }
+    }
+    int count = fec_decoder_recover(&r->decoder, ack_seq(r), rebuilt, FEC_MAX_GROUPS * FEC_MAX_M);
+    for (int i = 0; i < count; i++) {
+        int64_t index = segment_index(r, rebuilt[i].seq);
+        if (index < 0 || (uint64_t)index >= r->segments || has_segment(r, index)) continue;
+        store_segment(r, index, rebuilt[i].data, rebuilt[i].length);
+        r->recovered++;
+        metrics_count(M_FEC_RECOVERED, 1);
+        log_message("FEC RECOVERED SEQ=%u\n", rebuilt[i].seq);
+    }
+}
+
+static void handle_sender_packet(struct fanout_receiver *r, const union sham_datagram *rx, size_t length,
+                                 const struct sockaddr_in *from, uint64_t now) {
+    struct sham_header h;
+    sham_header_decode(&rx->packet.header, &h);
+    if (!(h.flags & MCAST)) {
+        log_message("IGNORE FLAGS=%u (not a fanout session)\n", h.flags);
+        return;
+    }
+    const char *payload = rx->packet.payload;
+    size_t payload_length = length - sizeof(struct sham_header);
+    if (h.flags & SYN) {
+        if (handle_announce(r, &h, payload, payload_length, from) < 0) r->finished = 1;
+    }
+    if (!r->joined || h.conn_id != r->session_id) return;
+    r->last_heard_us = now;
+    r->echo = h.ack_num;
+    r->echo_us = now;
+    if (h.flags & SYN) return;
+    if (h.flags & FIN) {
+        r->finished = 1;
+        log_message("RCV FIN\n");
+        return;
+    }
+
+    if (should_drop_packet()) {
+        r->dropped++;
+        log_message("DROP SEQ=%u FLAGS=%u (simulated loss)\n", h.seq_num, h.flags);
+        return;
+    }
+    if (h.flags & FEC) {
+        handle_parity(r, (const unsigned char *)rx, length);
+        return;
+    }
+    int64_t index = segment_index(r, h.seq_num);
+    metrics_count(M_SEGMENTS_RECEIVED, 1);
+    metrics_count(M_BYTES_RECEIVED, payload_length);
+    log_message("RCV DATA SEQ=%u LEN=%zu\n", h.seq_num, payload_length);
+    if (index >= 0) store_segment(r, index, payload, payload_length);
+}
+
+int fanout_receive(struct fanout_receiver *r) {
+    // Room for a full window in the socket, as the sender may burst it
+    int buffer = FANOUT_RECEIVE_WINDOW * (int)sizeof(struct sham_packet);
+    net_setsockopt(r->sockfd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    printf("Waiting for a fanout announce...\n");
+
+    union sham_datagram rx;
+    int completed = 0;
+    while (!r->finished) {
+        uint64_t now = now_us();
+        if (r->joined) {
+            int behind = r->highest > r->acked || r->acked != r->reported_ack;
+            uint64_t due = r->last_status_us + (behind ? FANOUT_NAK_INTERVAL_MS : FANOUT_KEEPALIVE_MS) * 1000ULL;
+            wait_readable(r->sockfd, due > now ? due - now : 0);
+        } else {
+            fd_set read_fds;
+            FD_ZERO(&read_fds);
+            FD_SET(r->sockfd, &read_fds);
+            net_select(r->sockfd + 1, &read_fds, NULL, NULL, NULL);
+        }
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t length;
+        for (int drained = 0; drained < FANOUT_DRAIN && !r->finished &&
+             (length = net_recvfrom(r->sockfd, &rx, sizeof(rx), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len)) > 0; drained++) {
+            from_len = sizeof(from);
+            if ((size_t)length < sizeof(struct sham_header)) continue;
+            handle_sender_packet(r, &rx, length, &from, now_us());
+        }
+        if (!r->joined) continue;
+
+        now = now_us();
+        if (!completed && r->acked == r->segments) {
+            completed = 1;
+            printf("Received all %llu segments.\n", (unsigned long long)r->segments);
+            send_status(r, now);
+            continue;
+        }
+        if (now - r->last_heard_us > FANOUT_SILENCE_TIMEOUT_MS * 1000ULL) {
+            printf("Sender went silent, giving up.\n");
+            break;
+        }
+        // Report at the NAK interval while anything is missing or new, at
+        // once after a quarter window of progress, and otherwise as a keepalive
+        int behind = r->highest > r->acked || r->acked != r->reported_ack;
+        uint64_t interval = (behind ? FANOUT_NAK_INTERVAL_MS : FANOUT_KEEPALIVE_MS) * 1000ULL;
+        if (now - r->last_status_us >= interval || r->acked - r->reported_ack >= FANOUT_RECEIVE_WINDOW / 4) {
+            send_status(r, now);
+        }
+    }
+
+    if (r->fd >= 0) close(r->fd);
+    free(r->have);
+    r->have = NULL;
+    if (!r->joined) return 1;
+
+    int ok = r->acked == r->segments && !r->write_error;
+    printf("Fanout received: %llu of %llu segments, %lu rebuilt from parity, %lu filled gaps, %lu duplicates, "
+           "%lu reports sent\n", (unsigned long long)r->received, (unsigned long long)r->segments, r->recovered,
+           r->repaired, r->duplicates, r->reports);
+    log_message("STATS RECEIVED=%llu RECOVERED=%lu DUPLICATES=%lu REPORTS=%lu DROPPED=%lu\n",
+                (unsigned long long)r->received, r->recovered, r->duplicates, r->reports, r->dropped);
+    if (!ok) {
+        printf("Transfer incomplete.\n");
+        return 1;
+    }
+    char expected[MD5_HEX_LENGTH], actual[MD5_HEX_LENGTH];
+    md5_to_hex(r->md5, expected);
+    if (md5_file_hex(r->output_path, actual) < 0) return 1;
+    printf("MD5: %s%s\n", actual, strcmp(actual, expected) == 0 ? "" : " MISMATCH");
+    return strcmp(actual, expected) != 0;
+}
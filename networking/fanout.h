@@ -0,0 +1,166 @@
+#ifndef SHAM_FANOUT_H
+#define SHAM_FANOUT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "headers.h"
+#include "fec.h"
+#include "filemap.h"
+
+// One-to-many file distribution. The sender transmits every segment once,
+// to a multicast group or to all unicast receivers in one sendmmsg() call,
+// so its cost does not grow with the number of receivers. Receivers write
+// segments at their offset as they arrive and report what is missing. Every
+// FANOUT_NAK_INTERVAL_MS each receiver sends at most one report with all
+// of its gaps. The sender repairs the union of the reports once per interval.
+// A parity group where no receiver lacks more than r segments gets r parity
+// rows. Otherwise the missing segments are sent again. Both go to the
+// whole group. The sender stays within the window of the receiver furthest
+// behind and spreads each window over the largest RTT.
+
+#ifndef FANOUT_NAK_INTERVAL_MS
+#define FANOUT_NAK_INTERVAL_MS 20
+#endif
+#define FANOUT_KEEPALIVE_MS 250     // Receiver reports at least this often
+#define FANOUT_ANNOUNCE_MS 250      // SYN repeated until every receiver joins
+#define FANOUT_JOIN_TIMEOUT_MS 5000 // Start with whoever joined by then
+#define FANOUT_RECEIVER_TIMEOUT_MS 3000 // A silent receiver is left behind
+#define FANOUT_SILENCE_TIMEOUT_MS 10000 // A receiver gives up on a silent sender
+#define FANOUT_FIN_COUNT 3
+
+#define FANOUT_MAX_RECEIVERS 64
+#define FANOUT_MAX_WINDOW 1024      // Segments between the slowest ACK and the send point
+#ifndef FANOUT_RECEIVE_WINDOW
+#define FANOUT_RECEIVE_WINDOW 512   // Segments a receiver accepts past its ACK
+#endif
+#define FANOUT_BURST 16             // Datagrams per sendmmsg() batch and pacing burst
+#define FANOUT_DRAIN 64             // Datagrams a receiver reads between report checks
+
+struct fanout_receiver_info {
+    uint32_t id;
+    struct sockaddr_in addr;
+    int active;                 // Joined and not timed out
+    int complete;
+    uint64_t acked;             // Segments received in order
+    uint64_t highest;           // One past the furthest segment it has
+    int window;                 // Segments
+    uint64_t last_heard_us;
+    double srtt, rttvar;        // ms
+    unsigned long naks;         // Segments it reported missing
+};
+
+// Per segment between the slowest ACK and the send point, indexed modulo
+// FANOUT_MAX_WINDOW
+struct fanout_slot {
+    uint64_t sent_us;
+    uint8_t requested;          // Reported missing since the last repair
+    uint8_t repairs;
+};
+
+struct fanout_group_state {
+    uint8_t parity_sent;        // Rows already sent, proactive and repair
+    uint8_t worst;              // Most segments any one receiver lacks
+    uint8_t parity_repaired;    // Later gaps get retransmissions
+};
+
+struct fanout_datagram {
+    size_t length;
+    unsigned char data[FEC_MAX_PACKET];
+};
+
+struct fanout_sender {
+    int sockfd;
+    uint32_t session_id;
+    uint32_t isn;
+    int multicast;
+    struct sockaddr_in targets[FANOUT_MAX_RECEIVERS]; // The group, or every unicast receiver
+    int target_count;
+    int expected;               // Receivers to wait for before sending
+
+    struct file_map map;
+    uint64_t size;
+    uint64_t segments;
+    unsigned char md5[16];
+
+    struct fanout_receiver_info receivers[FANOUT_MAX_RECEIVERS];
+    int receiver_count;
+
+    uint64_t next;              // Next segment sent for the first time
+    struct fanout_slot slots[FANOUT_MAX_WINDOW];
+    struct fanout_group_state groups[FANOUT_MAX_WINDOW];
+    int fec_k;                  // Parity group size; repairs use it too
+    int fec_m;                  // Proactive rows, -1 adaptive, 0 none
+    int started;                // Late joins are refused
+    int finishing;              // The FIN goes to every receiver that joined
+    double tokens;              // Pacing credit in segments
+    uint64_t tokens_us;
+    uint64_t next_repair_us;
+
+    struct fanout_datagram queue[FANOUT_BURST];
+    int queued;
+
+    unsigned long data_sent;
+    unsigned long retransmissions;
+    unsigned long parity_sent;
+    unsigned long parity_repairs;
+    unsigned long naked;        // Distinct segments reported missing
+    unsigned long reports;
+    unsigned long syscalls;
+};
+
+// Opens path and prepares a session. Targets are added by the caller.
+int fanout_sender_init(struct fanout_sender *s, int sockfd, const char *path, uint32_t session_id);
+
+// Announces, waits for receivers, sends the file and ends the session.
+// Returns 0 if every expected receiver has the whole file.
+int fanout_send(struct fanout_sender *s);
+
+void fanout_sender_close(struct fanout_sender *s);
+
+struct fanout_receiver {
+    int sockfd;
+    uint32_t id;
+    const char *output_path;
+    int fd;
+    struct sockaddr_in sender;
+    int joined;
+    uint32_t session_id;
+    uint32_t isn;
+    uint64_t size;
+    uint64_t segments;
+    unsigned char md5[16];
+
+    uint8_t *have;              // Bitmap of segments written
+    uint64_t acked;             // Segments received in order
+    uint64_t highest;           // One past the furthest segment received
+    uint64_t received;
+    uint64_t reported_ack;
+    uint64_t last_status_us;
+    uint64_t last_heard_us;
+    uint32_t echo;
+    uint64_t echo_us;
+    int finished;               // FIN heard
+    int write_error;
+    struct fec_decoder decoder;
+
+    unsigned long duplicates;
+    unsigned long recovered;
+    unsigned long repaired;     // Arrived after being reported missing
+    unsigned long reports;
+    unsigned long dropped;      // Simulated loss
+};
+
+// Output is written in place at each segment's offset
+void fanout_receiver_init(struct fanout_receiver *r, int sockfd, const char *output_path);
+
+// Waits for an announce, joins and receives one file. Returns 0 if it
+// arrived whole with the announced MD5.
+int fanout_receive(struct fanout_receiver *r);
+
+// Multicast setup; the interface is $SHAM_MCAST_IF, e.g. 127.0.0.1 for a
+// test on one host, or the system's choice
+int fanout_join_group(int sockfd, struct in_addr group);
+int fanout_multicast_interface(int sockfd);
+
+#endif
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "fec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_HAVE_SSSE3 1
+#endif
+
+// GF(256) with the 0x11d polynomial, generator 2
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t fec_matrix[FEC_MAX_M][FEC_MAX_K];
+static pthread_once_t fec_once = PTHREAD_ONCE_INIT;
+
+static void region_mul_xor_scalar(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t len);
+static void (*region_mul_xor)(uint8_t *, const uint8_t *, uint8_t, size_t) = region_mul_xor_scalar;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void region_mul_xor_scalar(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t len) {
+    uint8_t log_coef = gf_log[coef];
+    for (size_t i = 0; i < len; i++) {
+        if (src[i]) dst[i] ^= gf_exp[gf_log[src[i]] + log_coef];
+    }
+}
+
+#ifdef FEC_HAVE_SSSE3
+// Split-table multiply: the low and high nibble of every byte index two
+// 16-entry product tables with pshufb, 16 bytes per step.
+__attribute__((target("ssse3")))
+static void region_mul_xor_ssse3(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t len) {
+    uint8_t lo[16], hi[16];
+    for (int i = 0; i < 16; i++) {
+        lo[i] = gf_mul(coef, (uint8_t)i);
+        hi[i] = gf_mul(coef, (uint8_t)(i << 4));
+    }
+    __m128i table_lo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i table_hi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i low = _mm_shuffle_epi8(table_lo, _mm_and_si128(v, nibble));
+        __m128i high = _mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(v, 4), nibble));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(low, high)));
+    }
+    region_mul_xor_scalar(dst + i, src + i, coef, len - i);
+}
+#endif
+
+static void build_tables(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+
+    // Cauchy matrix 1/(x_j + y_i) with disjoint x and y, columns scaled so the
+    // first row is all ones. Column scaling keeps every square submatrix
+    // invertible, and row 0 stays a plain XOR for the common single loss.
+    for (int i = 0; i < FEC_MAX_K; i++) {
+        uint8_t first_row = (uint8_t)(FEC_MAX_K ^ i);
+        for (int j = 0; j < FEC_MAX_M; j++) {
+            uint8_t c = gf_inv((uint8_t)((FEC_MAX_K + j) ^ i));
+            fec_matrix[j][i] = gf_mul(c, first_row);
+        }
+    }
+
+#ifdef FEC_HAVE_SSSE3
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        region_mul_xor = region_mul_xor_ssse3;
+    }
+#endif
+}
+
+void fec_init(void) {
+    pthread_once(&fec_once, build_tables);
+}
+
+uint8_t fec_coefficient(int parity_index, int data_index) {
+    return fec_matrix[parity_index][data_index];
+}
+
+// dst ^= coef * src over GF(256)
+void fec_region_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t len) {
+    if (coef == 0) return;
+    if (coef == 1) {
+        for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    region_mul_xor(dst, src, coef, len);
+}
+
+// Smallest parity count that keeps the chance of more than m losses among
+// the k + m packets of a group under FEC_TARGET_RESIDUAL.
+int fec_choose_parity(double loss_rate, int k) {
+    if (loss_rate < 0.0) loss_rate = 0.0;
+    if (loss_rate > 0.5) loss_rate = 0.5;
+    for (int m = 1; m < FEC_MAX_M; m++) {
+        int n = k + m;
+        double unrecoverable = 0.0;
+        for (int losses = m + 1; losses <= n; losses++) {
+            double ways = 1.0;
+            for (int i = 0; i < losses; i++) ways = ways * (n - i) / (i + 1);
+            unrecoverable += ways * pow(loss_rate, losses) * pow(1.0 - loss_rate, n - losses);
+        }
+        if (unrecoverable < FEC_TARGET_RESIDUAL) return m;
+    }
+    return FEC_MAX_M;
+}
+
+static void build_symbol(uint8_t *symbol, const char *data, size_t len) {
+    symbol[0] = (uint8_t)(len >> 8);
+    symbol[1] = (uint8_t)(len & 0xff);
+    memcpy(symbol + 2, data, len);
+}
+
+void fec_encoder_reset(struct fec_encoder *enc, int k, int m) {
+    enc->k = k;
+    enc->m = m;
+    enc->count = 0;
+    enc->symbol_size = 0;
+    memset(enc->parity, 0, sizeof(enc->parity));
+}
+
+// Folds one data segment into the parity rows of the open group
+void fec_encoder_add(struct fec_encoder *enc, uint32_t seq, const char *data, size_t len) {
+    uint8_t symbol[FEC_SYMBOL_SIZE];
+    build_symbol(symbol, data, len);
+    for (int j = 0; j < enc->m; j++) {
+        fec_region_mul_xor(enc->parity[j], symbol, fec_coefficient(j, enc->count), len + 2);
+    }
+    enc->seqs[enc->count++] = seq;
+    if (len + 2 > enc->symbol_size) enc->symbol_size = len + 2;
+}
+
+// Writes parity packet `index` of the open group, returns its size
+size_t fec_encoder_build(const struct fec_encoder *enc, int index, uint32_t conn_id, unsigned char *datagram) {
+    struct sham_header header;
+    memset(&header, 0, sizeof(header));
+    header.flags = FEC;
+    header.seq_num = htonl(enc->seqs[0]);
+    header.window_size = htons(1024);
+    header.conn_id = htonl(conn_id);
+
+    struct sham_fec_header fec_header;
+    fec_header.k = (uint8_t)enc->count;
+    fec_header.m = (uint8_t)enc->m;
+    fec_header.index = (uint8_t)index;
+    fec_header.reserved = 0;
+    fec_header.symbol_size = htons((uint16_t)enc->symbol_size);
+
+    size_t offset = 0;
+    memcpy(datagram + offset, &header, sizeof(header));
+    offset += sizeof(header);
+    memcpy(datagram + offset, &fec_header, sizeof(fec_header));
+    offset += sizeof(fec_header);
+    for (int i = 0; i < enc->count; i++) {
+        uint32_t seq = htonl(enc->seqs[i]);
+        memcpy(datagram + offset, &seq, sizeof(seq));
+        offset += sizeof(seq);
+    }
+    memcpy(datagram + offset, enc->parity[index], enc->symbol_size);
+    return offset + enc->symbol_size;
+}
+
+void fec_decoder_init(struct fec_decoder *dec) {
+    memset(dec, 0, sizeof(*dec));
+}
+
+static struct fec_segment *find_cached(struct fec_decoder *dec, uint32_t seq) {
+    for (int i = 0; i < FEC_CACHE_SIZE; i++) {
+        if (dec->cache[i].is_valid && dec->cache[i].seq == seq) return &dec->cache[i];
+    }
+    return NULL;
+}
+
+// Remembers a received data segment so it can help rebuild its neighbours
+void fec_decoder_store(struct fec_decoder *dec, uint32_t seq, const char *data, size_t len) {
+    if (len > PAYLOAD_SIZE || find_cached(dec, seq)) return;
+    struct fec_segment *slot = &dec->cache[dec->cache_next];
+    dec->cache_next = (dec->cache_next + 1) % FEC_CACHE_SIZE;
+    slot->is_valid = 1;
+    slot->seq = seq;
+    slot->length = len;
+    memcpy(slot->data, data, len);
+}
+
+// Files a parity packet under its group. Returns the group slot or -1 if the
+// packet is malformed.
+int fec_decoder_add_parity(struct fec_decoder *dec, const unsigned char *datagram, size_t len) {
+    size_t offset = sizeof(struct sham_header);
+    struct sham_fec_header fec_header;
+    if (len < offset + sizeof(fec_header)) return -1;
+    memcpy(&fec_header, datagram + offset, sizeof(fec_header));
+    offset += sizeof(fec_header);
+
+    size_t symbol_size = ntohs(fec_header.symbol_size);
+    int k = fec_header.k;
+    if (k < 1 || k > FEC_MAX_K || fec_header.index >= FEC_MAX_M ||
+        symbol_size < 2 || symbol_size > FEC_SYMBOL_SIZE ||
+        len < offset + k * sizeof(uint32_t) + symbol_size) {
+        return -1;
+    }
+
+    uint32_t seqs[FEC_MAX_K];
+    for (int i = 0; i < k; i++) {
+        memcpy(&seqs[i], datagram + offset, sizeof(uint32_t));
+        seqs[i] = ntohl(seqs[i]);
+        offset += sizeof(uint32_t);
+    }
+
+    int slot = -1;
+    int oldest = 0;
+    for (int g = 0; g < FEC_MAX_GROUPS; g++) {
+        struct fec_group *group = &dec->groups[g];
+        if (group->in_use && group->k == k && group->seqs[0] == seqs[0]) {
+            slot = g;
+            break;
+        }
+        if (slot < 0 && !group->in_use) slot = g;
+        if (dec->groups[g].age < dec->groups[oldest].age) oldest = g;
+    }
+    if (slot < 0) slot = oldest;
+
+    struct fec_group *group = &dec->groups[slot];
+    if (!group->in_use || group->k != k || group->seqs[0] != seqs[0]) {
+        group->in_use = 1;
+        group->k = k;
+        memcpy(group->seqs, seqs, k * sizeof(uint32_t));
+        group->symbol_size = symbol_size;
+        group->parity_mask = 0;
+    }
+    group->age = ++dec->clock;
+    group->parity_mask |= 1u << fec_header.index;
+    memcpy(group->parity[fec_header.index], datagram + offset, symbol_size);
+    return slot;
+}
+
+// Gauss-Jordan inversion over GF(256), n <= FEC_MAX_M
+static int invert_matrix(uint8_t m[FEC_MAX_M][FEC_MAX_M], uint8_t inv[FEC_MAX_M][FEC_MAX_M], int n) {
+    for (int r = 0; r < n; r++) {
+        for (int c = 0; c < n; c++) inv[r][c] = (r == c);
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && m[pivot][col] == 0) pivot++;
+        if (pivot == n) return -1;
+        if (pivot != col) {
+            for (int c = 0; c < n; c++) {
+                uint8_t t = m[col][c]; m[col][c] = m[pivot][c]; m[pivot][c] = t;
+                t = inv[col][c]; inv[col][c] = inv[pivot][c]; inv[pivot][c] = t;
+            }
+        }
+        uint8_t scale = gf_inv(m[col][col]);
+        for (int c = 0; c < n; c++) {
+            m[col][c] = gf_mul(m[col][c], scale);
+            inv[col][c] = gf_mul(inv[col][c], scale);
+        }
+        for (int r = 0; r < n; r++) {
+            if (r == col || m[r][col] == 0) continue;
+            uint8_t factor = m[r][col];
+            for (int c = 0; c < n; c++) {
+                m[r][c] ^= gf_mul(factor, m[col][c]);
+                inv[r][c] ^= gf_mul(factor, inv[col][c]);
+            }
+        }
+    }
+    return 0;
+}
+
+// Rebuilds the missing segments of one group if enough parity has arrived.
+// Returns the number written to out, or -1 if the group still lacks parity.
+static int recover_group(struct fec_decoder *dec, struct fec_group *group, struct fec_segment *out) {
+    int missing[FEC_MAX_M];
+    int missing_count = 0;
+    int rows[FEC_MAX_M];
+    int row_count = 0;
+
+    for (int j = 0; j < FEC_MAX_M; j++) {
+        if (group->parity_mask & (1u << j)) rows[row_count++] = j;
+    }
+    for (int i = 0; i < group->k; i++) {
+        if (find_cached(dec, group->seqs[i])) continue;
+        if (missing_count == row_count) return -1;
+        missing[missing_count++] = i;
+    }
+    if (missing_count == 0) return 0;
+
+    // Syndromes: parity minus the contribution of every segment we hold
+    uint8_t (*syndrome)[FEC_SYMBOL_SIZE] = dec->syndrome;
+    uint8_t symbol[FEC_SYMBOL_SIZE];
+    for (int r = 0; r < missing_count; r++) {
+        memcpy(syndrome[r], group->parity[rows[r]], group->symbol_size);
+    }
+    for (int i = 0; i < group->k; i++) {
+        struct fec_segment *seg = find_cached(dec, group->seqs[i]);
+        if (!seg) continue;
+        if (seg->length + 2 > group->symbol_size) return -1;
+        build_symbol(symbol, seg->data, seg->length);
+        for (int r = 0; r < missing_count; r++) {
+            fec_region_mul_xor(syndrome[r], symbol, fec_coefficient(rows[r], i), seg->length + 2);
+        }
+    }
+
+    uint8_t matrix[FEC_MAX_M][FEC_MAX_M], inverse[FEC_MAX_M][FEC_MAX_M];
+    for (int r = 0; r < missing_count; r++) {
+        for (int c = 0; c < missing_count; c++) {
+            matrix[r][c] = fec_coefficient(rows[r], missing[c]);
+        }
+    }
+    if (invert_matrix(matrix, inverse, missing_count) < 0) return -1;
+
+    int recovered = 0;
+    for (int c = 0; c < missing_count; c++) {
+        memset(symbol, 0, group->symbol_size);
+        for (int r = 0; r < missing_count; r++) {
+            fec_region_mul_xor(symbol, syndrome[r], inverse[c][r], group->symbol_size);
+        }
+        size_t length = ((size_t)symbol[0] << 8) | symbol[1];
+        if (length > PAYLOAD_SIZE || length + 2 > group->symbol_size) continue;
+
+        struct fec_segment *seg = &out[recovered++];
+        seg->is_valid = 1;
+        seg->seq = group->seqs[missing[c]];
+        seg->length = length;
+        memcpy(seg->data, symbol + 2, length);
+        fec_decoder_store(dec, seg->seq, seg->data, seg->length);
+    }
+    dec->recovered += recovered;
+    return recovered;
+}
+
+// Tries every pending group. Groups that are fully delivered (all segments
+// below expected_seq) or reconstructed are retired. Returns the number of
+// rebuilt segments written to out.
+int fec_decoder_recover(struct fec_decoder *dec, uint32_t expected_seq, struct fec_segment *out, int max_out) {
+    int total = 0;
+    for (int g = 0; g < FEC_MAX_GROUPS && total + FEC_MAX_M <= max_out; g++) {
+        struct fec_group *group = &dec->groups[g];
+        if (!group->in_use) continue;
+
+        int delivered = 1;
+        for (int i = 0; i < group->k; i++) {
+            if ((int32_t)(group->seqs[i] - expected_seq) >= 0) {
+                delivered = 0;
+                break;
+            }
+        }
+        if (delivered) {
+            group->in_use = 0;
+            continue;
+        }
+
+        int recovered = recover_group(dec, group, out + total);
+        if (recovered >= 0) {
+            total += recovered;
+            group->in_use = 0;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,89 @@
+#ifndef SHAM_FEC_H
+#define SHAM_FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "headers.h"
+
+#define FEC_MAX_K 16        // Data segments per parity group
+#define FEC_MAX_M 4         // Parity packets per parity group
+#define FEC_DEFAULT_K 4
+#define FEC_CACHE_SIZE 64   // Received segments kept for reconstruction
+#define FEC_MAX_GROUPS 8    // Parity groups awaiting reconstruction
+#define FEC_TARGET_RESIDUAL 0.001 // Acceptable chance a group is unrecoverable
+
+// Every symbol is a 2-byte length followed by the payload, zero padded to the
+// longest segment in the group, so recovered segments know their own size.
+#define FEC_SYMBOL_SIZE (PAYLOAD_SIZE + 2)
+
+// Parity packets are a sham_header with the FEC flag and seq_num set to the
+// first data segment of the group, then this header, k sequence numbers
+// (network order) and symbol_size parity bytes.
+struct sham_fec_header {
+    uint8_t k;              // Data segments covered
+    uint8_t m;              // Parity packets emitted for the group
+    uint8_t index;          // Parity row, 0 is the plain XOR of the group
+    uint8_t reserved;
+    uint16_t symbol_size;   // Network order
+};
+
+#define FEC_MAX_PACKET (sizeof(struct sham_header) + sizeof(struct sham_fec_header) + \
+                        FEC_MAX_K * sizeof(uint32_t) + FEC_SYMBOL_SIZE)
+
+// Receive buffer large enough for both data and parity packets
+union sham_datagram {
+    struct sham_packet packet;
+    unsigned char bytes[FEC_MAX_PACKET];
+};
+
+struct fec_encoder {
+    int k;          // Target group size
+    int m;          // Parity rows for the open group
+    int count;      // Segments added so far
+    uint32_t seqs[FEC_MAX_K];
+    size_t symbol_size;
+    uint8_t parity[FEC_MAX_M][FEC_SYMBOL_SIZE];
+};
+
+struct fec_segment {
+    int is_valid;
+    uint32_t seq;
+    size_t length;
+    char data[PAYLOAD_SIZE];
+};
+
+struct fec_group {
+    int in_use;
+    unsigned long age;
+    int k;
+    uint32_t seqs[FEC_MAX_K];
+    size_t symbol_size;
+    unsigned parity_mask;
+    uint8_t parity[FEC_MAX_M][FEC_SYMBOL_SIZE];
+};
+
+struct fec_decoder {
+    struct fec_segment cache[FEC_CACHE_SIZE];
+    int cache_next;
+    struct fec_group groups[FEC_MAX_GROUPS];
+    unsigned long clock;
+    unsigned long recovered;
+    uint8_t syndrome[FEC_MAX_M][FEC_SYMBOL_SIZE]; // Recovery scratch, per decoder so threads do not share it
+};
+
+// Builds the shared tables once; safe to call from any thread
+void fec_init(void);
+uint8_t fec_coefficient(int parity_index, int data_index);
+void fec_region_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t len);
+int fec_choose_parity(double loss_rate, int k);
+
+void fec_encoder_reset(struct fec_encoder *enc, int k, int m);
+void fec_encoder_add(struct fec_encoder *enc, uint32_t seq, const char *data, size_t len);
+size_t fec_encoder_build(const struct fec_encoder *enc, int index, uint32_t conn_id, unsigned char *datagram);
+
+void fec_decoder_init(struct fec_decoder *dec);
+void fec_decoder_store(struct fec_decoder *dec, uint32_t seq, const char *data, size_t len);
+int fec_decoder_add_parity(struct fec_decoder *dec, const unsigned char *datagram, size_t len);
+int fec_decoder_recover(struct fec_decoder *dec, uint32_t expected_seq, struct fec_segment *out, int max_out);
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "filemap.h"
+
+int file_map_open(struct file_map *map, const char *path) {
+    return file_map_open_fd(map, open(path, O_RDONLY));
+}
+
+int file_map_open_fd(struct file_map *map, int fd) {
+    memset(map, 0, sizeof(*map));
+    map->fd = fd;
+    if (map->fd < 0) return -1;
+    struct stat st;
+    if (fstat(map->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(map->fd);
+        map->fd = -1;
+        return -1;
+    }
+    map->size = st.st_size;
+    return 0;
+}
+
+void file_map_range(struct file_map *map, uint64_t offset, uint64_t length) {
+    map->offset = offset;
+    map->length = length;
+    if (length == 0) return;
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+    map->skew = offset - start;
+    map->map_length = length + map->skew;
+    void *base = mmap(NULL, map->map_length, PROT_READ, MAP_SHARED, map->fd, start);
+    if (base == MAP_FAILED) {
+        perror("mmap failed, serving with pread");
+        map->map_length = 0;
+        posix_fadvise(map->fd, offset, length, POSIX_FADV_SEQUENTIAL);
+        return;
+    }
+    map->base = base;
+    madvise(map->base, map->map_length, MADV_SEQUENTIAL);
+}
+
+ssize_t file_map_read(const struct file_map *map, uint64_t pos, char *out, size_t n) {
+    if (pos >= map->length) return 0;
+    if (n > map->length - pos) n = map->length - pos;
+    if (map->base) {
+        memcpy(out, map->base + map->skew + pos, n);
+        return n;
+    }
+    return pread(map->fd, out, n, map->offset + pos);
+}
+
+void file_map_close(struct file_map *map) {
+    if (map->base) munmap(map->base, map->map_length);
+    if (map->fd >= 0) close(map->fd);
+    map->base = NULL;
+    map->fd = -1;
+}
@@ -0,0 +1,38 @@
+#ifndef SHAM_FILEMAP_H
+#define SHAM_FILEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Read-only view of part of a file, for serving downloads. The range is
+// mapped MAP_SHARED, so every download of a hot file, in this process or
+// any worker, copies out of the same page-cache pages rather than reading
+// the file again. Files that cannot be mapped fall back to pread().
+struct file_map {
+    int fd;
+    uint64_t size;          // Of the whole file
+    uint64_t offset;        // File position of the first byte of the view
+    uint64_t length;
+    char *base;             // Page-aligned mapping, or NULL when using pread
+    size_t map_length;
+    size_t skew;            // From base to the first byte of the view
+};
+
+// Opens path read-only and fills size. Returns 0, or -1 with errno set.
+int file_map_open(struct file_map *map, const char *path);
+// The same for a descriptor the caller opened read-only; the map owns it,
+// and closes it on failure too. A negative fd just fails.
+int file_map_open_fd(struct file_map *map, int fd);
+
+// Maps [offset, offset + length), which must lie within the file, and asks
+// for sequential readahead. As with any mapping, truncating the file while
+// it is served faults the server.
+void file_map_range(struct file_map *map, uint64_t offset, uint64_t length);
+
+// Copies up to n bytes from position pos of the view. Returns the count,
+// 0 past the end, or -1 on a read error.
+ssize_t file_map_read(const struct file_map *map, uint64_t pos, char *out, size_t n);
+
+void file_map_close(struct file_map *map);
+
+#endif
@@ -20,9 +20,24 @@ struct sham_header {
     uint32_t ack_num;     // Acknowledgment Number
     uint16_t flags;       // Control flags (SYN, ACK, FIN)
     uint16_t window_size; // Flow control window size
+    uint32_t conn_id;     // Connection ID, proposed in the SYN and fixed by the SYN-ACK
 };
 
+#ifndef PAYLOAD_SIZE
 #define PAYLOAD_SIZE 1024
+#endif
+
+#ifndef WINDOW_SIZE
+#define WINDOW_SIZE 4 // Max number of unacknowledged packets in flight
+#endif
+
+#ifndef RECEIVER_BUFFER_SIZE
+#define RECEIVER_BUFFER_SIZE 8192 // Reassembly space a receiver starts out advertising
+#endif
+
+#ifndef RECEIVER_BUFFER_MAX
+#define RECEIVER_BUFFER_MAX 65535 // Autotuning cap; the header's window field holds no more
+#endif
 
 // S.H.A.M. Packet Structure
 struct sham_packet {
@@ -34,5 +49,118 @@ struct sham_packet {
 #define SYN 0x1
 #define ACK 0x2
 #define FIN 0x4
+#define COMP 0x8 // SYN/SYN-ACK: file data is sent as compressed blocks
+#define FEC 0x10 // SYN/SYN-ACK: parity packets follow; otherwise marks a parity packet
+#define EARLY 0x20 // SYN carries the first data segment; SYN-ACK: it was accepted
+#define STREAMS 0x40 // SYN/SYN-ACK: every data segment starts with a stream frame header
+#define MSGS 0x80 // SYN/SYN-ACK: chat, every data segment is a run of messages, each behind a 16-bit length
+#define EXTSEQ 0x100 // SYN/SYN-ACK: random ISNs, data follows on from them, and offsets may pass 4 GB
+#define BATCH 0x200 // SYN/SYN-ACK: the data is a run of files, each behind a sham_file_header
+#define PIPE 0x400 // SYN/SYN-ACK: the data has no known length and ends with a sham_pipe_end
+#define GET 0x800 // SYN/SYN-ACK: the client sends a sham_get_request and the server sends the file
+#define MCAST 0x1000 // Part of a one-to-many session (fanout.h); never offered in a SYN
+
+// With STREAMS, one connection carries several independent byte streams. The
+// connection sequence space, ACKs, window and RTO are shared, but each stream
+// has its own offsets and is delivered in order on its own, so a loss in one
+// stream never holds back another.
+struct sham_stream_header {
+    uint16_t stream_id;   // Network order
+    uint16_t flags;       // Network order
+    uint32_t offset;      // Low 32 bits of the frame's byte offset within the stream, network order
+};
+
+#define STREAM_FIN 0x1 // Last frame of the stream
+
+#ifndef MAX_STREAMS
+#define MAX_STREAMS 16
+#endif
+#define STREAM_DATA_SIZE (PAYLOAD_SIZE - sizeof(struct sham_stream_header))
+
+// With BATCH, the connection byte stream is a run of files back to back: a
+// sham_file_header, the name, size bytes of data and the MD5 of that data.
+// Records ignore segment boundaries, so one segment can end a file and start
+// the next, and a sender reads each file once.
+struct sham_file_header {
+    uint16_t name_length; // Network order, bytes of relative path that follow
+    uint16_t flags;       // Network order, none defined yet
+    uint32_t mode;        // Permission bits, network order
+    uint32_t size_high;   // Data length, network order
+    uint32_t size_low;
+};
+
+#define BATCH_NAME_MAX 1024
+
+// With PIPE, the sender appends this once its input ends, so a complete
+// stream can be told from one cut short by an error. The receiver holds back
+// the last sizeof(struct sham_pipe_end) bytes until the FIN.
+struct sham_pipe_end {
+    char magic[8];          // PIPE_END_MAGIC, no terminator
+    uint32_t length_high;   // Data bytes before the marker, network order
+    uint32_t length_low;
+};
+
+#define PIPE_END_MAGIC "SHAM-END"
+
+// With GET, data flows from server to client. The client's only data is
+// this request and the path; the server answers with a sham_get_response
+// followed by the bytes it announced, then closes.
+struct sham_get_request {
+    uint16_t path_length;   // Network order, bytes of relative path that follow
+    uint16_t flags;         // Network order, none defined yet
+    uint32_t offset_high;   // First byte wanted, network order
+    uint32_t offset_low;
+    uint32_t length_high;   // Bytes wanted, 0 for the rest of the file
+    uint32_t length_low;
+};
+
+struct sham_get_response {
+    uint16_t status;        // GET_OK or an error, network order
+    uint16_t flags;
+    uint32_t size_high;     // Whole file, network order
+    uint32_t size_low;
+    uint32_t length_high;   // Bytes that follow: the range, cut at the end of the file
+    uint32_t length_low;
+};
+
+#define GET_PATH_MAX (PAYLOAD_SIZE - sizeof(struct sham_get_request)) // The request fits one segment
+
+#define GET_OK 0
+#define GET_NOT_FOUND 1
+#define GET_BAD_REQUEST 2
+#define GET_BAD_RANGE 3   // Offset past the end of the file
+
+// With MCAST, one sender transmits a file once to a multicast group, or to a
+// set of unicast receivers in one sendmmsg() batch. Its SYN announces the
+// file. Each receiver answers with a SYN-ACK to join, then reports its
+// cumulative ACK, window and gaps in periodic ACKs holding a
+// sham_fanout_status and up to FANOUT_MAX_NAKS ranges. Receivers put their
+// own random ID in seq_num; the sender puts its clock (us) in ack_num, and
+// receivers echo it for RTT samples. window_size counts segments.
+struct sham_fanout_announce {
+    uint32_t size_high;     // File length, network order
+    uint32_t size_low;
+    unsigned char md5[16];  // Of the whole file
+};
+
+struct sham_fanout_status {
+    uint32_t echo;          // ack_num of the newest packet heard from the sender, network order
+    uint32_t echo_delay;    // Microseconds between hearing it and sending this, network order
+    uint32_t high_seq;      // One past the furthest segment received, network order
+    uint16_t nak_count;     // Network order
+    uint16_t flags;         // Network order, none defined yet
+};
+
+struct sham_fanout_nak {
+    uint32_t seq;           // First missing segment, network order
+    uint32_t count;         // Missing segments from there on, network order
+};
+
+#define FANOUT_MAX_NAKS ((PAYLOAD_SIZE - sizeof(struct sham_fanout_status)) / sizeof(struct sham_fanout_nak))
+
+// Handshake packets are retransmitted with exponential backoff
+#define HANDSHAKE_INITIAL_TIMEOUT_MS 250
+#define HANDSHAKE_MAX_TIMEOUT_MS 2000
+#define HANDSHAKE_MAX_ATTEMPTS 6
 
 #endif
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "impair.h"
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+void rng_seed(uint64_t state[4], uint64_t seed, int stream) {
+    uint64_t s = seed * 2 + stream;
+    for (int i = 0; i < 4; i++) state[i] = splitmix64(&s);
+}
+
+double rng_uniform(uint64_t s[4]) {
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return (result >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double sample_jitter(struct impair_state *st) {
+    double j = st->cfg.jitter_ms;
+    if (j <= 0) return 0.0;
+    switch (st->cfg.dist) {
+    case JITTER_NORMAL: {
+        double u1 = rng_uniform(st->rng), u2 = rng_uniform(st->rng);
+        if (u1 < 1e-12) u1 = 1e-12;
+        return j * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+    }
+    case JITTER_PARETO: {
+        // Pareto with shape 2.5 scaled so the mean excess is j: rare long stalls
+        double u = rng_uniform(st->rng);
+        if (u < 1e-12) u = 1e-12;
+        return j * (2.5 - 1) * (pow(u, -1.0 / 2.5) - 1.0);
+    }
+    default:
+        return j * (2 * rng_uniform(st->rng) - 1);
+    }
+}
+
+void impair_defaults(struct impairment *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->ge_r = 1.0;
+    cfg->burst_bytes = IMPAIR_DEFAULT_BURST;
+}
+
+int impair_parse_option(struct impairment *cfg, const char *name, const char *value) {
+    if (strcmp(name, "delay") == 0) {
+        cfg->delay_ms = atof(value);
+    } else if (strcmp(name, "jitter") == 0) {
+        cfg->jitter_ms = atof(value);
+    } else if (strcmp(name, "dist") == 0) {
+        if (strcmp(value, "uniform") == 0) cfg->dist = JITTER_UNIFORM;
+        else if (strcmp(value, "normal") == 0) cfg->dist = JITTER_NORMAL;
+        else if (strcmp(value, "pareto") == 0) cfg->dist = JITTER_PARETO;
+        else return -1;
+    } else if (strcmp(name, "rate") == 0) {
+        cfg->rate_kbps = atof(value);
+    } else if (strcmp(name, "burst") == 0) {
+        cfg->burst_bytes = atof(value);
+    } else if (strcmp(name, "queue") == 0) {
+        cfg->queue_limit = atoi(value);
+    } else if (strcmp(name, "reorder") == 0) {
+        cfg->reorder = atof(value);
+    } else if (strcmp(name, "duplicate") == 0) {
+        cfg->duplicate = atof(value);
+    } else if (strcmp(name, "loss") == 0) {
+        cfg->ge_p = 0.0;
+        cfg->ge_r = 1.0;
+        cfg->loss_good = atof(value);
+        cfg->loss_bad = 0.0;
+    } else if (strcmp(name, "ge") == 0) {
+        if (sscanf(value, "%lf:%lf:%lf:%lf", &cfg->ge_p, &cfg->ge_r, &cfg->loss_good, &cfg->loss_bad) != 4) return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void impair_start(struct impair_state *st, const struct impairment *cfg, uint64_t seed, int stream, double now) {
+    memset(st, 0, sizeof(*st));
+    st->cfg = *cfg;
+    rng_seed(st->rng, seed, stream);
+    st->tokens = cfg->burst_bytes;
+    st->tokens_at = now;
+}
+
+int impair_packet(struct impair_state *st, double now, size_t length, double release[2]) {
+    struct impairment *cfg = &st->cfg;
+    st->received++;
+
+    // Gilbert-Elliott loss: move between states, then drop by the state's rate
+    if (st->ge_bad) {
+        if (rng_uniform(st->rng) < cfg->ge_r) st->ge_bad = 0;
+    } else {
+        if (rng_uniform(st->rng) < cfg->ge_p) st->ge_bad = 1;
+    }
+    if (rng_uniform(st->rng) < (st->ge_bad ? cfg->loss_bad : cfg->loss_good)) {
+        st->lost++;
+        return 0;
+    }
+
+    // Token-bucket bottleneck served in FIFO order, tail drop past the queue limit
+    double depart = now;
+    if (cfg->rate_kbps > 0) {
+        double bytes_per_ms = cfg->rate_kbps * 1000.0 / 8.0 / 1000.0;
+        double queued_bytes = (st->link_free_at - now) * bytes_per_ms;
+        if (queued_bytes > 0 && cfg->queue_limit > 0 && queued_bytes / length >= cfg->queue_limit) {
+            st->queue_drops++;
+            return 0;
+        }
+        depart = st->link_free_at > now ? st->link_free_at : now;
+        st->tokens += (depart - st->tokens_at) * bytes_per_ms;
+        if (st->tokens > cfg->burst_bytes) st->tokens = cfg->burst_bytes;
+        st->tokens_at = depart;
+        if (st->tokens < (double)length) {
+            double wait = (length - st->tokens) / bytes_per_ms;
+            depart += wait;
+            st->tokens = 0;
+            st->tokens_at = depart;
+        } else {
+            st->tokens -= length;
+        }
+        st->link_free_at = depart;
+    }
+
+    // Delay line: jitter never reorders on its own, only the reorder knob does
+    double when = depart + cfg->delay_ms + sample_jitter(st);
+    if (when < depart) when = depart;
+    if (cfg->reorder > 0 && rng_uniform(st->rng) < cfg->reorder) {
+        when = depart;
+        st->reordered++;
+    } else {
+        if (when < st->last_release) when = st->last_release;
+        st->last_release = when;
+    }
+
+    st->forwarded++;
+    release[0] = when;
+    if (cfg->duplicate > 0 && rng_uniform(st->rng) < cfg->duplicate) {
+        release[1] = when;
+        st->duplicated++;
+        return 2;
+    }
+    return 1;
+}
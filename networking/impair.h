@@ -0,0 +1,55 @@
+#ifndef SHAM_IMPAIR_H
+#define SHAM_IMPAIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Link impairment model shared by the proxy (wall clock) and the simulator
+// (virtual clock). Times are milliseconds on whichever clock the caller uses.
+
+#define IMPAIR_DEFAULT_BURST 2048
+
+enum jitter_dist { JITTER_UNIFORM, JITTER_NORMAL, JITTER_PARETO };
+
+struct impairment {
+    double delay_ms;        // One-way base delay
+    double jitter_ms;       // Spread of the jitter distribution
+    enum jitter_dist dist;
+    double rate_kbps;       // Bottleneck rate, 0 = unlimited
+    double burst_bytes;     // Token bucket depth
+    int queue_limit;        // Packets waiting at the bottleneck before tail drop
+    double reorder;         // Probability a packet skips the delay line
+    double duplicate;       // Probability a packet is sent twice
+    // Gilbert-Elliott: p = good->bad, r = bad->good, per-state loss rates
+    double ge_p;
+    double ge_r;
+    double loss_good;
+    double loss_bad;
+};
+
+// One direction of a link
+struct impair_state {
+    struct impairment cfg;
+    uint64_t rng[4];
+    int ge_bad;
+    double tokens;
+    double tokens_at;
+    double link_free_at;
+    double last_release;
+    unsigned long received, forwarded, lost, queue_drops, reordered, duplicated;
+};
+
+// xoshiro256** seeded through splitmix64; stream separates generators that
+// share a seed (e.g. the two directions of a link)
+void rng_seed(uint64_t state[4], uint64_t seed, int stream);
+double rng_uniform(uint64_t state[4]);
+
+void impair_defaults(struct impairment *cfg);
+int impair_parse_option(struct impairment *cfg, const char *name, const char *value);
+void impair_start(struct impair_state *st, const struct impairment *cfg, uint64_t seed, int stream, double now);
+
+// Runs one packet arriving at now through the model. Returns how many
+// copies to deliver (0, 1 or 2) and stores their release times.
+int impair_packet(struct impair_state *st, double now, size_t length, double release[2]);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "metrics.h"
+#include "net.h"
+
+static struct metrics_segment *segment = NULL;
+static int segment_shared = 0;
+static pid_t segment_owner = 0;
+static char segment_name[64];
+static struct metrics_block scratch_global;
+static struct metrics_block scratch_conn;
+static struct metrics_connection *current_connection = NULL;
+
+const char *metric_counter_names[METRIC_COUNTERS] = {
+    "segments_sent", "retransmissions", "timeouts", "bytes_sent", "bytes_acked", "acks_sent",
+    "acks_received", "segments_received", "bytes_received", "bytes_delivered", "out_of_order",
+    "duplicates", "buffer_drops", "fec_recovered", "simulated_drops", "connections",
+};
+const char *metric_gauge_names[METRIC_GAUGES] = {
+    "in_flight_bytes", "window_segments", "peer_window", "rto_us", "srtt_us", "buffer_used",
+};
+const char *metric_histogram_names[METRIC_HISTOGRAMS] = { "rtt", "ack_delay", "write_latency" };
+
+// Both point at scratch blocks until metrics_init(), so updates never branch
+struct metrics_block *metrics_global = &scratch_global;
+struct metrics_block *metrics_conn = &scratch_conn;
+
+uint64_t metrics_now_us(void) {
+    struct timeval tv;
+    net_gettimeofday(&tv);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void metrics_init(const char *role) {
+    const char *env = getenv("SHAM_METRICS");
+    if (env) {
+        if (env[0] == '/') snprintf(segment_name, sizeof(segment_name), "%s", env);
+        else snprintf(segment_name, sizeof(segment_name), "/sham-%s-%d", role, (int)getpid());
+        int fd = shm_open(segment_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(struct metrics_segment)) < 0) {
+            perror("Failed to create metrics segment");
+            if (fd >= 0) close(fd);
+        } else {
+            segment = mmap(NULL, sizeof(struct metrics_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (segment == MAP_FAILED) {
+                perror("Failed to map metrics segment");
+                shm_unlink(segment_name);
+                segment = NULL;
+            } else {
+                segment_shared = 1;
+                printf("Metrics: exporting to shared memory %s\n", segment_name);
+            }
+        }
+    }
+    if (!segment) {
+        segment = mmap(NULL, sizeof(struct metrics_segment), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (segment == MAP_FAILED) {
+            segment = NULL;
+            return;
+        }
+    }
+
+    segment_owner = getpid();
+    segment->version = METRICS_VERSION;
+    segment->pid = (uint32_t)segment_owner;
+    snprintf(segment->role, sizeof(segment->role), "%s", role);
+    segment->started_us = metrics_now_us();
+    metrics_global = &segment->global;
+    metrics_conn = &scratch_conn;
+    // Written last so a reader never sees a half-initialised header
+    atomic_thread_fence(memory_order_release);
+    segment->magic = METRICS_MAGIC;
+}
+
+struct metrics_block *metrics_claim_connection(uint32_t conn_id) {
+    if (!segment) return NULL;
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        struct metrics_connection *slot = &segment->connections[i];
+        uint32_t expected = METRICS_SLOT_FREE;
+        if (atomic_compare_exchange_strong(&slot->state, &expected, METRICS_SLOT_OPEN)) {
+            atomic_store_explicit(&slot->conn_id, conn_id, memory_order_relaxed);
+            atomic_store_explicit(&slot->opened_us, metrics_now_us(), memory_order_relaxed);
+            metrics_count_in(&slot->block, M_CONNECTIONS, 1);
+            return &slot->block;
+        }
+    }
+    return NULL;
+}
+
+void metrics_release_connection(struct metrics_block *block) {
+    if (!block || block == &scratch_conn) return;
+    struct metrics_connection *slot = (struct metrics_connection *)((char *)block - offsetof(struct metrics_connection, block));
+    atomic_store_explicit(&slot->closed_us, metrics_now_us(), memory_order_relaxed);
+    atomic_store_explicit(&slot->state, METRICS_SLOT_CLOSED, memory_order_release);
+}
+
+struct metrics_block *metrics_open_connection(uint32_t conn_id) {
+    struct metrics_block *block = metrics_claim_connection(conn_id);
+    if (block) {
+        current_connection = (struct metrics_connection *)((char *)block - offsetof(struct metrics_connection, block));
+        metrics_conn = block;
+    }
+    return metrics_conn;
+}
+
+void metrics_close_connection(void) {
+    if (!current_connection) return;
+    metrics_release_connection(&current_connection->block);
+    current_connection = NULL;
+    metrics_conn = &scratch_conn;
+}
+
+void metrics_shutdown(void) {
+    if (!segment) return;
+    metrics_close_connection();
+    metrics_global = &scratch_global;
+    munmap(segment, sizeof(struct metrics_segment));
+    segment = NULL;
+    // Forked workers share the mapping but leave the name to the creator
+    if (segment_shared && getpid() == segment_owner) shm_unlink(segment_name);
+}
+
+int hist_bucket(uint64_t value) {
+    if (value < (2u << HIST_SUB_BITS)) return (int)value;
+    if (value >= (1ULL << HIST_MAX_BITS)) value = (1ULL << HIST_MAX_BITS) - 1;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+uint64_t hist_bucket_low(int bucket) {
+    if (bucket < (2 << HIST_SUB_BITS)) return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    return ((1ULL << HIST_SUB_BITS) + sub) << shift;
+}
+
+static void record_into(struct metrics_histogram *h, uint64_t value_us) {
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket(value_us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value_us, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value_us > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value_us, memory_order_relaxed, memory_order_relaxed));
+}
+
+void metrics_record_in(struct metrics_block *conn, enum metric_histogram h, uint64_t value_us) {
+    record_into(&metrics_global->histograms[h], value_us);
+    record_into(&conn->histograms[h], value_us);
+}
+
+// Lower edge of the bucket holding the p-th fraction of samples
+uint64_t hist_percentile(const struct metrics_histogram *h, double p) {
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t)(p * (count - 1)) + 1, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        if (seen >= rank) return hist_bucket_low(b);
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
@@ -0,0 +1,147 @@
+#ifndef SHAM_METRICS_H
+#define SHAM_METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Counters, gauges and latency histograms kept in one memory segment. With
+// SHAM_METRICS set the segment is a POSIX shared-memory object named
+// /sham-<role>-<pid> (or the value of SHAM_METRICS if it starts with '/')
+// that sham-stat maps read-only; otherwise it is private memory. Updates are
+// relaxed atomic adds and stores, so readers never block the data path, and
+// server workers forked after metrics_init() add into the same global block.
+
+#define METRICS_MAGIC 0x53484d4d45545231ULL
+#define METRICS_VERSION 1
+#define METRICS_MAX_CONNECTIONS 64
+
+// Histograms are log-linear like HdrHistogram: values below 16 get their own
+// bucket, above that each power of two is split into 8 sub-buckets (at most
+// 12.5% relative error). Values are microseconds, capped at 2^36.
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+enum metric_counter {
+    M_SEGMENTS_SENT,        // Data segments handed to the socket, first transmissions
+    M_RETRANSMISSIONS,
+    M_TIMEOUTS,             // RTO and handshake timer expiries
+    M_BYTES_SENT,           // Payload bytes on the wire, retransmissions included
+    M_BYTES_ACKED,          // Payload bytes the peer acknowledged (sender goodput)
+    M_ACKS_SENT,
+    M_ACKS_RECEIVED,
+    M_SEGMENTS_RECEIVED,
+    M_BYTES_RECEIVED,
+    M_BYTES_DELIVERED,      // Bytes written in order to the output (receiver goodput)
+    M_OUT_OF_ORDER,
+    M_DUPLICATES,
+    M_BUFFER_DROPS,         // Out-of-order segments dropped for lack of buffer space
+    M_FEC_RECOVERED,
+    M_SIMULATED_DROPS,
+    M_CONNECTIONS,
+    METRIC_COUNTERS
+};
+
+enum metric_gauge {
+    G_IN_FLIGHT_BYTES,
+    G_WINDOW_SEGMENTS,      // Sender window occupancy
+    G_PEER_WINDOW,          // Last advertised receiver window
+    G_RTO_US,
+    G_SRTT_US,
+    G_BUFFER_USED,          // Receiver reorder buffer occupancy in bytes
+    METRIC_GAUGES
+};
+
+enum metric_histogram {
+    H_RTT,
+    H_ACK_DELAY,            // Segment arrival to the ACK that answers it
+    H_WRITE_LATENCY,        // One write into the output, decompression included
+    METRIC_HISTOGRAMS
+};
+
+struct metrics_histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+};
+
+struct metrics_block {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    _Atomic int64_t gauges[METRIC_GAUGES];
+    struct metrics_histogram histograms[METRIC_HISTOGRAMS];
+};
+
+#define METRICS_SLOT_FREE 0
+#define METRICS_SLOT_OPEN 1
+#define METRICS_SLOT_CLOSED 2
+
+struct metrics_connection {
+    _Atomic uint32_t state;
+    _Atomic uint32_t conn_id;
+    _Atomic uint64_t opened_us;
+    _Atomic uint64_t closed_us;
+    struct metrics_block block;
+};
+
+struct metrics_segment {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    char role[16];
+    uint64_t started_us;
+    struct metrics_block global;
+    struct metrics_connection connections[METRICS_MAX_CONNECTIONS];
+};
+
+extern const char *metric_counter_names[METRIC_COUNTERS];
+extern const char *metric_gauge_names[METRIC_GAUGES];
+extern const char *metric_histogram_names[METRIC_HISTOGRAMS];
+
+extern struct metrics_block *metrics_global;
+extern struct metrics_block *metrics_conn; // Current connection, or a scratch block
+
+// Creates the segment for this process; falls back to private memory
+void metrics_init(const char *role);
+// Claims a per-connection slot and returns its block, or NULL if all are in
+// use. Updates through metrics_count_in() and friends go to it and to the
+// global block, so any number of connections can each keep their own.
+struct metrics_block *metrics_claim_connection(uint32_t conn_id);
+void metrics_release_connection(struct metrics_block *block);
+// One connection per process: claims a slot and makes it metrics_conn, the
+// block metrics_count() updates. Returns metrics_conn.
+struct metrics_block *metrics_open_connection(uint32_t conn_id);
+void metrics_close_connection(void);
+// Unmaps, and unlinks if this process created the segment
+void metrics_shutdown(void);
+
+uint64_t metrics_now_us(void);
+void metrics_record_in(struct metrics_block *conn, enum metric_histogram h, uint64_t value_us);
+
+int hist_bucket(uint64_t value);
+uint64_t hist_bucket_low(int bucket);
+uint64_t hist_percentile(const struct metrics_histogram *h, double p);
+
+static inline void metrics_count_in(struct metrics_block *conn, enum metric_counter c, uint64_t n) {
+    atomic_fetch_add_explicit(&metrics_global->counters[c], n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&conn->counters[c], n, memory_order_relaxed);
+}
+
+static inline void metrics_gauge_in(struct metrics_block *conn, enum metric_gauge g, int64_t value) {
+    atomic_store_explicit(&metrics_global->gauges[g], value, memory_order_relaxed);
+    atomic_store_explicit(&conn->gauges[g], value, memory_order_relaxed);
+}
+
+static inline void metrics_count(enum metric_counter c, uint64_t n) {
+    metrics_count_in(metrics_conn, c, n);
+}
+
+static inline void metrics_gauge(enum metric_gauge g, int64_t value) {
+    metrics_gauge_in(metrics_conn, g, value);
+}
+
+static inline void metrics_record(enum metric_histogram h, uint64_t value_us) {
+    metrics_record_in(metrics_conn, h, value_us);
+}
+
+#endif
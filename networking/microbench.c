@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include "common.h"
+#include "rtt.h"
+#include "reorder.h"
+#include "digest.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+// Microbenchmarks for the per-packet building blocks. Each benchmark is
+// calibrated to run for at least --min-time per repetition, warmed up, then
+// repeated; the median ns/op is compared against a stored baseline.
+
+#define MAX_REPS 101
+#define MAX_BASELINE 32
+#define HEADER_BATCH 256
+#define SAMPLE_COUNT 1024
+#define DIGEST_FILE_SIZE (1 << 20)
+
+struct benchmark {
+    const char *name;
+    size_t bytes_per_op;              // Non-zero when throughput is meaningful
+    int (*setup)(void);
+    void (*teardown)(void);
+    uint64_t (*run)(uint64_t ops);    // Returns the operations actually done
+};
+
+struct baseline_entry {
+    char name[64];
+    double ns_per_op;
+};
+
+static volatile uint64_t sink; // Results land here so loops are not optimised away
+
+static struct sham_header headers[HEADER_BATCH];
+static struct reorder_buffer reorder;
+static struct sham_packet segment;
+static double samples[SAMPLE_COUNT];
+static char digest_path[64];
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles_now(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t run_header_encode(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        sham_header_encode(&headers[i % HEADER_BATCH], (uint32_t)i * PAYLOAD_SIZE + 1, (uint32_t)i, ACK, 8192, 0x5eed1234);
+    }
+    sink += headers[ops % HEADER_BATCH].seq_num;
+    return ops;
+}
+
+static uint64_t run_header_decode(uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < ops; i++) {
+        struct sham_header host;
+        sham_header_decode(&headers[i % HEADER_BATCH], &host);
+        sum += host.seq_num ^ host.ack_num ^ host.window_size;
+    }
+    sink += sum;
+    return ops;
+}
+
+static int setup_reorder(void) {
+    reorder_init(&reorder);
+    memset(&segment, 0xab, sizeof(segment));
+    return 0;
+}
+
+// One op is one segment going through the buffer: a full buffer of segments
+// arrives in reverse order behind a gap, then the gap fills and all drain.
+static uint64_t run_reorder(uint64_t ops) {
+    static int base = 1;
+    uint64_t done = 0;
+    while (done < ops) {
+        for (int k = MAX_BUFFER_PACKETS; k >= 1; k--) {
+            int seq = base + k * PAYLOAD_SIZE;
+            if (!reorder_contains(&reorder, seq)) {
+                reorder_insert(&reorder, seq, &segment, PAYLOAD_SIZE);
+            }
+        }
+        int expected = base + PAYLOAD_SIZE;
+        struct buffered_packet *next;
+        while ((next = reorder_next(&reorder, expected)) != NULL) {
+            expected += next->data_length;
+            reorder_release(next);
+        }
+        base = expected;
+        done += MAX_BUFFER_PACKETS;
+    }
+    sink += base;
+    return done;
+}
+
+// One op is one buffer taken from and returned to the calling thread's free
+// list, a window's worth at a time
+static uint64_t run_pool(uint64_t ops) {
+    uint32_t held[WINDOW_SIZE];
+    uint64_t done = 0;
+    while (done < ops) {
+        for (int i = 0; i < WINDOW_SIZE; i++) held[i] = pool_alloc();
+        for (int i = 0; i < WINDOW_SIZE; i++) pool_free(held[i]);
+        done += WINDOW_SIZE;
+    }
+    sink += held[0];
+    return done;
+}
+
+static int setup_rtt(void) {
+    srand(1);
+    for (int i = 0; i < SAMPLE_COUNT; i++) {
+        samples[i] = 5.0 + (rand() % 4500) / 100.0;
+    }
+    return 0;
+}
+
+static uint64_t run_rtt_update(uint64_t ops) {
+    double estimated_rtt = 500.0, dev_rtt = 0.0, rto = 0.0;
+    for (uint64_t i = 0; i < ops; i++) {
+        rto += rtt_update(&estimated_rtt, &dev_rtt, samples[i % SAMPLE_COUNT]);
+    }
+    sink += (uint64_t)rto;
+    return ops;
+}
+
+static int setup_drop(void) {
+    srand(1);
+    packet_loss_rate = 0.1;
+    return 0;
+}
+
+static void teardown_drop(void) {
+    packet_loss_rate = 0.0;
+}
+
+static uint64_t run_should_drop(uint64_t ops) {
+    uint64_t dropped = 0;
+    for (uint64_t i = 0; i < ops; i++) {
+        dropped += should_drop_packet();
+    }
+    sink += dropped;
+    return ops;
+}
+
+static int setup_log(void) {
+    log_file = fopen("/dev/null", "w");
+    if (!log_file) {
+        perror("Failed to open /dev/null");
+        return -1;
+    }
+    return 0;
+}
+
+static void teardown_log(void) {
+    fclose(log_file);
+    log_file = NULL;
+}
+
+static uint64_t run_log_message(uint64_t ops) {
+    for (uint64_t i = 0; i < ops; i++) {
+        log_message("SND DATA SEQ=%u LEN=%zu\n", (unsigned)i, (size_t)PAYLOAD_SIZE);
+    }
+    return ops;
+}
+
+static int setup_digest(void) {
+    strcpy(digest_path, "/tmp/sham_microbench_XXXXXX");
+    int fd = mkstemp(digest_path);
+    if (fd < 0) {
+        perror("Failed to create digest input");
+        return -1;
+    }
+    char *data = malloc(DIGEST_FILE_SIZE);
+    if (!data) {
+        close(fd);
+        unlink(digest_path);
+        return -1;
+    }
+    srand(1);
+    for (int i = 0; i < DIGEST_FILE_SIZE; i++) data[i] = (char)rand();
+    ssize_t written = write(fd, data, DIGEST_FILE_SIZE);
+    free(data);
+    close(fd);
+    if (written != DIGEST_FILE_SIZE) {
+        perror("Failed to write digest input");
+        unlink(digest_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void teardown_digest(void) {
+    unlink(digest_path);
+}
+
+static uint64_t run_md5(uint64_t ops) {
+    char hex[MD5_HEX_LENGTH];
+    for (uint64_t i = 0; i < ops; i++) {
+        if (md5_file_hex(digest_path, hex) == 0) sink += hex[0];
+    }
+    return ops;
+}
+
+static const struct benchmark benchmarks[] = {
+    {"header_encode", 0, NULL, NULL, run_header_encode},
+    {"header_decode", 0, NULL, NULL, run_header_decode},
+    {"reorder_insert_drain", PAYLOAD_SIZE, setup_reorder, NULL, run_reorder},
+    {"pool_alloc_free", 0, NULL, NULL, run_pool},
+    {"rtt_update", 0, setup_rtt, NULL, run_rtt_update},
+    {"should_drop_packet", 0, setup_drop, teardown_drop, run_should_drop},
+    {"log_message", 0, setup_log, teardown_log, run_log_message},
+    {"calculate_md5_hash", DIGEST_FILE_SIZE, setup_digest, teardown_digest, run_md5},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int load_baseline(const char *path, struct baseline_entry *entries) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    int count = 0;
+    char line[128];
+    while (count < MAX_BASELINE && fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", entries[count].name, &entries[count].ns_per_op) == 2) count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static double baseline_for(const struct baseline_entry *entries, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) return entries[i].ns_per_op;
+    }
+    return 0.0;
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s [options]\n", program_name);
+    printf("  --reps=N               Measured repetitions per benchmark (default 11)\n");
+    printf("  --warmup=N             Discarded repetitions before measuring (default 3)\n");
+    printf("  --min-time=MS          Minimum duration of one repetition (default 20)\n");
+    printf("  --filter=TEXT          Only run benchmarks whose name contains TEXT\n");
+    printf("  --baseline=FILE        Compare medians against FILE, fail on slowdowns\n");
+    printf("  --threshold=FRACTION   Allowed slowdown before failing (default 0.25)\n");
+    printf("  --save-baseline=FILE   Write the measured medians to FILE\n");
+}
+
+int main(int argc, char *argv[]) {
+    int reps = 11;
+    int warmup = 3;
+    double min_time_ms = 20.0;
+    double threshold = 0.25;
+    const char *filter = NULL;
+    const char *baseline_path = NULL;
+    const char *save_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--reps=", 7) == 0) {
+            reps = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+            min_time_ms = atof(argv[i] + 11);
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--save-baseline=", 16) == 0) {
+            save_path = argv[i] + 16;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (reps < 1 || reps > MAX_REPS) {
+        printf("Error: --reps must be between 1 and %d\n", MAX_REPS);
+        return 1;
+    }
+
+    struct baseline_entry baseline[MAX_BASELINE];
+    int baseline_count = 0;
+    if (baseline_path) {
+        baseline_count = load_baseline(baseline_path, baseline);
+        if (baseline_count < 0) {
+            printf("No baseline at %s, nothing to compare against (record one with --save-baseline)\n", baseline_path);
+            baseline_count = 0;
+        }
+    }
+
+    FILE *save_file = NULL;
+    if (save_path) {
+        save_file = fopen(save_path, "w");
+        if (!save_file) {
+            perror("Failed to open baseline for writing");
+            return 1;
+        }
+        fprintf(save_file, "# benchmark median_ns_per_op\n");
+    }
+
+    printf("%-22s %12s %10s %10s %7s %10s %9s %9s\n", "benchmark", "ops/rep", "ns/op", "min ns/op", "+/-%", "cycles/op", "MB/s", "change");
+#ifndef HAVE_TSC
+    printf("(cycle counter unavailable on this architecture)\n");
+#endif
+
+    int regressions = 0;
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const struct benchmark *bench = &benchmarks[b];
+        if (filter && !strstr(bench->name, filter)) continue;
+        if (bench->setup && bench->setup() < 0) {
+            printf("%-22s setup failed, skipped\n", bench->name);
+            continue;
+        }
+
+        // Grow the batch until one repetition is long enough to time reliably
+        uint64_t ops = 1;
+        while (1) {
+            double start = now_ns();
+            uint64_t done = bench->run(ops);
+            if ((now_ns() - start) / 1e6 >= min_time_ms || ops >= (1ULL << 32)) {
+                ops = done;
+                break;
+            }
+            ops *= 2;
+        }
+        for (int i = 0; i < warmup; i++) bench->run(ops);
+
+        double ns[MAX_REPS], cycles[MAX_REPS];
+        double sum = 0.0, sum_sq = 0.0;
+        for (int i = 0; i < reps; i++) {
+            double start = now_ns();
+            uint64_t start_cycles = cycles_now();
+            uint64_t done = bench->run(ops);
+            uint64_t end_cycles = cycles_now();
+            ns[i] = (now_ns() - start) / done;
+            cycles[i] = (double)(end_cycles - start_cycles) / done;
+            sum += ns[i];
+            sum_sq += ns[i] * ns[i];
+        }
+        if (bench->teardown) bench->teardown();
+
+        double mean = sum / reps;
+        double variance = sum_sq / reps - mean * mean;
+        double spread = mean > 0 && variance > 0 ? 100.0 * sqrt(variance) / mean : 0.0;
+        qsort(ns, reps, sizeof(double), compare_doubles);
+        qsort(cycles, reps, sizeof(double), compare_doubles);
+        double median = ns[reps / 2];
+
+        char throughput[16] = "-";
+        if (bench->bytes_per_op) snprintf(throughput, sizeof(throughput), "%.1f", bench->bytes_per_op / median * 1e3);
+        char cycle_text[16] = "-";
+#ifdef HAVE_TSC
+        snprintf(cycle_text, sizeof(cycle_text), "%.1f", cycles[reps / 2]);
+#endif
+        char change[24] = "-";
+        double reference = baseline_for(baseline, baseline_count, bench->name);
+        int slower = 0;
+        if (reference > 0) {
+            double delta = median / reference - 1.0;
+            slower = delta > threshold;
+            snprintf(change, sizeof(change), "%+.1f%%%s", delta * 100, slower ? " SLOWER" : "");
+        }
+        regressions += slower;
+
+        printf("%-22s %12llu %10.2f %10.2f %7.1f %10s %9s %9s\n", bench->name, (unsigned long long)ops, median, ns[0], spread, cycle_text, throughput, change);
+        fflush(stdout);
+        if (save_file) fprintf(save_file, "%s %.4f\n", bench->name, median);
+    }
+
+    if (save_file) {
+        fclose(save_file);
+        printf("Baseline saved to %s\n", save_path);
+    }
+    if (regressions > 0) {
+        printf("%d benchmark(s) slower than the baseline by more than %.0f%%\n", regressions, threshold * 100);
+        return 1;
+    }
+    return 0;
+}
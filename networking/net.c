@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "net.h"
+
+int net_socket(int domain, int type, int protocol) {
+    return socket(domain, type, protocol);
+}
+
+int net_bind(int sockfd, const struct sockaddr *addr, socklen_t addr_len) {
+    return bind(sockfd, addr, addr_len);
+}
+
+int net_setsockopt(int sockfd, int level, int name, const void *value, socklen_t value_len) {
+    return setsockopt(sockfd, level, name, value, value_len);
+}
+
+int net_getsockopt(int sockfd, int level, int name, void *value, socklen_t *value_len) {
+    return getsockopt(sockfd, level, name, value, value_len);
+}
+
+int net_close(int sockfd) {
+    return close(sockfd);
+}
+
+ssize_t net_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len) {
+    return sendto(sockfd, buf, len, flags, addr, addr_len);
+}
+
+int net_sendmmsg(int sockfd, struct mmsghdr *messages, unsigned int count, int flags) {
+    return sendmmsg(sockfd, messages, count, flags);
+}
+
+ssize_t net_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len) {
+    return recvfrom(sockfd, buf, len, flags, addr, addr_len);
+}
+
+int net_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    return select(nfds, readfds, writefds, exceptfds, timeout);
+}
+
+int net_gettimeofday(struct timeval *tv) {
+    return gettimeofday(tv, NULL);
+}
+
+// 32 random bits from /dev/urandom, with a weaker fallback
+uint32_t net_random32(void) {
+    uint32_t value = 0;
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    if (urandom) {
+        if (fread(&value, sizeof(value), 1, urandom) == 1) {
+            fclose(urandom);
+            return value;
+        }
+        fclose(urandom);
+    }
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand() ^ (uint32_t)getpid();
+}
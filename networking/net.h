@@ -0,0 +1,27 @@
+#ifndef SHAM_NET_H
+#define SHAM_NET_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+// Every socket, clock and randomness call the protocol makes goes through
+// these. net.c forwards them to the system; the simulator links client.c and
+// server.c against its own definitions to run them on a virtual clock.
+
+int net_socket(int domain, int type, int protocol);
+int net_bind(int sockfd, const struct sockaddr *addr, socklen_t addr_len);
+int net_setsockopt(int sockfd, int level, int name, const void *value, socklen_t value_len);
+int net_getsockopt(int sockfd, int level, int name, void *value, socklen_t *value_len);
+int net_close(int sockfd);
+ssize_t net_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len);
+struct mmsghdr;
+int net_sendmmsg(int sockfd, struct mmsghdr *messages, unsigned int count, int flags);
+ssize_t net_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len);
+int net_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+int net_gettimeofday(struct timeval *tv);
+uint32_t net_random32(void);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+#define POOL_BATCH (POOL_THREAD_CACHE / 2) // Buffers moved per trip to the shared list
+
+char *pool_slabs[POOL_MAX_SLABS];
+
+// Shared state, under pool_lock. Freed buffers are chained through their
+// first four bytes; buffers past carved have never been handed out, so their
+// pages are not touched until they are.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int slab_count;
+static uint32_t carved;
+static uint32_t shared_free = POOL_NONE;
+
+struct pool_cache {
+    int count;
+    int registered;
+    uint32_t free[POOL_THREAD_CACHE];
+};
+
+static __thread struct pool_cache cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static uint32_t *next_free(uint32_t index) {
+    return (uint32_t *)pool_packet(index);
+}
+
+static char *map_slab(void) {
+    int huge = getenv("SHAM_HUGEPAGES") != NULL;
+    void *slab = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (huge) slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (slab == MAP_FAILED) {
+        slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            perror("Packet pool mmap failed");
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        if (huge) madvise(slab, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+    return slab;
+}
+
+// Must hold pool_lock
+static void flush_locked(struct pool_cache *pc, int n) {
+    while (n-- > 0 && pc->count > 0) {
+        uint32_t index = pc->free[--pc->count];
+        *next_free(index) = shared_free;
+        shared_free = index;
+    }
+}
+
+// A thread that exits hands its cached buffers back
+static void cache_destroy(void *arg) {
+    struct pool_cache *pc = arg;
+    pthread_mutex_lock(&pool_lock);
+    flush_locked(pc, pc->count);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void cache_key_create(void) {
+    pthread_key_create(&cache_key, cache_destroy);
+}
+
+static void refill(struct pool_cache *pc) {
+    if (!pc->registered) {
+        pthread_once(&cache_key_once, cache_key_create);
+        pthread_setspecific(cache_key, pc);
+        pc->registered = 1;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while (pc->count < POOL_BATCH && shared_free != POOL_NONE) {
+        pc->free[pc->count++] = shared_free;
+        shared_free = *next_free(shared_free);
+    }
+    while (pc->count < POOL_BATCH) {
+        if (carved == (uint32_t)slab_count * POOL_SLAB_BUFFERS) {
+            if (slab_count == POOL_MAX_SLABS) break;
+            char *slab = map_slab();
+            if (!slab) break;
+            pool_slabs[slab_count++] = slab;
+        }
+        pc->free[pc->count++] = carved++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+uint32_t pool_alloc(void) {
+    if (cache.count == 0) {
+        refill(&cache);
+        if (cache.count == 0) return POOL_NONE;
+    }
+    return cache.free[--cache.count];
+}
+
+void pool_free(uint32_t index) {
+    if (index == POOL_NONE) return;
+    if (cache.count == POOL_THREAD_CACHE) {
+        pthread_mutex_lock(&pool_lock);
+        flush_locked(&cache, POOL_BATCH);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    cache.free[cache.count++] = index;
+}
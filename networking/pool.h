@@ -0,0 +1,40 @@
+#ifndef SHAM_POOL_H
+#define SHAM_POOL_H
+
+#include <stdint.h>
+#include "headers.h"
+
+// Fixed-size packet buffers shared by every connection in the process. Send
+// windows and reorder buffers keep a small descriptor per segment and a
+// buffer index, so memory follows the segments actually held rather than
+// WINDOW_SIZE and MAX_BUFFER_PACKETS times the largest packet.
+//
+// Buffers are cut from 2 MB slabs that are mapped on demand and never
+// returned. With SHAM_HUGEPAGES set a slab is backed by one huge page when
+// the system has them reserved (transparent huge pages otherwise). Each
+// buffer starts on a cache line. Every thread keeps a short free list of its
+// own and only takes the pool lock to move a batch to or from the shared one.
+
+#define POOL_CACHE_LINE 64
+#define POOL_BUFFER_SIZE ((sizeof(struct sham_packet) + POOL_CACHE_LINE - 1) & ~(size_t)(POOL_CACHE_LINE - 1))
+#define POOL_SLAB_SIZE (2u << 20)
+#define POOL_SLAB_BUFFERS (POOL_SLAB_SIZE / POOL_BUFFER_SIZE)
+#define POOL_MAX_SLABS 64
+#define POOL_NONE UINT32_MAX
+
+#ifndef POOL_THREAD_CACHE
+#define POOL_THREAD_CACHE 64    // Free buffers a thread keeps for itself
+#endif
+
+extern char *pool_slabs[POOL_MAX_SLABS];
+
+// A buffer index, or POOL_NONE once POOL_MAX_SLABS are in use or mapping
+// fails. The contents are not cleared.
+uint32_t pool_alloc(void);
+void pool_free(uint32_t index);
+
+static inline struct sham_packet *pool_packet(uint32_t index) {
+    return (struct sham_packet *)(pool_slabs[index / POOL_SLAB_BUFFERS] + (index % POOL_SLAB_BUFFERS) * POOL_BUFFER_SIZE);
+}
+
+#endif
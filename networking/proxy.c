@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "impair.h"
+
+// Standalone UDP impairment proxy. Clients talk to the listen port, every
+// client gets its own upstream socket towards the server, and each direction
+// runs packets through loss, a token-bucket bottleneck, delay/jitter,
+// reordering and duplication driven by its own seeded PRNG.
+
+#define MAX_DATAGRAM 2048
+#define MAX_FLOWS 64
+#define MAX_SCHEDULED 8192
+
+#define DIR_UP 0    // client -> server
+#define DIR_DOWN 1  // server -> client
+
+struct direction {
+    const char *name;
+    struct impairment cfg;
+    struct impair_state state;
+    unsigned long overflow_drops;   // Delay line full, not counted as forwarded
+};
+
+struct flow {
+    int in_use;
+    struct sockaddr_in client_addr;
+    int upstream_fd;
+};
+
+struct scheduled {
+    double release;
+    unsigned long order;    // Tie-break so equal release times keep arrival order
+    int fd;
+    struct sockaddr_in dest;
+    size_t length;
+    char data[MAX_DATAGRAM];
+};
+
+struct direction dirs[2];
+struct flow flows[MAX_FLOWS];
+struct scheduled *heap[MAX_SCHEDULED];
+int heap_count = 0;
+unsigned long schedule_order = 0;
+volatile sig_atomic_t stop_requested = 0;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void heap_push(struct scheduled *item) {
+    int i = heap_count++;
+    heap[i] = item;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap[parent]->release < heap[i]->release ||
+            (heap[parent]->release == heap[i]->release && heap[parent]->order < heap[i]->order)) break;
+        struct scheduled *t = heap[parent]; heap[parent] = heap[i]; heap[i] = t;
+        i = parent;
+    }
+}
+
+static struct scheduled *heap_pop(void) {
+    struct scheduled *top = heap[0];
+    heap[0] = heap[--heap_count];
+    int i = 0;
+    while (1) {
+        int left = 2 * i + 1, right = left + 1, smallest = i;
+        if (left < heap_count && (heap[left]->release < heap[smallest]->release ||
+            (heap[left]->release == heap[smallest]->release && heap[left]->order < heap[smallest]->order))) smallest = left;
+        if (right < heap_count && (heap[right]->release < heap[smallest]->release ||
+            (heap[right]->release == heap[smallest]->release && heap[right]->order < heap[smallest]->order))) smallest = right;
+        if (smallest == i) break;
+        struct scheduled *t = heap[smallest]; heap[smallest] = heap[i]; heap[i] = t;
+        i = smallest;
+    }
+    return top;
+}
+
+// Returns -1 if the delay line has no room for the packet
+static int schedule(double release, int fd, struct sockaddr_in *dest, const char *data, size_t length) {
+    if (heap_count == MAX_SCHEDULED) return -1;
+    struct scheduled *item = malloc(sizeof(*item));
+    if (!item) return -1;
+    item->release = release;
+    item->order = schedule_order++;
+    item->fd = fd;
+    // Upstream sockets are connected and have no destination
+    if (dest) item->dest = *dest;
+    else memset(&item->dest, 0, sizeof(item->dest));
+    item->length = length;
+    memcpy(item->data, data, length);
+    heap_push(item);
+    return 0;
+}
+
+// Runs one packet through the direction's impairments and schedules it
+static void impair(struct direction *d, int fd, struct sockaddr_in *dest, const char *data, size_t length) {
+    double release[2];
+    int copies = impair_packet(&d->state, now_ms(), length, release);
+    for (int i = 0; i < copies; i++) {
+        if (schedule(release[i], fd, dest, data, length) == 0) continue;
+        // The first copy was counted as forwarded, the second as a duplicate
+        if (i == 0) d->state.forwarded--;
+        else d->state.duplicated--;
+        d->overflow_drops++;
+        printf("Warning: delay line full, dropping packet (%s)\n", d->name);
+    }
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static struct flow *flow_for_client(struct sockaddr_in *addr, struct sockaddr_in *server_addr) {
+    for (int i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].in_use && flows[i].client_addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            flows[i].client_addr.sin_port == addr->sin_port) {
+            return &flows[i];
+        }
+    }
+    for (int i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].in_use) continue;
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            perror("upstream socket creation failed");
+            return NULL;
+        }
+        if (connect(fd, (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+            perror("upstream connect failed");
+            close(fd);
+            return NULL;
+        }
+        flows[i].in_use = 1;
+        flows[i].client_addr = *addr;
+        flows[i].upstream_fd = fd;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr->sin_addr, ip, sizeof(ip));
+        printf("New flow %d from %s:%d\n", i, ip, ntohs(addr->sin_port));
+        return &flows[i];
+    }
+    printf("Warning: flow table full, dropping packet\n");
+    return NULL;
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s <listen_port> <server_ip> <server_port> [options]\n", program_name);
+    printf("Options apply to both directions, or prefix with up- (client to server) or down-:\n");
+    printf("  --delay=MS             One-way base delay\n");
+    printf("  --jitter=MS            Jitter spread (default distribution uniform +/-MS)\n");
+    printf("  --dist=uniform|normal|pareto\n");
+    printf("  --rate=KBPS            Token-bucket bottleneck rate\n");
+    printf("  --burst=BYTES          Token-bucket depth (default one datagram)\n");
+    printf("  --queue=PACKETS        Bottleneck queue limit before tail drop\n");
+    printf("  --reorder=P            Probability a packet overtakes the delay line\n");
+    printf("  --duplicate=P          Probability a packet is sent twice\n");
+    printf("  --loss=P               Independent loss\n");
+    printf("  --ge=p:r:good:bad      Gilbert-Elliott burst loss (transition and per-state loss rates)\n");
+    printf("  --seed=N               PRNG seed, identical seeds replay identical impairments\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int listen_port = atoi(argv[1]);
+    int server_port = atoi(argv[3]);
+    if (listen_port <= 0 || server_port <= 0) {
+        printf("Error: Invalid port number\n");
+        return 1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, argv[2], &server_addr.sin_addr) <= 0) {
+        printf("Error: Invalid server IP address\n");
+        return 1;
+    }
+
+    uint64_t seed = 1;
+    for (int d = 0; d < 2; d++) {
+        memset(&dirs[d], 0, sizeof(dirs[d]));
+        dirs[d].name = d == DIR_UP ? "up" : "down";
+        impair_defaults(&dirs[d].cfg);
+    }
+    for (int i = 4; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0 || !strchr(argv[i], '=')) {
+            printf("Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+        char name[32];
+        const char *option = argv[i] + 2;
+        const char *value = strchr(option, '=') + 1;
+        int first = 0, last = 1;
+        if (strncmp(option, "up-", 3) == 0) {
+            option += 3;
+            last = 0;
+        } else if (strncmp(option, "down-", 5) == 0) {
+            option += 5;
+            first = 1;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(value - 1 - option), option);
+        if (strcmp(name, "seed") == 0) {
+            seed = strtoull(value, NULL, 10);
+            continue;
+        }
+        for (int d = first; d <= last; d++) {
+            if (impair_parse_option(&dirs[d].cfg, name, value) < 0) {
+                printf("Error: Invalid option %s\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+    for (int d = 0; d < 2; d++) {
+        impair_start(&dirs[d].state, &dirs[d].cfg, seed, d, now_ms());
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listen_fd < 0) {
+        perror("socket creation failed");
+        return 1;
+    }
+    struct sockaddr_in listen_addr;
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = INADDR_ANY;
+    listen_addr.sin_port = htons(listen_port);
+    if (bind(listen_fd, (const struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
+        perror("bind failed");
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    printf("Proxy listening on port %d, forwarding to %s:%d (seed %llu)\n", listen_port, argv[2], server_port, (unsigned long long)seed);
+    for (int d = 0; d < 2; d++) {
+        struct impairment *c = &dirs[d].cfg;
+        printf("  %-4s delay=%.1fms jitter=%.1fms rate=%.0fkbps queue=%d reorder=%.3f dup=%.3f ge=%.3f:%.3f:%.3f:%.3f\n",
+               dirs[d].name, c->delay_ms, c->jitter_ms, c->rate_kbps, c->queue_limit, c->reorder, c->duplicate,
+               c->ge_p, c->ge_r, c->loss_good, c->loss_bad);
+    }
+    fflush(stdout);
+
+    struct pollfd fds[MAX_FLOWS + 1];
+    int fd_flow[MAX_FLOWS + 1];
+    char buffer[MAX_DATAGRAM];
+
+    while (!stop_requested) {
+        int nfds = 0;
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        fd_flow[nfds++] = -1;
+        for (int i = 0; i < MAX_FLOWS; i++) {
+            if (!flows[i].in_use) continue;
+            fds[nfds].fd = flows[i].upstream_fd;
+            fds[nfds].events = POLLIN;
+            fd_flow[nfds++] = i;
+        }
+
+        int timeout = 1000;
+        if (heap_count > 0) {
+            double wait = heap[0]->release - now_ms();
+            timeout = wait <= 0 ? 0 : (int)ceil(wait);
+        }
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0) {
+            if (stop_requested) break;
+            perror("poll error");
+            break;
+        }
+
+        for (int i = 0; i < nfds && ready > 0; i++) {
+            if (!fds[i].revents) continue;
+            ready--;
+            if (!(fds[i].revents & POLLIN)) continue;
+            if (fd_flow[i] < 0) {
+                struct sockaddr_in client_addr;
+                socklen_t client_len = sizeof(client_addr);
+                ssize_t n = recvfrom(listen_fd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &client_len);
+                if (n <= 0) continue;
+                struct flow *flow = flow_for_client(&client_addr, &server_addr);
+                if (flow) impair(&dirs[DIR_UP], flow->upstream_fd, NULL, buffer, n);
+            } else {
+                struct flow *flow = &flows[fd_flow[i]];
+                ssize_t n = recv(flow->upstream_fd, buffer, sizeof(buffer), 0);
+                if (n <= 0) continue;
+                impair(&dirs[DIR_DOWN], listen_fd, &flow->client_addr, buffer, n);
+            }
+        }
+
+        double now = now_ms();
+        while (heap_count > 0 && heap[0]->release <= now) {
+            struct scheduled *item = heap_pop();
+            if (item->dest.sin_family == AF_INET) {
+                sendto(item->fd, item->data, item->length, 0, (const struct sockaddr *)&item->dest, sizeof(item->dest));
+            } else {
+                send(item->fd, item->data, item->length, 0);
+            }
+            free(item);
+        }
+    }
+
+    printf("\nProxy statistics:\n");
+    for (int d = 0; d < 2; d++) {
+        struct impair_state *st = &dirs[d].state;
+        printf("  %-4s received=%lu forwarded=%lu lost=%lu queue_drops=%lu overflow_drops=%lu reordered=%lu duplicated=%lu\n",
+               dirs[d].name, st->received, st->forwarded, st->lost, st->queue_drops, dirs[d].overflow_drops,
+               st->reordered, st->duplicated);
+    }
+    while (heap_count > 0) free(heap_pop());
+    for (int i = 0; i < MAX_FLOWS; i++) {
+        if (flows[i].in_use) close(flows[i].upstream_fd);
+    }
+    close(listen_fd);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "headers.h"
+#include "qlog.h"
+#include "net.h"
+
+struct qlog_trace qlog_process;
+
+static uint64_t now_us(void) {
+    struct timeval tv;
+    net_gettimeofday(&tv);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void qlog_open_in(struct qlog_trace *t, const char *role) {
+    const char *dir = getenv("SHAM_QLOG");
+    if (!dir || !*dir) return;
+    snprintf(t->dir, sizeof(t->dir), "%s", dir);
+    snprintf(t->role, sizeof(t->role), "%s", role);
+    snprintf(t->path, sizeof(t->path), "%s/%s-pid%d.jsonl", t->dir, role, (int)getpid());
+    t->file = fopen(t->path, "w");
+    if (!t->file) {
+        perror("Failed to open qlog trace");
+        return;
+    }
+    t->reference_us = now_us();
+    fprintf(t->file, "{\"qlog_version\":\"sham-1\",\"vantage_point\":\"%s\",\"pid\":%d,\"reference_time_us\":%llu}\n",
+            role, (int)getpid(), (unsigned long long)t->reference_us);
+    printf("Tracing: writing qlog events to %s\n", t->path);
+}
+
+// Renames the trace after the connection ID, so the two sides pair up by name
+void qlog_set_connection_in(struct qlog_trace *t, uint32_t conn_id) {
+    if (!t->file) return;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s-%u.jsonl", t->dir, t->role, conn_id);
+    if (rename(t->path, path) == 0) snprintf(t->path, sizeof(t->path), "%s", path);
+    qlog_event_in(t, "connectivity:connection_started", "\"conn_id\":%u", conn_id);
+}
+
+void qlog_close_in(struct qlog_trace *t) {
+    if (!t->file) return;
+    qlog_event_in(t, "connectivity:connection_closed", " ");
+    fclose(t->file);
+    t->file = NULL;
+}
+
+static void vevent(struct qlog_trace *t, const char *name, const char *data_format, va_list args) {
+    if (!t->file) return;
+    fprintf(t->file, "{\"time\":%.3f,\"name\":\"%s\",\"data\":{", (now_us() - t->reference_us) / 1000.0, name);
+    vfprintf(t->file, data_format, args);
+    fputs("}}\n", t->file);
+}
+
+void qlog_event_in(struct qlog_trace *t, const char *name, const char *data_format, ...) {
+    va_list args;
+    va_start(args, data_format);
+    vevent(t, name, data_format, args);
+    va_end(args);
+}
+
+void qlog_open(const char *role) {
+    qlog_open_in(&qlog_process, role);
+}
+
+void qlog_set_connection(uint32_t conn_id) {
+    qlog_set_connection_in(&qlog_process, conn_id);
+}
+
+void qlog_close(void) {
+    qlog_close_in(&qlog_process);
+}
+
+int qlog_enabled(void) {
+    return qlog_process.file != NULL;
+}
+
+void qlog_event(const char *name, const char *data_format, ...) {
+    va_list args;
+    va_start(args, data_format);
+    vevent(&qlog_process, name, data_format, args);
+    va_end(args);
+}
+
+// Chat data segments also carry the ACK flag, so a payload makes it data
+static const char *packet_type(uint16_t flags, size_t payload_length) {
+    if ((flags & SYN) && (flags & ACK)) return "syn_ack";
+    if (flags & SYN) return "syn";
+    if (flags & FIN) return "fin";
+    if (flags & FEC) return "parity";
+    if ((flags & ACK) && payload_length == 0) return "ack";
+    return "data";
+}
+
+void qlog_packet_in(struct qlog_trace *t, const char *name, const void *datagram, ssize_t length) {
+    if (!t->file || length < (ssize_t)sizeof(struct sham_header)) return;
+    const struct sham_header *h = datagram;
+    size_t payload_length = (size_t)length - sizeof(struct sham_header);
+    qlog_event_in(t, name, "\"type\":\"%s\",\"seq\":%u,\"ack\":%u,\"flags\":%u,\"window\":%u,\"length\":%zu",
+                  packet_type(h->flags, payload_length), ntohl(h->seq_num), ntohl(h->ack_num), h->flags, ntohs(h->window_size),
+                  payload_length);
+}
+
+void qlog_packet(const char *name, const void *datagram, ssize_t length) {
+    qlog_packet_in(&qlog_process, name, datagram, length);
+}
@@ -0,0 +1,65 @@
+#ifndef SHAM_QLOG_H
+#define SHAM_QLOG_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+// Optional structured trace in the spirit of qlog, one JSON object per line.
+// Enabled by pointing SHAM_QLOG at a directory; each process writes
+// <role>-<conn_id>.jsonl there (named by PID until the ID is known).
+//
+// Line 1 describes the trace:
+//   {"qlog_version":"sham-1","vantage_point":"client","pid":123,"reference_time_us":1700000000000000}
+// Every further line is an event, time in ms since reference_time_us:
+//   {"time":12.345,"name":"transport:packet_sent","data":{...}}
+//
+// Events and their data fields:
+//   connectivity:connection_started   conn_id
+//   connectivity:connection_closed    -
+//   transport:packet_sent             type, seq, ack, flags, window, length
+//   transport:packet_received         type, seq, ack, flags, window, length
+//   transport:packet_dropped          trigger ("simulated_loss", "buffer_full"), seq if known
+//   recovery:packet_lost              seq, trigger ("rto")
+//   recovery:packet_acked             seq, length
+//   recovery:packet_recovered         seq, length (rebuilt from FEC parity)
+//   recovery:metrics_updated          latest_rtt, smoothed_rtt, rtt_variance, rto (ms)
+//                                     or bytes_in_flight, window_segments, peer_window
+//   transport:window_updated          buffer_used, window (receiver side)
+// type is one of syn, syn_ack, ack, data, fin, parity; length is the payload.
+
+#define QLOG_SENT "transport:packet_sent"
+#define QLOG_RECEIVED "transport:packet_received"
+
+// One trace file. A process running several connections gives each its own
+// (sham_config.qlog); the functions without the _in suffix write to the
+// process trace, qlog_process.
+struct qlog_trace {
+    FILE *file;
+    char dir[256];
+    char path[512];
+    char role[16];
+    uint64_t reference_us;
+};
+
+extern struct qlog_trace qlog_process;
+
+void qlog_open_in(struct qlog_trace *t, const char *role);
+void qlog_set_connection_in(struct qlog_trace *t, uint32_t conn_id);
+void qlog_close_in(struct qlog_trace *t);
+
+// Writes an event whose data members are given as a printf format
+void qlog_event_in(struct qlog_trace *t, const char *name, const char *data_format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Decodes a datagram as it appears on the wire into a packet event
+void qlog_packet_in(struct qlog_trace *t, const char *name, const void *datagram, ssize_t length);
+
+void qlog_open(const char *role);
+void qlog_set_connection(uint32_t conn_id);
+void qlog_close(void);
+int qlog_enabled(void);
+void qlog_event(const char *name, const char *data_format, ...) __attribute__((format(printf, 2, 3)));
+void qlog_packet(const char *name, const void *datagram, ssize_t length);
+
+#endif
@@ -0,0 +1,60 @@
+#include <string.h>
+#include "reorder.h"
+
+void reorder_init(struct reorder_buffer *rb) {
+    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+        rb->slots[i].is_valid = 0;
+    }
+}
+
+int reorder_contains(const struct reorder_buffer *rb, uint32_t seq_num) {
+    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+        if (rb->slots[i].is_valid && rb->slots[i].seq_num == seq_num) return 1;
+    }
+    return 0;
+}
+
+int reorder_insert(struct reorder_buffer *rb, uint32_t seq_num, const struct sham_packet *packet, size_t length) {
+    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+        if (!rb->slots[i].is_valid) {
+            uint32_t buffer = POOL_NONE;
+            if (packet) {
+                buffer = pool_alloc();
+                if (buffer == POOL_NONE) return -1;
+                // Only the header and the payload bytes in use are worth copying
+                memcpy(pool_packet(buffer), packet, sizeof(struct sham_header) + length);
+            }
+            rb->slots[i].buffer = buffer;
+            rb->slots[i].seq_num = seq_num;
+            rb->slots[i].data_length = length;
+            rb->slots[i].is_valid = 1;
+            rb->slots[i].consumed = 0;
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct buffered_packet *reorder_next(struct reorder_buffer *rb, uint32_t expected_seq) {
+    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+        if (rb->slots[i].is_valid && rb->slots[i].seq_num == expected_seq) return &rb->slots[i];
+    }
+    return NULL;
+}
+
+void reorder_release(struct buffered_packet *slot) {
+    pool_free(slot->buffer);
+    slot->is_valid = 0;
+}
+
+void reorder_consume(struct buffered_packet *slot) {
+    pool_free(slot->buffer);
+    slot->buffer = POOL_NONE;
+    slot->consumed = 1;
+}
+
+void reorder_clear(struct reorder_buffer *rb) {
+    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+        if (rb->slots[i].is_valid) reorder_release(&rb->slots[i]);
+    }
+}
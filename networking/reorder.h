@@ -0,0 +1,49 @@
+#ifndef SHAM_REORDER_H
+#define SHAM_REORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "headers.h"
+#include "pool.h"
+
+#ifndef MAX_BUFFER_PACKETS
+#define MAX_BUFFER_PACKETS 10
+#endif
+
+// The segment itself, header included, is in pool buffer `buffer`
+struct buffered_packet {
+    uint32_t buffer;
+    uint32_t seq_num;
+    uint16_t data_length;
+    uint8_t is_valid;
+    uint8_t consumed;   // Delivered ahead of a gap, kept only for the cumulative ACK
+};
+
+// Received segments, held until the gap before them is filled and the
+// reader has taken them
+struct reorder_buffer {
+    struct buffered_packet slots[MAX_BUFFER_PACKETS];
+};
+
+void reorder_init(struct reorder_buffer *rb);
+int reorder_contains(const struct reorder_buffer *rb, uint32_t seq_num);
+
+// Copies the segment into a pool buffer behind a free slot; returns the slot,
+// or -1 if all slots are taken or the pool is exhausted. With packet NULL
+// only the descriptor is kept.
+int reorder_insert(struct reorder_buffer *rb, uint32_t seq_num, const struct sham_packet *packet, size_t length);
+
+// Returns the buffered segment starting at expected_seq, or NULL. The caller
+// consumes it and hands it back with reorder_release().
+struct buffered_packet *reorder_next(struct reorder_buffer *rb, uint32_t expected_seq);
+void reorder_release(struct buffered_packet *slot);
+// Marks a slot delivered ahead of a gap and returns its buffer to the pool
+void reorder_consume(struct buffered_packet *slot);
+// Releases every slot, e.g. when the connection goes away
+void reorder_clear(struct reorder_buffer *rb);
+
+static inline struct sham_packet *reorder_packet(const struct buffered_packet *slot) {
+    return pool_packet(slot->buffer);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#include <math.h>
+#include "rtt.h"
+
+double rto_from_estimate(double estimated_rtt, double dev_rtt) {
+    double rto = estimated_rtt + 4 * dev_rtt;
+    if (rto < RTO_MIN_MS) rto = RTO_MIN_MS;
+    if (rto > RTO_MAX_MS) rto = RTO_MAX_MS;
+    return rto;
+}
+
+double rtt_update(double *estimated_rtt, double *dev_rtt, double sample_rtt) {
+    *estimated_rtt = (1 - ALPHA) * *estimated_rtt + ALPHA * sample_rtt;
+    *dev_rtt = (1 - BETA) * *dev_rtt + BETA * fabs(sample_rtt - *estimated_rtt);
+    return rto_from_estimate(*estimated_rtt, *dev_rtt);
+}
+
+double rto_backoff(double rto) {
+    rto *= 2;
+    if (rto > RTO_MAX_MS) rto = RTO_MAX_MS;
+    return rto;
+}
@@ -0,0 +1,19 @@
+#ifndef SHAM_RTT_H
+#define SHAM_RTT_H
+
+// RTO constants
+#define ALPHA 0.25
+#define BETA 0.75
+#define RTO_MIN_MS 100.0
+#define RTO_MAX_MS 5000.0
+
+// RTO = EstimatedRTT + 4 * DevRTT, clamped to [RTO_MIN_MS, RTO_MAX_MS]
+double rto_from_estimate(double estimated_rtt, double dev_rtt);
+
+// Folds one RTT sample (ms) into the estimates and returns the new RTO
+double rtt_update(double *estimated_rtt, double *dev_rtt, double sample_rtt);
+
+// Exponential backoff after a timeout
+double rto_backoff(double rto);
+
+#endif
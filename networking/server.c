@@ -7,394 +7,890 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/select.h>
-#include <openssl/md5.h> // Include for MD5 functions
-#include <stdarg.h>
-#include <openssl/evp.h> // Use EVP API for modern cryptographic operations
+#include <stddef.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include "common.h"
+#include "net.h"
+#include "metrics.h"
+#include "qlog.h"
+#include "digest.h"
+#include "filemap.h"
+#include "compress.h"
+#include "chat.h"
+#include "fanout.h"
+#include "sham.h"
 
-#define MAX_BUFFER_PACKETS 10
-#define RECEIVER_BUFFER_SIZE 8192
-
-double packet_loss_rate = 0.0;
 int chat_mode = 0;
-FILE *log_file = NULL;
+int coalesce_delay_ms = -1; // --coalesce[=MS]
+int compression_enabled = 0; // Negotiated in the handshake, file mode only
+struct decompressor *decompressor = NULL;
+int decompress_failed = 0; // Nothing more is written once a block fails
+int streams_enabled = 0; // Negotiated in the handshake, file mode only
+int batch_enabled = 0; // Negotiated in the handshake, file mode only
+const char *target_dir = "."; // --dir: where batch files are created
+const char *serve_dir = NULL; // --serve: downloads are offered only from here
+int pipe_enabled = 0; // Negotiated in the handshake, file mode only
+const char *output_name = "received_file.dat"; // --output, "-" for stdout
+FILE *stdout_data = NULL; // With --output=-, the real stdout; messages go to stderr
+int transfer_incomplete = 0; // A pipe ended without its end marker, or decompression failed
+int fanout_mode = 0; // --fanout[=GROUP]: receive from a one-to-many sender
+int fanout_multicast = 0;
+struct in_addr fanout_group;
 
-struct buffered_packet {
-    struct sham_packet packet;
-    int seq_num;
-    size_t data_length;
-    int is_valid;
+// Connections are found by ID rather than by address, so a client whose
+// NAT rebinds keeps its session. Open addressing, O(1) on average. With
+// --workers the accepting process keeps every session it handed out: by
+// assigned ID, so no two workers hand out the same one, and by the ID the
+// client proposed, so a retransmitted SYN is not given a second worker.
+#define CONN_TABLE_SIZE 256
+#define MAX_WORKERS 64
+struct connection {
+    int in_use;
+    uint32_t id;            // The key: assigned, or proposed in proposal_table
+    uint32_t assigned;
+    int worker;
+    struct sockaddr_in addr;
 };
+struct connection conn_table[CONN_TABLE_SIZE];
+struct connection proposal_table[CONN_TABLE_SIZE];
+uint32_t connection_id = 0; // ID of the session this process is serving
+int worker_count = 1;
+int worker_index = 0;
 
-struct flow_control {
-    int buffer_used;
-    int buffer_available;
+// Output side of one multiplexed stream, opened by its first frame
+struct recv_stream {
+    FILE *file;
+    char path[256];
+    uint64_t expected_offset;
+    int finished;
 };
 
-int should_drop_packet(void);
-void recv_data_chat(int sockfd);
-void recv_data_file(int sockfd, const char* output_filename);
-void print_usage(const char* program_name);
-void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int ack_num, int window_size);
-void calculate_md5_hash(const char* filename);
-void log_message(const char *format, ...);
-void send_termination_sequence(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int next_seq_num, int available_window);
-
-// Function to log messages with high-precision timestamps
-void log_message(const char *format, ...) {
-    if (!log_file) return; // Ensure logging is active only when log_file is open
-
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    time_t curtime = tv.tv_sec;
-    char time_buffer[30];
-    strftime(time_buffer, 30, "%Y-%m-%d %H:%M:%S", localtime(&curtime));
+// Parser for a batch: the stage says which part of the current file record
+// the next bytes belong to. Headers, names and digests may be split across
+// segments, so they are collected in record first.
+enum batch_stage {
+    BATCH_HEADER,
+    BATCH_NAME,
+    BATCH_DATA,
+    BATCH_DIGEST,
+    BATCH_BROKEN,   // Malformed record, the rest is ignored
+};
+struct batch_receiver {
+    enum batch_stage stage;
+    char record[BATCH_NAME_MAX + 1];
+    size_t have;
+    size_t name_length;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t remaining;
+    FILE *file;                 // NULL while skipping a file that could not be created
+    char path[4096];
+    struct md5_stream *md5;
+    int files;
+    int mismatches;
+    uint64_t bytes;
+};
 
-    fprintf(log_file, "[%s.%06ld] [LOG] ", time_buffer, tv.tv_usec);
+// A pipe's last bytes may be its end marker, so they are held back until
+// more data or the FIN shows which they are
+struct pipe_receiver {
+    char held[sizeof(struct sham_pipe_end)];
+    size_t held_length;
+    uint64_t bytes;
+};
 
-    va_list args;
-    va_start(args, format);
-    vfprintf(log_file, format, args);
-    va_end(args);
+// Output state for one file transfer; reassembly happens in the connection
+struct receiver_state {
+    FILE *output_file;
+    const char *output_filename;
+    struct recv_stream streams[MAX_STREAMS];
+    struct batch_receiver batch;
+    struct pipe_receiver pipe;
+};
 
-    fflush(log_file);
-}
+void recv_data_chat(struct sham_conn *conn);
+void recv_data_file(struct sham_conn *conn, struct receiver_state *rs);
+void serve_download(struct sham_conn *conn);
+int recv_data_fanout(int sockfd);
+void print_usage(const char* program_name);
+void write_payload(FILE *output_file, const char *data, size_t length);
+ssize_t read_syn(int sockfd, union sham_datagram *rx, struct sockaddr_in *client_addr);
+void run_session(int sockfd, const char *output_filename, union sham_datagram *rx, ssize_t bytes_received,
+                 struct sockaddr_in *client_addr);
+void accept_sessions(int sockets[]);
+int attach_steering_program(int sockfd, int workers);
+struct connection *lookup_connection(struct connection *table, uint32_t id);
+struct connection *insert_connection(struct connection *table, uint32_t id, struct sockaddr_in *addr);
+uint32_t assign_connection_id(uint32_t proposed, struct sockaddr_in *addr);
+int deliver_stream_frame(struct receiver_state *rs, const char *payload, size_t length);
+int deliver_stream_ahead(void *arg, const char *payload, size_t length);
+void deliver_payload(struct receiver_state *rs, const char *payload, size_t length);
+void close_streams(struct receiver_state *rs);
+void deliver_batch_data(struct receiver_state *rs, const char *data, size_t length);
+void finish_batch(struct receiver_state *rs);
+void deliver_pipe_data(struct receiver_state *rs, const char *data, size_t length);
+void finish_pipe(struct receiver_state *rs);
 
-// Function to calculate and print the MD5 hash of a file
-void calculate_md5_hash(const char* filename) {
-    unsigned char md_value[EVP_MAX_MD_SIZE];
-    unsigned int md_len;
-    FILE *inFile = fopen(filename, "rb");
-    if (!inFile) {
-        perror("Failed to open file for MD5 calculation");
+// Write path for in-order file data, decompressing it when negotiated.
+// Compressed bytes never reach the file, even when the decoder is gone.
+void write_payload(FILE *output_file, const char *data, size_t length) {
+    uint64_t start = metrics_now_us();
+    if (!compression_enabled) {
+        fwrite(data, 1, length, output_file);
+    } else if (decompress_failed) {
         return;
-    }
-
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        perror("Failed to create EVP_MD_CTX");
-        fclose(inFile);
+    } else if (!decompressor || decompressor_write(decompressor, data, length) < 0) {
+        log_message("COMP STREAM CORRUPT\n");
+        decompress_failed = 1;
+        transfer_incomplete = 1;
         return;
     }
+    metrics_record(H_WRITE_LATENCY, metrics_now_us() - start);
+    metrics_count(M_BYTES_DELIVERED, length);
+}
 
-    if (EVP_DigestInit_ex(mdctx, EVP_md5(), NULL) != 1) {
-        perror("Failed to initialize MD5 digest");
-        EVP_MD_CTX_free(mdctx);
-        fclose(inFile);
-        return;
+static unsigned conn_hash(uint32_t id) {
+    return (id * 2654435761u) >> 24; // Top byte of a Fibonacci hash, CONN_TABLE_SIZE buckets
+}
+
+struct connection *lookup_connection(struct connection *table, uint32_t id) {
+    unsigned slot = conn_hash(id);
+    for (int probe = 0; probe < CONN_TABLE_SIZE; probe++) {
+        struct connection *conn = &table[(slot + probe) % CONN_TABLE_SIZE];
+        if (!conn->in_use) return NULL;
+        if (conn->id == id) return conn;
     }
+    return NULL;
+}
 
-    unsigned char data[1024];
-    int bytes;
-    while ((bytes = fread(data, 1, sizeof(data), inFile)) != 0) {
-        if (EVP_DigestUpdate(mdctx, data, bytes) != 1) {
-            perror("Failed to update MD5 digest");
-            EVP_MD_CTX_free(mdctx);
-            fclose(inFile);
-            return;
+struct connection *insert_connection(struct connection *table, uint32_t id, struct sockaddr_in *addr) {
+    unsigned slot = conn_hash(id);
+    for (int probe = 0; probe < CONN_TABLE_SIZE; probe++) {
+        struct connection *conn = &table[(slot + probe) % CONN_TABLE_SIZE];
+        if (!conn->in_use || conn->id == id) {
+            conn->in_use = 1;
+            conn->id = id;
+            conn->addr = *addr;
+            return conn;
         }
     }
+    return NULL;
+}
 
-    if (EVP_DigestFinal_ex(mdctx, md_value, &md_len) != 1) {
-        perror("Failed to finalize MD5 digest");
-        EVP_MD_CTX_free(mdctx);
-        fclose(inFile);
-        return;
+// Keeps the client's proposal unless it is taken by another peer, in which
+// case the replacement stays congruent to this worker's steering index
+uint32_t assign_connection_id(uint32_t proposed, struct sockaddr_in *addr) {
+    uint32_t slots = UINT32_MAX / worker_count; // IDs congruent to worker_index
+    uint32_t slot = proposed / worker_count;
+    if (proposed == 0 || (uint32_t)worker_index != proposed % worker_count || slot >= slots) {
+        slot = (uint32_t)rand() % slots;
     }
-
-    EVP_MD_CTX_free(mdctx);
-    fclose(inFile);
-
-    printf("MD5: ");
-    for (unsigned int i = 0; i < md_len; i++) {
-        printf("%02x", md_value[i]);
+    while (1) {
+        uint32_t id = slot * worker_count + worker_index;
+        struct connection *conn = lookup_connection(conn_table, id);
+        if (id != 0 && (!conn || (conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr && conn->addr.sin_port == addr->sin_port))) {
+            return id;
+        }
+        slot = (slot + 1) % slots;
     }
-    printf("\n");
 }
 
-// Simulate packet loss
-int should_drop_packet() {
-    if (packet_loss_rate <= 0.0) return 0;
-    double random_val = (double)rand() / RAND_MAX;
-    return random_val < packet_loss_rate;
+// Classic BPF for the reuseport group. Socket 0 belongs to the accepting
+// process and gets every SYN, so a new client reaches whichever worker is
+// free rather than the one its proposed ID names. Everything else goes to
+// socket 1 + conn_id % workers. Packets too short to carry a header end up
+// at socket 0 too, which ignores them.
+int attach_steering_program(int sockfd, int workers) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    // flags is carried in host order, so find the byte holding SYN
+    uint16_t syn = SYN;
+    const uint8_t *syn_bytes = (const uint8_t *)&syn;
+    uint32_t syn_byte = syn_bytes[0] ? 0 : 1;
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, offsetof(struct sham_header, flags) + syn_byte },
+        { BPF_JMP | BPF_JSET | BPF_K, 0, 1, syn_bytes[syn_byte] },
+        { BPF_RET | BPF_K, 0, 0, 0 },
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, offsetof(struct sham_header, conn_id) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workers },
+        { BPF_ALU | BPF_ADD | BPF_K, 0, 0, 1 },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+    if (net_setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF failed");
+        return -1;
+    }
+    return 0;
+#else
+    (void)sockfd;
+    (void)workers;
+    return -1;
+#endif
 }
 
-void send_ack(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int ack_num, int window_size) {
-    struct sham_header ack_header;
-    memset(&ack_header, 0, sizeof(ack_header));
-    ack_header.flags = ACK;
-    ack_header.ack_num = htonl(ack_num);
-    ack_header.window_size = htons(window_size);
-    if (!should_drop_packet()) {
-        sendto(sockfd, &ack_header, sizeof(ack_header), 0, (const struct sockaddr *)client_addr, client_len);
-        printf("SND ACK=%u, Window=%d\n", ack_num, window_size);
-        log_message("SND ACK=%u WIN=%d\n", ack_num, window_size);
-    } else {
-        printf("DROPPED ACK=%u (simulated loss)\n", ack_num);
-        log_message("DROP ACK=%u\n", ack_num);
+// Waits for the next SYN on sockfd and returns its length
+ssize_t read_syn(int sockfd, union sham_datagram *rx, struct sockaddr_in *client_addr) {
+    while (1) {
+        socklen_t client_len = sizeof(*client_addr);
+        ssize_t bytes_received = net_recvfrom(sockfd, rx, sizeof(*rx), 0, (struct sockaddr *)client_addr, &client_len);
+        if (bytes_received >= (ssize_t)sizeof(struct sham_header) && (rx->packet.header.flags & SYN)) return bytes_received;
+        printf("Expected SYN, but received different flag. Ignoring.\n");
     }
 }
 
-void send_termination_sequence(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int next_seq_num, int available_window) {
-    printf("Sending server FIN. Waiting for final ACK.\n");
-    log_message("SND FIN SEQ=%u\n", next_seq_num);
-    struct sham_header fin_header;
-    memset(&fin_header, 0, sizeof(fin_header));
-    fin_header.flags = FIN;
-    fin_header.seq_num = htonl(next_seq_num);
-    fin_header.ack_num = htonl(0);
-    fin_header.window_size = htons(available_window);
-    
-    int retries = 0;
-    while (retries < 5) {
-        if (!should_drop_packet()) {
-            sendto(sockfd, &fin_header, sizeof(fin_header), 0, (const struct sockaddr *)client_addr, client_len);
-        } else {
-            printf("DROPPED server FIN (simulated loss)\n");
-            log_message("DROP FIN\n");
+// With --workers, the parent reads every SYN from socket 0 and forks a
+// worker for it on a free socket, under an ID congruent to that socket's
+// index. The parent keeps every socket open until all workers have ended,
+// because closing one would reorder the reuseport group under the steering
+// program. Each worker serves one session, so the server ends after
+// worker_count sessions, as many of them at once as clients arrive.
+void accept_sessions(int sockets[]) {
+    int used[MAX_WORKERS] = {0};
+    int started = 0;
+    while (started < worker_count) {
+        union sham_datagram rx;
+        struct sockaddr_in client_addr;
+        ssize_t bytes_received = read_syn(sockets[0], &rx, &client_addr);
+        uint32_t proposed = ntohl(rx.packet.header.conn_id);
+
+        struct connection *known = lookup_connection(proposal_table, proposed);
+        if (known && known->addr.sin_addr.s_addr == client_addr.sin_addr.s_addr && known->addr.sin_port == client_addr.sin_port) {
+            // Its worker keeps resending the SYN-ACK on its own timer
+            printf("Retransmitted SYN for connection %u, already with worker %d\n", known->assigned, known->worker);
+            continue;
+        }
+
+        // The worker the proposal names if it is free, the first free one otherwise
+        int worker = proposed % worker_count;
+        if (used[worker]) {
+            worker = 0;
+            while (used[worker]) worker++;
+        }
+        used[worker] = 1;
+        started++;
+        worker_index = worker;
+        uint32_t id = assign_connection_id(proposed, &client_addr);
+        insert_connection(conn_table, id, &client_addr)->worker = worker;
+        struct connection *entry = insert_connection(proposal_table, proposed, &client_addr);
+        if (entry) {
+            entry->assigned = id;
+            entry->worker = worker;
+        }
+        printf("Connection %u goes to worker %d\n", id, worker);
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork failed");
+            continue;
         }
-        
-        struct timeval tv = {1, 0};
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
-        
-        int select_result = select(sockfd + 1, &read_fds, NULL, NULL, &tv);
-        if (select_result > 0) {
-            struct sham_header final_ack;
-            ssize_t bytes_received = recvfrom(sockfd, &final_ack, sizeof(final_ack), 0, NULL, NULL);
-            if (bytes_received > 0 && final_ack.flags & ACK) {
-                printf("Received final ACK. Connection closed gracefully.\n");
-                log_message("RCV ACK\n");
-                return; // Exit the function on success
+        if (pid == 0) {
+            for (int j = 0; j <= worker_count; j++) {
+                if (j != worker + 1) net_close(sockets[j]);
             }
+            connection_id = id;
+            char output_filename[64];
+            snprintf(output_filename, sizeof(output_filename), "received_file.%d.dat", worker);
+            run_session(sockets[worker + 1], output_filename, &rx, bytes_received, &client_addr);
+            if (log_file) fclose(log_file);
+            exit(transfer_incomplete ? EXIT_FAILURE : EXIT_SUCCESS);
         }
-        printf("Timeout waiting for final ACK. Retransmitting FIN...\n");
-        log_message("TIMEOUT RETX FIN\n");
-        retries++;
     }
-    printf("Failed to receive final ACK. Connection may not have closed gracefully.\n");
-    log_message("FINAL ACK TIMEOUT\n");
+    while (wait(NULL) > 0);
+    for (int i = 0; i <= worker_count; i++) net_close(sockets[i]);
 }
 
-void recv_data_chat(int sockfd) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    struct sham_packet packet;
-    int expected_seq = 1;
+// One client session from its SYN: the library does the rest of the
+// handshake, the data phase and teardown
+void run_session(int sockfd, const char *output_filename, union sham_datagram *syn, ssize_t bytes_received,
+                 struct sockaddr_in *client_addr) {
+    union sham_datagram rx = *syn;
 
-    struct buffered_packet buffer[MAX_BUFFER_PACKETS];
-    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
-        buffer[i].is_valid = 0;
+    qlog_open("server");
+    qlog_packet(QLOG_RECEIVED, &rx, bytes_received);
+    if (worker_count == 1) {
+        connection_id = assign_connection_id(ntohl(rx.packet.header.conn_id), client_addr);
+        insert_connection(conn_table, connection_id, client_addr);
     }
+    printf("Connection ID: %u\n", connection_id);
+    metrics_open_connection(connection_id);
+    qlog_set_connection(connection_id);
 
-    struct flow_control fc;
-    fc.buffer_used = 0;
-    fc.buffer_available = RECEIVER_BUFFER_SIZE;
+    struct receiver_state rs;
+    memset(&rs, 0, sizeof(rs));
+    rs.output_filename = output_filename;
 
-    printf("Ready to receive chat messages from the client...\n");
-    printf("Receiver buffer size: %d bytes\n", RECEIVER_BUFFER_SIZE);
+    struct sham_config cfg;
+    sham_config_init(&cfg);
+    cfg.loss_rate = packet_loss_rate;
+    cfg.log = log_file;
+    cfg.trace = stdout;
+    cfg.peer_name = "client";
+    if (chat_mode) {
+        // Chat loss stays on what each side sends, as the client applies it
+        cfg.options = MSGS | EARLY | EXTSEQ;
+        cfg.ack_delay_ms = CHAT_ACK_DELAY_MS;
+    } else {
+        cfg.receive_loss_rate = packet_loss_rate;
+        // Each stream would need its own decompressor
+        cfg.options = FEC | STREAMS | EARLY | EXTSEQ | BATCH | PIPE;
+        if (serve_dir) cfg.options |= GET;
+        if (!(rx.packet.header.flags & STREAMS)) cfg.options |= COMP;
+    }
+    const char *isn = getenv("SHAM_ISN");
+    if (isn) cfg.isn = strtoll(isn, NULL, 10);
+    if (!chat_mode && (rx.packet.header.flags & STREAMS)) {
+        cfg.deliver_ahead = deliver_stream_ahead;
+        cfg.deliver_arg = &rs;
+    }
+
+    static struct sham_conn conn;
+    sham_accept(&conn, sockfd, &rx, bytes_received, client_addr, connection_id, &cfg);
+    while (!sham_established(&conn)) {
+        if (sham_wait(&conn) < 0) break;
+    }
+    compression_enabled = (conn.options & COMP) != 0;
+    streams_enabled = (conn.options & STREAMS) != 0;
+    batch_enabled = (conn.options & BATCH) != 0;
+    pipe_enabled = (conn.options & PIPE) != 0;
+
+    printf("Handshake complete. Starting data transfer.\n");
+    if (chat_mode) {
+        recv_data_chat(&conn);
+    } else if (conn.options & GET) {
+        serve_download(&conn);
+    } else {
+        recv_data_file(&conn, &rs);
+    }
+    sham_close(&conn);
+
+    printf("Server shutting down.\n");
+    metrics_close_connection();
+    qlog_close();
+    net_close(sockfd);
+}
+
+void recv_data_chat(struct sham_conn *conn) {
+    if (!(conn->options & MSGS)) {
+        printf("Client did not ask for chat, closing\n");
+        return;
+    }
+    struct chat_session session;
+    chat_session_init(&session, conn);
+    session.peer_name = "Client";
+    session.coalesce_delay_ms = coalesce_delay_ms;
+
+    printf("Ready to chat with the client (it ends the session with /quit)...\n");
+    printf("Receiver buffer size: %d bytes\n", conn->receive_buffer);
     if (packet_loss_rate > 0.0) {
         printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
     }
+    chat_run(&session);
+}
 
-    while (1) {
-        ssize_t bytes_received = recvfrom(sockfd, &packet, sizeof(struct sham_packet), 0, (struct sockaddr *)&client_addr, &client_len);
-        if (bytes_received < 0) {
-            continue;
-        }
+// Writes a stream frame if it is the next data of its stream. Returns 1 once
+// the frame needs no further delivery (written, or stale), 0 if it has to
+// wait for earlier data of the same stream.
+int deliver_stream_frame(struct receiver_state *rs, const char *payload, size_t length) {
+    if (length < sizeof(struct sham_stream_header)) return 1;
+    struct sham_stream_header sh;
+    memcpy(&sh, payload, sizeof(sh));
+    uint16_t id = ntohs(sh.stream_id), flags = ntohs(sh.flags);
+    size_t data_length = length - sizeof(sh);
+    if (id >= MAX_STREAMS) {
+        log_message("IGNORE STREAM=%u\n", id);
+        return 1;
+    }
+    struct recv_stream *st = &rs->streams[id];
+    // The wire carries 32 bits; frames are never 2 GB away from where the
+    // stream is, so the full offset is the one nearest expected_offset
+    int32_t distance = (int32_t)(ntohl(sh.offset) - (uint32_t)st->expected_offset);
+    if (st->finished || distance < 0) return 1;
+    if (distance > 0) return 0;
+    uint64_t offset = st->expected_offset;
 
-        if (should_drop_packet()) {
-            printf("DROPPED packet SEQ=%u (simulated loss)\n", ntohl(packet.header.seq_num));
-            log_message("DROP DATA SEQ=%u\n", ntohl(packet.header.seq_num));
-            continue;
+    if (!st->file) {
+        if (id == 0) snprintf(st->path, sizeof(st->path), "%s", rs->output_filename);
+        else snprintf(st->path, sizeof(st->path), "%s.%u", rs->output_filename, id);
+        st->file = fopen(st->path, "wb");
+        if (!st->file) {
+            perror("Failed to open stream output file");
+            st->finished = 1;
+            return 1;
         }
+        printf("Stream %u opened, writing to %s\n", id, st->path);
+        log_message("STREAM OPEN ID=%u\n", id);
+    }
+    write_payload(st->file, payload + sizeof(sh), data_length);
+    st->expected_offset += data_length;
+    log_message("RCV STREAM=%u OFF=%llu LEN=%zu\n", id, (unsigned long long)offset, data_length);
+    if (flags & STREAM_FIN) {
+        fclose(st->file);
+        st->file = NULL;
+        st->finished = 1;
+        printf("Stream %u complete: %llu bytes saved as %s\n", id, (unsigned long long)st->expected_offset, st->path);
+        log_message("STREAM FIN ID=%u LEN=%llu\n", id, (unsigned long long)st->expected_offset);
+        calculate_md5_hash(st->path);
+    }
+    return 1;
+}
+
+// Lets the connection hand over a frame that is next in its own stream even
+// while earlier segments of the connection are still missing
+int deliver_stream_ahead(void *arg, const char *payload, size_t length) {
+    return deliver_stream_frame(arg, payload, length);
+}
+
+// Batch names and download paths are relative paths with no empty, "." or
+// ".." components, so every file stays inside its directory
+static int safe_relative_name(const char *name) {
+    if (name[0] == '\0' || name[0] == '/') return 0;
+    const char *part = name;
+    while (1) {
+        size_t n = strcspn(part, "/");
+        if (n == 0 || (n == 1 && part[0] == '.') || (n == 2 && part[0] == '.' && part[1] == '.')) return 0;
+        if (part[n] == '\0') return 1;
+        part += n + 1;
+    }
+}
 
-        if (packet.header.flags & FIN) {
-            printf("Received FIN from client. Starting connection termination.\n");
-            log_message("RCV FIN SEQ=%u\n", ntohl(packet.header.seq_num));
-            int next_seq_num = ntohl(packet.header.seq_num) + 1;
-            send_ack(sockfd, &client_addr, client_len, next_seq_num, fc.buffer_available);
-            log_message("SND ACK FOR FIN\n");
-            send_termination_sequence(sockfd, &client_addr, client_len, next_seq_num, fc.buffer_available);
-            break;
+// Opens a safe_relative_name() under dir one component at a time with
+// O_NOFOLLOW, so a symlink anywhere inside dir cannot lead out of it. With
+// O_CREAT the missing directories on the way are created too. Returns the
+// descriptor, or -1 with errno set.
+static int open_beneath(const char *dir, const char *name, int flags, mode_t mode) {
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) return -1;
+    char part[NAME_MAX + 1];
+    const char *p = name;
+    while (1) {
+        size_t n = strcspn(p, "/");
+        if (n >= sizeof(part)) {
+            close(dirfd);
+            errno = ENAMETOOLONG;
+            return -1;
         }
+        memcpy(part, p, n);
+        part[n] = '\0';
+        if (p[n] == '\0') break;
+        if ((flags & O_CREAT) && mkdirat(dirfd, part, 0755) < 0 && errno != EEXIST) {
+            close(dirfd);
+            return -1;
+        }
+        int next = openat(dirfd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        close(dirfd);
+        if (next < 0) return -1;
+        dirfd = next;
+        p += n + 1;
+    }
+    int fd = openat(dirfd, part, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+    int saved = errno;
+    close(dirfd);
+    errno = saved;
+    return fd;
+}
 
-        int received_seq = ntohl(packet.header.seq_num);
-        size_t payload_length = bytes_received - sizeof(struct sham_header);
-        if (payload_length > 0 && payload_length < sizeof(packet.payload)) {
-            packet.payload[payload_length] = '\0';
+static void open_batch_file(struct batch_receiver *b) {
+    b->record[b->name_length] = '\0';
+    b->file = NULL;
+    if (strlen(b->record) != b->name_length || !safe_relative_name(b->record)) {
+        printf("Warning: Unsafe batch file name, skipping %s\n", b->record);
+        log_message("BATCH REJECT NAME=%s\n", b->record);
+    } else {
+        snprintf(b->path, sizeof(b->path), "%s/%s", target_dir, b->record);
+        int fd = open_beneath(target_dir, b->record, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        b->file = fd < 0 ? NULL : fdopen(fd, "wb");
+        if (!b->file) {
+            perror(b->path);
+            if (fd >= 0) close(fd);
         }
+    }
+    b->md5 = md5_stream_new();
+    b->stage = b->remaining > 0 ? BATCH_DATA : BATCH_DIGEST;
+}
 
-        printf("RCV DATA SEQ=%u, Expected=%u, Length=%zu, Buffer Used=%d, Available=%d\n", received_seq, expected_seq, payload_length, fc.buffer_used, fc.buffer_available);
-        log_message("RCV DATA SEQ=%u LEN=%zu\n", received_seq, payload_length);
+static void close_batch_file(struct batch_receiver *b) {
+    unsigned char digest[MD5_DIGEST_SIZE];
+    char hex[MD5_HEX_LENGTH];
+    md5_stream_final(b->md5, digest);
+    b->md5 = NULL;
+    md5_to_hex(digest, hex);
+    int match = memcmp(digest, b->record, MD5_DIGEST_SIZE) == 0;
+    if (b->file) {
+        fchmod(fileno(b->file), b->mode & 0777);
+        fclose(b->file);
+        b->file = NULL;
+        b->files++;
+        if (!match) b->mismatches++;
+        printf("Batch file %s: %llu bytes, MD5 %s%s\n", b->path, (unsigned long long)b->size, hex, match ? "" : " MISMATCH");
+        log_message("BATCH FILE=%s LEN=%llu MD5=%s%s\n", b->path, (unsigned long long)b->size, hex, match ? "" : " MISMATCH");
+    }
+    b->stage = BATCH_HEADER;
+}
+
+// Runs delivered bytes through the record parser, writing file data as it
+// goes
+void deliver_batch_data(struct receiver_state *rs, const char *data, size_t length) {
+    struct batch_receiver *b = &rs->batch;
+    while (length > 0 && b->stage != BATCH_BROKEN) {
+        if (b->stage == BATCH_DATA) {
+            size_t n = length < b->remaining ? length : (size_t)b->remaining;
+            if (b->file) write_payload(b->file, data, n);
+            md5_stream_update(b->md5, data, n);
+            b->remaining -= n;
+            b->bytes += n;
+            data += n;
+            length -= n;
+            if (b->remaining == 0) b->stage = BATCH_DIGEST;
+            continue;
+        }
 
-        if (received_seq == expected_seq) {
-            printf("Client: %s\n", packet.payload);
-            expected_seq += payload_length;
+        size_t want = b->stage == BATCH_HEADER ? sizeof(struct sham_file_header)
+                    : b->stage == BATCH_NAME ? b->name_length : MD5_DIGEST_SIZE;
+        size_t n = want - b->have < length ? want - b->have : length;
+        memcpy(b->record + b->have, data, n);
+        b->have += n;
+        data += n;
+        length -= n;
+        if (b->have < want) break;
+        b->have = 0;
 
-            send_ack(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
-        } else if (received_seq > expected_seq) {
-            printf("Out-of-order packet SEQ=%u (expecting %u). Sending ACK.\n", received_seq, expected_seq);
-            send_ack(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
+        if (b->stage == BATCH_HEADER) {
+            struct sham_file_header fh;
+            memcpy(&fh, b->record, sizeof(fh));
+            b->name_length = ntohs(fh.name_length);
+            b->mode = ntohl(fh.mode);
+            b->size = b->remaining = ((uint64_t)ntohl(fh.size_high) << 32) | ntohl(fh.size_low);
+            if (b->name_length == 0 || b->name_length > BATCH_NAME_MAX) {
+                printf("Error: Malformed batch record, ignoring the rest of the batch\n");
+                log_message("BATCH BROKEN NAME_LEN=%zu\n", b->name_length);
+                b->stage = BATCH_BROKEN;
+            } else {
+                b->stage = BATCH_NAME;
+            }
+        } else if (b->stage == BATCH_NAME) {
+            open_batch_file(b);
         } else {
-            printf("Duplicate/old packet SEQ=%u (expecting %u). Sending ACK.\n", received_seq, expected_seq);
-            send_ack(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
+            close_batch_file(b);
         }
     }
 }
 
-void recv_data_file(int sockfd, const char* output_filename) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    struct sham_packet packet;
-    int expected_seq = 1;
-    FILE *output_file = NULL;
-    
-    struct buffered_packet buffer[MAX_BUFFER_PACKETS];
-    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
-        buffer[i].is_valid = 0;
+void finish_batch(struct receiver_state *rs) {
+    struct batch_receiver *b = &rs->batch;
+    if (b->stage == BATCH_DATA || b->stage == BATCH_DIGEST) {
+        printf("Warning: Batch ended inside %s\n", b->file ? b->path : b->record);
+        log_message("BATCH INCOMPLETE FILE=%s\n", b->file ? b->path : b->record);
+        if (b->file) fclose(b->file);
+        b->file = NULL;
+        unsigned char digest[MD5_DIGEST_SIZE];
+        md5_stream_final(b->md5, digest);
+        b->md5 = NULL;
     }
-    
-    struct flow_control fc;
-    fc.buffer_used = 0;
-    fc.buffer_available = RECEIVER_BUFFER_SIZE;
-    
+    printf("Batch: received %d files, %llu bytes of data, %d digest mismatches\n", b->files, (unsigned long long)b->bytes, b->mismatches);
+    log_message("BATCH RECEIVED FILES=%d BYTES=%llu MISMATCH=%d\n", b->files, (unsigned long long)b->bytes, b->mismatches);
+}
+
+// Writes everything except the last sizeof(struct sham_pipe_end) bytes seen
+void deliver_pipe_data(struct receiver_state *rs, const char *data, size_t length) {
+    struct pipe_receiver *p = &rs->pipe;
+    size_t total = p->held_length + length;
+    if (total > sizeof(p->held)) {
+        size_t out = total - sizeof(p->held);
+        size_t from_held = out < p->held_length ? out : p->held_length;
+        write_payload(rs->output_file, p->held, from_held);
+        memmove(p->held, p->held + from_held, p->held_length - from_held);
+        p->held_length -= from_held;
+        write_payload(rs->output_file, data, out - from_held);
+        data += out - from_held;
+        length -= out - from_held;
+        p->bytes += out;
+    }
+    memcpy(p->held + p->held_length, data, length);
+    p->held_length += length;
+}
+
+void finish_pipe(struct receiver_state *rs) {
+    struct pipe_receiver *p = &rs->pipe;
+    struct sham_pipe_end marker;
+    memcpy(&marker, p->held, sizeof(marker));
+    uint64_t length = ((uint64_t)ntohl(marker.length_high) << 32) | ntohl(marker.length_low);
+    if (p->held_length == sizeof(marker) && memcmp(marker.magic, PIPE_END_MAGIC, sizeof(marker.magic)) == 0 &&
+        length == p->bytes) {
+        printf("Pipe complete: %llu bytes\n", (unsigned long long)p->bytes);
+        log_message("PIPE COMPLETE LEN=%llu\n", (unsigned long long)p->bytes);
+        return;
+    }
+    // Whatever was held back is data after all
+    write_payload(rs->output_file, p->held, p->held_length);
+    p->bytes += p->held_length;
+    printf("Warning: Pipe ended without its end marker after %llu bytes\n", (unsigned long long)p->bytes);
+    log_message("PIPE INCOMPLETE LEN=%llu\n", (unsigned long long)p->bytes);
+    transfer_incomplete = 1;
+}
+
+// In-order delivery in connection sequence: straight to the file, to the
+// frame's stream, or through the batch or pipe framing
+void deliver_payload(struct receiver_state *rs, const char *payload, size_t length) {
+    if (streams_enabled) {
+        deliver_stream_frame(rs, payload, length);
+    } else if (batch_enabled) {
+        deliver_batch_data(rs, payload, length);
+    } else if (pipe_enabled) {
+        deliver_pipe_data(rs, payload, length);
+    } else {
+        write_payload(rs->output_file, payload, length);
+        fflush(rs->output_file);
+        printf("Wrote %zu bytes to file\n", length);
+    }
+}
+
+void close_streams(struct receiver_state *rs) {
+    for (int i = 0; i < MAX_STREAMS; i++) {
+        struct recv_stream *st = &rs->streams[i];
+        if (!st->file) continue;
+        fclose(st->file);
+        st->file = NULL;
+        printf("Warning: Stream %d ended without its final frame after %llu bytes (%s)\n", i, (unsigned long long)st->expected_offset, st->path);
+        log_message("STREAM INCOMPLETE ID=%d LEN=%llu\n", i, (unsigned long long)st->expected_offset);
+    }
+}
+
+void recv_data_file(struct sham_conn *conn, struct receiver_state *rs) {
     printf("Ready to receive file data from the client...\n");
     printf("Receiver buffer size: %d bytes\n", RECEIVER_BUFFER_SIZE);
     if (packet_loss_rate > 0.0) {
         printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
     }
-    
-    output_file = fopen(output_filename, "wb");
-    if (!output_file) {
-        perror("Failed to open output file");
-        return;
+
+    if (streams_enabled) {
+        printf("Streams: enabled, stream 0 goes to %s and stream N to %s.N\n", rs->output_filename, rs->output_filename);
+    } else if (batch_enabled) {
+        printf("Batch: enabled, creating files under %s\n", target_dir);
+    } else {
+        rs->output_file = stdout_data ? stdout_data : fopen(rs->output_filename, "wb");
+        if (pipe_enabled) printf("Pipe: enabled, writing to %s until the end marker\n", stdout_data ? "stdout" : rs->output_filename);
+        if (!rs->output_file) {
+            perror("Failed to open output file");
+            return;
+        }
     }
-    
+    if (compression_enabled) {
+        decompressor = decompressor_new(rs->output_file);
+        decompress_failed = 0;
+        printf("Compression: enabled, decompressing in the write path\n");
+    }
+    if (conn->options & FEC) {
+        printf("FEC: enabled, rebuilding lost segments from parity\n");
+    }
+
+    // Segments are written straight out of the reassembly buffer
+    ssize_t length;
     while (1) {
-        ssize_t bytes_received = recvfrom(sockfd, &packet, sizeof(struct sham_packet), 0, (struct sockaddr *)&client_addr, &client_len);
-        if (bytes_received < 0) {
-            continue;
+        const char *payload;
+        while ((length = sham_recv_peek(conn, &payload)) > 0) {
+            deliver_payload(rs, payload, length);
+            sham_recv_release(conn);
         }
-        
-        if (should_drop_packet()) {
-            printf("DROPPED packet SEQ=%u (simulated loss)\n", ntohl(packet.header.seq_num));
-            log_message("DROP DATA SEQ=%u\n", ntohl(packet.header.seq_num));
+        // Pipe output is flushed once per burst rather than per segment
+        if (pipe_enabled) fflush(rs->output_file);
+        if (length == 0 || sham_done(conn) || sham_wait(conn) < 0) break;
+    }
+    if (length == 0) {
+        printf("File transfer complete.\n");
+    } else {
+        printf("Connection to the client ended before its FIN.\n");
+    }
+
+    if (decompressor) {
+        if (decompressor_finish(decompressor) < 0 && !decompress_failed) {
+            log_message("COMP STREAM TRUNCATED\n");
+            decompress_failed = 1;
+            transfer_incomplete = 1;
+        }
+        decompressor = NULL;
+    }
+    if (conn->options & FEC) {
+        printf("FEC: rebuilt %lu segments without retransmission\n", conn->fec_dec.recovered);
+        log_message("FEC RECOVERED=%lu\n", conn->fec_dec.recovered);
+    }
+    if (streams_enabled) {
+        close_streams(rs);
+    } else if (batch_enabled) {
+        finish_batch(rs);
+    } else {
+        if (pipe_enabled) finish_pipe(rs);
+        fflush(rs->output_file);
+        if (stdout_data) {
+            printf("Data written to stdout\n");
+        } else if (decompress_failed) {
+            fclose(rs->output_file);
+            printf("Error: Compressed stream could not be decoded, %s is incomplete\n", rs->output_filename);
+        } else {
+            fclose(rs->output_file);
+            printf("File saved as: %s\n", rs->output_filename);
+            calculate_md5_hash(rs->output_filename);
+        }
+    }
+
+    sham_shutdown(conn);
+    while (!sham_done(conn)) {
+        if (sham_wait(conn) < 0) break;
+    }
+    if (conn->error) {
+        printf("Failed to receive final ACK. Connection may not have closed gracefully.\n");
+        log_message("FINAL ACK TIMEOUT\n");
+    }
+}
+
+// Collects the client's sham_get_request. Returns GET_OK with the path and
+// range filled in, another GET_ status for a malformed request, or -1 if
+// the client closed without one.
+static int read_get_request(struct sham_conn *conn, char *path, uint64_t *offset, uint64_t *length) {
+    char buffer[PAYLOAD_SIZE];
+    struct sham_get_request req;
+    size_t have = 0, want = sizeof(req);
+    while (have < want) {
+        const char *payload;
+        ssize_t received = sham_recv_peek(conn, &payload);
+        if (received > 0) {
+            size_t n = (size_t)received < sizeof(buffer) - have ? (size_t)received : sizeof(buffer) - have;
+            memcpy(buffer + have, payload, n);
+            have += n;
+            sham_recv_release(conn);
+            if (have >= sizeof(req)) {
+                memcpy(&req, buffer, sizeof(req));
+                want = sizeof(req) + ntohs(req.path_length);
+                if (want > sizeof(buffer)) return GET_BAD_REQUEST;
+            }
             continue;
         }
-        
-        if (packet.header.flags & FIN) {
-            printf("Received FIN from client. File transfer complete.\n");
-            log_message("RCV FIN SEQ=%u\n", ntohl(packet.header.seq_num));
-            
-            size_t total_written = 0;
-            int found_next;
-            do {
-                found_next = 0;
-                for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
-                    if (buffer[i].is_valid && buffer[i].seq_num == expected_seq) {
-                        fwrite(buffer[i].packet.payload, 1, buffer[i].data_length, output_file);
-                        total_written += buffer[i].data_length;
-                        printf("Wrote %zu buffered bytes to file\n", buffer[i].data_length);
-                        fc.buffer_used -= buffer[i].data_length;
-                        fc.buffer_available += buffer[i].data_length;
-                        expected_seq += buffer[i].data_length;
-                        buffer[i].is_valid = 0;
-                        found_next = 1;
-                        break;
-                    }
-                }
-            } while (found_next);
-            
-            fflush(output_file);
-            fclose(output_file);
-            printf("File saved as: %s\n", output_filename);
-            calculate_md5_hash(output_filename); // Call the MD5 function here
-
-            send_ack(sockfd, &client_addr, client_len, ntohl(packet.header.seq_num) + 1, fc.buffer_available);
-            send_termination_sequence(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
-            break;
+        if (received == 0 || sham_done(conn) || sham_wait(conn) < 0) return -1;
+    }
+
+    size_t path_length = want - sizeof(req);
+    memcpy(path, buffer + sizeof(req), path_length);
+    path[path_length] = '\0';
+    *offset = ((uint64_t)ntohl(req.offset_high) << 32) | ntohl(req.offset_low);
+    *length = ((uint64_t)ntohl(req.length_high) << 32) | ntohl(req.length_low);
+    if (strlen(path) != path_length || !safe_relative_name(path)) return GET_BAD_REQUEST;
+    return GET_OK;
+}
+
+// Download mode: answers the client's request with a sham_get_response and
+// the range, copied from the file mapping straight into outgoing segments
+void serve_download(struct sham_conn *conn) {
+    char name[PAYLOAD_SIZE];
+    uint64_t offset = 0, length = 0;
+    int status = read_get_request(conn, name, &offset, &length);
+    if (status < 0) {
+        printf("Client closed without a download request.\n");
+        log_message("GET NO REQUEST\n");
+        sham_shutdown(conn);
+        while (!sham_done(conn)) {
+            if (sham_wait(conn) < 0) break;
         }
-        
-        int received_seq = ntohl(packet.header.seq_num);
-        size_t payload_length = bytes_received - sizeof(struct sham_header);
-        
-        printf("RCV DATA SEQ=%u, Expected=%u, Length=%zu, Buffer Used=%d, Available=%d\n", received_seq, expected_seq, payload_length, fc.buffer_used, fc.buffer_available);
-        log_message("RCV DATA SEQ=%u LEN=%zu\n", received_seq, payload_length);
-        
-        if (received_seq == expected_seq) {
-            fwrite(packet.payload, 1, payload_length, output_file);
-            fflush(output_file);
-            printf("Wrote %zu bytes to file\n", payload_length);
-            expected_seq += payload_length;
-            
-            int found_next;
-            do {
-                found_next = 0;
-                for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
-                    if (buffer[i].is_valid && buffer[i].seq_num == expected_seq) {
-                        printf("Processing buffered packet SEQ=%u\n", expected_seq);
-                        fwrite(buffer[i].packet.payload, 1, buffer[i].data_length, output_file);
-                        fflush(output_file);
-                        printf("Wrote %zu buffered bytes to file\n", buffer[i].data_length);
-                        fc.buffer_used -= buffer[i].data_length;
-                        fc.buffer_available += buffer[i].data_length;
-                        expected_seq += buffer[i].data_length;
-                        buffer[i].is_valid = 0;
-                        found_next = 1;
-                        break;
-                    }
-                }
-            } while (found_next);
-            
-            send_ack(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
-        } else if (received_seq > expected_seq) {
-            printf("Out-of-order packet SEQ=%u (expecting %u). ", received_seq, expected_seq);
-            int already_buffered = 0;
-            for(int i = 0; i < MAX_BUFFER_PACKETS; i++) {
-                if(buffer[i].is_valid && buffer[i].seq_num == received_seq) {
-                    already_buffered = 1;
-                    break;
-                }
+        return;
+    }
+
+    struct file_map map;
+    memset(&map, 0, sizeof(map));
+    map.fd = -1;
+    char path[4096];
+    if (status == GET_OK) {
+        snprintf(path, sizeof(path), "%s/%s", serve_dir, name);
+        if (file_map_open_fd(&map, open_beneath(serve_dir, name, O_RDONLY, 0)) < 0) {
+            perror(path);
+            status = GET_NOT_FOUND;
+        } else if (offset > map.size) {
+            status = GET_BAD_RANGE;
+        } else {
+            if (length == 0 || length > map.size - offset) length = map.size - offset;
+            file_map_range(&map, offset, length);
+        }
+    }
+    if (status != GET_OK) length = 0;
+    printf("Download request: %s, %llu bytes from %llu, status %d\n", status == GET_BAD_REQUEST ? "(invalid)" : name,
+           (unsigned long long)length, (unsigned long long)offset, status);
+    log_message("GET STATUS=%d OFF=%llu LEN=%llu\n", status, (unsigned long long)offset, (unsigned long long)length);
+
+    struct sham_get_response resp;
+    resp.status = htons(status);
+    resp.flags = 0;
+    resp.size_high = htonl((uint32_t)(map.size >> 32));
+    resp.size_low = htonl((uint32_t)map.size);
+    resp.length_high = htonl((uint32_t)(length >> 32));
+    resp.length_low = htonl((uint32_t)length);
+
+    uint64_t sent = 0;
+    int header_sent = 0, finished = 0;
+    while (!sham_done(conn)) {
+        while (!finished) {
+            size_t room;
+            char *payload = sham_send_buffer(conn, &room);
+            if (!payload) break;
+            size_t used = 0;
+            if (!header_sent) {
+                memcpy(payload, &resp, sizeof(resp));
+                used = sizeof(resp);
+                header_sent = 1;
             }
-            if (!already_buffered && fc.buffer_available >= (int)payload_length) {
-                int buffered = 0;
-                for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
-                    if (!buffer[i].is_valid) {
-                        buffer[i].packet = packet;
-                        buffer[i].seq_num = received_seq;
-                        buffer[i].data_length = payload_length;
-                        buffer[i].is_valid = 1;
-                        fc.buffer_used += payload_length;
-                        fc.buffer_available -= payload_length;
-                        buffered = 1;
-                        printf("Buffering at slot %d\n", i);
-                        break;
-                    }
-                }
-                if (!buffered) {
-                    printf("Warning: Buffer slots full, dropping packet SEQ=%u\n", received_seq);
-                }
-            } else {
-                 if (already_buffered) {
-                     printf("Packet already buffered.\n");
-                 } else {
-                     printf("Insufficient buffer space (%d bytes needed, %d available), dropping packet\n", (int)payload_length, fc.buffer_available);
-                 }
+            ssize_t n = file_map_read(&map, sent, payload + used, room - used);
+            if (n < 0) {
+                perror("Failed to read the served file");
+                n = 0;
+                sent = length; // The client sees the range cut short
+            }
+            sent += n;
+            used += n;
+            if (used > 0) sham_send_commit(conn, used);
+            if (sent >= length) {
+                sham_shutdown(conn);
+                finished = 1;
             }
-            send_ack(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
-        } else {
-            printf("Duplicate/old packet SEQ=%u (expecting %u). Sending ACK.\n", received_seq, expected_seq);
-            send_ack(sockfd, &client_addr, client_len, expected_seq, fc.buffer_available);
         }
+        if (sham_wait(conn) < 0) break;
+        // Nothing else is expected from the client, but keep its window open
+        const char *payload;
+        while (sham_recv_peek(conn, &payload) > 0) sham_recv_release(conn);
+    }
+    file_map_close(&map);
+
+    if (conn->error) {
+        printf("Failed to close connection gracefully: %s.\n", strerror(conn->error));
+    } else {
+        printf("Download served: %llu bytes.\n", (unsigned long long)sent);
     }
 }
 
+// Fanout mode: one file from a one-to-many sender, written in place as
+// segments arrive. Returns non-zero unless it arrived whole.
+int recv_data_fanout(int sockfd) {
+    static struct fanout_receiver receiver;
+    fanout_receiver_init(&receiver, sockfd, output_name);
+    return fanout_receive(&receiver);
+}
+
 void print_usage(const char* program_name) {
     printf("Usage: %s <port> [--chat] [loss_rate]\n", program_name);
     printf("  port: Port number to listen on\n");
     printf("  --chat: Enable chat mode (optional)\n");
-    printf("  loss_rate: Packet loss probability 0.0-1.0 (optional, default: 0.0)\n");
+    printf("  --coalesce[=MS]: Chat: pack lines into shared segments, holding one back at most MS ms (default %d)\n",
+           CHAT_COALESCE_DELAY_MS);
+    printf("  --workers=N: Serve N sessions in worker processes steered by connection ID (optional)\n");
+    printf("  --dir=DIR: Create the files of a client's --batch under DIR (default: current directory)\n");
+    printf("  --serve=DIR: Answer a client's --get with files under DIR; without it downloads are declined\n");
+    printf("  --output=FILE: Write a single file or pipe transfer to FILE, or to stdout with - (messages\n");
+    printf("                 then go to stderr; default received_file.dat)\n");
+    printf("  --fanout[=GROUP]: Receive one file from a client's --fanout, joining multicast GROUP if given;\n");
+    printf("                    receivers sharing a group share the port (SHAM_MCAST_IF picks the interface)\n");
+    printf("  loss_rate: Packet loss probability 0.0-1.0 (optional, default: 0.0); with --fanout it drops\n");
+    printf("             arriving data, so each receiver loses different segments\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -403,6 +899,18 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    // With --output=- the data owns stdout, so everything printed goes to stderr
+    for (int i = 2; i < argc && !stdout_data; i++) {
+        if (strcmp(argv[i], "--output=-") != 0) continue;
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        stdout_data = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (!stdout_data || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Failed to set up output to stdout");
+            return 1;
+        }
+    }
+
     int server_port = atoi(argv[1]);
     if (server_port <= 0) {
         printf("Error: Invalid port number\n");
@@ -412,6 +920,36 @@ int main(int argc, char *argv[]) {
     for (int i = 2; i < argc; i++) {
         if (strcmp(argv[i], "--chat") == 0) {
             chat_mode = 1;
+        } else if (strncmp(argv[i], "--coalesce", 10) == 0) {
+            coalesce_delay_ms = CHAT_COALESCE_DELAY_MS;
+            if (argv[i][10] == '=') {
+                coalesce_delay_ms = atoi(argv[i] + 11);
+                if (coalesce_delay_ms < 0) {
+                    printf("Warning: Invalid coalescing delay %s, using %d ms\n", argv[i] + 11, CHAT_COALESCE_DELAY_MS);
+                    coalesce_delay_ms = CHAT_COALESCE_DELAY_MS;
+                }
+            }
+        } else if (strncmp(argv[i], "--fanout", 8) == 0) {
+            fanout_mode = 1;
+            if (argv[i][8] == '=') {
+                if (inet_pton(AF_INET, argv[i] + 9, &fanout_group) <= 0 || !IN_MULTICAST(ntohl(fanout_group.s_addr))) {
+                    printf("Error: %s is not a multicast group\n", argv[i] + 9);
+                    return 1;
+                }
+                fanout_multicast = 1;
+            }
+        } else if (strncmp(argv[i], "--dir=", 6) == 0) {
+            target_dir = argv[i] + 6;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serve_dir = argv[i] + 8;
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            output_name = argv[i] + 9;
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            worker_count = atoi(argv[i] + 10);
+            if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                printf("Warning: Invalid worker count %s, using 1\n", argv[i] + 10);
+                worker_count = 1;
+            }
         } else {
             double loss_rate = atof(argv[i]);
             if (loss_rate >= 0.0 && loss_rate <= 1.0) {
@@ -431,78 +969,96 @@ int main(int argc, char *argv[]) {
         printf("Logging enabled: writing to server_log.txt\n");
     }
     
-    srand(time(NULL));
-    
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    struct sham_header header;
+    srand(net_random32());
 
-    if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror("socket creation failed");
-        if (log_file) fclose(log_file);
-        exit(EXIT_FAILURE);
+    if (fanout_mode) {
+        if (chat_mode || stdout_data) {
+            printf("Error: --fanout writes a file, not chat or stdout\n");
+            if (log_file) fclose(log_file);
+            return 1;
+        }
+        if (worker_count > 1) {
+            printf("Note: --workers is not used with --fanout\n");
+            worker_count = 1;
+        }
     }
+    
+    int sockets[MAX_WORKERS + 1];
+    int socket_count = worker_count > 1 ? worker_count + 1 : 1;
+    struct sockaddr_in server_addr;
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(server_port);
 
-    if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind failed");
+    // Worker sockets share the port; their bind order is their reuseport
+    // index, with the accepting socket first
+    for (int i = 0; i < socket_count; i++) {
+        if ((sockets[i] = net_socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            perror("socket creation failed");
+            if (log_file) fclose(log_file);
+            exit(EXIT_FAILURE);
+        }
+        if (fanout_multicast) {
+            // Every receiver of the group on this host binds the group's port
+            int enable = 1;
+            net_setsockopt(sockets[i], SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        }
+        if (socket_count > 1) {
+            int enable = 1;
+            if (net_setsockopt(sockets[i], SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+                perror("SO_REUSEPORT failed");
+                if (log_file) fclose(log_file);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (net_bind(sockets[i], (const struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("bind failed");
+            if (log_file) fclose(log_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (fanout_multicast && fanout_join_group(sockets[0], fanout_group) < 0) {
         if (log_file) fclose(log_file);
         exit(EXIT_FAILURE);
     }
 
+    metrics_init("server");
     printf("Server listening on port %d...\n", server_port);
-    printf("Mode: %s\n", chat_mode ? "Chat" : "File Transfer");
+    printf("Mode: %s\n", fanout_mode ? "Fanout" : chat_mode ? "Chat" : "File Transfer");
     if (packet_loss_rate > 0.0) {
         printf("Packet loss rate: %.2f%%\n", packet_loss_rate * 100);
     }
 
-    printf("Waiting for SYN from client...\n");
-    recvfrom(sockfd, &header, sizeof(header), 0, (struct sockaddr *)&client_addr, &client_len);
-
-    if (header.flags & SYN) {
-        printf("Received SYN with seq_num: %u\n", ntohl(header.seq_num));
-        log_message("RCV SYN SEQ=%u\n", ntohl(header.seq_num));
-
-        struct sham_header syn_ack_header;
-        memset(&syn_ack_header, 0, sizeof(syn_ack_header));
-        syn_ack_header.flags = SYN | ACK;
-        syn_ack_header.seq_num = htonl(100);
-        syn_ack_header.ack_num = htonl(ntohl(header.seq_num) + 1);
-        syn_ack_header.window_size = htons(RECEIVER_BUFFER_SIZE);
-        if (!should_drop_packet()) {
-            sendto(sockfd, &syn_ack_header, sizeof(syn_ack_header), 0, (const struct sockaddr *)&client_addr, client_len);
-            printf("SND SYN-ACK SEQ=%u ACK=%u\n", ntohl(syn_ack_header.seq_num), ntohl(syn_ack_header.ack_num));
-            log_message("SND SYN-ACK SEQ=%u ACK=%u\n", ntohl(syn_ack_header.seq_num), ntohl(syn_ack_header.ack_num));
-        } else {
-            printf("DROPPED SYN-ACK (simulated loss)\n");
-            log_message("DROP SYN-ACK\n");
-        }
-
-        recvfrom(sockfd, &header, sizeof(header), 0, (struct sockaddr *)&client_addr, &client_len);
-        if ((header.flags & ACK) && (ntohl(header.ack_num) == ntohl(syn_ack_header.seq_num) + 1)) {
-            printf("Received final ACK. Handshake complete.\n");
-            log_message("RCV ACK FOR SYN\n");
-        } else {
-            printf("Handshake failed.\n");
-        }
-    } else {
-        printf("Expected SYN, but received different flag.\n");
+    if (worker_count > 1 && attach_steering_program(sockets[0], worker_count) < 0) {
+        // Without steering no SYN is sure to reach the accepting socket
+        printf("Warning: connection ID steering unavailable, serving one session\n");
+        for (int i = 1; i < socket_count; i++) net_close(sockets[i]);
+        worker_count = 1;
     }
 
-    printf("Handshake complete. Starting data transfer.\n");
-    if (chat_mode) {
-        recv_data_chat(sockfd);
+    if (fanout_mode) {
+        transfer_incomplete = recv_data_fanout(sockets[0]);
+    } else if (worker_count == 1) {
+        union sham_datagram rx;
+        struct sockaddr_in client_addr;
+        printf("Waiting for SYN from client...\n");
+        ssize_t bytes_received = read_syn(sockets[0], &rx, &client_addr);
+        run_session(sockets[0], output_name, &rx, bytes_received, &client_addr);
     } else {
-        recv_data_file(sockfd, "received_file.dat");
+        if (strcmp(output_name, "received_file.dat") != 0) {
+            printf("Note: --output is not used with --workers, worker N writes received_file.N.dat\n");
+        }
+        printf("Workers: %d, steering by connection ID\n", worker_count);
+        printf("Waiting for SYN from client...\n");
+        fflush(stdout);
+        accept_sessions(sockets);
+        printf("Server shutting down.\n");
     }
     
-    printf("Server shutting down.\n");
-    close(sockfd);
+    metrics_shutdown();
     if (log_file) fclose(log_file);
-    return 0;
-}
\ No newline at end of file
+    return transfer_incomplete;
+}
@@ -0,0 +1,1118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include "sham.h"
+#include "common.h"
+#include "net.h"
+#include "metrics.h"
+#include "qlog.h"
+#include "rtt.h"
+
+static void conn_log(struct sham_conn *c, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void trace(struct sham_conn *c, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void conn_log(struct sham_conn *c, const char *format, ...) {
+    if (!c->cfg.log) return;
+    va_list args;
+    va_start(args, format);
+    vlog_to(c->cfg.log, format, args);
+    va_end(args);
+}
+
+static void trace(struct sham_conn *c, const char *format, ...) {
+    if (!c->cfg.trace) return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(c->cfg.trace, format, args);
+    va_end(args);
+}
+
+// Sequence comparison that survives wraparound
+static int seq_after(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+// Moves next_seq past a new segment, counting each pass through 2^32
+static void advance_next_seq(struct sham_conn *c, size_t length) {
+    c->next_seq += length;
+    if (c->next_seq < length) {
+        c->send_wraps++;
+        conn_log(c, "SEQ WRAP SND EPOCH=%u\n", c->send_wraps);
+    }
+}
+
+static double elapsed_ms(const struct timeval *from, const struct timeval *to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_usec - from->tv_usec) / 1000.0;
+}
+
+static void transmit(struct sham_conn *c, const void *datagram, size_t length, const char *what, uint32_t seq) {
+    // Logged before the loss decision: a dropped packet was still sent as far
+    // as the sender knows, and its resend must show up as a second send
+    qlog_packet_in(c->qlog, QLOG_SENT, datagram, length);
+    if (should_drop(c->cfg.loss_rate, &c->loss_seed, c->metrics)) {
+        qlog_event_in(c->qlog, "transport:packet_dropped", "\"seq\":%u,\"trigger\":\"simulated_loss\"", seq);
+        trace(c, "DROPPED %s SEQ=%u (simulated loss)\n", what, seq);
+        conn_log(c, "DROP %s SEQ=%u\n", what, seq);
+        return;
+    }
+    net_sendto(c->sockfd, datagram, length, 0, (const struct sockaddr *)&c->peer, c->peer_len);
+}
+
+static void record_rtt(struct sham_conn *c, double sample_rtt) {
+    metrics_record_in(c->metrics, H_RTT, (uint64_t)(sample_rtt * 1000));
+    metrics_gauge_in(c->metrics, G_SRTT_US, (int64_t)(c->srtt * 1000));
+    metrics_gauge_in(c->metrics, G_RTO_US, (int64_t)(c->rto * 1000));
+    qlog_event_in(c->qlog, "recovery:metrics_updated", "\"latest_rtt\":%.3f,\"smoothed_rtt\":%.3f,\"rtt_variance\":%.3f,\"rto\":%.1f",
+               sample_rtt, c->srtt, c->rttvar, c->rto);
+}
+
+static void record_window(struct sham_conn *c) {
+    int in_flight = (int)(c->next_seq - c->acked);
+    metrics_gauge_in(c->metrics, G_IN_FLIGHT_BYTES, in_flight);
+    metrics_gauge_in(c->metrics, G_WINDOW_SEGMENTS, c->window_count);
+    metrics_gauge_in(c->metrics, G_PEER_WINDOW, c->peer_window);
+    qlog_event_in(c->qlog, "recovery:metrics_updated", "\"bytes_in_flight\":%d,\"window_segments\":%d,\"peer_window\":%d",
+               in_flight, c->window_count, c->peer_window);
+}
+
+// Free reassembly space, limited by free slots as well as bytes
+static int receive_window(const struct sham_conn *c) {
+    int free_slots = 0;
+    for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+        if (!c->reorder.slots[i].is_valid) free_slots++;
+    }
+    int window = c->receive_buffer - c->buffer_used;
+    if (window > free_slots * PAYLOAD_SIZE) window = free_slots * PAYLOAD_SIZE;
+    if (window < 0) window = 0;
+    if (window > UINT16_MAX) window = UINT16_MAX;
+    return window;
+}
+
+// Every packet from the data phase acknowledges all that has arrived
+static void ack_carried(struct sham_conn *c) {
+    c->ack_held = 0;
+    if (c->segment_arrival_us) {
+        metrics_record_in(c->metrics, H_ACK_DELAY, metrics_now_us() - c->segment_arrival_us);
+        c->segment_arrival_us = 0;
+    }
+}
+
+static void send_ack(struct sham_conn *c) {
+    struct sham_header header;
+    c->advertised_window = receive_window(c);
+    sham_header_encode(&header, c->next_seq, c->expected_seq, ACK, c->advertised_window, c->conn_id);
+    transmit(c, &header, sizeof(header), "ACK", c->expected_seq);
+    trace(c, "SND ACK=%u, Window=%d\n", c->expected_seq, c->advertised_window);
+    conn_log(c, "SND ACK=%u WIN=%d\n", c->expected_seq, c->advertised_window);
+    metrics_count_in(c->metrics, M_ACKS_SENT, 1);
+    ack_carried(c);
+}
+
+// With cfg.ack_delay_ms, the ACK for a lone in-order segment is held in case
+// data going the other way can carry it. A second segment, a filled gap or
+// anything out of order is acknowledged at once.
+static void acknowledge(struct sham_conn *c, int delayable) {
+    if (delayable && c->cfg.ack_delay_ms > 0 && !c->ack_held) {
+        c->ack_held = 1;
+        net_gettimeofday(&c->ack_held_since);
+        return;
+    }
+    send_ack(c);
+}
+
+// Data segments carry the ACK for the opposite direction as well
+static void send_segment(struct sham_conn *c, struct sham_segment *seg) {
+    c->advertised_window = receive_window(c);
+    struct sham_packet *packet = pool_packet(seg->buffer);
+    sham_header_encode(&packet->header, seg->seq_num, c->expected_seq, ACK, c->advertised_window, c->conn_id);
+    transmit(c, packet, sizeof(struct sham_header) + seg->data_length, "DATA", seg->seq_num);
+    net_gettimeofday(&seg->sent_time);
+    metrics_count_in(c->metrics, M_BYTES_SENT, seg->data_length);
+    ack_carried(c);
+}
+
+// A zero-window probe: no data, and a sequence number just below what the
+// peer expects, so it is answered with an ACK carrying the current window
+static void send_window_probe(struct sham_conn *c) {
+    struct sham_header header;
+    c->advertised_window = receive_window(c);
+    sham_header_encode(&header, c->next_seq - 1, c->expected_seq, ACK, c->advertised_window, c->conn_id);
+    transmit(c, &header, sizeof(header), "PROBE", c->next_seq - 1);
+    ack_carried(c);
+    trace(c, "SND WINDOW PROBE, next in %.0fms\n", rto_backoff(c->persist_interval));
+    conn_log(c, "SND WINDOW PROBE\n");
+}
+
+static void send_fin(struct sham_conn *c) {
+    struct sham_header header;
+    c->advertised_window = receive_window(c);
+    sham_header_encode(&header, c->fin_seq, c->expected_seq, FIN | ACK, c->advertised_window, c->conn_id);
+    transmit(c, &header, sizeof(header), "FIN", c->fin_seq);
+    ack_carried(c);
+    net_gettimeofday(&c->fin_time);
+    conn_log(c, "%s FIN SEQ=%u\n", c->fin_sent ? "RETX" : "SND", c->fin_seq);
+    c->fin_sent = 1;
+}
+
+static void send_handshake_packet(struct sham_conn *c) {
+    const char *what = c->initiator ? "SYN" : "SYN-ACK";
+    const char *verb = c->handshake_attempts ? "RETX" : "SND";
+    transmit(c, &c->handshake, c->handshake_length, what, ntohl(c->handshake.header.seq_num));
+    if (c->initiator) {
+        size_t early_length = c->handshake_length - sizeof(struct sham_header);
+        trace(c, "%s SYN with seq_num: %u%s\n", c->handshake_attempts ? "Resent" : "Sent",
+              ntohl(c->handshake.header.seq_num), early_length ? " and early data" : "");
+        conn_log(c, "%s SYN SEQ=%u LEN=%zu\n", verb, ntohl(c->handshake.header.seq_num), early_length);
+    } else {
+        trace(c, "%s SYN-ACK SEQ=%u ACK=%u\n", verb, ntohl(c->handshake.header.seq_num), ntohl(c->handshake.header.ack_num));
+        conn_log(c, "%s SYN-ACK SEQ=%u ACK=%u\n", verb, ntohl(c->handshake.header.seq_num), ntohl(c->handshake.header.ack_num));
+    }
+    net_gettimeofday(&c->handshake_sent);
+    c->handshake_attempts++;
+}
+
+// Acknowledges a SYN-ACK, also when the server retransmits it because our
+// first ACK was lost
+static void send_handshake_ack(struct sham_conn *c, const struct sham_header *syn_ack) {
+    struct sham_header header;
+    sham_header_encode(&header, syn_ack->ack_num, syn_ack->seq_num + 1, ACK, receive_window(c), c->conn_id);
+    transmit(c, &header, sizeof(header), "ACK FOR SYN", syn_ack->ack_num);
+    trace(c, "Sent final ACK. Handshake complete.\n");
+    conn_log(c, "SND ACK FOR SYN\n");
+}
+
+// Emits the parity packets of the open FEC group and closes it
+static void send_fec_parity(struct sham_conn *c) {
+    struct fec_encoder *enc = &c->fec_enc;
+    unsigned char datagram[FEC_MAX_PACKET];
+    for (int j = 0; j < enc->m; j++) {
+        size_t length = fec_encoder_build(enc, j, c->conn_id, datagram);
+        transmit(c, datagram, length, "PARITY", enc->seqs[0]);
+        trace(c, "SND PARITY SEQ=%u, K=%d, Index=%d/%d\n", enc->seqs[0], enc->count, j + 1, enc->m);
+        conn_log(c, "SND PARITY SEQ=%u K=%d IDX=%d\n", enc->seqs[0], enc->count, j);
+    }
+    enc->count = 0;
+}
+
+void sham_config_init(struct sham_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->peer_name = "peer";
+    cfg->fec_k = FEC_DEFAULT_K;
+    cfg->receive_buffer = RECEIVER_BUFFER_SIZE;
+    cfg->receive_buffer_max = RECEIVER_BUFFER_MAX;
+    cfg->max_timeouts = SHAM_MAX_TIMEOUTS;
+    cfg->isn = -1;
+}
+
+// Lets the kernel queue a full window of datagrams, allowing as much again
+// for its per-packet bookkeeping. A larger system default is left alone.
+static void size_socket_buffer(struct sham_conn *c) {
+    int wanted = 2 * c->receive_buffer;
+    if (wanted <= c->socket_buffer) return;
+    int current = 0;
+    socklen_t length = sizeof(current);
+    if (net_getsockopt(c->sockfd, SOL_SOCKET, SO_RCVBUF, &current, &length) == 0 && current >= wanted) {
+        c->socket_buffer = current;
+        return;
+    }
+    if (net_setsockopt(c->sockfd, SOL_SOCKET, SO_RCVBUF, &wanted, sizeof(wanted)) < 0) {
+        conn_log(c, "SO_RCVBUF %d FAILED\n", wanted);
+    } else {
+        conn_log(c, "SO_RCVBUF=%d\n", wanted);
+    }
+    c->socket_buffer = wanted;
+}
+
+static void init_conn(struct sham_conn *c, int sockfd, const struct sockaddr_in *peer, socklen_t peer_len,
+                      uint32_t conn_id, const struct sham_config *cfg, int initiator) {
+    memset(c, 0, sizeof(*c));
+    c->cfg = *cfg;
+    c->metrics = cfg->metrics ? cfg->metrics : metrics_conn;
+    c->qlog = cfg->qlog ? cfg->qlog : &qlog_process;
+    if (c->cfg.receive_buffer <= 0) c->cfg.receive_buffer = RECEIVER_BUFFER_SIZE;
+    // The reorder slots bound the window whatever the byte count
+    if (c->cfg.receive_buffer_max > MAX_BUFFER_PACKETS * PAYLOAD_SIZE) c->cfg.receive_buffer_max = MAX_BUFFER_PACKETS * PAYLOAD_SIZE;
+    if (c->cfg.receive_buffer_max < c->cfg.receive_buffer) c->cfg.receive_buffer_max = c->cfg.receive_buffer;
+    c->receive_buffer = c->cfg.receive_buffer;
+    if (!c->cfg.peer_name) c->cfg.peer_name = "peer";
+    c->sockfd = sockfd;
+    c->peer = *peer;
+    c->peer_len = peer_len;
+    c->conn_id = conn_id;
+    c->initiator = initiator;
+    c->loss_seed = net_random32();
+    c->peer_window = PAYLOAD_SIZE;
+    if (cfg->srtt > 0) {
+        c->srtt = cfg->srtt;
+        c->rttvar = cfg->rttvar;
+        c->rto = rto_from_estimate(c->srtt, c->rttvar);
+    } else {
+        c->srtt = 500.0;
+        c->rto = 1000.0;
+    }
+    c->fec_group_k = cfg->fec_k < WINDOW_SIZE ? cfg->fec_k : WINDOW_SIZE;
+    c->handshake_timeout = HANDSHAKE_INITIAL_TIMEOUT_MS;
+    for (int i = 0; i < WINDOW_SIZE; i++) c->window[i].buffer = POOL_NONE;
+    reorder_init(&c->reorder);
+    size_socket_buffer(c);
+    net_gettimeofday(&c->last_receive);
+}
+
+static void receive_segment(struct sham_conn *c, const struct sham_packet *packet, size_t length, uint32_t seq);
+
+int sham_connect(struct sham_conn *c, int sockfd, const struct sockaddr_in *peer, socklen_t peer_len,
+                 uint32_t conn_id, const struct sham_config *cfg, const void *early, size_t early_length) {
+    if (early_length > PAYLOAD_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    init_conn(c, sockfd, peer, peer_len, conn_id, cfg, 1);
+    c->isn = SHAM_CLIENT_ISN;
+    if (cfg->options & EXTSEQ) c->isn = cfg->isn >= 0 ? (uint32_t)cfg->isn : net_random32();
+    c->next_seq = c->acked = SHAM_CLIENT_FIRST_SEQ;
+
+    uint16_t flags = SYN | (cfg->options & SHAM_OPTIONS);
+    if (early_length > 0) flags |= EARLY;
+    sham_header_encode(&c->handshake.header, c->isn, 0, flags, receive_window(c), conn_id);
+    if (early_length > 0) memcpy(c->handshake.payload, early, early_length);
+    c->handshake_length = sizeof(struct sham_header) + early_length;
+
+    // A known server gets a SYN timeout sized from its RTT
+    if (cfg->srtt > 0) {
+        c->handshake_timeout = 3 * cfg->srtt;
+        if (c->handshake_timeout < 50) c->handshake_timeout = 50;
+        if (c->handshake_timeout > HANDSHAKE_MAX_TIMEOUT_MS) c->handshake_timeout = HANDSHAKE_MAX_TIMEOUT_MS;
+    }
+    c->state = SHAM_SYN_SENT;
+    send_handshake_packet(c);
+    return 0;
+}
+
+int sham_accept(struct sham_conn *c, int sockfd, const void *syn, ssize_t syn_length,
+                const struct sockaddr_in *from, uint32_t conn_id, const struct sham_config *cfg) {
+    const struct sham_packet *packet = syn;
+    struct sham_header h;
+    if (syn_length < (ssize_t)sizeof(struct sham_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+    sham_header_decode(&packet->header, &h);
+    if (!(h.flags & SYN)) {
+        errno = EINVAL;
+        return -1;
+    }
+    init_conn(c, sockfd, from, sizeof(*from), conn_id, cfg, 0);
+    trace(c, "Received SYN with seq_num: %u\n", h.seq_num);
+    conn_log(c, "RCV SYN SEQ=%u\n", h.seq_num);
+    conn_log(c, "CONN ID=%u\n", conn_id);
+
+    c->peer_window = h.window_size;
+    c->options = h.flags & cfg->options & SHAM_OPTIONS;
+    if (c->options & EXTSEQ) {
+        c->isn = cfg->isn >= 0 ? (uint32_t)cfg->isn : net_random32();
+        c->expected_seq = c->read_seq = h.seq_num + 1;
+        conn_log(c, "EXTSEQ NEGOTIATED ISN=%u\n", c->isn);
+    } else {
+        c->isn = SHAM_SERVER_ISN;
+        c->expected_seq = c->read_seq = SHAM_CLIENT_FIRST_SEQ;
+    }
+    c->next_seq = c->acked = c->isn + 1;
+    if (c->options & COMP) conn_log(c, "COMP NEGOTIATED\n");
+    if (c->options & FEC) {
+        fec_init();
+        fec_decoder_init(&c->fec_dec);
+        conn_log(c, "FEC NEGOTIATED\n");
+    }
+    if (c->options & STREAMS) conn_log(c, "STREAMS NEGOTIATED\n");
+
+    size_t early_length = syn_length - sizeof(struct sham_header);
+    if ((h.flags & EARLY) && early_length > 0 && (cfg->options & EARLY)) {
+        c->early_accepted = 1;
+        trace(c, "Accepted %zu bytes of early data on the SYN\n", early_length);
+        conn_log(c, "RCV EARLY DATA LEN=%zu\n", early_length);
+        receive_segment(c, packet, early_length, c->expected_seq);
+    }
+
+    uint16_t flags = SYN | ACK | c->options | (c->early_accepted ? EARLY : 0);
+    sham_header_encode(&c->handshake.header, c->isn, h.seq_num + 1, flags, receive_window(c), conn_id);
+    c->handshake_length = sizeof(struct sham_header);
+    c->state = SHAM_SYN_RECEIVED;
+    send_handshake_packet(c);
+    return 0;
+}
+
+// Arms the persist timer while the peer's window is shut with nothing in
+// flight: no ACK is due then, so a lost window update would never be repaired
+static void update_persist(struct sham_conn *c) {
+    if (c->peer_window > 0 || c->window_count > 0 || c->shutdown) {
+        c->persist_interval = 0;
+        return;
+    }
+    if (c->persist_interval > 0) return;
+    c->persist_interval = c->rto;
+    net_gettimeofday(&c->persist_time);
+    trace(c, "Receiver window closed, probing in %.0fms\n", c->persist_interval);
+    conn_log(c, "PERSIST %.0fms\n", c->persist_interval);
+}
+
+static void establish(struct sham_conn *c) {
+    c->state = SHAM_ESTABLISHED;
+    net_gettimeofday(&c->last_receive);
+    // Early data waited for the handshake to be acknowledged
+    if (!c->initiator && c->early_accepted) send_ack(c);
+}
+
+// Puts the segment that rode on the SYN into the window as already in flight
+static int seed_early_segment(struct sham_conn *c) {
+    struct sham_segment *seg = &c->window[0];
+    size_t length = c->handshake_length - sizeof(struct sham_header);
+    seg->buffer = pool_alloc();
+    if (seg->buffer == POOL_NONE) return -1;
+    seg->seq_num = c->next_seq;
+    seg->data_length = length;
+    seg->sent_time = c->handshake_sent;
+    seg->retransmitted = c->handshake_attempts > 1;
+    memcpy(pool_packet(seg->buffer)->payload, c->handshake.payload, length);
+    c->window_count = 1;
+    advance_next_seq(c, length);
+    c->segments_sent++;
+    metrics_count_in(c->metrics, M_SEGMENTS_SENT, 1);
+    metrics_count_in(c->metrics, M_BYTES_SENT, length);
+    return 0;
+}
+
+static void handle_syn_ack(struct sham_conn *c, const struct sham_header *h, const struct sockaddr_in *from) {
+    if (!(h->flags & SYN) || !(h->flags & ACK) || h->ack_num != c->isn + 1) return;
+    // Read on arrival, never before the wait for the SYN-ACK, or the sample
+    // below is close to zero and the RTO falls to its floor
+    struct timeval now;
+    net_gettimeofday(&now);
+    if (from) c->peer = *from;
+    trace(c, "Received SYN-ACK with seq_num: %u, ack_num: %u, window: %d\n", h->seq_num, h->ack_num, h->window_size);
+    conn_log(c, "RCV SYN-ACK SEQ=%u ACK=%u\n", h->seq_num, h->ack_num);
+    if (h->conn_id != c->conn_id) {
+        trace(c, "Server assigned connection ID %u (proposed %u)\n", h->conn_id, c->conn_id);
+        c->conn_id = h->conn_id;
+    }
+    conn_log(c, "CONN ID=%u\n", c->conn_id);
+
+    // Karn's rule: only an unambiguous SYN exchange gives an RTT sample
+    if (c->handshake_attempts == 1) {
+        double sample = elapsed_ms(&c->handshake_sent, &now);
+        if (c->cfg.srtt > 0) {
+            c->rto = rtt_update(&c->srtt, &c->rttvar, sample);
+        } else {
+            c->srtt = sample;
+            c->rttvar = sample / 2;
+            c->rto = rto_from_estimate(c->srtt, c->rttvar);
+        }
+        conn_log(c, "HANDSHAKE RTT=%.3f RTO=%.1f\n", sample, c->rto);
+        record_rtt(c, sample);
+    }
+
+    size_t early_length = c->handshake_length - sizeof(struct sham_header);
+    c->options = h->flags & c->cfg.options & SHAM_OPTIONS;
+    if (c->options & EXTSEQ) c->next_seq = c->acked = c->isn + 1;
+    c->early_accepted = early_length > 0 && (h->flags & EARLY);
+    c->peer_window = h->window_size;
+    c->expected_seq = c->read_seq = h->seq_num + 1;
+    if (c->options & FEC) {
+        fec_init();
+        fec_decoder_init(&c->fec_dec);
+    }
+    send_handshake_ack(c, h);
+    establish(c);
+    update_persist(c);
+
+    if (early_length > 0) {
+        int sent = c->early_accepted ? seed_early_segment(c)
+                                     : (int)sham_send(c, c->handshake.payload, early_length);
+        if (sent < 0) {
+            trace(c, "Out of packet buffers, closing the connection\n");
+            c->state = SHAM_DONE;
+            c->error = ENOBUFS;
+        }
+    }
+}
+
+// Returns 1 if the datagram should go on to the data path
+static int handle_handshake_ack(struct sham_conn *c, const struct sham_header *h, size_t payload_length) {
+    if (h->flags & SYN) {
+        // The client retransmitted its SYN, so our SYN-ACK was lost or late
+        conn_log(c, "RCV DUP SYN\n");
+        c->handshake_timeout *= 2;
+        if (c->handshake_timeout > HANDSHAKE_MAX_TIMEOUT_MS) c->handshake_timeout = HANDSHAKE_MAX_TIMEOUT_MS;
+        send_handshake_packet(c);
+        return 0;
+    }
+    if ((h->flags & ACK) && !(h->flags & FIN) && h->ack_num == c->isn + 1) {
+        trace(c, "Received final ACK. Handshake complete.\n");
+        conn_log(c, "RCV ACK FOR SYN\n");
+        if (c->handshake_attempts == 1) {
+            struct timeval now;
+            net_gettimeofday(&now);
+            double sample = elapsed_ms(&c->handshake_sent, &now);
+            c->srtt = sample;
+            c->rttvar = sample / 2;
+            c->rto = rto_from_estimate(c->srtt, c->rttvar);
+            record_rtt(c, sample);
+        }
+        establish(c);
+        // A segment from the client carries this ACK too
+        return payload_length > 0;
+    }
+    // Parity or FIN: the client has our SYN-ACK and moved on
+    trace(c, "Handshake ACK lost, data-phase packet confirms the connection.\n");
+    conn_log(c, "RCV DATA BEFORE ACK FOR SYN\n");
+    establish(c);
+    return 1;
+}
+
+static void process_ack(struct sham_conn *c, const struct sham_header *h, int pure_ack) {
+    uint32_t ack_num = h->ack_num;
+    c->peer_window = h->window_size;
+    metrics_count_in(c->metrics, M_ACKS_RECEIVED, 1);
+
+    // The first duplicate of an ACK marks a gap at the receiver
+    if (pure_ack) {
+        if (ack_num == c->last_ack && c->window_count > 0) {
+            if (!c->dup_ack_seen) c->loss_events++;
+            c->dup_ack_seen = 1;
+        } else {
+            c->dup_ack_seen = 0;
+        }
+        c->last_ack = ack_num;
+        trace(c, "Received ACK=%u, Receiver Window=%d\n", ack_num, c->peer_window);
+        conn_log(c, "RCV ACK=%u\n", ack_num);
+    }
+    if (!seq_after(ack_num, c->acked) || seq_after(ack_num, c->next_seq)) return;
+
+    // New data got through, so the backoff ends even without a sample
+    c->rto = rto_from_estimate(c->srtt, c->rttvar);
+    struct timeval now;
+    net_gettimeofday(&now);
+    while (c->window_count > 0) {
+        struct sham_segment *seg = &c->window[c->window_start];
+        if (seq_after(seg->seq_num + seg->data_length, ack_num)) break;
+        if (!seg->retransmitted) {
+            double sample = elapsed_ms(&seg->sent_time, &now);
+            c->rto = rtt_update(&c->srtt, &c->rttvar, sample);
+            record_rtt(c, sample);
+        }
+        trace(c, "Packet SEQ=%u acknowledged\n", seg->seq_num);
+        metrics_count_in(c->metrics, M_BYTES_ACKED, seg->data_length);
+        qlog_event_in(c->qlog, "recovery:packet_acked", "\"seq\":%u,\"length\":%zu", seg->seq_num, seg->data_length);
+        pool_free(seg->buffer);
+        seg->buffer = POOL_NONE;
+        c->window_start = (c->window_start + 1) % WINDOW_SIZE;
+        c->window_count--;
+    }
+    c->acked = ack_num;
+    c->timeouts = 0;
+    if (c->fin_sent && !c->fin_acked && ack_num == c->fin_seq + 1) {
+        trace(c, "Received ACK from %s for our FIN.%s\n", c->cfg.peer_name, c->peer_closed ? "" : " Waiting for theirs.");
+        conn_log(c, "RCV ACK FOR FIN\n");
+        c->fin_acked = 1;
+    }
+    trace(c, "Flow control update: Bytes in flight = %d, Receiver window = %d\n", (int)(c->next_seq - c->acked), c->peer_window);
+    conn_log(c, "FLOW WIN UPDATE=%u\n", c->peer_window);
+    record_window(c);
+}
+
+// Time to receive one advertised window: the RTT when the window is what
+// holds the sender back, more than that otherwise. It falls to any lower
+// sample at once and rises slowly, as queueing only ever inflates it.
+static void measure_receive_rtt(struct sham_conn *c) {
+    struct timeval now;
+    net_gettimeofday(&now);
+    if (c->receive_rtt_time.tv_sec != 0) {
+        if (seq_after(c->receive_rtt_seq, c->expected_seq)) return;
+        double sample = elapsed_ms(&c->receive_rtt_time, &now);
+        if (sample < 0.01) sample = 0.01;
+        if (c->receive_rtt == 0 || sample < c->receive_rtt) {
+            c->receive_rtt = sample;
+        } else {
+            c->receive_rtt = 0.875 * c->receive_rtt + 0.125 * sample;
+        }
+    }
+    c->receive_rtt_seq = c->expected_seq + (c->advertised_window > 0 ? c->advertised_window : PAYLOAD_SIZE);
+    c->receive_rtt_time = now;
+}
+
+// Sizes the receive buffer at twice what the reader took in the last RTT,
+// so a sender held back by the window can double its rate every round trip
+// while a slow reader keeps the buffer small. It only grows, up to
+// receive_buffer_max.
+static void tune_receive_buffer(struct sham_conn *c) {
+    if (c->receive_rtt == 0 || c->receive_buffer >= c->cfg.receive_buffer_max) return;
+    struct timeval now;
+    net_gettimeofday(&now);
+    if (c->reader_time.tv_sec == 0) {
+        c->reader_seq = c->read_seq;
+        c->reader_time = now;
+        return;
+    }
+    double elapsed = elapsed_ms(&c->reader_time, &now);
+    if (elapsed < c->receive_rtt) return;
+    int copied = (int)(c->read_seq - c->reader_seq);
+    if (copied > c->reader_space && 2 * copied > c->receive_buffer) {
+        int target = 2 * copied;
+        if (target > c->cfg.receive_buffer_max) target = c->cfg.receive_buffer_max;
+        trace(c, "Receive buffer %d -> %d bytes (%d read in %.1fms)\n", c->receive_buffer, target, copied, elapsed);
+        conn_log(c, "RCVBUF TUNE=%d READ=%d RTT=%.1f\n", target, copied, c->receive_rtt);
+        c->receive_buffer = target;
+        size_socket_buffer(c);
+    }
+    c->reader_space = copied;
+    c->reader_seq = c->read_seq;
+    c->reader_time = now;
+}
+
+// Segments the caller's deliver_ahead accepts while earlier connection data
+// is still missing; they stay in the buffer only for the cumulative ACK
+static void deliver_backlog(struct sham_conn *c) {
+    if (!c->cfg.deliver_ahead) return;
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (int i = 0; i < MAX_BUFFER_PACKETS; i++) {
+            struct buffered_packet *slot = &c->reorder.slots[i];
+            if (!slot->is_valid || slot->consumed) continue;
+            if (c->cfg.deliver_ahead(c->cfg.deliver_arg, reorder_packet(slot)->payload, slot->data_length)) {
+                reorder_consume(slot);
+                c->buffer_used -= slot->data_length;
+                progress = 1;
+            }
+        }
+    }
+}
+
+// Handles one data segment, whether it arrived on the wire or was rebuilt
+// from parity, then acknowledges the cumulative position
+static void receive_segment(struct sham_conn *c, const struct sham_packet *packet, size_t length, uint32_t seq) {
+    int delayable = 0;
+    trace(c, "RCV DATA SEQ=%u, Expected=%u, Length=%zu, Buffer Used=%d\n", seq, c->expected_seq, length, c->buffer_used);
+    conn_log(c, "RCV DATA SEQ=%u LEN=%zu\n", seq, length);
+
+    if (!c->peer_closed && seq == c->expected_seq) {
+        // Kept until the caller reads it
+        if (reorder_insert(&c->reorder, seq, packet, length) < 0) {
+            trace(c, "Warning: Buffer slots full, dropping packet SEQ=%u\n", seq);
+            metrics_count_in(c->metrics, M_BUFFER_DROPS, 1);
+            qlog_event_in(c->qlog, "transport:packet_dropped", "\"seq\":%u,\"trigger\":\"buffer_full\"", seq);
+        } else {
+            c->buffer_used += length;
+            c->expected_seq += length;
+            delayable = 1;
+            struct buffered_packet *next;
+            while ((next = reorder_next(&c->reorder, c->expected_seq)) != NULL) {
+                trace(c, "Gap filled up to buffered packet SEQ=%u\n", c->expected_seq);
+                c->expected_seq += next->data_length;
+                delayable = 0;
+            }
+            if (c->expected_seq < seq) {
+                c->receive_wraps++;
+                conn_log(c, "SEQ WRAP RCV EPOCH=%u\n", c->receive_wraps);
+            }
+            measure_receive_rtt(c);
+            deliver_backlog(c);
+        }
+    } else if (!c->peer_closed && seq_after(seq, c->expected_seq)) {
+        metrics_count_in(c->metrics, M_OUT_OF_ORDER, 1);
+        trace(c, "Out-of-order packet SEQ=%u (expecting %u). ", seq, c->expected_seq);
+        if (reorder_contains(&c->reorder, seq)) {
+            trace(c, "Packet already buffered.\n");
+            metrics_count_in(c->metrics, M_DUPLICATES, 1);
+        } else if (c->cfg.deliver_ahead && c->cfg.deliver_ahead(c->cfg.deliver_arg, packet->payload, length)) {
+            int slot = reorder_insert(&c->reorder, seq, NULL, length);
+            if (slot >= 0) {
+                reorder_consume(&c->reorder.slots[slot]);
+                trace(c, "Delivered ahead of the connection gap, slot %d\n", slot);
+                deliver_backlog(c);
+            } else {
+                // Already delivered; the retransmission will be recognised as stale
+                trace(c, "Warning: Buffer slots full, delivered packet SEQ=%u will be resent\n", seq);
+            }
+        } else if (receive_window(c) >= (int)length && reorder_insert(&c->reorder, seq, packet, length) >= 0) {
+            c->buffer_used += length;
+            trace(c, "Buffered\n");
+        } else {
+            trace(c, "Insufficient buffer space (%d bytes needed, %d available), dropping packet\n", (int)length, receive_window(c));
+            metrics_count_in(c->metrics, M_BUFFER_DROPS, 1);
+            qlog_event_in(c->qlog, "transport:packet_dropped", "\"seq\":%u,\"trigger\":\"buffer_full\"", seq);
+        }
+    } else {
+        metrics_count_in(c->metrics, M_DUPLICATES, 1);
+        trace(c, "Duplicate/old packet SEQ=%u (expecting %u). Sending ACK.\n", seq, c->expected_seq);
+    }
+
+    metrics_gauge_in(c->metrics, G_BUFFER_USED, c->buffer_used);
+    qlog_event_in(c->qlog, "transport:window_updated", "\"buffer_used\":%d,\"window\":%d", c->buffer_used, receive_window(c));
+    if (c->state == SHAM_ESTABLISHED) acknowledge(c, delayable);
+}
+
+// Feeds every segment the parity groups can now rebuild back into the
+// normal data path, so the sender never has to retransmit them
+static void apply_fec_recovery(struct sham_conn *c) {
+    struct fec_segment rebuilt[FEC_MAX_K];
+    int count;
+    while ((count = fec_decoder_recover(&c->fec_dec, c->expected_seq, rebuilt, FEC_MAX_K)) > 0) {
+        for (int i = 0; i < count; i++) {
+            struct sham_packet packet;
+            memset(&packet.header, 0, sizeof(packet.header));
+            packet.header.seq_num = htonl(rebuilt[i].seq);
+            memcpy(packet.payload, rebuilt[i].data, rebuilt[i].length);
+            trace(c, "FEC rebuilt SEQ=%u, Length=%zu\n", rebuilt[i].seq, rebuilt[i].length);
+            conn_log(c, "FEC RECOVER SEQ=%u LEN=%zu\n", rebuilt[i].seq, rebuilt[i].length);
+            metrics_count_in(c->metrics, M_FEC_RECOVERED, 1);
+            qlog_event_in(c->qlog, "recovery:packet_recovered", "\"seq\":%u,\"length\":%zu", rebuilt[i].seq, rebuilt[i].length);
+            receive_segment(c, &packet, rebuilt[i].length, rebuilt[i].seq);
+        }
+    }
+}
+
+static void process_fin(struct sham_conn *c, uint32_t seq) {
+    if (!c->peer_closed && seq == c->expected_seq) {
+        trace(c, "Received FIN from %s.\n", c->cfg.peer_name);
+        conn_log(c, "RCV FIN SEQ=%u\n", seq);
+        c->peer_closed = 1;
+        c->expected_seq = seq + 1; // The FIN takes one sequence number
+    } else {
+        conn_log(c, "RCV %s FIN SEQ=%u\n", c->peer_closed ? "DUP" : "EARLY", seq);
+    }
+    send_ack(c);
+}
+
+// FIN once everything sent is acknowledged; done once both sides are closed
+static void advance(struct sham_conn *c) {
+    if (c->state != SHAM_ESTABLISHED) return;
+    if (c->shutdown && c->window_count == 0 && !c->fin_sent) {
+        trace(c, "Sending FIN to %s...\n", c->cfg.peer_name);
+        c->fin_seq = c->next_seq++;
+        send_fin(c);
+    }
+    if (c->fin_acked && c->peer_closed) {
+        trace(c, "Connection closed.\n");
+        conn_log(c, "CLOSED\n");
+        c->state = SHAM_DONE;
+    }
+}
+
+void sham_input(struct sham_conn *c, const void *datagram, ssize_t length, const struct sockaddr_in *from) {
+    if (length < (ssize_t)sizeof(struct sham_header) || c->state == SHAM_IDLE) return;
+    const struct sham_packet *packet = datagram;
+    struct sham_header h;
+    sham_header_decode(&packet->header, &h);
+
+    // The SYN-ACK may assign a different connection ID
+    if (c->state == SHAM_SYN_SENT) {
+        handle_syn_ack(c, &h, from);
+        return;
+    }
+    if (h.conn_id != c->conn_id) {
+        conn_log(c, "IGNORE CONN=%u\n", h.conn_id);
+        return;
+    }
+    size_t payload_length = length - sizeof(struct sham_header);
+    if (c->state == SHAM_DONE) {
+        // Our final ACK was lost and the peer is repeating its FIN
+        if (h.flags & FIN) send_ack(c);
+        return;
+    }
+    if (c->state == SHAM_SYN_RECEIVED && !handle_handshake_ack(c, &h, payload_length)) return;
+
+    if (from && (from->sin_addr.s_addr != c->peer.sin_addr.s_addr || from->sin_port != c->peer.sin_port)) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &from->sin_addr, ip, sizeof(ip));
+        trace(c, "Connection %u migrated to %s:%d\n", c->conn_id, ip, ntohs(from->sin_port));
+        conn_log(c, "MIGRATE CONN=%u %s:%d\n", c->conn_id, ip, ntohs(from->sin_port));
+        c->peer = *from;
+    }
+    if (should_drop(c->cfg.receive_loss_rate, &c->loss_seed, c->metrics)) {
+        qlog_event_in(c->qlog, "transport:packet_dropped", "\"seq\":%u,\"trigger\":\"simulated_loss\"", h.seq_num);
+        trace(c, "DROPPED packet SEQ=%u (simulated loss)\n", h.seq_num);
+        conn_log(c, "DROP DATA SEQ=%u\n", h.seq_num);
+        return;
+    }
+    net_gettimeofday(&c->last_receive);
+    c->probes = 0;
+
+    if (h.flags & SYN) {
+        if (h.flags & ACK) {
+            // Retransmitted SYN-ACK, our handshake ACK was lost
+            send_handshake_ack(c, &h);
+        } else {
+            conn_log(c, "IGNORE HANDSHAKE PACKET\n");
+        }
+        return;
+    }
+    if (h.flags & FEC) {
+        if ((c->options & FEC) && fec_decoder_add_parity(&c->fec_dec, datagram, length) >= 0) {
+            conn_log(c, "RCV PARITY SEQ=%u\n", h.seq_num);
+            apply_fec_recovery(c);
+        }
+        return;
+    }
+
+    if (h.flags & ACK) {
+        process_ack(c, &h, payload_length == 0 && !(h.flags & FIN));
+        update_persist(c);
+    }
+    if (payload_length == 0 && !(h.flags & FIN) && h.seq_num + 1 == c->expected_seq) {
+        // A window probe: the answer carries our current window
+        conn_log(c, "RCV WINDOW PROBE\n");
+        send_ack(c);
+    }
+    if (payload_length > 0) {
+        metrics_count_in(c->metrics, M_SEGMENTS_RECEIVED, 1);
+        metrics_count_in(c->metrics, M_BYTES_RECEIVED, payload_length);
+        c->segment_arrival_us = metrics_now_us();
+        receive_segment(c, packet, payload_length, h.seq_num);
+        if (c->options & FEC) {
+            fec_decoder_store(&c->fec_dec, h.seq_num, packet->payload, payload_length);
+            apply_fec_recovery(c);
+        }
+    }
+    if (h.flags & FIN) process_fin(c, h.seq_num + payload_length);
+    advance(c);
+}
+
+// Handshake retransmissions, the held ACK, the RTO, FIN retries and the wait
+// for the peer's FIN. Returns ms until the next of them is due, or -1 if none is armed.
+static double service_timers(struct sham_conn *c, int fire) {
+    struct timeval now;
+    net_gettimeofday(&now);
+    double next = -1;
+
+    if (c->state == SHAM_SYN_SENT || c->state == SHAM_SYN_RECEIVED) {
+        double remaining = c->handshake_timeout - elapsed_ms(&c->handshake_sent, &now);
+        if (remaining > 0 || !fire) return remaining > 0 ? remaining : 0;
+        if (c->state == SHAM_SYN_SENT) {
+            trace(c, "Timeout waiting for SYN-ACK after %.0fms\n", c->handshake_timeout);
+            conn_log(c, "TIMEOUT SYN\n");
+            metrics_count_in(c->metrics, M_TIMEOUTS, 1);
+        }
+        if (c->handshake_attempts >= HANDSHAKE_MAX_ATTEMPTS) {
+            if (c->state == SHAM_SYN_SENT) {
+                c->state = SHAM_DONE;
+                c->error = ETIMEDOUT;
+                return -1;
+            }
+            trace(c, "No ACK for SYN-ACK after %d attempts, continuing.\n", HANDSHAKE_MAX_ATTEMPTS);
+            conn_log(c, "TIMEOUT ACK FOR SYN\n");
+            establish(c);
+        } else {
+            c->handshake_timeout *= 2;
+            if (c->handshake_timeout > HANDSHAKE_MAX_TIMEOUT_MS) c->handshake_timeout = HANDSHAKE_MAX_TIMEOUT_MS;
+            send_handshake_packet(c);
+            return c->handshake_timeout;
+        }
+    }
+    if (c->state != SHAM_ESTABLISHED) return -1;
+
+    if (c->ack_held) {
+        double remaining = c->cfg.ack_delay_ms - elapsed_ms(&c->ack_held_since, &now);
+        if (remaining <= 0 && fire) {
+            send_ack(c);
+        } else {
+            next = remaining > 0 ? remaining : 0;
+        }
+    }
+
+    if (c->window_count > 0) {
+        struct sham_segment *seg = &c->window[c->window_start];
+        double remaining = c->rto - elapsed_ms(&seg->sent_time, &now);
+        if (remaining <= 0 && fire) {
+            trace(c, "TIMEOUT! Retransmitting SEQ=%u\n", seg->seq_num);
+            conn_log(c, "TIMEOUT SEQ=%u\n", seg->seq_num);
+            qlog_event_in(c->qlog, "recovery:packet_lost", "\"seq\":%u,\"trigger\":\"rto\"", seg->seq_num);
+            metrics_count_in(c->metrics, M_TIMEOUTS, 1);
+            metrics_count_in(c->metrics, M_RETRANSMISSIONS, 1);
+            c->retransmissions++;
+            c->loss_events++;
+            if (c->cfg.max_timeouts > 0 && ++c->timeouts > c->cfg.max_timeouts) {
+                trace(c, "No response from %s after %d retransmissions, giving up.\n", c->cfg.peer_name, c->cfg.max_timeouts);
+                conn_log(c, "PEER UNREACHABLE\n");
+                c->state = SHAM_DONE;
+                c->error = ETIMEDOUT;
+                return -1;
+            }
+            // Everything in flight now waits on the repair, so none of it
+            // gives a meaningful RTT sample either
+            for (int i = 0; i < c->window_count; i++) {
+                c->window[(c->window_start + i) % WINDOW_SIZE].retransmitted = 1;
+            }
+            send_segment(c, seg);
+            conn_log(c, "RETX DATA SEQ=%u LEN=%zu\n", seg->seq_num, seg->data_length);
+            c->rto = rto_backoff(c->rto);
+            remaining = c->rto;
+        }
+        if (remaining < 0) remaining = 0;
+        if (next < 0 || remaining < next) next = remaining;
+    }
+
+    if (c->persist_interval > 0) {
+        double remaining = c->persist_interval - elapsed_ms(&c->persist_time, &now);
+        if (remaining <= 0 && fire) {
+            // A peer that answers probes is alive, however long its window stays shut
+            if (c->cfg.max_timeouts > 0 && ++c->probes > c->cfg.max_timeouts) {
+                trace(c, "No answer from %s to %d window probes, giving up.\n", c->cfg.peer_name, c->cfg.max_timeouts);
+                conn_log(c, "PEER UNREACHABLE\n");
+                c->state = SHAM_DONE;
+                c->error = ETIMEDOUT;
+                return -1;
+            }
+            send_window_probe(c);
+            c->persist_time = now;
+            c->persist_interval = rto_backoff(c->persist_interval);
+            remaining = c->persist_interval;
+        }
+        if (remaining < 0) remaining = 0;
+        if (next < 0 || remaining < next) next = remaining;
+    }
+
+    if (c->fin_sent && !c->fin_acked) {
+        double remaining = c->rto - elapsed_ms(&c->fin_time, &now);
+        if (remaining <= 0 && fire) {
+            if (++c->fin_retries > SHAM_FIN_RETRIES) {
+                trace(c, "Failed to close connection gracefully after multiple retries.\n");
+                conn_log(c, "FIN TIMEOUT\n");
+                c->state = SHAM_DONE;
+                c->error = ETIMEDOUT;
+                return -1;
+            }
+            trace(c, "Timeout waiting for FIN acknowledgement. Re-transmitting FIN...\n");
+            c->rto = rto_backoff(c->rto);
+            send_fin(c);
+            remaining = c->rto;
+        }
+        if (remaining < 0) remaining = 0;
+        if (next < 0 || remaining < next) next = remaining;
+    } else if (c->fin_acked && !c->peer_closed) {
+        double remaining = SHAM_CLOSE_TIMEOUT_MS - elapsed_ms(&c->last_receive, &now);
+        if (remaining <= 0 && fire) {
+            trace(c, "Timeout waiting for FIN from %s.\n", c->cfg.peer_name);
+            conn_log(c, "TIMEOUT waiting for peer FIN\n");
+            c->state = SHAM_DONE;
+            return -1;
+        }
+        if (remaining < 0) remaining = 0;
+        if (next < 0 || remaining < next) next = remaining;
+    }
+    return next;
+}
+
+int sham_process(struct sham_conn *c) {
+    union sham_datagram rx;
+    while (c->state != SHAM_IDLE) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t length = net_recvfrom(c->sockfd, &rx, sizeof(rx), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        qlog_packet_in(c->qlog, QLOG_RECEIVED, &rx, length);
+        sham_input(c, &rx, length, &from);
+    }
+    service_timers(c, 1);
+    advance(c);
+    return 0;
+}
+
+int sham_fd(const struct sham_conn *c) {
+    return c->sockfd;
+}
+
+int sham_timeout_ms(const struct sham_conn *c) {
+    double next = service_timers((struct sham_conn *)c, 0);
+    if (next < 0) return -1;
+    return (int)next + 1; // Rounded up, so the timer is due on wakeup
+}
+
+int sham_wait(struct sham_conn *c) {
+    int timeout = sham_timeout_ms(c);
+    struct timeval tv = {1, 0};
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(c->sockfd, &read_fds);
+    if (net_select(c->sockfd + 1, &read_fds, NULL, NULL, &tv) < 0 && errno != EINTR) {
+        perror("select error");
+        return -1;
+    }
+    return sham_process(c);
+}
+
+int sham_established(const struct sham_conn *c) {
+    return c->state == SHAM_ESTABLISHED;
+}
+
+int sham_done(const struct sham_conn *c) {
+    return c->state == SHAM_DONE;
+}
+
+void sham_close(struct sham_conn *c) {
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        pool_free(c->window[i].buffer);
+        c->window[i].buffer = POOL_NONE;
+    }
+    c->window_count = 0;
+    reorder_clear(&c->reorder);
+    c->state = SHAM_DONE;
+}
+
+// A full segment must fit the advertised space, except that one may always
+// go out into an open window with nothing in flight
+static int window_open(const struct sham_conn *c) {
+    int in_flight = (int)(c->next_seq - c->acked);
+    return c->window_count < WINDOW_SIZE && in_flight < c->peer_window &&
+           (in_flight == 0 || in_flight + PAYLOAD_SIZE <= c->peer_window);
+}
+
+int sham_writable(const struct sham_conn *c) {
+    return c->state == SHAM_ESTABLISHED && !c->shutdown && window_open(c);
+}
+
+char *sham_send_buffer(struct sham_conn *c, size_t *room) {
+    if (c->state != SHAM_ESTABLISHED) {
+        errno = c->state == SHAM_DONE ? EPIPE : ENOTCONN;
+        return NULL;
+    }
+    if (c->shutdown) {
+        errno = EPIPE;
+        return NULL;
+    }
+    if (!window_open(c)) {
+        // Flow control rather than the window is what stops us: close a short
+        // group now rather than after the receiver drains
+        if (c->window_count < WINDOW_SIZE) sham_flush(c);
+        errno = EAGAIN;
+        return NULL;
+    }
+    struct sham_segment *seg = &c->window[(c->window_start + c->window_count) % WINDOW_SIZE];
+    if (seg->buffer == POOL_NONE) seg->buffer = pool_alloc();
+    if (seg->buffer == POOL_NONE) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+    *room = PAYLOAD_SIZE;
+    return pool_packet(seg->buffer)->payload;
+}
+
+int sham_send_commit(struct sham_conn *c, size_t length) {
+    struct sham_segment *seg = &c->window[(c->window_start + c->window_count) % WINDOW_SIZE];
+    if (length == 0 || length > PAYLOAD_SIZE || seg->buffer == POOL_NONE) {
+        errno = EINVAL;
+        return -1;
+    }
+    seg->seq_num = c->next_seq;
+    seg->data_length = length;
+    seg->retransmitted = 0;
+    send_segment(c, seg);
+    trace(c, "SND DATA SEQ=%u, Size=%zu, Bytes in flight: %d, Receiver window: %d\n", seg->seq_num, length,
+          (int)(c->next_seq + length - c->acked), c->peer_window);
+    conn_log(c, "SND DATA SEQ=%u LEN=%zu\n", seg->seq_num, length);
+
+    // A group never spans more than one window, so the segments after any
+    // loss can always be sent and the group closed without waiting on ACKs
+    if (c->options & FEC) {
+        struct fec_encoder *enc = &c->fec_enc;
+        if (enc->count == 0) {
+            if (c->segments_since_estimate > 0) {
+                double sample = (double)c->loss_events / c->segments_since_estimate;
+                c->fec_loss_estimate = 0.75 * c->fec_loss_estimate + 0.25 * sample;
+                c->loss_events = 0;
+                c->segments_since_estimate = 0;
+            }
+            int m = c->cfg.fec_m ? c->cfg.fec_m : fec_choose_parity(c->fec_loss_estimate, c->fec_group_k);
+            fec_encoder_reset(enc, c->fec_group_k, m);
+        }
+        fec_encoder_add(enc, seg->seq_num, pool_packet(seg->buffer)->payload, length);
+        c->segments_since_estimate++;
+        if (enc->count == enc->k) send_fec_parity(c);
+    }
+
+    c->segments_sent++;
+    metrics_count_in(c->metrics, M_SEGMENTS_SENT, 1);
+    advance_next_seq(c, length);
+    c->window_count++;
+    return 0;
+}
+
+ssize_t sham_send(struct sham_conn *c, const void *data, size_t length) {
+    size_t room;
+    char *payload = sham_send_buffer(c, &room);
+    if (!payload) return -1;
+    if (length > room) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(payload, data, length);
+    if (sham_send_commit(c, length) < 0) return -1;
+    return length;
+}
+
+void sham_flush(struct sham_conn *c) {
+    if ((c->options & FEC) && c->fec_enc.count > 0) send_fec_parity(c);
+}
+
+void sham_shutdown(struct sham_conn *c) {
+    if (c->shutdown) return;
+    c->shutdown = 1;
+    c->persist_interval = 0;
+    sham_flush(c);
+    advance(c);
+}
+
+ssize_t sham_recv_peek(struct sham_conn *c, const char **data) {
+    struct buffered_packet *next;
+    // Segments deliver_ahead took are only skipped
+    while ((next = reorder_next(&c->reorder, c->read_seq)) != NULL && next->consumed) {
+        c->read_seq += next->data_length;
+        reorder_release(next);
+        tune_receive_buffer(c);
+    }
+    if (next) {
+        *data = reorder_packet(next)->payload;
+        return next->data_length;
+    }
+    if (c->peer_closed && c->read_seq + 1 == c->expected_seq) return 0;
+    errno = c->state == SHAM_DONE && c->error ? c->error : EAGAIN;
+    return -1;
+}
+
+void sham_recv_release(struct sham_conn *c) {
+    struct buffered_packet *next = reorder_next(&c->reorder, c->read_seq);
+    if (!next) return;
+    c->read_seq += next->data_length;
+    if (!next->consumed) c->buffer_used -= next->data_length;
+    reorder_release(next);
+    tune_receive_buffer(c);
+    // A window that had closed is reopened at once rather than on the
+    // sender's next probe
+    if (c->state == SHAM_ESTABLISHED && c->advertised_window < PAYLOAD_SIZE && receive_window(c) >= PAYLOAD_SIZE) {
+        send_ack(c);
+    }
+}
+
+ssize_t sham_recv(struct sham_conn *c, void *buffer, size_t length) {
+    const char *data;
+    ssize_t available = sham_recv_peek(c, &data);
+    if (available <= 0) return available;
+    if ((size_t)available > length) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buffer, data, available);
+    sham_recv_release(c);
+    return available;
+}
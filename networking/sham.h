@@ -0,0 +1,234 @@
+#ifndef SHAM_LIB_H
+#define SHAM_LIB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "headers.h"
+#include "reorder.h"
+#include "fec.h"
+#include "pool.h"
+#include "metrics.h"
+#include "qlog.h"
+
+// libsham: one S.H.A.M. connection as a self-contained object. Handshake,
+// sender, receiver and teardown keep all their state in struct sham_conn, so a
+// process can run any number of connections; the only process-wide sink is
+// the global metrics block, and a connection writes the process qlog trace
+// only when it is given no trace of its own. Nothing blocks. A caller with its own
+// event loop waits for sham_fd() to become readable or sham_timeout_ms() to
+// pass, then calls sham_process() and moves data with sham_send()/sham_recv(),
+// both of which fail with EAGAIN instead of waiting. sham_wait() is that loop
+// body for callers without one.
+//
+// Segment boundaries are kept: every send becomes one segment of at most
+// PAYLOAD_SIZE bytes and every receive returns one segment.
+// sham_send_buffer()/sham_send_commit() and sham_recv_peek()/sham_recv_release()
+// hand out the segment storage itself, so data is read straight into the
+// outgoing packet and written straight out of the reassembly buffer.
+
+// Sequence numbers count bytes and wrap at 2^32; every comparison is serial
+// arithmetic, so a transfer may run through any number of wraps as long as
+// less than 2 GB is outstanding. Peers that agree on EXTSEQ pick random ISNs
+// and start their data right after them. Without it the fixed numbers below
+// are used, as older peers expect.
+#define SHAM_CLIENT_ISN 50   // SYN sequence number
+#define SHAM_CLIENT_FIRST_SEQ 1 // Client data does not follow on from its ISN
+#define SHAM_SERVER_ISN 100  // SYN-ACK sequence number; server data starts after it
+
+#define SHAM_OPTIONS (COMP | FEC | STREAMS | MSGS | EXTSEQ | BATCH | PIPE | GET) // Agreed in the SYN and SYN-ACK
+
+#define SHAM_FIN_RETRIES 5
+#define SHAM_MAX_TIMEOUTS 12 // Consecutive RTOs without ACK progress before giving up
+#define SHAM_CLOSE_TIMEOUT_MS 10000 // Wait for the peer's FIN after ours is acknowledged
+
+enum sham_state {
+    SHAM_IDLE,
+    SHAM_SYN_SENT,
+    SHAM_SYN_RECEIVED,
+    SHAM_ESTABLISHED,
+    SHAM_DONE,          // Both directions closed, or the peer was given up on
+};
+
+// Delivers a segment that arrived ahead of a gap in the connection sequence.
+// Returns 1 if it was consumed (sham_recv() then skips it), 0 if it has to
+// wait for its turn.
+typedef int (*sham_deliver_fn)(void *arg, const char *payload, size_t length);
+
+struct sham_config {
+    double loss_rate;           // Simulated loss on everything sent
+    double receive_loss_rate;   // Simulated loss on data-phase datagrams received
+    FILE *log;                  // RUDP_LOG-style event log, or NULL
+    FILE *trace;                // Per-packet narration (the CLIs pass stdout), or NULL
+    const char *peer_name;      // For the narration, e.g. "server"
+    uint16_t options;           // Client: the SHAM_OPTIONS to request. Server: the ones to accept, and EARLY.
+    long long isn;              // With EXTSEQ: our initial sequence number, or -1 for a random one
+    int fec_k, fec_m;           // Parity group shape once FEC is agreed; m = 0 follows the loss rate
+    int receive_buffer;         // Reassembly space advertised at first
+    int receive_buffer_max;     // Autotuning stops here; receive_buffer turns it off
+    double srtt, rttvar;        // RTT estimate from an earlier connection, or 0
+    int ack_delay_ms;           // Hold the ACK for a lone in-order segment this long; 0 ACKs at once
+    int max_timeouts;
+    sham_deliver_fn deliver_ahead;
+    void *deliver_arg;
+    struct metrics_block *metrics; // From metrics_claim_connection(), or NULL for metrics_conn
+    struct qlog_trace *qlog;    // From qlog_open_in(), or NULL for qlog_process
+};
+
+// A window slot. The packet lives in pool buffer `buffer`, taken when the
+// slot is first written and returned when the segment is acknowledged.
+struct sham_segment {
+    uint32_t buffer;            // POOL_NONE while the slot is empty
+    uint32_t seq_num;
+    size_t data_length;
+    struct timeval sent_time;
+    int retransmitted;          // Karn's rule: no RTT sample from it
+};
+
+struct sham_conn {
+    struct sham_config cfg;
+    enum sham_state state;
+    int error;                  // errno-style reason for SHAM_DONE without a clean close
+    int sockfd;
+    struct sockaddr_in peer;
+    socklen_t peer_len;
+    uint32_t conn_id;
+    int initiator;
+    uint16_t options;           // Agreed in the handshake
+    uint32_t isn;               // Ours
+    unsigned int loss_seed;
+
+    // Handshake
+    struct sham_packet handshake;   // SYN (with early data) or SYN-ACK, for retransmission
+    size_t handshake_length;
+    int handshake_attempts;
+    double handshake_timeout;
+    struct timeval handshake_sent;
+    int early_accepted;
+
+    // Send half
+    struct sham_segment window[WINDOW_SIZE];
+    int window_start;
+    int window_count;
+    uint32_t next_seq;
+    uint32_t acked;             // Peer's cumulative ACK
+    uint32_t send_wraps;        // Times next_seq has passed 2^32, for the log
+    int peer_window;
+    double srtt, rttvar, rto;   // ms
+    int timeouts;               // Since the last ACK progress
+    uint32_t last_ack;
+    int dup_ack_seen;
+    struct fec_encoder fec_enc;
+    int fec_group_k;
+    int loss_events;
+    int segments_since_estimate;
+    double fec_loss_estimate;
+    double persist_interval;    // Zero-window probe timer, 0 while not armed
+    struct timeval persist_time;
+    int probes;                 // Sent since the peer was last heard from
+
+    // Receive half. Segments stay in the reorder buffer from arrival until
+    // the caller reads them, so unread data shrinks the advertised window.
+    uint32_t expected_seq;      // Cumulative ACK: everything before it has arrived
+    uint32_t receive_wraps;     // Times expected_seq has passed 2^32
+    uint32_t read_seq;          // Next byte sham_recv() returns
+    struct reorder_buffer reorder;
+    int buffer_used;
+    int advertised_window;
+    int receive_buffer;         // Autotuned from what the reader takes per RTT
+    int socket_buffer;          // SO_RCVBUF last asked for
+    double receive_rtt;         // ms to receive one advertised window, 0 until measured
+    uint32_t receive_rtt_seq;
+    struct timeval receive_rtt_time;
+    int reader_space;           // Bytes read in the last measured RTT
+    uint32_t reader_seq;
+    struct timeval reader_time;
+    struct fec_decoder fec_dec;
+    uint64_t segment_arrival_us;
+    int ack_held;               // cfg.ack_delay_ms: an ACK is owed from ack_held_since
+    struct timeval ack_held_since;
+    int peer_closed;            // FIN received in sequence
+
+    // Teardown
+    int shutdown;               // No more sends; FIN once the window drains
+    int fin_sent;
+    int fin_acked;
+    uint32_t fin_seq;
+    int fin_retries;
+    struct timeval fin_time;
+    struct timeval last_receive;
+
+    unsigned long segments_sent;
+    unsigned long retransmissions;
+    struct metrics_block *metrics; // Per-connection counters; never NULL
+    struct qlog_trace *qlog;    // Never NULL
+};
+
+// Defaults: no loss, no log or narration, RECEIVER_BUFFER_SIZE window
+void sham_config_init(struct sham_config *cfg);
+
+// Client side: sends the SYN, carrying early_length bytes of early data when
+// non-zero. If the server declines them they are sent again as the first
+// segment once the connection is up.
+int sham_connect(struct sham_conn *c, int sockfd, const struct sockaddr_in *peer, socklen_t peer_len,
+                 uint32_t conn_id, const struct sham_config *cfg, const void *early, size_t early_length);
+
+// Server side: answers a SYN the caller received on sockfd. The caller picks
+// conn_id, since only it knows which IDs are taken.
+int sham_accept(struct sham_conn *c, int sockfd, const void *syn, ssize_t syn_length,
+                const struct sockaddr_in *from, uint32_t conn_id, const struct sham_config *cfg);
+
+// Handles one datagram for this connection, for callers that read the socket
+// themselves (e.g. to demultiplex by connection ID)
+void sham_input(struct sham_conn *c, const void *datagram, ssize_t length, const struct sockaddr_in *from);
+
+// Reads every datagram waiting on the socket and runs due timers. Returns -1
+// on a socket error.
+int sham_process(struct sham_conn *c);
+
+int sham_fd(const struct sham_conn *c);
+
+// Milliseconds until sham_process() has timer work, or -1 if none is armed
+int sham_timeout_ms(const struct sham_conn *c);
+
+// Blocks until the socket is readable or the next timer is due, then
+// processes. The event loop of callers that have no other work.
+int sham_wait(struct sham_conn *c);
+
+int sham_established(const struct sham_conn *c);
+int sham_done(const struct sham_conn *c);
+
+// Returns the connection's packet buffers to the pool. Call it once the
+// connection is done and everything wanted has been read; it cannot be used
+// afterwards.
+void sham_close(struct sham_conn *c);
+
+// Whether sham_send_buffer() would hand out room now
+int sham_writable(const struct sham_conn *c);
+
+// Room for the next segment (PAYLOAD_SIZE bytes), or NULL with errno EAGAIN
+// while the window is full, EPIPE after sham_shutdown(), ENOTCONN before
+// the handshake completes
+char *sham_send_buffer(struct sham_conn *c, size_t *room);
+// Sends the first length bytes of the buffer as one segment
+int sham_send_commit(struct sham_conn *c, size_t length);
+ssize_t sham_send(struct sham_conn *c, const void *data, size_t length);
+
+// Sends the parity of a short FEC group now instead of waiting for it to fill
+void sham_flush(struct sham_conn *c);
+
+// No more data from this side; the FIN follows once everything is acknowledged
+void sham_shutdown(struct sham_conn *c);
+
+// The next in-order segment: its length with *data pointing at it, 0 at the
+// end of the peer's data, -1 with errno EAGAIN if nothing is ready. The data
+// stays valid until sham_recv_release().
+ssize_t sham_recv_peek(struct sham_conn *c, const char **data);
+void sham_recv_release(struct sham_conn *c);
+// Copying variant; fails with EMSGSIZE if the segment does not fit
+ssize_t sham_recv(struct sham_conn *c, void *buffer, size_t length);
+
+#endif
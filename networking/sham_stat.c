@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "metrics.h"
+
+// Reads the metrics segment of a running client or server. The segment is
+// mapped read-only, so polling never touches the data path.
+
+#define SHM_DIR "/dev/shm"
+
+static uint64_t wall_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t load(const _Atomic uint64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+static int process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static const struct metrics_segment *map_segment(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    const struct metrics_segment *seg = mmap(NULL, sizeof(struct metrics_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) return NULL;
+    if (seg->magic != METRICS_MAGIC || seg->version != METRICS_VERSION) {
+        munmap((void *)seg, sizeof(struct metrics_segment));
+        return NULL;
+    }
+    return seg;
+}
+
+static void list_segments(void) {
+    DIR *dir = opendir(SHM_DIR);
+    if (!dir) {
+        perror("Failed to open " SHM_DIR);
+        return;
+    }
+    printf("%-28s %-8s %8s %6s %6s %10s\n", "segment", "role", "pid", "alive", "conns", "uptime_s");
+    struct dirent *entry;
+    int found = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "sham-", 5) != 0) continue;
+        char name[300];
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        const struct metrics_segment *seg = map_segment(name);
+        if (!seg) continue;
+        int open = 0;
+        for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+            if (atomic_load(&seg->connections[i].state) == METRICS_SLOT_OPEN) open++;
+        }
+        printf("%-28s %-8s %8u %6s %6d %10.1f\n", name, seg->role, seg->pid, process_alive(seg->pid) ? "yes" : "no", open,
+               (wall_us() - seg->started_us) / 1e6);
+        munmap((void *)seg, sizeof(struct metrics_segment));
+        found++;
+    }
+    closedir(dir);
+    if (!found) printf("No metrics segments. Start client or server with SHAM_METRICS=1.\n");
+}
+
+// Accepts a segment name with or without the leading slash, or a PID
+static int resolve_name(const char *target, char *name, size_t name_len) {
+    if (strspn(target, "0123456789") == strlen(target)) {
+        DIR *dir = opendir(SHM_DIR);
+        if (!dir) return -1;
+        struct dirent *entry;
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "-%s", target);
+        int found = -1;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name), suffix_len = strlen(suffix);
+            if (strncmp(entry->d_name, "sham-", 5) == 0 && len > suffix_len && strcmp(entry->d_name + len - suffix_len, suffix) == 0) {
+                snprintf(name, name_len, "/%s", entry->d_name);
+                found = 0;
+                break;
+            }
+        }
+        closedir(dir);
+        return found;
+    }
+    snprintf(name, name_len, "%s%s", target[0] == '/' ? "" : "/", target);
+    return 0;
+}
+
+static void print_histograms(const struct metrics_block *block, const char *indent) {
+    printf("%s%-14s %10s %10s %10s %10s %10s %10s\n", indent, "histogram_ms", "count", "mean", "p50", "p90", "p99", "max");
+    for (int h = 0; h < METRIC_HISTOGRAMS; h++) {
+        const struct metrics_histogram *hist = &block->histograms[h];
+        uint64_t count = load(&hist->count);
+        if (count == 0) continue;
+        printf("%s%-14s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", indent, metric_histogram_names[h], (unsigned long long)count,
+               load(&hist->sum) / 1000.0 / count, hist_percentile(hist, 0.5) / 1000.0, hist_percentile(hist, 0.9) / 1000.0,
+               hist_percentile(hist, 0.99) / 1000.0, load(&hist->max) / 1000.0);
+    }
+}
+
+static void print_snapshot(const struct metrics_segment *seg, uint64_t *previous, uint64_t previous_at) {
+    uint64_t now = wall_us();
+    double interval = previous_at ? (now - previous_at) / 1e6 : 0;
+    printf("== %s pid %u, up %.1f s%s\n", seg->role, seg->pid, (now - seg->started_us) / 1e6, process_alive(seg->pid) ? "" : " (exited)");
+
+    printf("%-20s %14s %14s\n", "counter", "total", interval > 0 ? "per_second" : "");
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        uint64_t value = load(&seg->global.counters[c]);
+        if (interval > 0) printf("%-20s %14llu %14.1f\n", metric_counter_names[c], (unsigned long long)value, (value - previous[c]) / interval);
+        else printf("%-20s %14llu\n", metric_counter_names[c], (unsigned long long)value);
+        previous[c] = value;
+    }
+
+    uint64_t sent = load(&seg->global.counters[M_SEGMENTS_SENT]);
+    uint64_t retx = load(&seg->global.counters[M_RETRANSMISSIONS]);
+    if (sent > 0) printf("retransmit ratio     %13.2f%%\n", 100.0 * retx / sent);
+
+    printf("gauges:");
+    for (int g = 0; g < METRIC_GAUGES; g++) {
+        printf(" %s=%lld", metric_gauge_names[g], (long long)atomic_load_explicit(&seg->global.gauges[g], memory_order_relaxed));
+    }
+    printf("\n");
+    print_histograms(&seg->global, "");
+
+    for (int i = 0; i < METRICS_MAX_CONNECTIONS; i++) {
+        const struct metrics_connection *conn = &seg->connections[i];
+        uint32_t state = atomic_load_explicit(&conn->state, memory_order_acquire);
+        if (state == METRICS_SLOT_FREE) continue;
+        uint64_t opened = load(&conn->opened_us);
+        uint64_t closed = state == METRICS_SLOT_CLOSED ? load(&conn->closed_us) : now;
+        double age = closed > opened ? (closed - opened) / 1e6 : 0;
+        // Acked bytes on a sender, bytes delivered in order on a receiver
+        uint64_t goodput_bytes = load(&conn->block.counters[M_BYTES_ACKED]) + load(&conn->block.counters[M_BYTES_DELIVERED]);
+        uint64_t conn_sent = load(&conn->block.counters[M_SEGMENTS_SENT]);
+        uint64_t conn_retx = load(&conn->block.counters[M_RETRANSMISSIONS]);
+        printf("connection %u %s, %.2f s: goodput %.3f Mbit/s, %llu segments sent, %llu received, retransmit %.2f%%\n",
+               atomic_load(&conn->conn_id), state == METRICS_SLOT_OPEN ? "open" : "closed", age,
+               age > 0 ? goodput_bytes * 8 / age / 1e6 : 0.0, (unsigned long long)conn_sent,
+               (unsigned long long)load(&conn->block.counters[M_SEGMENTS_RECEIVED]), conn_sent ? 100.0 * conn_retx / conn_sent : 0.0);
+        print_histograms(&conn->block, "  ");
+    }
+    fflush(stdout);
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s [segment|pid] [--interval=SEC] [--count=N]\n", program_name);
+    printf("  Without a target, lists the metrics segments in " SHM_DIR ".\n");
+    printf("  segment: name such as sham-client-1234, or the PID of a client or server\n");
+    printf("  --interval=SEC: Poll every SEC seconds and show per-second rates (default: one snapshot)\n");
+    printf("  --count=N: Stop after N snapshots (default: until the process exits)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *target = NULL;
+    double interval = 0;
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--interval=", 11) == 0) {
+            interval = atof(argv[i] + 11);
+        } else if (strncmp(argv[i], "--count=", 8) == 0) {
+            count = atoi(argv[i] + 8);
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (!target) {
+            target = argv[i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!target) {
+        list_segments();
+        return 0;
+    }
+
+    char name[300];
+    const struct metrics_segment *seg = NULL;
+    if (resolve_name(target, name, sizeof(name)) == 0) seg = map_segment(name);
+    if (!seg) {
+        printf("Error: No metrics segment for %s\n", target);
+        return 1;
+    }
+
+    uint64_t previous[METRIC_COUNTERS] = {0};
+    uint64_t previous_at = 0;
+    for (int n = 1;; n++) {
+        print_snapshot(seg, previous, previous_at);
+        previous_at = wall_us();
+        if (interval <= 0 || (count > 0 && n >= count) || !process_alive(seg->pid)) break;
+        usleep((useconds_t)(interval * 1e6));
+        printf("\n");
+    }
+    munmap((void *)seg, sizeof(struct metrics_segment));
+    return 0;
+}
@@ -0,0 +1,995 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "headers.h"
+#include "impair.h"
+#include "net.h"
+
+// Deterministic in-process network simulator. The unmodified client and
+// server run as threads inside one process, linked against the net_* calls
+// below instead of net.c: sockets are in-memory queues, the clock is virtual,
+// and every datagram crosses an impair.c link. Only one endpoint runs at a
+// time and the clock only moves when both are waiting, so a scenario seed
+// fully determines the run and --replay reproduces it exactly.
+//
+// Each scenario runs in a forked child (own globals, own temp directory);
+// the parent fans seeds out over --jobs children and checks the results.
+
+#define SIM_SERVER_PORT 9000
+#define SIM_FIRST_EPHEMERAL_PORT 40000
+#define SIM_FD_BASE 100
+#define SIM_MAX_SOCKETS 16
+#define SIM_MAX_ARGS 32
+#define SIM_EPOCH_SEC 1700000000LL // What net_gettimeofday() reports at virtual time 0
+#define POLL_QUANTUM_MS 0.01        // Virtual cost of a select() that finds nothing ready
+#define NODE_STACK_SIZE (16 * 1024 * 1024)
+#define SIM_DEFAULT_RCVBUF 212992   // Linux's usual net.core.rmem_default
+
+#define NODE_CLIENT 0
+#define NODE_SERVER 1
+
+enum status { SIM_OK, SIM_MISMATCH, SIM_EXIT, SIM_STUCK, SIM_CRASH, SIM_TIMEOUT };
+static const char *status_names[] = { "ok", "mismatch", "exit", "stuck", "crash", "timeout" };
+
+int sim_client_main(int argc, char *argv[]);
+int sim_server_main(int argc, char *argv[]);
+
+struct datagram {
+    struct datagram *next;
+    double release;
+    unsigned long order;    // Tie-break so equal release times keep send order
+    int from_port;
+    int to_port;
+    size_t length;
+    unsigned char data[];
+};
+
+enum node_state { NODE_READY, NODE_RUNNING, NODE_BLOCKED, NODE_DONE };
+
+struct node {
+    const char *name;
+    int index;
+    pthread_t thread;
+    pthread_cond_t wake;
+    enum node_state state;
+    fd_set wait_set;        // Sockets that end a block when readable
+    int wait_nfds;
+    double deadline;        // Virtual time that ends a block, < 0 = none
+    int (*entry)(int, char **);
+    int argc;
+    char *argv[SIM_MAX_ARGS];
+    int exit_code;
+};
+
+struct sim_socket {
+    int in_use;
+    struct node *owner;
+    int port;
+    struct datagram *rx_head;
+    struct datagram *rx_tail;
+    int receive_buffer;     // SO_RCVBUF, recorded but not enforced
+};
+
+struct scenario {
+    uint64_t seed;
+    size_t size;
+    struct impairment link[2];  // Indexed by the sending node
+    long long isn;              // Both endpoints' ISN, or -1 to let them draw one
+};
+
+struct result {
+    int status;
+    double virtual_ms;
+    unsigned long sent[2];
+    unsigned long lost[2];
+};
+
+// State of the one scenario running in this process
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t scheduler_wake;
+    double now;
+    unsigned long order;
+    struct node nodes[2];
+    struct sim_socket sockets[SIM_MAX_SOCKETS];
+    struct impair_state links[2];
+    struct datagram **inflight; // Min-heap on (release, order)
+    int inflight_count;
+    int inflight_capacity;
+    uint64_t rng[4];
+    int next_port;
+    int trace;
+} sim = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static __thread struct node *self;
+
+// Options shared by every scenario of a run
+static size_t max_size = 64 * 1024;
+static int fixed_size = -1;
+static char *overrides[SIM_MAX_ARGS];
+static int override_count = 0;
+static char *client_args[SIM_MAX_ARGS];
+static int client_arg_count = 0;
+static char *server_args[SIM_MAX_ARGS];
+static int server_arg_count = 0;
+static double virtual_limit_ms = 600000;
+static int wall_timeout_sec = 30;
+static int keep_failed = 0;
+
+static int datagram_before(const struct datagram *a, const struct datagram *b) {
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+static void inflight_push(struct datagram *d) {
+    if (sim.inflight_count == sim.inflight_capacity) {
+        sim.inflight_capacity = sim.inflight_capacity ? sim.inflight_capacity * 2 : 256;
+        sim.inflight = realloc(sim.inflight, sim.inflight_capacity * sizeof(*sim.inflight));
+        if (!sim.inflight) {
+            perror("realloc failed");
+            _exit(EXIT_FAILURE);
+        }
+    }
+    int i = sim.inflight_count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!datagram_before(d, sim.inflight[parent])) break;
+        sim.inflight[i] = sim.inflight[parent];
+        i = parent;
+    }
+    sim.inflight[i] = d;
+}
+
+static struct datagram *inflight_pop(void) {
+    struct datagram *top = sim.inflight[0];
+    struct datagram *last = sim.inflight[--sim.inflight_count];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= sim.inflight_count) break;
+        if (child + 1 < sim.inflight_count && datagram_before(sim.inflight[child + 1], sim.inflight[child])) child++;
+        if (!datagram_before(sim.inflight[child], last)) break;
+        sim.inflight[i] = sim.inflight[child];
+        i = child;
+    }
+    if (sim.inflight_count > 0) sim.inflight[i] = last;
+    return top;
+}
+
+static struct sim_socket *lookup_socket(int fd) {
+    int index = fd - SIM_FD_BASE;
+    if (index < 0 || index >= SIM_MAX_SOCKETS || !sim.sockets[index].in_use) return NULL;
+    return &sim.sockets[index];
+}
+
+static struct sim_socket *socket_on_port(int port) {
+    for (int i = 0; i < SIM_MAX_SOCKETS; i++) {
+        if (sim.sockets[i].in_use && sim.sockets[i].port == port) return &sim.sockets[i];
+    }
+    return NULL;
+}
+
+static int count_readable(fd_set *set, int nfds, fd_set *ready) {
+    int count = 0;
+    if (ready) FD_ZERO(ready);
+    for (int fd = 0; fd < nfds && fd < FD_SETSIZE; fd++) {
+        if (!FD_ISSET(fd, set)) continue;
+        struct sim_socket *sock = lookup_socket(fd);
+        if (sock && sock->rx_head) {
+            count++;
+            if (ready) FD_SET(fd, ready);
+        }
+    }
+    return count;
+}
+
+// Parks the calling endpoint until one of its wait sockets is readable or
+// the virtual clock reaches the deadline. Called with sim.lock held.
+static void block_node(fd_set *wait_set, int nfds, double deadline) {
+    if (wait_set) {
+        self->wait_set = *wait_set;
+        self->wait_nfds = nfds;
+    } else {
+        FD_ZERO(&self->wait_set);
+        self->wait_nfds = 0;
+    }
+    self->deadline = deadline;
+    self->state = NODE_BLOCKED;
+    pthread_cond_signal(&sim.scheduler_wake);
+    while (self->state != NODE_RUNNING) pthread_cond_wait(&self->wake, &sim.lock);
+}
+
+static void format_flags(uint16_t flags, char *out) {
+    const char *letters = "SAFCXE";
+    int n = 0;
+    for (int bit = 0; bit < 6; bit++) {
+        if (flags & (1 << bit)) out[n++] = letters[bit];
+    }
+    if (n == 0) out[n++] = '-';
+    out[n] = '\0';
+}
+
+static void trace_datagram(const void *buf, size_t len, struct impair_state *link, const struct impair_state *before, int copies, double release[2]) {
+    char flags[8] = "?";
+    uint32_t seq = 0, ack = 0;
+    if (len >= sizeof(struct sham_header)) {
+        const struct sham_header *h = buf;
+        seq = ntohl(h->seq_num);
+        ack = ntohl(h->ack_num);
+        format_flags(h->flags, flags);
+    }
+    printf("[%10.3f] %s seq=%u ack=%u flags=%s len=%zu", sim.now, self->index == NODE_CLIENT ? "C>S" : "S>C", seq, ack, flags, len);
+    if (copies == 0) {
+        printf(" %s\n", link->queue_drops != before->queue_drops ? "QUEUE-DROP" : "LOST");
+        return;
+    }
+    printf(" arrives %.3f", release[0]);
+    if (link->reordered != before->reordered) printf(" REORDERED");
+    if (copies == 2) printf(" DUPLICATED");
+    printf("\n");
+}
+
+int net_socket(int domain, int type, int protocol) {
+    (void)protocol;
+    if (domain != AF_INET || type != SOCK_DGRAM) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    for (int i = 0; i < SIM_MAX_SOCKETS; i++) {
+        if (!sim.sockets[i].in_use) {
+            memset(&sim.sockets[i], 0, sizeof(sim.sockets[i]));
+            sim.sockets[i].in_use = 1;
+            sim.sockets[i].owner = self;
+            sim.sockets[i].receive_buffer = SIM_DEFAULT_RCVBUF;
+            return SIM_FD_BASE + i;
+        }
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+int net_bind(int sockfd, const struct sockaddr *addr, socklen_t addr_len) {
+    struct sim_socket *sock = lookup_socket(sockfd);
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+    if (addr_len < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+        return -1;
+    }
+    int port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+    if (port == 0) port = sim.next_port++;
+    if (socket_on_port(port)) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    sock->port = port;
+    return 0;
+}
+
+int net_setsockopt(int sockfd, int level, int name, const void *value, socklen_t value_len) {
+    struct sim_socket *sock = lookup_socket(sockfd);
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+    // Doubled for bookkeeping overhead, as Linux does
+    if (level == SOL_SOCKET && name == SO_RCVBUF && value_len >= sizeof(int)) sock->receive_buffer = 2 * *(const int *)value;
+    return 0;
+}
+
+int net_getsockopt(int sockfd, int level, int name, void *value, socklen_t *value_len) {
+    struct sim_socket *sock = lookup_socket(sockfd);
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+    if (level != SOL_SOCKET || name != SO_RCVBUF || *value_len < sizeof(int)) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+    *(int *)value = sock->receive_buffer;
+    *value_len = sizeof(int);
+    return 0;
+}
+
+int net_close(int sockfd) {
+    struct sim_socket *sock = lookup_socket(sockfd);
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+    while (sock->rx_head) {
+        struct datagram *d = sock->rx_head;
+        sock->rx_head = d->next;
+        free(d);
+    }
+    sock->in_use = 0;
+    return 0;
+}
+
+ssize_t net_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addr_len) {
+    (void)flags;
+    struct sim_socket *sock = lookup_socket(sockfd);
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!addr || addr_len < sizeof(struct sockaddr_in)) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    if (sock->port == 0) sock->port = sim.next_port++;
+
+    struct impair_state *link = &sim.links[self->index];
+    struct impair_state before = *link;
+    double release[2];
+    int copies = impair_packet(link, sim.now, len, release);
+    if (sim.trace) trace_datagram(buf, len, link, &before, copies, release);
+
+    for (int c = 0; c < copies; c++) {
+        struct datagram *d = malloc(sizeof(*d) + len);
+        if (!d) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        d->next = NULL;
+        d->release = release[c];
+        d->order = sim.order++;
+        d->from_port = sock->port;
+        d->to_port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+        d->length = len;
+        memcpy(d->data, buf, len);
+        inflight_push(d);
+    }
+    return len;
+}
+
+// One simulated datagram per message, like the kernel's loop
+int net_sendmmsg(int sockfd, struct mmsghdr *messages, unsigned int count, int flags) {
+    for (unsigned int i = 0; i < count; i++) {
+        struct msghdr *m = &messages[i].msg_hdr;
+        if (m->msg_iovlen != 1) {
+            errno = EINVAL;
+            return i > 0 ? (int)i : -1;
+        }
+        ssize_t sent = net_sendto(sockfd, m->msg_iov[0].iov_base, m->msg_iov[0].iov_len, flags, m->msg_name, m->msg_namelen);
+        if (sent < 0) return i > 0 ? (int)i : -1;
+        messages[i].msg_len = sent;
+    }
+    return count;
+}
+
+ssize_t net_recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addr_len) {
+    struct sim_socket *sock = lookup_socket(sockfd);
+    if (!sock) {
+        errno = EBADF;
+        return -1;
+    }
+    while (!sock->rx_head) {
+        if (flags & MSG_DONTWAIT) {
+            errno = EAGAIN;
+            return -1;
+        }
+        fd_set wait_set;
+        FD_ZERO(&wait_set);
+        FD_SET(sockfd, &wait_set);
+        block_node(&wait_set, sockfd + 1, -1);
+    }
+
+    struct datagram *d = sock->rx_head;
+    sock->rx_head = d->next;
+    if (!sock->rx_head) sock->rx_tail = NULL;
+    size_t copied = d->length < len ? d->length : len;
+    memcpy(buf, d->data, copied);
+    if (addr && addr_len) {
+        struct sockaddr_in from;
+        memset(&from, 0, sizeof(from));
+        from.sin_family = AF_INET;
+        from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        from.sin_port = htons(d->from_port);
+        socklen_t n = *addr_len < sizeof(from) ? *addr_len : sizeof(from);
+        memcpy(addr, &from, n);
+        *addr_len = sizeof(from);
+    }
+    free(d);
+    return copied;
+}
+
+// Only simulated sockets ever become readable; anything else in the sets
+// (stdin, for instance) is treated as idle
+int net_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    fd_set wait_set;
+    FD_ZERO(&wait_set);
+    if (readfds) wait_set = *readfds;
+    if (writefds) FD_ZERO(writefds);
+    if (exceptfds) FD_ZERO(exceptfds);
+
+    double deadline = -1;
+    if (timeout) {
+        deadline = sim.now + timeout->tv_sec * 1000.0 + timeout->tv_usec / 1000.0;
+        if (deadline < sim.now + POLL_QUANTUM_MS) deadline = sim.now + POLL_QUANTUM_MS;
+    }
+    while (1) {
+        int ready = count_readable(&wait_set, nfds, readfds);
+        if (ready > 0) return ready;
+        if (deadline >= 0 && sim.now >= deadline) return 0;
+        block_node(&wait_set, nfds, deadline);
+    }
+}
+
+int net_gettimeofday(struct timeval *tv) {
+    long long usec = SIM_EPOCH_SEC * 1000000LL + (long long)llround(sim.now * 1000.0);
+    tv->tv_sec = usec / 1000000;
+    tv->tv_usec = usec % 1000000;
+    return 0;
+}
+
+uint32_t net_random32(void) {
+    return (uint32_t)(rng_uniform(sim.rng) * 4294967296.0);
+}
+
+static void *node_thread(void *arg) {
+    struct node *node = arg;
+    self = node;
+    pthread_mutex_lock(&sim.lock);
+    while (node->state != NODE_RUNNING) pthread_cond_wait(&node->wake, &sim.lock);
+    node->exit_code = node->entry(node->argc, node->argv);
+    for (int i = 0; i < SIM_MAX_SOCKETS; i++) {
+        if (sim.sockets[i].in_use && sim.sockets[i].owner == node) net_close(SIM_FD_BASE + i);
+    }
+    node->state = NODE_DONE;
+    pthread_cond_signal(&sim.scheduler_wake);
+    pthread_mutex_unlock(&sim.lock);
+    return NULL;
+}
+
+static int node_runnable(struct node *node) {
+    if (node->state == NODE_READY) return 1;
+    if (node->state != NODE_BLOCKED) return 0;
+    if (count_readable(&node->wait_set, node->wait_nfds, NULL) > 0) return 1;
+    return node->deadline >= 0 && node->deadline <= sim.now;
+}
+
+static void deliver_due(void) {
+    while (sim.inflight_count > 0 && sim.inflight[0]->release <= sim.now) {
+        struct datagram *d = inflight_pop();
+        struct sim_socket *sock = socket_on_port(d->to_port);
+        if (!sock) {
+            free(d);
+            continue;
+        }
+        d->next = NULL;
+        if (sock->rx_tail) sock->rx_tail->next = d;
+        else sock->rx_head = d;
+        sock->rx_tail = d;
+    }
+}
+
+// Hands the baton to whichever endpoint can make progress; when neither can,
+// jumps the clock to the next delivery or timer. Returns SIM_OK once both
+// mains have returned, SIM_STUCK on deadlock or past the virtual time limit.
+static int run_scheduler(void) {
+    pthread_mutex_lock(&sim.lock);
+    while (1) {
+        int ran = 0;
+        for (int i = 0; i < 2; i++) {
+            struct node *node = &sim.nodes[i];
+            if (!node_runnable(node)) continue;
+            node->state = NODE_RUNNING;
+            pthread_cond_signal(&node->wake);
+            while (node->state == NODE_RUNNING) pthread_cond_wait(&sim.scheduler_wake, &sim.lock);
+            ran = 1;
+        }
+        if (ran) continue;
+        if (sim.nodes[0].state == NODE_DONE && sim.nodes[1].state == NODE_DONE) break;
+
+        double next = INFINITY;
+        if (sim.inflight_count > 0) next = sim.inflight[0]->release;
+        for (int i = 0; i < 2; i++) {
+            struct node *node = &sim.nodes[i];
+            if (node->state == NODE_BLOCKED && node->deadline >= 0 && node->deadline < next) next = node->deadline;
+        }
+        if (next == INFINITY || next > virtual_limit_ms) {
+            pthread_mutex_unlock(&sim.lock);
+            return SIM_STUCK;
+        }
+        if (next > sim.now) sim.now = next;
+        deliver_due();
+    }
+    pthread_mutex_unlock(&sim.lock);
+    return SIM_OK;
+}
+
+static double uniform_between(uint64_t rng[4], double low, double high) {
+    return low + (high - low) * rng_uniform(rng);
+}
+
+// Applies --name=value overrides (optionally up-/down- prefixed) on top of
+// the link parameters drawn from the seed
+static int apply_overrides(struct scenario *sc) {
+    for (int i = 0; i < override_count; i++) {
+        char name[32];
+        const char *option = overrides[i] + 2;
+        const char *value = strchr(option, '=') + 1;
+        int first = 0, last = 1;
+        if (strncmp(option, "up-", 3) == 0) {
+            option += 3;
+            last = 0;
+        } else if (strncmp(option, "down-", 5) == 0) {
+            option += 5;
+            first = 1;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)(value - 1 - option), option);
+        for (int d = first; d <= last; d++) {
+            if (impair_parse_option(&sc->link[d], name, value) < 0) {
+                printf("Error: Invalid option %s\n", overrides[i]);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Draws file size and both link models from the scenario seed
+static void make_scenario(struct scenario *sc, uint64_t seed) {
+    uint64_t rng[4];
+    rng_seed(rng, seed, 2);
+    memset(sc, 0, sizeof(*sc));
+    sc->seed = seed;
+
+    // Sizes around segment boundaries are where off-by-one bugs live
+    const size_t edges[] = { 0, 1, PAYLOAD_SIZE - 1, PAYLOAD_SIZE, PAYLOAD_SIZE + 1, 4 * PAYLOAD_SIZE };
+    if (rng_uniform(rng) < 0.15) sc->size = edges[(int)(rng_uniform(rng) * 6)];
+    else sc->size = (size_t)(rng_uniform(rng) * (max_size + 1));
+    if (sc->size > max_size) sc->size = max_size;
+    if (fixed_size >= 0) sc->size = fixed_size;
+
+    double delay = uniform_between(rng, 1, 50);
+    for (int d = 0; d < 2; d++) {
+        struct impairment *cfg = &sc->link[d];
+        impair_defaults(cfg);
+        cfg->delay_ms = delay;
+        cfg->jitter_ms = rng_uniform(rng) < 0.5 ? 0 : uniform_between(rng, 0, delay / 2);
+        cfg->dist = (enum jitter_dist)(int)(rng_uniform(rng) * 3);
+        if (rng_uniform(rng) < 0.25) {
+            cfg->ge_p = uniform_between(rng, 0.01, 0.05);
+            cfg->ge_r = uniform_between(rng, 0.2, 0.5);
+            cfg->loss_good = uniform_between(rng, 0, 0.02);
+            cfg->loss_bad = uniform_between(rng, 0.3, 0.9);
+        } else if (rng_uniform(rng) < 0.7) {
+            cfg->loss_good = uniform_between(rng, 0, 0.2);
+        }
+        if (rng_uniform(rng) < 0.5) cfg->reorder = uniform_between(rng, 0, 0.1);
+        if (rng_uniform(rng) < 0.3) cfg->duplicate = uniform_between(rng, 0, 0.05);
+        if (rng_uniform(rng) < 0.2) {
+            cfg->rate_kbps = uniform_between(rng, 500, 50000);
+            cfg->queue_limit = 10 + (int)(rng_uniform(rng) * 90);
+        }
+    }
+
+    // A random ISN rarely lands near 2^32, so some transfers are made to
+    // run through the wrap
+    sc->isn = -1;
+    if (rng_uniform(rng) < 0.25) sc->isn = 0xffffffffLL - (long long)(rng_uniform(rng) * sc->size);
+}
+
+static void describe_scenario(const struct scenario *sc, char *out, size_t out_len) {
+    const struct impairment *up = &sc->link[0], *down = &sc->link[1];
+    snprintf(out, out_len, "size=%zu delay=%.1f jitter=%.1f/%.1f loss=%.3f/%.3f ge=%s/%s reorder=%.3f/%.3f dup=%.3f/%.3f rate=%.0f/%.0f",
+             sc->size, up->delay_ms, up->jitter_ms, down->jitter_ms, up->loss_good, down->loss_good,
+             up->ge_p > 0 ? "on" : "off", down->ge_p > 0 ? "on" : "off",
+             up->reorder, down->reorder, up->duplicate, down->duplicate, up->rate_kbps, down->rate_kbps);
+    if (sc->isn >= 0) {
+        size_t used = strlen(out);
+        snprintf(out + used, out_len - used, " isn=%lld", sc->isn);
+    }
+}
+
+static int write_input(const char *path, const struct scenario *sc) {
+    uint64_t rng[4];
+    rng_seed(rng, sc->seed, 3);
+    FILE *file = fopen(path, "wb");
+    if (!file) return -1;
+    // Half the inputs are text-like so compression and FEC see both kinds
+    int text = rng_uniform(rng) < 0.5;
+    for (size_t i = 0; i < sc->size; i++) {
+        int byte = text ? "the quick brown fox jumps over the lazy dog\n"[(i + (size_t)(rng_uniform(rng) < 0.01)) % 44]
+                        : (int)(rng_uniform(rng) * 256);
+        fputc(byte, file);
+    }
+    return fclose(file);
+}
+
+static int files_equal(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    int equal = fa && fb;
+    while (equal) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if (ca != cb) equal = 0;
+        if (ca == EOF || cb == EOF) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return equal;
+}
+
+static void remove_tree(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d) {
+        struct dirent *entry;
+        char path[512];
+        while ((entry = readdir(d)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+static void setup_node(struct node *node, int index, const char *name, int (*entry)(int, char **), char **extra, int extra_count, char **fixed, int fixed_count) {
+    memset(node, 0, sizeof(*node));
+    node->index = index;
+    node->name = name;
+    node->entry = entry;
+    node->state = NODE_READY;
+    node->deadline = -1;
+    pthread_cond_init(&node->wake, NULL);
+    for (int i = 0; i < fixed_count; i++) node->argv[node->argc++] = fixed[i];
+    for (int i = 0; i < extra_count && node->argc < SIM_MAX_ARGS - 1; i++) node->argv[node->argc++] = extra[i];
+    node->argv[node->argc] = NULL;
+}
+
+// Runs one scenario in the current (child) process
+static void run_scenario(const struct scenario *sc, struct result *res) {
+    char dir[] = "/tmp/sham-sim.XXXXXX";
+    memset(res, 0, sizeof(*res));
+    if (!mkdtemp(dir) || chdir(dir) < 0 || write_input("input.dat", sc) < 0) {
+        perror("scenario setup failed");
+        res->status = SIM_CRASH;
+        return;
+    }
+
+    sim.now = 0;
+    sim.next_port = SIM_FIRST_EPHEMERAL_PORT;
+    rng_seed(sim.rng, sc->seed, 4);
+    for (int d = 0; d < 2; d++) impair_start(&sim.links[d], &sc->link[d], sc->seed, d, 0);
+    if (sc->isn >= 0) {
+        char isn[24];
+        snprintf(isn, sizeof(isn), "%lld", sc->isn);
+        setenv("SHAM_ISN", isn, 1);
+    } else {
+        unsetenv("SHAM_ISN");
+    }
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", SIM_SERVER_PORT);
+    char *server_fixed[] = { "server", port };
+    char *client_fixed[] = { "client", "127.0.0.1", port, "input.dat", "output.dat" };
+    setup_node(&sim.nodes[NODE_CLIENT], NODE_CLIENT, "client", sim_client_main, client_args, client_arg_count, client_fixed, 5);
+    setup_node(&sim.nodes[NODE_SERVER], NODE_SERVER, "server", sim_server_main, server_args, server_arg_count, server_fixed, 2);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, NODE_STACK_SIZE);
+    // Server first so it is listening before the client's SYN is sent
+    for (int i = 1; i >= 0; i--) {
+        if (pthread_create(&sim.nodes[i].thread, &attr, node_thread, &sim.nodes[i]) != 0) {
+            perror("pthread_create failed");
+            res->status = SIM_CRASH;
+            return;
+        }
+    }
+
+    res->status = run_scheduler();
+    res->virtual_ms = sim.now;
+    for (int d = 0; d < 2; d++) {
+        res->sent[d] = sim.links[d].received;
+        res->lost[d] = sim.links[d].lost + sim.links[d].queue_drops;
+    }
+    if (res->status == SIM_OK) {
+        for (int i = 0; i < 2; i++) pthread_join(sim.nodes[i].thread, NULL);
+        if (sim.nodes[0].exit_code != 0 || sim.nodes[1].exit_code != 0) res->status = SIM_EXIT;
+        else if (!files_equal("input.dat", "received_file.dat")) res->status = SIM_MISMATCH;
+    }
+    if (res->status == SIM_OK || !keep_failed) remove_tree(dir);
+    else fprintf(stderr, "seed %llu: kept %s\n", (unsigned long long)sc->seed, dir);
+}
+
+struct job {
+    pid_t pid;
+    int pipe_fd;
+    int index;
+};
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int count, double p) {
+    if (count == 0) return 0;
+    int i = (int)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static double elapsed_sec(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void collect(struct job *job, int wait_status, struct result *results) {
+    struct result res;
+    memset(&res, 0, sizeof(res));
+    if (read(job->pipe_fd, &res, sizeof(res)) != sizeof(res)) {
+        res.status = WIFSIGNALED(wait_status) && WTERMSIG(wait_status) == SIGALRM ? SIM_TIMEOUT : SIM_CRASH;
+    }
+    close(job->pipe_fd);
+    results[job->index] = res;
+    job->pid = 0;
+}
+
+// Loads seed -> virtual_ms for passing scenarios of an earlier --csv run
+static int load_baseline(const char *path, uint64_t first_seed, int count, double *baseline) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    char line[512];
+    for (int i = 0; i < count; i++) baseline[i] = -1;
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long long seed;
+        char status[16];
+        double virtual_ms;
+        if (sscanf(line, "%llu,%15[^,],%*[^,],%lf", &seed, status, &virtual_ms) != 3) continue;
+        if (seed < first_seed || seed >= first_seed + (uint64_t)count || strcmp(status, "ok") != 0) continue;
+        baseline[seed - first_seed] = virtual_ms;
+    }
+    fclose(file);
+    return 0;
+}
+
+void print_usage(const char *program_name) {
+    printf("Usage: %s [options] [--name=value ...]\n", program_name);
+    printf("  --count=N              Scenarios to run (default 1000)\n");
+    printf("  --seed=N               First scenario seed; scenario i uses seed N+i (default 1)\n");
+    printf("  --jobs=N               Scenarios run in parallel (default: online CPUs)\n");
+    printf("  --replay=SEED          Rerun one scenario with endpoint output and a packet trace\n");
+    printf("  --max-size=BYTES       Largest generated file (default 65536)\n");
+    printf("  --size=BYTES           Use this file size for every scenario\n");
+    printf("  --client-arg=ARG       Extra argument for the client (repeatable)\n");
+    printf("  --server-arg=ARG       Extra argument for the server (repeatable)\n");
+    printf("  --limit=MS             Virtual time after which a scenario counts as stuck (default 600000)\n");
+    printf("  --timeout=SEC          Wall-clock watchdog per scenario (default 30)\n");
+    printf("  --csv=FILE             Write per-scenario results\n");
+    printf("  --baseline=FILE        Compare virtual completion times with an earlier --csv\n");
+    printf("  --threshold=F          Allowed slowdown against the baseline (default 0.10)\n");
+    printf("  --keep-failed          Keep the temp directory of failing scenarios\n");
+    printf("Link options as in the proxy (--loss=, --delay=, --reorder=, --up-ge=, ...) replace\n");
+    printf("the values drawn from the seed.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int count = 1000;
+    uint64_t first_seed = 1;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int replay = 0;
+    const char *csv_path = NULL;
+    const char *baseline_path = NULL;
+    double threshold = 0.10;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--count=", 8) == 0) {
+            count = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            first_seed = strtoull(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atol(argv[i] + 7);
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            first_seed = strtoull(argv[i] + 9, NULL, 10);
+            count = 1;
+            replay = 1;
+        } else if (strncmp(argv[i], "--max-size=", 11) == 0) {
+            max_size = strtoul(argv[i] + 11, NULL, 10);
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            fixed_size = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--client-arg=", 13) == 0 && client_arg_count < SIM_MAX_ARGS - 8) {
+            client_args[client_arg_count++] = argv[i] + 13;
+        } else if (strncmp(argv[i], "--server-arg=", 13) == 0 && server_arg_count < SIM_MAX_ARGS - 8) {
+            server_args[server_arg_count++] = argv[i] + 13;
+        } else if (strncmp(argv[i], "--limit=", 8) == 0) {
+            virtual_limit_ms = atof(argv[i] + 8);
+        } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+            wall_timeout_sec = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--csv=", 6) == 0) {
+            csv_path = argv[i] + 6;
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline_path = argv[i] + 11;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = atof(argv[i] + 12);
+        } else if (strcmp(argv[i], "--keep-failed") == 0) {
+            keep_failed = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0 && strchr(argv[i], '=') && override_count < SIM_MAX_ARGS) {
+            overrides[override_count++] = argv[i];
+        } else {
+            printf("Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (count < 1 || jobs < 1) {
+        printf("Error: --count and --jobs must be positive\n");
+        return 1;
+    }
+    struct scenario probe;
+    make_scenario(&probe, first_seed);
+    if (apply_overrides(&probe) < 0) return 1;
+    if (replay) jobs = 1;
+
+    struct result *results = calloc(count, sizeof(*results));
+    struct job *running = calloc(jobs, sizeof(*running));
+    if (!results || !running) {
+        perror("calloc failed");
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+    int next = 0, active = 0;
+    while (next < count || active > 0) {
+        while (next < count && active < jobs) {
+            struct scenario sc;
+            make_scenario(&sc, first_seed + next);
+            apply_overrides(&sc);
+            if (replay) {
+                char description[256];
+                describe_scenario(&sc, description, sizeof(description));
+                printf("Scenario %llu: %s\n", (unsigned long long)sc.seed, description);
+                fflush(stdout);
+                sim.trace = 1;
+            }
+            int fds[2];
+            if (pipe(fds) < 0) {
+                perror("pipe failed");
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork failed");
+                return 1;
+            }
+            if (pid == 0) {
+                close(fds[0]);
+                if (!replay) {
+                    int null_fd = open("/dev/null", O_WRONLY);
+                    if (null_fd >= 0) {
+                        dup2(null_fd, STDOUT_FILENO);
+                        close(null_fd);
+                    }
+                }
+                alarm(wall_timeout_sec);
+                struct result res;
+                run_scenario(&sc, &res);
+                fflush(stdout);
+                if (write(fds[1], &res, sizeof(res)) != sizeof(res)) _exit(EXIT_FAILURE);
+                _exit(EXIT_SUCCESS);
+            }
+            close(fds[1]);
+            for (int j = 0; j < jobs; j++) {
+                if (running[j].pid == 0) {
+                    running[j].pid = pid;
+                    running[j].pipe_fd = fds[0];
+                    running[j].index = next;
+                    break;
+                }
+            }
+            next++;
+            active++;
+        }
+
+        int wait_status;
+        pid_t pid = wait(&wait_status);
+        if (pid < 0) break;
+        for (int j = 0; j < jobs; j++) {
+            if (running[j].pid == pid) {
+                collect(&running[j], wait_status, results);
+                active--;
+                break;
+            }
+        }
+    }
+    double wall = elapsed_sec(&start);
+
+    FILE *csv = NULL;
+    if (csv_path) {
+        csv = fopen(csv_path, "w");
+        if (!csv) {
+            perror("Failed to open CSV file");
+            return 1;
+        }
+        fprintf(csv, "seed,status,size,virtual_ms,up_sent,up_lost,down_sent,down_lost\n");
+    }
+
+    int failed = 0, passed = 0;
+    double *times = calloc(count, sizeof(double));
+    for (int i = 0; i < count; i++) {
+        struct scenario sc;
+        make_scenario(&sc, first_seed + i);
+        apply_overrides(&sc);
+        struct result *res = &results[i];
+        if (csv) {
+            fprintf(csv, "%llu,%s,%zu,%.3f,%lu,%lu,%lu,%lu\n", (unsigned long long)sc.seed, status_names[res->status], sc.size,
+                    res->virtual_ms, res->sent[0], res->lost[0], res->sent[1], res->lost[1]);
+        }
+        if (res->status == SIM_OK) {
+            times[passed++] = res->virtual_ms;
+            continue;
+        }
+        char description[256];
+        describe_scenario(&sc, description, sizeof(description));
+        printf("FAIL seed=%llu %s at %.1f ms: %s\n", (unsigned long long)sc.seed, status_names[res->status], res->virtual_ms, description);
+        failed++;
+    }
+    if (csv) fclose(csv);
+
+    if (replay) {
+        struct result *res = &results[0];
+        printf("Result: %s after %.3f virtual ms, %lu/%lu datagrams sent up/down, %lu/%lu lost\n", status_names[res->status],
+               res->virtual_ms, res->sent[0], res->sent[1], res->lost[0], res->lost[1]);
+        return res->status == SIM_OK ? 0 : 1;
+    }
+
+    qsort(times, passed, sizeof(double), compare_double);
+    printf("Scenarios: %d, passed %d, failed %d (%.2f s wall, %.0f scenarios/s)\n", count, passed, failed, wall, count / wall);
+    printf("Virtual completion ms: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n", percentile(times, passed, 0.5),
+           percentile(times, passed, 0.9), percentile(times, passed, 0.99), passed ? times[passed - 1] : 0);
+    if (failed > 0) {
+        printf("Replay a failure with: %s --replay=SEED", argv[0]);
+        for (int i = 0; i < override_count; i++) printf(" %s", overrides[i]);
+        for (int i = 0; i < client_arg_count; i++) printf(" --client-arg=%s", client_args[i]);
+        for (int i = 0; i < server_arg_count; i++) printf(" --server-arg=%s", server_args[i]);
+        printf("\n");
+    }
+
+    int regressed = 0;
+    if (baseline_path) {
+        double *baseline = calloc(count, sizeof(double));
+        if (!baseline || load_baseline(baseline_path, first_seed, count, baseline) < 0) {
+            printf("Error: Cannot read baseline %s\n", baseline_path);
+            return 1;
+        }
+        double before = 0, after = 0;
+        int compared = 0, slower = 0;
+        for (int i = 0; i < count; i++) {
+            if (baseline[i] < 0 || results[i].status != SIM_OK) continue;
+            before += baseline[i];
+            after += results[i].virtual_ms;
+            if (results[i].virtual_ms > baseline[i] * (1 + threshold)) slower++;
+            compared++;
+        }
+        double change = before > 0 ? after / before - 1 : 0;
+        regressed = change > threshold;
+        printf("Against baseline: total virtual time %+.1f%% over %d scenarios, %d individually slower by more than %.0f%%%s\n",
+               change * 100, compared, slower, threshold * 100, regressed ? " REGRESSION" : "");
+        free(baseline);
+    }
+
+    free(times);
+    free(results);
+    free(running);
+    return failed > 0 || regressed ? 1 : 0;
+}
@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+"""Joins client and server qlog traces (SHAM_QLOG) and reports where time went.
+
+Give it trace files or directories. Traces are paired by connection ID, one
+client and one server per connection; a lone side is analyzed on its own.
+For each connection it writes, under <out>/<conn_id>/:
+
+  time_sequence.csv  data sends, retransmissions, losses and receptions, and
+                     ACKs sent and received, as (time_ms, side, event, seq,
+                     length, ack)
+  inflight.csv       sender bytes in flight, window occupancy and peer window
+  rtt.csv            RTT samples with the smoothed estimate and RTO
+  one_way.csv        per-segment client send to server receive delay
+
+and prints a summary. That covers goodput, retransmissions (and how many were
+spurious), segments lost on the wire, RTT and one-way delay percentiles, and
+stall periods. A stall is a gap in cumulative ACK progress longer than
+--stall-ms. Times are ms from the client's first event. With --align the
+server clock is shifted by an offset estimated from the minimum one-way delays
+in each direction (assumes symmetric paths).
+"""
+
+import argparse
+import csv
+import json
+import os
+import sys
+from collections import defaultdict
+
+ACK_FLAG = 0x2
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    ordered = sorted(values)
+    rank = max(0, min(len(ordered) - 1, int(round(p / 100.0 * len(ordered) + 0.5)) - 1))
+    return ordered[rank]
+
+
+def fmt(value, digits=3):
+    return "-" if value is None else "%.*f" % (digits, value)
+
+
+class Trace:
+    def __init__(self, path):
+        self.path = path
+        self.events = []
+        self.conn_id = None
+        with open(path) as f:
+            header = json.loads(f.readline())
+            self.role = header["vantage_point"]
+            reference_ms = header["reference_time_us"] / 1000.0
+            for line in f:
+                line = line.strip()
+                if not line:
+                    continue
+                try:
+                    event = json.loads(line)
+                except ValueError:
+                    break  # Truncated tail of a trace that was cut short
+                event["abs"] = reference_ms + event["time"]
+                if event["name"] == "connectivity:connection_started":
+                    self.conn_id = event["data"]["conn_id"]
+                self.events.append(event)
+
+    def named(self, name, **match):
+        for event in self.events:
+            if event["name"] != name:
+                continue
+            if all(event["data"].get(k) == v for k, v in match.items()):
+                yield event
+
+
+def carries_ack(event):
+    """Bare ACKs, and chat data or FINs with an ACK piggybacked on them."""
+    d = event["data"]
+    return bool(d.get("flags", 0) & ACK_FLAG) and d.get("type") != "syn_ack"
+
+
+def load_traces(paths):
+    files = []
+    for path in paths:
+        if os.path.isdir(path):
+            files.extend(os.path.join(path, n) for n in sorted(os.listdir(path)) if n.endswith(".jsonl"))
+        else:
+            files.append(path)
+    traces = []
+    for path in files:
+        try:
+            traces.append(Trace(path))
+        except (ValueError, KeyError, OSError) as e:
+            print("Skipping %s: %s" % (path, e), file=sys.stderr)
+    return traces
+
+
+def pair_traces(traces):
+    pairs = defaultdict(dict)
+    for trace in traces:
+        key = trace.conn_id if trace.conn_id is not None else trace.path
+        pairs[key][trace.role] = trace
+    return pairs
+
+
+def estimate_offset(client, server):
+    """server_clock - client_clock, from the fastest segment each way."""
+    sent = {}
+    for e in client.named("transport:packet_sent", type="data"):
+        sent.setdefault(e["data"]["seq"], e["abs"])
+    up = [e["abs"] - sent[e["data"]["seq"]] for e in server.named("transport:packet_received", type="data")
+          if e["data"]["seq"] in sent]
+    acked = {}
+    for e in filter(carries_ack, server.named("transport:packet_sent")):
+        acked.setdefault(e["data"]["ack"], e["abs"])
+    down = [e["abs"] - acked[e["data"]["ack"]] for e in filter(carries_ack, client.named("transport:packet_received"))
+            if e["data"]["ack"] in acked]
+    if not up or not down:
+        return None
+    return (min(up) - min(down)) / 2.0
+
+
+def find_stalls(progress, end, threshold, client):
+    """Gaps between cumulative-ACK advances, with a guess at the cause."""
+    lost = [e["abs"] for e in client.named("recovery:packet_lost")] if client else []
+    sends = [e["abs"] for e in client.named("transport:packet_sent", type="data")] if client else []
+    windows = [(e["abs"], e["data"]["peer_window"]) for e in client.named("recovery:metrics_updated")
+               if "peer_window" in e["data"]] if client else []
+    stalls = []
+    points = progress + [end]
+    for before, after in zip(points, points[1:]):
+        if after - before < threshold:
+            continue
+        peer_window = None
+        for t, w in windows:
+            if t > before:
+                break
+            peer_window = w
+        if peer_window == 0:
+            cause = "zero receive window"
+        elif any(before < t <= after for t in lost):
+            cause = "retransmission timeout"
+        elif not any(before < t <= after for t in sends):
+            cause = "sender idle"
+        else:
+            cause = "no ACK progress"
+        stalls.append({"start": before, "duration": after - before, "cause": cause})
+    return stalls
+
+
+def analyze(conn, sides, args):
+    client, server = sides.get("client"), sides.get("server")
+    offset = estimate_offset(client, server) if client and server else None
+    shift = offset if args.align and offset is not None else 0.0
+    if args.offset_ms is not None:
+        shift = args.offset_ms
+
+    def server_time(e):
+        return e["abs"] - shift
+
+    anchor = client or server
+    zero = anchor.events[0]["abs"] if anchor.events else 0.0
+    if anchor is server:
+        zero -= shift
+    rows, inflight, rtt, one_way = [], [], [], []
+    summary = {"conn_id": conn, "client": client.path if client else None, "server": server.path if server else None,
+               "clock_offset_ms": offset, "applied_offset_ms": shift}
+
+    first_send, first_retransmit, retransmits, spurious = {}, {}, 0, 0
+    timeouts, simulated_drops = 0, 0
+    server_first_rx = {}
+    if server:
+        for e in server.named("transport:packet_received", type="data"):
+            server_first_rx.setdefault(e["data"]["seq"], server_time(e))
+            rows.append((server_time(e) - zero, "server", "recv", e["data"]["seq"], e["data"]["length"], ""))
+        for e in filter(carries_ack, server.named("transport:packet_sent")):
+            rows.append((server_time(e) - zero, "server", "ack_sent", "", "", e["data"]["ack"]))
+
+    progress, highest_ack, payload_bytes = [], 0, 0
+    if client:
+        for e in client.events:
+            d, t = e["data"], e["abs"] - zero
+            if e["name"] == "transport:packet_sent" and d.get("type") == "data":
+                seq = d["seq"]
+                if seq in first_send:
+                    retransmits += 1
+                    first_retransmit.setdefault(seq, e["abs"])
+                    if server_first_rx.get(seq, float("inf")) < e["abs"]:
+                        spurious += 1
+                    rows.append((t, "client", "retransmit", seq, d["length"], ""))
+                else:
+                    first_send[seq] = (e["abs"], d["length"])
+                    payload_bytes += d["length"]
+                    rows.append((t, "client", "send", seq, d["length"], ""))
+            elif e["name"] == "transport:packet_received" and carries_ack(e):
+                rows.append((t, "client", "ack_recv", "", "", d["ack"]))
+                if d["ack"] > highest_ack:
+                    highest_ack = d["ack"]
+                    progress.append(e["abs"])
+            elif e["name"] == "recovery:packet_lost":
+                timeouts += 1
+                rows.append((t, "client", "lost", d["seq"], "", ""))
+            elif e["name"] == "transport:packet_dropped" and d.get("trigger") == "simulated_loss":
+                simulated_drops += 1
+            elif e["name"] == "recovery:metrics_updated":
+                if "latest_rtt" in d:
+                    rtt.append((t, d["latest_rtt"], d["smoothed_rtt"], d["rtt_variance"], d["rto"]))
+                if "bytes_in_flight" in d:
+                    inflight.append((t, d["bytes_in_flight"], d["window_segments"], d["peer_window"]))
+
+    for seq, (sent_at, _) in sorted(first_send.items()):
+        if seq in server_first_rx:
+            one_way.append((seq, sent_at - zero, server_first_rx[seq] - zero, server_first_rx[seq] - sent_at))
+    rows.sort(key=lambda r: r[0])
+
+    events = [e["abs"] for e in client.events] if client else []
+    events += [server_time(e) for e in server.events] if server else []
+    duration = (max(events) - zero) if events else 0.0
+    transfer_end = progress[-1] if progress else zero
+    transfer_ms = transfer_end - (min(v[0] for v in first_send.values()) if first_send else zero)
+    rtt_samples = [r[1] for r in rtt]
+    delays = [r[3] for r in one_way]
+    stall_ms = args.stall_ms
+    if stall_ms is None:
+        stall_ms = max(50.0, 4 * (percentile(rtt_samples, 50) or 25.0))
+    start = min((v[0] for v in first_send.values()), default=zero)
+    stalls = find_stalls([start] + progress, transfer_end, stall_ms, client) if client else []
+
+    summary.update({
+        "duration_ms": duration,
+        "transfer_ms": transfer_ms,
+        "payload_bytes": payload_bytes,
+        "goodput_mbps": payload_bytes * 8 / transfer_ms / 1000.0 if transfer_ms > 0 else None,
+        "segments": len(first_send),
+        "retransmissions": retransmits,
+        "spurious_retransmissions": spurious if server else None,
+        # Every timeout resends its segment, so this should never exceed retransmissions
+        "timeouts": timeouts,
+        "simulated_drops": simulated_drops,
+        # Original never arrived, or arrived only after the retransmission went out
+        "lost_on_wire": len([s for s in first_send if server_first_rx.get(s, float("inf")) > first_retransmit.get(s, float("inf"))
+                             or s not in server_first_rx]) if server else None,
+        "rtt_ms": {"samples": len(rtt_samples), "min": min(rtt_samples, default=None), "p50": percentile(rtt_samples, 50),
+                   "p90": percentile(rtt_samples, 90), "max": max(rtt_samples, default=None)},
+        "one_way_ms": {"samples": len(delays), "min": min(delays, default=None), "p50": percentile(delays, 50),
+                       "p90": percentile(delays, 90), "max": max(delays, default=None)},
+        "stall_threshold_ms": stall_ms,
+        "stalls": [{"start_ms": s["start"] - zero, "duration_ms": s["duration"], "cause": s["cause"]} for s in stalls],
+        "stalled_ms": sum(s["duration"] for s in stalls),
+    })
+
+    out = os.path.join(args.out, str(conn))
+    os.makedirs(out, exist_ok=True)
+    outputs = [
+        ("time_sequence.csv", ["time_ms", "side", "event", "seq", "length", "ack"], rows),
+        ("inflight.csv", ["time_ms", "bytes_in_flight", "window_segments", "peer_window"], inflight),
+        ("rtt.csv", ["time_ms", "latest_rtt", "smoothed_rtt", "rtt_variance", "rto"], rtt),
+        ("one_way.csv", ["seq", "client_send_ms", "server_recv_ms", "delay_ms"], one_way),
+    ]
+    for name, header, data in outputs:
+        with open(os.path.join(out, name), "w", newline="") as f:
+            writer = csv.writer(f)
+            writer.writerow(header)
+            for row in data:
+                writer.writerow([("%.3f" % v) if isinstance(v, float) else v for v in row])
+    with open(os.path.join(out, "summary.json"), "w") as f:
+        json.dump(summary, f, indent=2)
+    return summary, out
+
+
+def print_summary(s, out):
+    print("Connection %s: %s" % (s["conn_id"], ", ".join(p for p in (s["client"], s["server"]) if p)))
+    if s["clock_offset_ms"] is not None:
+        print("  clock offset estimate %.3f ms, applied %.3f ms" % (s["clock_offset_ms"], s["applied_offset_ms"]))
+    print("  %d bytes in %d segments over %s ms, goodput %s Mbit/s" % (
+        s["payload_bytes"], s["segments"], fmt(s["transfer_ms"], 1), fmt(s["goodput_mbps"])))
+    line = "  retransmissions %d" % s["retransmissions"]
+    if s["spurious_retransmissions"] is not None:
+        line += " (%d spurious), first transmissions lost on the wire %d" % (s["spurious_retransmissions"], s["lost_on_wire"])
+    print(line)
+    print("  timeouts %d, sends dropped by simulated loss %d" % (s["timeouts"], s["simulated_drops"]))
+    for key, label in (("rtt_ms", "RTT"), ("one_way_ms", "one-way delay")):
+        d = s[key]
+        if d["samples"]:
+            print("  %s ms: min %s, p50 %s, p90 %s, max %s (%d samples)" % (
+                label, fmt(d["min"]), fmt(d["p50"]), fmt(d["p90"]), fmt(d["max"]), d["samples"]))
+    print("  stalls over %.0f ms: %d, %.1f ms total" % (s["stall_threshold_ms"], len(s["stalls"]), s["stalled_ms"]))
+    for stall in s["stalls"]:
+        print("    at %10.3f ms for %9.3f ms: %s" % (stall["start_ms"], stall["duration_ms"], stall["cause"]))
+    print("  wrote %s/{time_sequence,inflight,rtt,one_way}.csv and summary.json" % out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("traces", nargs="+", help="trace files or directories of .jsonl traces")
+    parser.add_argument("--out", default="trace_analysis")
+    parser.add_argument("--stall-ms", type=float, default=None,
+                        help="minimum gap in ACK progress reported as a stall (default 4x median RTT, at least 50)")
+    parser.add_argument("--align", action="store_true", help="shift the server clock by the estimated offset")
+    parser.add_argument("--offset-ms", type=float, default=None, help="shift the server clock by this much instead")
+    args = parser.parse_args()
+
+    pairs = pair_traces(load_traces(args.traces))
+    if not pairs:
+        print("No traces found")
+        return 1
+    for conn, sides in sorted(pairs.items(), key=lambda kv: str(kv[0])):
+        summary, out = analyze(conn, sides, args)
+        print_summary(summary, out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())